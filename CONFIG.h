@@ -18,10 +18,138 @@ than the binaries used in the installation of the actual daemon */
 #define PATHNAME_TERM_ASYNC_SAFE "./termHandlerAsyncSafe.bin" 
 #endif
 
+/* [back-end] file where the in-process profiler dumps its samples as folded
+stacks (after receiving SIGUSR2) */
+#ifndef TEST
+#define PROFILER_OUTPUT_PATH "/var/lib/papayachat/papayachat.folded"
+#else
+#define PROFILER_OUTPUT_PATH "./papayachat.folded"
+#endif
+
+/* [back-end] file where the flusher process writes the durability metrics
+(bytes not synced yet, latency of fdatasync()) every DURABILITY_METRICS_PERIOD
+ms, only with 'DURABILITY interval' or 'DURABILITY batch' in server.config */
+#ifndef TEST
+#define DURABILITY_METRICS_PATH "/var/lib/papayachat/papayachat.metrics"
+#else
+#define DURABILITY_METRICS_PATH "./papayachat.metrics"
+#endif
+#define DURABILITY_METRICS_PERIOD 1000
+
+/* [back-end] default ms between two syncs of the chat log with 'DURABILITY
+interval', it can be changed with DURABILITY_INTERVAL in server.config */
+#define DURABILITY_DEFAULT_INTERVAL 1000
+
+/* [back-end] the chat log is allocated on disk in chunks of
+CHATLOG_PREALLOCATION bytes, the next chunk is allocated when less than half
+of the current one is left. When the daemon starts, the logical end of the
+chat log is found again by reading the preallocated bytes backwards in
+chunks of CHATLOG_RECOVERY_CHUNK bytes */
+#define CHATLOG_PREALLOCATION (8 * 1024 * 1024)
+#define CHATLOG_RECOVERY_CHUNK (64 * 1024)
+
+/* [back-end] when the daemon starts, the last CHATLOG_RECOVERY_WINDOW bytes
+of the chat log are checked for the damage left by a crash in the middle of
+a write (a last line without newline, NUL bytes of blocks that were never
+written). Only this window is read, so the startup does not depend on the
+size of the chat log */
+#define CHATLOG_RECOVERY_WINDOW (1024 * 1024)
+
+/* [back-end] bytes at the end of the chat log kept in memory shared by all
+processes of the daemon, the history sent to joining and resuming clients
+and the new messages are copied from it, only older messages are read from
+the chat log file */
+#define CHATLOG_HOT_TAIL (1024 * 1024)
+
+/* [back-end] file with the inverted index of the chat log used by the
+search (SEARCH on in server.config). It is created sparse with
+SEARCH_INDEX_MAX_SIZE bytes, when they are used up no more lines are indexed.
+The terms are stored in a hash table with SEARCH_INDEX_BUCKETS buckets */
+#ifndef TEST
+#define SEARCH_INDEX_PATH "/var/lib/papayachat/papayachat.index"
+#else
+#define SEARCH_INDEX_PATH "./papayachat.index"
+#endif
+#define SEARCH_INDEX_MAX_SIZE (256 * 1024 * 1024)
+#define SEARCH_INDEX_BUCKETS (1 << 18)
+
+/* [back-end] file with the time of the messages, an entry (time, offset of
+the chat log) for every second in which messages were written */
+#ifndef TEST
+#define TIME_INDEX_PATH "/var/lib/papayachat/papayachat.time"
+#else
+#define TIME_INDEX_PATH "./papayachat.time"
+#endif
+
+/* [back-end] file where the primary writes the replication lag of its
+standby, and a standby the state of its connection to the primary, every
+REPLICATION_STATUS_PERIOD ms */
+#ifndef TEST
+#define REPLICATION_STATUS_PATH "/var/lib/papayachat/papayachat.replication"
+#else
+#define REPLICATION_STATUS_PATH "./papayachat.replication"
+#endif
+#define REPLICATION_STATUS_PERIOD 1000
+
+/* [back-end] max. bytes of the chat log which the primary sends to a standby
+before they are acknowledged */
+#define REPLICATION_WINDOW (4 * 1024 * 1024)
+
+/* [back-end] max. number of event loop threads (THREADS in server.config) */
+#define THREADS_MAX 256
+
+/* [back-end] file where the low-latency mode (LOW_LATENCY in server.config)
+writes the load of every CPU running an event loop, every CPU_LOAD_PERIOD ms */
+#ifndef TEST
+#define CPU_LOAD_PATH "/var/lib/papayachat/papayachat.cpu"
+#else
+#define CPU_LOAD_PATH "./papayachat.cpu"
+#endif
+#define CPU_LOAD_PERIOD 1000
+
+/* max. number of matching lines sent back for a search, the most recent ones */
+#define SEARCH_MAX_RESULTS 100
+
 /* bytes transmission size, defined in CONFIG.h
 to share the value between multiple files */
 #define BUF_SIZE 4096 
 
+/* [front-end] max. bytes of messages written by the user, which were not sent
+to the server yet (the server is not reading from the socket) */
+#define SEND_BUFFER_SIZE (16 * BUF_SIZE)
+
+/* [front-end] default number of lines kept in the scrollback of the chat, it
+can be changed with SCROLLBACK in client.config */
+#define SCROLLBACK_LINES 10000
+
+/* [front-end] the history cache of a server is stored in
+$HOME HISTORY_CACHE_PREFIX <host>_<port> HISTORY_CACHE_SUFFIX, it can be
+disabled with HISTORY_CACHE off in client.config */
+#define HISTORY_CACHE_PREFIX "/.papayachat/history_"
+#define HISTORY_CACHE_SUFFIX ".cache"
+
+/* [front-end] max. number of times per second that the screen is updated,
+all changes in between are drawn together */
+#define CLIENT_MAX_FPS 60
+
+/* max. length of the hello line, which the client sends after the key
+("JOIN", "RESUME <offset>", "SEARCH <terms>", "SINCE <time>", "BETWEEN
+<time> <time>" or "REPLICATE <offset> <fingerprint>"), and of the line
+answered by the server ("OFFSET <offset>", "MATCHES <lines> <lines sent>",
+"RANGE <start> <end>" or "STREAM <offset>") */
+#define HELLO_MAX_LENGTH 256
+
+/* [front-end and back-end] delay in ms before the first attempt to reconnect
+after the connection to the server was lost, the delay doubles after every
+failed attempt up to RECONNECT_MAX_DELAY (used by the client and by the
+replicator of a standby) */
+#define RECONNECT_MIN_DELAY 250
+#define RECONNECT_MAX_DELAY 8000
+
+/* [front-end and back-end] max. time in ms that the server has to answer the
+hello line, while connecting the user interface does not react */
+#define HANDSHAKE_TIMEOUT 2000
+
 /* [back-end] max number of clients in listening backlog queue */
 #define BACKLOG_QUEUE 10		
 
@@ -33,6 +161,15 @@ sha512(frannie)="300f94f8f88dc7af5ef51295cc1bb6f212324c2f85721cafd9d7ea97f723ca3
 the amount of characters is 128 */
 #define KEY_LENGTH 128
 
+/* [back-end] samples per second of CPU time taken by the in-process profiler
+in every process (only used with 'PROFILER on' in server.config) */
+#define PROFILER_FREQUENCY 99
+
+/* [back-end] max. number of different stacks and max. depth of a stack stored
+by the in-process profiler */
+#define PROFILER_MAX_STACKS 4096
+#define PROFILER_MAX_DEPTH 32
+
 
 /* if compiled with gcc -D NON_DEFAULT_CONFIG option, then only userConfig.h
 will be used */
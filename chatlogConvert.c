@@ -0,0 +1,274 @@
+/* chatlogConvert.c
+
+Convert a chat log between the text format written by the daemon and the
+binary record format of file_locking.c (one header with length, sequence,
+time, sender and checksum per message), and verify record logs.
+
+Usage: chatlogConvert.bin [-t time_index] text_log record_log
+		chatlogConvert.bin -r record_log text_log
+		chatlogConvert.bin -c record_log
+
+(default)	every complete line "username: message" of text_log becomes a
+			record appended to record_log. With -t the records get the time
+			of the time index of the daemon (papayachat.time), otherwise 0.
+			The NUL bytes preallocated after the end of the chat log are
+			skipped, an incomplete last line is not converted.
+-r			write the lines of the records of record_log to text_log, the
+			result is the text log that was converted.
+-c			count the records of record_log reading only their headers,
+			then verify the checksum of every record.
+
+*/
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "basics.h"
+#include "file_locking.h"	/* binary record format */
+#include "timeIndex.h"		/* struct timeEntry, timeIndexEntries() */
+#include "CONFIG.h"			/* BUF_SIZE */
+
+/* a line longer than this is not a chat message */
+#define CONVERT_MAX_LINE (1024 * 1024)
+
+/* the whole time index in memory, the entries are ordered by offset */
+static struct timeEntry * timeEntries = NULL;
+static size_t timeEntriesCount = 0;
+
+static void
+loadTimeIndex(const char * path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1)
+		errExit("open(%s)", path);
+	int64_t entries = timeIndexEntries(fd);
+	if(entries == -1)
+		errExit("fstat(%s)", path);
+
+	timeEntriesCount = entries;
+	timeEntries = malloc((timeEntriesCount + 1) * sizeof(struct timeEntry));
+	if(timeEntries == NULL)
+		errExit("malloc()");
+	size_t size = timeEntriesCount * sizeof(struct timeEntry);
+	if(size > 0 && pread(fd, timeEntries, size, 0) != (ssize_t) size)
+		errExit("pread(%s)", path);
+	close(fd);
+}
+
+/* time of the byte at offset of the text log, the entries are walked
+forwards because the offsets only grow */
+static int64_t
+timeOfOffset(off_t offset)
+{
+	static size_t entry = 0;
+	while(entry + 1 < timeEntriesCount && timeEntries[entry + 1].offset <= offset)
+		entry++;
+	if(timeEntriesCount == 0 || timeEntries[entry].offset > offset)
+		return 0;
+	return timeEntries[entry].time;
+}
+
+/* write a record for a line of the text log (without its newline) */
+static void
+convertLine(struct chatRecordWriter * writer, const char * line, size_t length, off_t offset)
+{
+	/* "username: message", anything else is stored with an empty sender */
+	char sender[CHAT_RECORD_SENDER] = "";
+	const char * separator = memchr(line, ':', length);
+	size_t senderLength = (separator != NULL) ? (size_t) (separator - line) : 0;
+	if(separator != NULL && senderLength > 0 && senderLength < CHAT_RECORD_SENDER
+		&& senderLength + 1 < length && separator[1] == ' '){
+		memcpy(sender, line, senderLength);
+		line += senderLength + 2;
+		length -= senderLength + 2;
+	}
+
+	if(writeRecord(writer, sender, timeOfOffset(offset), line, length) == -1)
+		errExit("writeRecord()");
+}
+
+static void
+textToRecords(const char * textPath, const char * recordPath)
+{
+	int text_fd = open(textPath, O_RDONLY | O_CLOEXEC);
+	if(text_fd == -1)
+		errExit("open(%s)", textPath);
+	int record_fd = open(recordPath, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+	if(record_fd == -1)
+		errExit("open(%s)", recordPath);
+
+	/* append to an existing record log */
+	struct chatRecordWriter writer;
+	if(openRecordWriter(&writer, record_fd) == -1)
+		errExit("openRecordWriter(%s)", recordPath);
+
+	char * line = malloc(CONVERT_MAX_LINE);
+	if(line == NULL)
+		errExit("malloc()");
+	size_t lineLength = 0;
+	off_t lineOffset = 0;		/* offset of the first byte of line */
+	off_t offset = 0;			/* offset of buf[0] in the text log */
+	unsigned long lines = 0;
+	char buf[BUF_SIZE];
+	ssize_t numRead;
+
+	while((numRead = read(text_fd, buf, BUF_SIZE)) > 0){
+		for(ssize_t i = 0; i < numRead; i++){
+			if(buf[i] == '\0')
+				continue;
+			if(lineLength == 0)
+				lineOffset = offset + i;
+			if(buf[i] == '\n'){
+				convertLine(&writer, line, lineLength, lineOffset);
+				lineLength = 0;
+				lines++;
+				continue;
+			}
+			if(lineLength == CONVERT_MAX_LINE)
+				fatal("line at offset %lld is longer than %d bytes", (long long) lineOffset, CONVERT_MAX_LINE);
+			line[lineLength++] = buf[i];
+		}
+		offset += numRead;
+	}
+	if(numRead == -1)
+		errExit("read(%s)", textPath);
+	if(lineLength > 0)
+		fprintf(stderr, "incomplete last line at offset %lld (%zu bytes) not converted\n",
+			(long long) lineOffset, lineLength);
+
+	if(fsync(record_fd) == -1)
+		errExit("fsync(%s)", recordPath);
+	printf("%lu lines converted, %s has %llu records (%lld bytes)\n", lines, recordPath,
+		(unsigned long long) writer.sequence, (long long) writer.offset);
+	free(line);
+	close(text_fd);
+	close(record_fd);
+}
+
+static void
+recordsToText(const char * recordPath, const char * textPath)
+{
+	int record_fd = open(recordPath, O_RDONLY | O_CLOEXEC);
+	if(record_fd == -1)
+		errExit("open(%s)", recordPath);
+	FILE * text = fopen(textPath, "we");
+	if(text == NULL)
+		errExit("fopen(%s)", textPath);
+
+	struct chatRecordReader reader;
+	if(openRecordReader(&reader, record_fd, 0) == -1)
+		errExit("openRecordReader()");
+
+	char * payload = malloc(CONVERT_MAX_LINE);
+	if(payload == NULL)
+		errExit("malloc()");
+	struct chatRecordHeader header;
+	unsigned long records = 0;
+	int result;
+	while((result = nextRecord(&reader, &header)) == 1){
+		if(header.length > CONVERT_MAX_LINE)
+			fatal("record %llu has %u bytes", (unsigned long long) header.sequence, header.length);
+		if(readRecordPayload(&reader, &header, payload) == -1)
+			errExit("record %llu at offset %lld", (unsigned long long) header.sequence, (long long) reader.current);
+
+		if(header.sender[0] != '\0')
+			fprintf(text, "%.*s: ", CHAT_RECORD_SENDER, header.sender);
+		fwrite(payload, 1, header.length, text);
+		fputc('\n', text);
+		records++;
+	}
+	if(result == -1)
+		errExit("record at offset %lld", (long long) reader.offset);
+
+	if(fclose(text) == EOF)
+		errExit("fclose(%s)", textPath);
+	printf("%lu records converted\n", records);
+	free(payload);
+	closeRecordReader(&reader);
+	close(record_fd);
+}
+
+static void
+checkRecords(const char * recordPath)
+{
+	int record_fd = open(recordPath, O_RDONLY | O_CLOEXEC);
+	if(record_fd == -1)
+		errExit("open(%s)", recordPath);
+
+	/* counting needs only the headers, the payloads are skipped */
+	struct chatRecordReader reader;
+	if(openRecordReader(&reader, record_fd, 0) == -1)
+		errExit("openRecordReader()");
+	struct chatRecordHeader header;
+	unsigned long records = 0;
+	int result;
+	while((result = nextRecord(&reader, &header)) == 1)
+		records++;
+	if(result == -1)
+		errExit("record %lu at offset %lld", records, (long long) reader.offset);
+	printf("%lu records, %lld bytes\n", records, (long long) reader.offset);
+	closeRecordReader(&reader);
+
+	char * payload = malloc(CONVERT_MAX_LINE);
+	if(payload == NULL)
+		errExit("malloc()");
+	if(openRecordReader(&reader, record_fd, 0) == -1)
+		errExit("openRecordReader()");
+	unsigned long corrupt = 0;
+	while(nextRecord(&reader, &header) == 1){
+		if(header.length > CONVERT_MAX_LINE || readRecordPayload(&reader, &header, payload) == -1){
+			fprintf(stderr, "record %llu at offset %lld: %s\n", (unsigned long long) header.sequence,
+				(long long) reader.current, (header.length > CONVERT_MAX_LINE) ? "too long" : strerror(errno));
+			corrupt++;
+		}
+	}
+	printf("%lu records with a wrong checksum\n", corrupt);
+	free(payload);
+	closeRecordReader(&reader);
+	close(record_fd);
+	exit((corrupt == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+int
+main(int argc, char * argv[])
+{
+	const char * timeIndexPath = NULL;
+	bool reverse = false;
+	bool check = false;
+	int opt;
+	while((opt = getopt(argc, argv, "t:rc")) != -1){
+		switch(opt){
+			case 't':
+				timeIndexPath = optarg;
+				break;
+			case 'r':
+				reverse = true;
+				break;
+			case 'c':
+				check = true;
+				break;
+			default:
+				usageErr("%s [-t time_index] text_log record_log | -r record_log text_log | -c record_log\n", argv[0]);
+		}
+	}
+
+	if(check){
+		if(optind + 1 != argc)
+			usageErr("%s -c record_log\n", argv[0]);
+		checkRecords(argv[optind]);
+	}
+	if(optind + 2 != argc)
+		usageErr("%s [-t time_index] text_log record_log | -r record_log text_log | -c record_log\n", argv[0]);
+
+	if(reverse)
+		recordsToText(argv[optind], argv[optind + 1]);
+	else{
+		if(timeIndexPath != NULL)
+			loadTimeIndex(timeIndexPath);
+		textToRecords(argv[optind], argv[optind + 1]);
+	}
+	exit(EXIT_SUCCESS);
+}
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
@@ -0,0 +1,244 @@
+/* chatlogSnapshot.c
+
+Copy a consistent snapshot of the chat log while the daemon is running.
+
+Usage: chatlogSnapshot.bin [-l chat_log] [-t time_index] [-S since] [-U until]
+			[-u username] [output]
+
+The snapshot ends after the last complete line of the chat log at the time
+the tool is started (chatLogSnapshotEnd()): the daemon only appends, the
+bytes before that end never change, so they are copied without taking the
+lock of the chat log, the daemon keeps writing while a big chat log is
+copied. A message still being written is not part of the snapshot.
+
+The bytes are copied by the kernel from the page cache of the chat log to
+output (or stdout) with copy_file_range() if output is a file and sendfile()
+otherwise (a pipe or a socket), without going through this process. read()
+and write() are only used if the kernel supports neither for the output.
+
+-l			the chat log (default CHAT_LOG_PATH)
+-S, -U		only the messages written from second since up to second until
+			(seconds since the epoch, both included), found with the time
+			index of the daemon (-t, default TIME_INDEX_PATH)
+-u			only the lines sent by username ("username: ..."), the chat log
+			is mapped to find them, the runs of consecutive lines are copied
+			by the kernel as well
+
+*/
+
+#define _GNU_SOURCE				/* To get copy_file_range() from <unistd.h> */
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+#include "basics.h"
+#include "file_locking.h"	/* chatLogSnapshotEnd() */
+#include "lineScan.h"		/* scanFind() */
+#include "timeIndex.h"		/* timeIndexOffsetAfter() */
+#include "CONFIG.h"			/* CHAT_LOG_PATH, TIME_INDEX_PATH */
+
+/* max. bytes copied by one syscall */
+#define SNAPSHOT_CHUNK (16 * 1024 * 1024)
+
+/* how the bytes are copied, the next method is tried if the kernel does not
+support one for the output */
+enum copyMethod { COPY_FILE_RANGE, SENDFILE, READ_WRITE };
+static const char * methodNames[] = { "copy_file_range", "sendfile", "read/write" };
+static enum copyMethod method = COPY_FILE_RANGE;
+
+/* errors of copy_file_range() and sendfile() which mean that the output
+(or the combination of both files) is not supported */
+static int
+unsupported(int error)
+{
+	return error == EINVAL || error == EXDEV || error == ENOSYS
+		|| error == EBADF || error == EOPNOTSUPP;
+}
+
+/* copy length bytes of in_fd starting at offset to out_fd */
+static void
+copyRange(int in_fd, int out_fd, off_t offset, size_t length)
+{
+	char * buf = NULL;
+	while(length > 0){
+		size_t chunk = (length < SNAPSHOT_CHUNK) ? length : SNAPSHOT_CHUNK;
+		ssize_t copied = -1;
+		switch(method){
+			case COPY_FILE_RANGE:
+				copied = copy_file_range(in_fd, &offset, out_fd, NULL, chunk, 0);
+				if(copied == -1 && unsupported(errno)){
+					method = SENDFILE;
+					continue;
+				}
+				break;
+			case SENDFILE:
+				copied = sendfile(out_fd, in_fd, &offset, chunk);
+				if(copied == -1 && unsupported(errno)){
+					method = READ_WRITE;
+					continue;
+				}
+				break;
+			case READ_WRITE:
+				if(buf == NULL && (buf = (char *) malloc(SNAPSHOT_CHUNK)) == NULL)
+					errExit("malloc()");
+				copied = pread(in_fd, buf, chunk, offset);
+				if(copied > 0){
+					if(write(out_fd, buf, copied) != copied)
+						errExit("write()");
+					offset += copied;
+				}
+				break;
+		}
+		if(copied == -1 && errno == EINTR)
+			continue;
+		if(copied == -1)
+			errExit("%s()", methodNames[method]);
+		if(copied == 0)
+			fatal("the chat log ends before offset %lld", (long long) offset);
+		length -= copied;
+	}
+	free(buf);
+}
+
+/* offset of the first byte of the chat log written after second time, with
+the time index open as fd. Returns end if all bytes were written before */
+static off_t
+offsetAfter(int fd, int64_t time, off_t end)
+{
+	int64_t entries = timeIndexEntries(fd);
+	if(entries == -1)
+		errExit("fstat(time index)");
+	off_t offset = timeIndexOffsetAfter(fd, entries, time, end);
+	if(offset == -1)
+		errExit("pread(time index)");
+	return offset;
+}
+
+/* copy the lines of [start, stop) of the chat log sent by username, the
+consecutive ones are copied at once. Returns the number of bytes copied */
+static off_t
+copyLinesOf(int in_fd, int out_fd, off_t start, off_t stop, const char * username)
+{
+	if(stop == start)
+		return 0;
+	char * chat = mmap(NULL, stop, PROT_READ, MAP_SHARED, in_fd, 0);
+	if(chat == MAP_FAILED)
+		errExit("mmap(chat log)");
+	madvise(chat + start, stop - start, MADV_SEQUENTIAL);
+
+	char prefix[MAX_LINE_LENGTH];
+	int prefixLength = snprintf(prefix, sizeof(prefix), "%s: ", username);
+
+	off_t copied = 0;
+	off_t runStart = -1;	/* first line of the run of matching lines */
+	off_t line = start;
+	while(line < stop){
+		const char * newline = scanFind(chat + line, stop - line, '\n');
+		off_t next = (newline != NULL) ? newline - chat + 1 : stop;
+		int matches = next - line >= prefixLength && memcmp(chat + line, prefix, prefixLength) == 0;
+		if(matches && runStart == -1)
+			runStart = line;
+		if(!matches && runStart != -1){
+			copyRange(in_fd, out_fd, runStart, line - runStart);
+			copied += line - runStart;
+			runStart = -1;
+		}
+		line = next;
+	}
+	if(runStart != -1){
+		copyRange(in_fd, out_fd, runStart, stop - runStart);
+		copied += stop - runStart;
+	}
+
+	munmap(chat, stop);
+	return copied;
+}
+
+/* parse a time given with -S or -U in seconds since the epoch */
+static long long
+parseSeconds(const char * argument)
+{
+	char * end;
+	errno = 0;
+	long long seconds = strtoll(argument, &end, 10);
+	if(errno != 0 || *end != '\0' || end == argument || seconds < 0)
+		cmdLineErr("'%s' is not a time in seconds since the epoch\n", argument);
+	return seconds;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char * chatLogPath = CHAT_LOG_PATH;
+	const char * timeIndexPath = TIME_INDEX_PATH;
+	const char * username = NULL;
+	long long since = -1, until = -1;
+
+	int opt;
+	while((opt = getopt(argc, argv, "l:t:S:U:u:")) != -1){
+		switch(opt){
+			case 'l': chatLogPath = optarg; break;
+			case 't': timeIndexPath = optarg; break;
+			case 'S': since = parseSeconds(optarg); break;
+			case 'U': until = parseSeconds(optarg); break;
+			case 'u': username = optarg; break;
+			default:
+				usageErr("%s [-l chat_log] [-t time_index] [-S since] [-U until] [-u username] [output]\n", argv[0]);
+		}
+	}
+	if(optind + 1 < argc)
+		usageErr("%s [-l chat_log] [-t time_index] [-S since] [-U until] [-u username] [output]\n", argv[0]);
+	if(since != -1 && until != -1 && until < since)
+		cmdLineErr("until is before since\n");
+
+	int in_fd = open(chatLogPath, O_RDONLY | O_CLOEXEC);
+	if(in_fd == -1)
+		errExit("open(%s)", chatLogPath);
+
+	/* the end is taken first, everything after it is left out, even if the
+	time index already knows about it */
+	off_t end = chatLogSnapshotEnd(in_fd);
+	if(end == -1)
+		errExit("chatLogSnapshotEnd(%s)", chatLogPath);
+
+	off_t start = 0, stop = end;
+	if(since != -1 || until != -1){
+		int index_fd = open(timeIndexPath, O_RDONLY | O_CLOEXEC);
+		if(index_fd == -1)
+			errExit("open(%s)", timeIndexPath);
+		if(since > 0)
+			start = offsetAfter(index_fd, since - 1, end);
+		if(until != -1)
+			stop = offsetAfter(index_fd, until, end);
+		if(stop < start)
+			stop = start;
+		close(index_fd);
+	}
+
+	int out_fd = STDOUT_FILENO;
+	const char * outputPath = (optind < argc) ? argv[optind] : "-";
+	if(strcmp(outputPath, "-") != 0){
+		out_fd = open(outputPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+		if(out_fd == -1)
+			errExit("open(%s)", outputPath);
+	}
+
+	off_t copied;
+	if(username != NULL)
+		copied = copyLinesOf(in_fd, out_fd, start, stop, username);
+	else{
+		copyRange(in_fd, out_fd, start, stop - start);
+		copied = stop - start;
+	}
+
+	if(out_fd != STDOUT_FILENO && close(out_fd) == -1)
+		errExit("close(%s)", outputPath);
+	fprintf(stderr, "snapshot of %s up to offset %lld: bytes %lld-%lld, %lld bytes written (%s)\n",
+		chatLogPath, (long long) end, (long long) start, (long long) stop,
+		(long long) copied, methodNames[method]);
+	exit(EXIT_SUCCESS);
+}
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
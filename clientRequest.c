@@ -6,6 +6,7 @@ Functions to handle sending and receiving data from clients.
 */
 
 #include <signal.h>		/* needed for sig_atomic_t variable */
+#include <limits.h>		/* LLONG_MAX */
 
 #include <syslog.h>	/* server runs as daemon, pipe errors messages to syslog */
 /* daemon posts still with the configuration of concurrent_server.c, 
@@ -14,6 +15,13 @@ configure_syslog.h functions are unnecessary */
 #include "clientRequest.h"
 #include "basics.h"
 #include "file_locking.h"
+#include "tracepoints.h"	/* static tracepoints (USDT) */
+#include "profiler.h"	/* in-process sampling profiler */
+#include "durability.h"	/* fdatasync() policy of the chat log */
+#include "searchIndex.h"	/* inverted index of the chat log */
+#include "timeIndex.h"	/* time of the messages */
+#include "replication.h"	/* streaming to a hot standby */
+#include "lineScan.h"	/* scanRemove() */
 #include "CONFIG.h"	/* declaration of BUF_SIZE */
 
 /* global (extern) variable from signalHandling.c 
@@ -83,60 +91,47 @@ readChatlogSendClient(int client_fd, int chatlog_fd, off_t offset)
 		return offset;
 	}
 
-	/* TODO: consider that all of this is happening after UNLOCKING
-	shared read lock */
-	/* ANSWER: this is a problem, MAYBE, because another client might send new messages 
-	to the server, but in that case I think that another SIGUSR would be triggered, and the
-	system would start reading again from the chatlog */
-
 	/* update offset value after read */
 	offset = offset + bytesRead;
 
-	/* store only the characters read on a new string */
-	char * stringClient = (char *) malloc(bytesRead);
-	/* if malloc fails, it returns a NULL pointer */
-	if(stringClient == NULL){
-		syslog(LOG_ERR, "malloc failed: %s", strerror(errno));
-		free(string_buf);
-		_exit(EXIT_FAILURE);
-	}
-
-/* TODO: the reason why I have to append a newline to the messages in the
-front end, is because the snprintf, does not copy the \n of the line received
-from the server, because it copies bytesRead-1 characters and appends a \0
-check `man snprintf`
-So in order to "fix" that issue, I should probably start working here */
-	/* copy only the bytesRead into stringClient */
-	if(snprintf(stringClient,bytesRead,"%s",string_buf)<0){
-		syslog(LOG_ERR, "snprintf() failed: %s", strerror(errno));
-		free(string_buf);
-		free(stringClient);
-		_exit(EXIT_FAILURE);
-	}
-
-	/* send message to client socket */
-	if(write(client_fd,stringClient,bytesRead)!=bytesRead){
+	/* send the bytes exactly as they are stored in the chat log, the client
+	counts them to know up to which offset of the chat log it received the
+	messages (RESUME) */
+	if(write(client_fd,string_buf,bytesRead)!=bytesRead){
 		syslog(LOG_ERR, "write() failed: %s", strerror(errno));
 		free(string_buf);
-		free(stringClient);
 		_exit(EXIT_FAILURE);
 	}
+	/* the offset passed is the one of the first byte sent */
+	TRACEPOINT3(socket__write, traceConnectionID, offset - bytesRead, bytesRead);
 
 	/* DEBUG: print to syslog the contents of the chat log */
-	//syslog(LOG_DEBUG, "---> Contents of chat log: %s<---", stringClient);
+	//syslog(LOG_DEBUG, "---> Contents of chat log: %.*s<---", (int) bytesRead, string_buf);
 	
 	/* free malloc resources before end of loop */
 	free(string_buf);
-	free(stringClient);
 
 	return offset; /* value used in the next iteration */
 
 }
 
-/* function to send new messages to client after receiving SIGUSR1 signal */
+/* function to send new messages to client after receiving SIGUSR1 signal,
+the chat log is sent starting at offset */
 static void
-sendNewMessages(int client_fd, int chatlog_fd)
+sendNewMessages(int client_fd, int chatlog_fd, off_t offset)
 {
+	/* SIGUSR1 is blocked outside of sigsuspend(), a message written while
+	this process is still sending the previous ones is not lost, the signal
+	stays pending and sigsuspend() returns right away */
+	sigset_t blockedUSR1, waitMask;
+	sigemptyset(&blockedUSR1);
+	sigaddset(&blockedUSR1, SIGUSR1);
+	if(sigprocmask(SIG_BLOCK, &blockedUSR1, &waitMask)==-1){
+		syslog(LOG_ERR, "sigprocmask() failed: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	sigdelset(&waitMask, SIGUSR1);
+
 	/* activate SIGUSR1 only for this child process, this means that this 
 	child process can receive the SIGUSR1 signal, when a client sends a message 
 	to the server */
@@ -148,29 +143,246 @@ sendNewMessages(int client_fd, int chatlog_fd)
 		_exit(EXIT_FAILURE);
 	}// end activateSIGUSR1()
 
-	/* start reading from beginning of file */
-	off_t offset = 0;
-
-	/* read from chatlog as soon as the client connects, and send
-	new messages eventually right away */
-	offset = messagesFromFirstClientConnection(chatlog_fd, client_fd);
-	/* check if there was an error in the above function call */
-	if(offset == -1){
-		syslog(LOG_ERR, "messagesFromFirstClientConnection failed: %s", strerror(errno));
+	/* tell the client at which offset of the chat log the messages start,
+	every byte sent afterwards is the next byte of the chat log */
+	char offsetLine[HELLO_MAX_LENGTH];
+	int offsetLength = snprintf(offsetLine, HELLO_MAX_LENGTH, "OFFSET %lld\n", (long long) offset);
+	if(write(client_fd,offsetLine,offsetLength)!=offsetLength){
+		syslog(LOG_ERR, "write() failed: %s", strerror(errno));
 		_exit(EXIT_FAILURE);
 	}
-	
+
 	for(;;){
+		/* send everything from offset until the end of the chat log, the
+		messages missed by a resuming client can be more than BUF_SIZE */
+		off_t previousOffset;
+		do {
+			previousOffset = offset;
+			offset = readChatlogSendClient(client_fd, chatlog_fd, offset);
+		} while(offset != previousOffset);
+
 		/* block until a signal is received, in this case the multicast 
 		SIGUSR1 */
-		pause();			
-		
-		/* SIGUSR1 was received, so attempt to read from chatlog and send new 
-		messages to client */
-		offset = readChatlogSendClient(client_fd, chatlog_fd, offset);
+		sigsuspend(&waitMask);
+		TRACEPOINT2(wakeup, traceConnectionID, offset);
+	}// end for-loop
+}
+
+/* answer a search ("SEARCH <terms>") with the line "MATCHES <lines> <lines
+sent>" followed by the most recent lines of the chat log containing every
+term (at most SEARCH_MAX_RESULTS), the lines are found with the search index */
+static void
+sendSearchResults(int client_fd, int chatlog_fd, const char * query)
+{
+	off_t * results = (off_t *) malloc(SEARCH_MAX_RESULTS * sizeof(off_t));
+	char * line = (char *) malloc(BUF_SIZE);
+	if(results == NULL || line == NULL){
+		syslog(LOG_ERR, "malloc failed: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
 
+	long matches = searchIndexQuery(query, results, SEARCH_MAX_RESULTS);
+	if(matches == -1){
+		syslog(LOG_ERR, "searchIndexQuery() failed: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	long sent = (matches > SEARCH_MAX_RESULTS) ? SEARCH_MAX_RESULTS : matches;
+	syslog(LOG_DEBUG, "Search (%s): %ld lines match.", query, matches);
 
-	}// end for-loop
+	char matchesLine[HELLO_MAX_LENGTH];
+	int matchesLength = snprintf(matchesLine, HELLO_MAX_LENGTH, "MATCHES %ld %ld\n", matches, sent);
+	if(write(client_fd,matchesLine,matchesLength)!=matchesLength){
+		syslog(LOG_ERR, "write() failed: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+
+	for(long i = 0; i < sent; i++){
+		ssize_t bytesRead = sharedRead(chatlog_fd, line, BUF_SIZE, results[i]);
+		if(bytesRead==-1){
+			syslog(LOG_ERR, "sharedRead() failed: %s", strerror(errno));
+			_exit(EXIT_FAILURE);
+		}
+		/* a line longer than BUF_SIZE is cut, every line sent ends with a
+		newline */
+		char * newline = memchr(line, '\n', bytesRead);
+		size_t lineLength = (newline != NULL) ? (size_t) (newline - line + 1) : (size_t) bytesRead;
+		if(newline == NULL && bytesRead > 0)
+			line[lineLength - 1] = '\n';
+		if(write(client_fd,line,lineLength)!=lineLength){
+			syslog(LOG_ERR, "write() failed: %s", strerror(errno));
+			_exit(EXIT_FAILURE);
+		}
+	}
+
+	free(results);
+	free(line);
+}
+
+/* answer a time range ("SINCE <time>" or "BETWEEN <time> <time>", seconds
+since the epoch) with the line "RANGE <start> <end>" followed by the bytes of
+the chat log written in the range (the offsets start up to end), the bytes
+are found with the time index */
+static void
+sendTimeRange(int client_fd, int chatlog_fd, time_t since, time_t until)
+{
+	off_t start, end;
+	if(timeIndexRange(since, until, &start, &end)==-1){
+		syslog(LOG_ERR, "timeIndexRange() failed: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	syslog(LOG_DEBUG, "Time range %lld-%lld: offsets %lld-%lld.", (long long) since,
+		(long long) until, (long long) start, (long long) end);
+
+	char rangeLine[HELLO_MAX_LENGTH];
+	int rangeLength = snprintf(rangeLine, HELLO_MAX_LENGTH, "RANGE %lld %lld\n",
+		(long long) start, (long long) end);
+	if(write(client_fd,rangeLine,rangeLength)!=rangeLength){
+		syslog(LOG_ERR, "write() failed: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+
+	char * string_buf = (char *) malloc(BUF_SIZE);
+	if(string_buf == NULL){
+		syslog(LOG_ERR, "malloc failed: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	/* a single sequential read of the range */
+	for(off_t offset = start; offset < end; ){
+		size_t wanted = (end - offset < BUF_SIZE) ? (size_t) (end - offset) : BUF_SIZE;
+		ssize_t bytesRead = sharedRead(chatlog_fd, string_buf, wanted, offset);
+		if(bytesRead<=0){
+			syslog(LOG_ERR, "sharedRead() failed: %s", (bytesRead==0) ? "EOF" : strerror(errno));
+			_exit(EXIT_FAILURE);
+		}
+		if(write(client_fd,string_buf,bytesRead)!=bytesRead){
+			syslog(LOG_ERR, "write() failed: %s", strerror(errno));
+			_exit(EXIT_FAILURE);
+		}
+		offset += bytesRead;
+	}
+	free(string_buf);
+}
+
+off_t
+chatOffset(int chatlog_fd, const char * hello)
+{
+	/* the logical end, the file itself is longer (preallocated) */
+	off_t endOfFile = chatLogEnd();
+
+	if(strncmp(hello, "RESUME ", strlen("RESUME ")) == 0){
+		char * end;
+		errno = 0;
+		long long offset = strtoll(hello + strlen("RESUME "), &end, 10);
+		/* an offset after the end of the chat log does not belong to this
+		chat log (e.g. it was deleted), the client joins again */
+		if(errno == 0 && *end == '\0' && offset >= 0 && offset <= endOfFile){
+			syslog(LOG_DEBUG, "Client resumes at offset %lld.", offset);
+			return offset;
+		}
+		syslog(LOG_INFO, "Invalid RESUME offset (%s), client joins again.", hello);
+	}
+	else if(strcmp(hello, "JOIN") != 0){
+		errno = EINVAL;
+		return -1;
+	}
+
+	return historyOffset(chatlog_fd);
+}
+
+int
+isOneShotRequest(const char * hello)
+{
+	return strncmp(hello, "SEARCH ", strlen("SEARCH ")) == 0
+		|| strncmp(hello, "SINCE ", strlen("SINCE ")) == 0
+		|| strncmp(hello, "BETWEEN ", strlen("BETWEEN ")) == 0
+		|| strncmp(hello, "REPLICATE ", strlen("REPLICATE ")) == 0;
+}
+
+void
+handleOneShotRequest(int client_fd, int chatlog_fd, const char * hello)
+{
+	if(strncmp(hello, "SEARCH ", strlen("SEARCH ")) == 0){
+		sendSearchResults(client_fd, chatlog_fd, hello + strlen("SEARCH "));
+		syslog(LOG_DEBUG, "Search results sent, closing connection.");
+		_exit(EXIT_SUCCESS);
+	}
+	else if(strncmp(hello, "SINCE ", strlen("SINCE ")) == 0
+		|| strncmp(hello, "BETWEEN ", strlen("BETWEEN ")) == 0){
+		long long since, until = LLONG_MAX;
+		int valid = (hello[0] == 'S')
+			? sscanf(hello, "SINCE %lld", &since) == 1
+			: sscanf(hello, "BETWEEN %lld %lld", &since, &until) == 2;
+		if(!valid || since < 0 || until < since){
+			syslog(LOG_INFO, "Invalid time range (%s). Client dropped!", hello);
+			_exit(EXIT_FAILURE);
+		}
+		sendTimeRange(client_fd, chatlog_fd, since, until);
+		syslog(LOG_DEBUG, "Time range sent, closing connection.");
+		_exit(EXIT_SUCCESS);
+	}
+	else if(strncmp(hello, "REPLICATE ", strlen("REPLICATE ")) == 0){
+		replicationServe(client_fd, chatlog_fd, hello + strlen("REPLICATE "));
+	}
+	syslog(LOG_INFO, "Unknown request (%s). Client dropped!", hello);
+	_exit(EXIT_FAILURE);
+}
+
+/* read the hello line sent by the client after the key, byte by byte, so
+that no message sent right after it is consumed here.
+"JOIN" the client connects for the first time, it gets the last lines of
+the chat log.
+"RESUME <offset>" the client lost its connection, it gets everything written
+to the chat log since offset, which is the offset right after the last byte
+that it received.
+"SEARCH <terms>" the client only searches the chat log, the results are sent
+and the connection is closed, this function does not return.
+"SINCE <time>" and "BETWEEN <time> <time>" the client only gets the messages
+written in a time range, afterwards the connection is closed as well.
+"REPLICATE <offset> <fingerprint>" the client is a standby daemon, it gets
+the chat log streamed until it disconnects, this function does not return.
+returns the offset from which the chat log is sent to the client */
+static off_t
+readHello(int client_fd, int chatlog_fd)
+{
+	char hello[HELLO_MAX_LENGTH];
+	size_t length = 0;
+
+	/* the client has as much time as for the key, the SIGALRM disposition
+	configured by authClient() terminates this process */
+	alarm(1);
+	for(;;){
+		ssize_t numRead = read(client_fd, &hello[length], 1);
+		if(numRead == -1){
+			syslog(LOG_ERR, "hello read() failed: %s", strerror(errno));
+			_exit(EXIT_FAILURE);
+		}
+		if(numRead == 0){
+			syslog(LOG_DEBUG, "Received EOF from client before hello!");
+			_exit(EXIT_FAILURE);
+		}
+		if(hello[length] == '\n')
+			break;
+		if(++length == HELLO_MAX_LENGTH){
+			syslog(LOG_INFO, "Hello line too long. Client dropped!");
+			_exit(EXIT_FAILURE);
+		}
+	}
+	alarm(0);
+	hello[length] = '\0';
+
+	if(isOneShotRequest(hello))
+		handleOneShotRequest(client_fd, chatlog_fd, hello);
+
+	off_t offset = chatOffset(chatlog_fd, hello);
+	if(offset == -1 && errno == EINVAL){
+		syslog(LOG_INFO, "Unknown hello (%s). Client dropped!", hello);
+		_exit(EXIT_FAILURE);
+	}
+	if(offset == -1){
+		syslog(LOG_ERR, "historyOffset() failed: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	return offset;
 }
 
 /* send a SIGTERM signal when closing connection or crashing with error to 
@@ -210,17 +422,47 @@ receiveMessages(int client_fd, int chatlog_fd, pid_t child_pid)
 		/* if the client closes its connection, the previous read() syscall will get an
 		EOF, and it will return 0, in that case, the while-loop ends, and there is no 
 		syslog error appended to the log, since read() did not return an error */  
-		if ((numRead = read(client_fd, buf, BUF_SIZE)) > 0) {
+		if ((numRead = read(client_fd, buf, BUF_SIZE)) > 0 && replicationIsStandby()) {
+			/* only the replicator appends to the chat log of a standby, the
+			clients can read the chat but their messages are dropped */
+			syslog(LOG_DEBUG, "%ld Bytes received from client dropped (standby).", numRead);
+		}
+		else if (numRead > 0) {
 			/* add debug syslog to see amount of bytes received from client */
 			syslog(LOG_DEBUG, "%ld Bytes received from client.", numRead);
+			TRACEPOINT2(receive, traceConnectionID, numRead);
+
+			/* NUL bytes mark the preallocated end of the chat log, they are
+			removed from the messages (file_locking.c) */
+			size_t length = scanRemove(buf, numRead, '\0');
+			if(length == 0){
+				free(buf);
+				continue;
+			}
 
 			/* using locks guarantee exclusive write on file with concurrent clients */
-			if(exclusiveWrite(chatlog_fd, buf, numRead)==-1){
+			if(exclusiveWrite(chatlog_fd, buf, length)==-1){
 				syslog(LOG_ERR, "exclusiveWrite() failed: %s", strerror(errno));
 				free(buf);
 				killChild(child_pid);
 				_exit(EXIT_FAILURE);
 			}
+			/* with 'DURABILITY batch' the messages are on disk before the
+			next ones are read from the client, otherwise only the metrics
+			are updated */
+			if(durabilityAppend(chatlog_fd, length)==-1){
+				syslog(LOG_ERR, "fdatasync() of the chat log failed: %s", strerror(errno));
+				free(buf);
+				killChild(child_pid);
+				_exit(EXIT_FAILURE);
+			}
+			/* the search index is not needed to chat, if it cannot be
+			updated, only the search misses the new messages */
+			if(searchIndexUpdate(chatlog_fd)==-1)
+				syslog(LOG_ERR, "searchIndexUpdate() failed: %s", strerror(errno));
+			/* stamp the messages with the time of the server */
+			if(timeIndexUpdate()==-1)
+				syslog(LOG_ERR, "timeIndexUpdate() failed: %s", strerror(errno));
 		} // read()
 
 		/* free resources */
@@ -256,6 +498,10 @@ handleRequest(int client_fd, int chatlog_fd)
 	/* send intro message to client */
 	//introMessage(client_fd);
 
+	/* the hello line is read before fork(), afterwards the parent process
+	reads every byte sent by the client */
+	off_t offset = readHello(client_fd, chatlog_fd);
+
 	/* store the pid of the child process in order to send kill signal when connection is closed */
 	pid_t sendingChild_pid = fork();
 	/* create a new child process to solely handle sending new messages back to client */
@@ -267,7 +513,10 @@ handleRequest(int client_fd, int chatlog_fd)
 
 		/* Child process */
 		case 0:
-			sendNewMessages(client_fd, chatlog_fd);
+			/* interval timers are not inherited, sample this process as well */
+			if(profilerArmProcess()==-1)
+				syslog(LOG_ERR, "profilerArmProcess() failed: %s", strerror(errno));
+			sendNewMessages(client_fd, chatlog_fd, offset);
 			/* when the parent process receiveMessages() receives a EOF from the client, when the client
 			disconnects, then the parent process sends a SIGTERM signal to the child (sendNewMessages) 
 			and _exit() itself. Therefore finishing all processes of a particular client. The sockets used
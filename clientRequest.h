@@ -4,17 +4,38 @@
 
 /* in order to define pid_t */
 #include "basics.h"
+#include <time.h>	/* time_t */
 
 #ifndef CLIENTREQUEST_H	/* header guard */
 #define CLIENTREQUEST_H
 
 void handleRequest(int,int);
 
+/* offset from which the chat log is sent to a client which sent the hello
+"JOIN" or "RESUME <offset>" (without newline). Returns -1 on error, errno =
+EINVAL if hello is neither */
+off_t chatOffset(int chatlog_fd, const char * hello);
+
+/* 1 if hello (without newline) is a request answered by a single process
+until the connection is closed ("SEARCH", "SINCE", "BETWEEN" or
+"REPLICATE"), 0 otherwise */
+int isOneShotRequest(const char * hello);
+
+/* answer such a request, the process is terminated afterwards, it never
+returns */
+void handleOneShotRequest(int client_fd, int chatlog_fd, const char * hello);
+
 static void introMessage(int);
 
 static off_t readChatlogSendClient(int, int, off_t);
 
-static void sendNewMessages(int, int);
+static void sendNewMessages(int, int, off_t);
+
+static void sendSearchResults(int, int, const char *);
+
+static void sendTimeRange(int, int, time_t, time_t);
+
+static off_t readHello(int, int);
 
 static void receiveMessages(int, int, pid_t);
 
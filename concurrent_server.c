@@ -21,10 +21,21 @@ Back-end server handling clients of papayaChat
 #include "signalHandling.h"		/* signal handlers library */
 #include "clientRequest.h"		/* what server does with client requests */
 #include "configParser.h"	/* function to parse config files */
+#include "tracepoints.h"		/* static tracepoints (USDT) */
+#include "profiler.h"			/* in-process sampling profiler */
+#include "durability.h"			/* fdatasync() policy of the chat log */
+#include "searchIndex.h"		/* inverted index of the chat log */
+#include "timeIndex.h"			/* time of the messages */
+#include "replication.h"		/* streaming to a hot standby */
+#include "threadedServer.h"		/* event loop threads instead of processes */
 
 #include "CONFIG.h"				/* add config file to define TCP port, 
 								termAsync binary pathname, BUF_SIZE, backlog queue */
 
+/* server's config file, it can be changed with -c (e.g. to run a primary
+and a standby on the same machine) */
+static const char * server_config_file = "/etc/papayachat/server.config";
+
 /* signal handler for SIGTERM signal */
 static void 
 termHandler(int sig)
@@ -73,8 +84,6 @@ static void
 getConfigValues(char * port_parsed)
 {
 	
-	const char * server_config_file = "/etc/papayachat/server.config";
-
 	/* parse PORT in server's config file */
 	if(parseConfigFile(server_config_file, "PORT", port_parsed)==-1){
 		syslog(LOG_ERR,"parseConfigFile for port failed: %s",strerror(errno));
@@ -83,6 +92,186 @@ getConfigValues(char * port_parsed)
 
 }
 
+/* parse PROFILER, the profiler is only used if the value is 'on', returns 1 if
+the profiler should be used and 0 otherwise */
+static int
+getProfilerMode(void)
+{
+
+	char * profiler_parsed = (char *) malloc(MAX_LINE_LENGTH+10);
+	if(profiler_parsed==NULL){
+		syslog(LOG_ERR,"malloc profiler_parsed failed: %s",strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* PROFILER is optional, if it cannot be parsed the profiler is off */
+	int enabled = 0;
+	if(parseConfigFile(server_config_file, "PROFILER", profiler_parsed)==0)
+		enabled = (strcmp(profiler_parsed, "on")==0);
+
+	free(profiler_parsed);
+	return enabled;
+
+}
+
+/* parse DURABILITY and DURABILITY_INTERVAL, both are optional, without them
+the chat log is never synced (none). The interval in ms is stored in
+intervalMs, returns the durability mode */
+static int
+getDurabilityMode(long * intervalMs)
+{
+
+	char * value_parsed = (char *) malloc(MAX_LINE_LENGTH+10);
+	if(value_parsed==NULL){
+		syslog(LOG_ERR,"malloc value_parsed failed: %s",strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	int mode = DURABILITY_NONE;
+	if(parseConfigFile(server_config_file, "DURABILITY", value_parsed)==0){
+		mode = durabilityParseMode(value_parsed);
+		if(mode == -1){
+			syslog(LOG_ERR,"DURABILITY must be none, interval or batch (not %s)",value_parsed);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	*intervalMs = DURABILITY_DEFAULT_INTERVAL;
+	if(parseConfigFile(server_config_file, "DURABILITY_INTERVAL", value_parsed)==0){
+		char * end;
+		*intervalMs = strtol(value_parsed, &end, 10);
+		if(*end != '\0' || *intervalMs <= 0){
+			syslog(LOG_ERR,"DURABILITY_INTERVAL must be a number of ms (not %s)",value_parsed);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	free(value_parsed);
+	return mode;
+
+}
+
+/* parse SEARCH, the search index is only used if the value is not 'off',
+returns 1 if the chat log should be indexed and 0 otherwise */
+static int
+getSearchMode(void)
+{
+
+	char * search_parsed = (char *) malloc(MAX_LINE_LENGTH+10);
+	if(search_parsed==NULL){
+		syslog(LOG_ERR,"malloc search_parsed failed: %s",strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* SEARCH is optional, without it the chat log is indexed */
+	int enabled = 1;
+	if(parseConfigFile(server_config_file, "SEARCH", search_parsed)==0)
+		enabled = (strcmp(search_parsed, "off")!=0);
+
+	free(search_parsed);
+	return enabled;
+
+}
+
+/* parse REPLICATION_PRIMARY and REPLICATION_PORT, both are optional, with
+them this daemon is a standby of the primary daemon at host:port. Returns 1
+if this daemon is a standby and 0 otherwise */
+static int
+getReplicationConfig(char * host, char * port)
+{
+
+	if(parseConfigFile(server_config_file, "REPLICATION_PRIMARY", host)==-1)
+		return 0;
+	if(parseConfigFile(server_config_file, "REPLICATION_PORT", port)==-1){
+		syslog(LOG_ERR,"REPLICATION_PRIMARY requires REPLICATION_PORT: %s",strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return 1;
+
+}
+
+/* parse THREADS, it is optional, without it (or with 'off') every client is
+handled by its own processes. 'auto' starts one event loop per online CPU,
+a number starts that many. Returns the number of event loops or 0 */
+static int
+getThreadsConfig(void)
+{
+
+	char * threads_parsed = (char *) malloc(MAX_LINE_LENGTH+10);
+	if(threads_parsed==NULL){
+		syslog(LOG_ERR,"malloc threads_parsed failed: %s",strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	long threads = 0;
+	if(parseConfigFile(server_config_file, "THREADS", threads_parsed)==0
+		&& strcmp(threads_parsed, "off")!=0){
+		if(strcmp(threads_parsed, "auto")==0)
+			threads = sysconf(_SC_NPROCESSORS_ONLN);
+		else{
+			char * end;
+			threads = strtol(threads_parsed, &end, 10);
+			if(*end != '\0' || threads <= 0 || threads > THREADS_MAX){
+				syslog(LOG_ERR,"THREADS must be off, auto or 1-%d (not %s)",THREADS_MAX,threads_parsed);
+				exit(EXIT_FAILURE);
+			}
+		}
+		if(threads < 1)
+			threads = 1;
+		if(threads > THREADS_MAX)
+			threads = THREADS_MAX;
+	}
+
+	free(threads_parsed);
+	return (int) threads;
+
+}
+
+/* parse LOW_LATENCY and BUSY_POLL, both are optional. With 'LOW_LATENCY on'
+the connections get TCP_NODELAY, and SO_BUSY_POLL if BUSY_POLL is a number of
+microseconds (stored in busyPollUs, 0 without it). Returns 1 if the
+low-latency mode is on and 0 otherwise */
+static int
+getLowLatencyConfig(int * busyPollUs)
+{
+
+	char * value_parsed = (char *) malloc(MAX_LINE_LENGTH+10);
+	if(value_parsed==NULL){
+		syslog(LOG_ERR,"malloc value_parsed failed: %s",strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	int enabled = 0;
+	if(parseConfigFile(server_config_file, "LOW_LATENCY", value_parsed)==0)
+		enabled = (strcmp(value_parsed, "on")==0);
+
+	*busyPollUs = 0;
+	if(enabled && parseConfigFile(server_config_file, "BUSY_POLL", value_parsed)==0){
+		char * end;
+		long busyPoll = strtol(value_parsed, &end, 10);
+		if(*end != '\0' || busyPoll < 0 || busyPoll > 1000000){
+			syslog(LOG_ERR,"BUSY_POLL must be a number of microseconds (not %s)",value_parsed);
+			exit(EXIT_FAILURE);
+		}
+		*busyPollUs = (int) busyPoll;
+	}
+
+	free(value_parsed);
+	return enabled;
+
+}
+
+/* dump the samples of the profiler after SIGUSR2 was received */
+static void
+dumpProfile(void)
+{
+	int stacks = profilerDump(PROFILER_OUTPUT_PATH);
+	if(stacks == -1)
+		syslog(LOG_ERR, "profilerDump() failed: %s", strerror(errno));
+	else
+		syslog(LOG_INFO, "Profiler: %d stacks dumped to %s", stacks, PROFILER_OUTPUT_PATH);
+}
+
 /* parse KEY */
 static void
 getKey(char * key)
@@ -105,6 +294,8 @@ static int
 authClient(int client_fd, char * key)
 {
 
+	TRACEPOINT2(auth__start, traceConnectionID, client_fd);
+
 	/* setup timeout for authentication process */
 	if(configureTimeout()==-1){
 		syslog(LOG_ERR, "timeout configuration during auth failed: %s", strerror(errno));
@@ -133,11 +324,13 @@ authClient(int client_fd, char * key)
 		/* compare key received with system key for validity */
 		if(strncmp(buf,key,KEY_LENGTH)==0){
 			syslog(LOG_DEBUG, "[OK] Key received is valid.");
+			TRACEPOINT3(auth__end, traceConnectionID, 0, numRead);
 			free(buf);
 			return 0; /* Auth succeded */
 		}
 		else{
 			syslog(LOG_DEBUG, "[FAIL] Key received is NOT valid.");
+			TRACEPOINT3(auth__end, traceConnectionID, -1, numRead);
 			free(buf);
 			return -1; /* Auth failed */
 		}
@@ -167,6 +360,17 @@ int
 main(int argc, char *argv[])
 {
     int listen_fd, client_fd;               /* server listening socket and client socket */
+
+	/* the options are parsed before the daemon loses its controlling
+	terminal, errors are still printed to stderr */
+	int opt;
+	while((opt = getopt(argc, argv, "c:")) != -1){
+		switch(opt){
+			case 'c': server_config_file = optarg; break;
+			default:
+				usageErr("%s [-c server.config]\n", argv[0]);
+		}
+	}
 	
 	/* server should run as a daemon, 
 	DAEMON_FLAH_NO_CHDIR -> daemon should initially stay in the same 
@@ -220,9 +424,91 @@ main(int argc, char *argv[])
 	}
 	getKey(key); /* get auth key */
 
+	/* start the in-process profiler, it samples this process and every child
+	process created from now on */
+	if(getProfilerMode()){
+		if(profilerInit()==-1 || profilerConfigureDumpSignal()==-1){
+			syslog(LOG_ERR, "Error: profiler initialization: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		syslog(LOG_INFO, "Profiler is on (%d Hz), send SIGUSR2 to dump samples.", PROFILER_FREQUENCY);
+	}
+
+	/* the flusher process syncs the chat log in the background and writes
+	the durability metrics, it is started after the profiler so that it is
+	sampled as well */
+	long durabilityInterval;
+	int durabilityMode = getDurabilityMode(&durabilityInterval);
+	if(durabilityInit(durabilityMode, durabilityInterval)==-1
+		|| durabilityStartFlusher(chatlog_fd, DURABILITY_METRICS_PATH)==-1){
+		syslog(LOG_ERR, "Error: durability initialization: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* index the lines appended to the chat log while the daemon was not
+	running, before any client can append more */
+	if(getSearchMode()){
+		if(searchIndexOpen(SEARCH_INDEX_PATH, chatlog_fd)==-1){
+			syslog(LOG_ERR, "Error: search index %s: %s", SEARCH_INDEX_PATH, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* the messages are stamped with the time of the server */
+	if(timeIndexOpen(TIME_INDEX_PATH)==-1){
+		syslog(LOG_ERR, "Error: time index %s: %s", TIME_INDEX_PATH, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* a standby replicates the chat log of its primary, it is started after
+	the indexes were opened, so that it updates them like a client */
+	replicationInit(REPLICATION_STATUS_PATH);
+	char * primary_host = (char *) malloc(MAX_LINE_LENGTH+10);
+	char * primary_port = (char *) malloc(MAX_LINE_LENGTH+10);
+	if(primary_host==NULL || primary_port==NULL){
+		syslog(LOG_ERR, "malloc replication config failed: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	/* the event loops of the threaded mode do not get the SIGUSR1 of the
+	replicator, its appends are counted in an eventfd */
+	int threads = getThreadsConfig();
+	int appended_fd = -1;
+	if(getReplicationConfig(primary_host, primary_port)){
+		if(threads > 0 && (appended_fd = chatLogNotifyAppends())==-1){
+			syslog(LOG_ERR, "Error: chatLogNotifyAppends(): %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if(replicationStartStandby(chatlog_fd, primary_host, primary_port, key)==-1){
+			syslog(LOG_ERR, "Error: replication from %s:%s: %s", primary_host, primary_port, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		syslog(LOG_INFO, "Standby of %s:%s, clients can only read the chat.", primary_host, primary_port);
+	}
+
+	/* in the threaded mode the clients are served by event loop threads of
+	this process, the listening thread only accepts them */
+	int busyPollUs;
+	int lowLatency = getLowLatencyConfig(&busyPollUs);
+	if(threads > 0){
+		/* the low-latency mode pins the loops to the CPUs and steers the
+		connections, the processes of the process mode are not pinned */
+		if(lowLatency)
+			threadedServerPinLoops(CPU_LOAD_PATH);
+		if(appended_fd != -1)
+			threadedServerWatchAppends(appended_fd);
+		if(threadedServerStart(chatlog_fd, key, threads)==-1){
+			syslog(LOG_ERR, "Error: threadedServerStart(): %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		syslog(LOG_INFO, "Threaded mode: %d event loops.", threads);
+	}
+
 	/* server listens on port, with a certain BACKLOG_QUEUE, and does not want to 
 	receive information about the address of the client socket (NULL) */
-    listen_fd = serverListen(port_parsed, BACKLOG_QUEUE, NULL);
+	if(lowLatency)
+		listen_fd = serverListenLowLatency(port_parsed, BACKLOG_QUEUE, NULL, busyPollUs);
+	else
+		listen_fd = serverListen(port_parsed, BACKLOG_QUEUE, NULL);
 	free(port_parsed);
     if (listen_fd == -1) {
 		/* The listening socket could not be created. */
@@ -232,11 +518,22 @@ main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+	if (lowLatency)
+		syslog(LOG_INFO, "Low-latency mode: TCP_NODELAY, busy poll %d us%s.", busyPollUs,
+			(threads > 0) ? ", event loops pinned to CPUs" : "");
+
 	/* send message to syslog, server is listening */
 	syslog(LOG_DEBUG, "Server is listening on incomming connections.");
 
     for (;;) {
         client_fd = accept(listen_fd, NULL, NULL);  /* Wait for connection from client */
+		/* accept() is interrupted by SIGUSR2 when the profiler should dump its
+		samples, that is not an error */
+		if (client_fd == -1 && errno == EINTR) {
+			if (profilerDumpRequested())
+				dumpProfile();
+			continue;
+		}
         if (client_fd == -1) {
             syslog(LOG_ERR, "Failure in accept(): %s", strerror(errno));
             exit(EXIT_FAILURE);				/* TODO: if accept() fails, should it try again?
@@ -244,6 +541,22 @@ main(int argc, char *argv[])
 											for all possible errors, one error is probably if the
 											internet is down! */
         }
+
+		/* small messages are sent at once, not after the ACK of the previous
+		ones */
+		if (lowLatency && socketLowLatency(client_fd, busyPollUs) == -1)
+			syslog(LOG_ERR, "socketLowLatency() failed: %s", strerror(errno));
+
+		/* every client gets a new connection id, which is inherited by the
+		child processes handling it (used by the tracepoints) */
+		traceConnectionID++;
+		TRACEPOINT2(accept, traceConnectionID, client_fd);
+
+		/* Threaded back-end architecture: an event loop serves the client */
+		if (threads > 0) {
+			threadedServerDispatch(client_fd);
+			continue;
+		}
 	
         /* Multi-process server back-end architecture:
 		Handle each client request in a new child process */
@@ -260,6 +573,9 @@ main(int argc, char *argv[])
 		/* write debug to syslog with child's PID, new configuration of syslog */
 			configure_syslog("papayaChat(child)");
             syslog(LOG_DEBUG, "Child process initialized (handling client connection)");
+			/* interval timers are not inherited, sample this process as well */
+			if(profilerArmProcess()==-1)
+				syslog(LOG_ERR, "profilerArmProcess() failed: %s", strerror(errno));
 			/* Authenticate client with key */
 			if(authClient(client_fd,key)==-1){
 			/* if the client takes more than 1 second to send the key, then the function authClient() 
@@ -0,0 +1,298 @@
+/* durability.c
+
+[back-end] Durability policy of the chat log.
+
+exclusiveWrite() only hands the messages to the page cache, a crash of the
+machine loses everything which the kernel did not write back yet. Calling
+fdatasync() after every message would make every client wait for the disk,
+so the policy is configurable with DURABILITY in server.config:
+
+	none		never sync (default)
+	interval	a flusher process syncs every DURABILITY_INTERVAL ms, at most
+				that much of the chat is lost, appends never wait for the disk
+	batch		the process receiving from a client syncs every batch of
+				messages (one read() from the socket) after writing it
+
+All processes of the daemon share the same open file description of the chat
+log, so an fdatasync() by any of them syncs the appends of all of them.
+
+The metrics (bytes appended and synced, how long ago the oldest byte not
+synced was appended, latency of fdatasync()) are kept in memory shared by all
+processes (MAP_SHARED memory is inherited through fork()), and the flusher
+writes them to a text file every DURABILITY_METRICS_PERIOD ms:
+
+	$ cat /var/lib/papayachat/papayachat.metrics
+
+Every fdatasync() also fires the tracepoint 'fsync' (see tracepoints.h).
+
+*/
+
+#include <signal.h>
+#include <time.h>		/* clock_gettime(), clock_nanosleep() */
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>	/* shared memory */
+#include <syslog.h>		/* the flusher runs as part of the daemon */
+
+#include "basics.h"
+#include "durability.h"
+#include "configure_syslog.h"
+#include "tracepoints.h"	/* static tracepoints (USDT) */
+#include "profiler.h"		/* in-process sampling profiler */
+#include "CONFIG.h"			/* DURABILITY_METRICS_PERIOD */
+
+/* metrics shared by all processes, only updated with atomic operations */
+struct durabilityMetrics {
+	unsigned long long appended;	/* bytes appended since the daemon started */
+	unsigned long long synced;		/* bytes of appended known to be on disk */
+	long long dirtySince;			/* time (us) when the oldest byte not
+									synced was appended, 0 if all are synced */
+	unsigned long long fsyncs;
+	unsigned long long fsyncErrors;
+	unsigned long long fsyncTotalUs;
+	unsigned long long fsyncLastUs;
+	unsigned long long fsyncMaxUs;
+};
+
+/* NULL with DURABILITY_NONE */
+static struct durabilityMetrics * metrics = NULL;
+
+static int durabilityMode = DURABILITY_NONE;
+static long durabilityIntervalMs = 0;
+
+/* set by the SIGTERM handler of the flusher */
+static volatile sig_atomic_t flusherTerminate = 0;
+
+static const char * modeNames[] = { "none", "interval", "batch" };
+
+/* monotonic time in microseconds (the same clock in every process) */
+static long long
+nowUs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+int
+durabilityParseMode(const char * name)
+{
+	for(int mode = DURABILITY_NONE; mode <= DURABILITY_BATCH; mode++)
+		if(strcmp(name, modeNames[mode]) == 0)
+			return mode;
+	return -1;
+}
+
+int
+durabilityInit(int mode, long intervalMs)
+{
+	durabilityMode = mode;
+	durabilityIntervalMs = intervalMs;
+	if(mode == DURABILITY_NONE)
+		return 0;
+
+	metrics = mmap(NULL, sizeof(struct durabilityMetrics), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(metrics == MAP_FAILED){
+		metrics = NULL;
+		return -1;
+	}
+	memset(metrics, 0, sizeof(struct durabilityMetrics));
+	return 0;
+}
+
+/* store value in *max, if it is bigger */
+static void
+atomicMax(unsigned long long * max, unsigned long long value)
+{
+	unsigned long long current = __atomic_load_n(max, __ATOMIC_RELAXED);
+	while(value > current
+		&& !__atomic_compare_exchange_n(max, &current, value, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		continue;
+}
+
+/* fdatasync() the chat log and update the metrics, returns 0 on success and
+-1 on error */
+static int
+syncChatlog(int chatlog_fd)
+{
+	/* everything appended before fdatasync() is called, is on disk after it
+	returned */
+	long long dirty = __atomic_load_n(&metrics->dirtySince, __ATOMIC_SEQ_CST);
+	unsigned long long target = __atomic_load_n(&metrics->appended, __ATOMIC_SEQ_CST);
+	long long start = nowUs();
+
+	if(fdatasync(chatlog_fd) == -1){
+		__atomic_add_fetch(&metrics->fsyncErrors, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	unsigned long long latency = nowUs() - start;
+	__atomic_add_fetch(&metrics->fsyncs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&metrics->fsyncTotalUs, latency, __ATOMIC_RELAXED);
+	__atomic_store_n(&metrics->fsyncLastUs, latency, __ATOMIC_RELAXED);
+	atomicMax(&metrics->fsyncMaxUs, latency);
+	/* several processes sync concurrently with DURABILITY_BATCH, synced
+	never goes back */
+	atomicMax(&metrics->synced, target);
+
+	/* the oldest byte not synced was appended after the sync started (or it
+	was already reset by another process) */
+	if(dirty != 0 && __atomic_compare_exchange_n(&metrics->dirtySince, &dirty, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+		if(__atomic_load_n(&metrics->appended, __ATOMIC_SEQ_CST) > target){
+			long long none = 0;
+			__atomic_compare_exchange_n(&metrics->dirtySince, &none, start, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		}
+	}
+
+	TRACEPOINT3(fsync, traceConnectionID, latency, target);
+	return 0;
+}
+
+int
+durabilityAppend(int chatlog_fd, size_t bytes)
+{
+	if(metrics == NULL)
+		return 0;
+
+	__atomic_add_fetch(&metrics->appended, bytes, __ATOMIC_SEQ_CST);
+	long long none = 0;
+	__atomic_compare_exchange_n(&metrics->dirtySince, &none, nowUs(), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+	if(durabilityMode == DURABILITY_BATCH)
+		return syncChatlog(chatlog_fd);
+	return 0;
+}
+
+/* write the metrics to a temporary file and rename it to pathname, so that
+a reader never sees half of the metrics. Returns 0 on success and -1 on
+error */
+static int
+writeMetrics(const char * pathname)
+{
+	unsigned long long appended = __atomic_load_n(&metrics->appended, __ATOMIC_SEQ_CST);
+	unsigned long long synced = __atomic_load_n(&metrics->synced, __ATOMIC_SEQ_CST);
+	long long dirtySince = __atomic_load_n(&metrics->dirtySince, __ATOMIC_SEQ_CST);
+	unsigned long long fsyncs = __atomic_load_n(&metrics->fsyncs, __ATOMIC_RELAXED);
+	unsigned long long totalUs = __atomic_load_n(&metrics->fsyncTotalUs, __ATOMIC_RELAXED);
+
+	long long lagMs = 0;
+	if(dirtySince != 0)
+		lagMs = (nowUs() - dirtySince) / 1000;
+
+	char text[BUF_SIZE];
+	int length = snprintf(text, sizeof(text),
+		"durability_mode %s\n"
+		"durability_interval_ms %ld\n"
+		"appended_bytes %llu\n"
+		"synced_bytes %llu\n"
+		"lag_bytes %llu\n"
+		"lag_ms %lld\n"
+		"fsync_count %llu\n"
+		"fsync_errors %llu\n"
+		"fsync_last_us %llu\n"
+		"fsync_max_us %llu\n"
+		"fsync_avg_us %llu\n",
+		modeNames[durabilityMode], durabilityIntervalMs,
+		appended, synced, (appended > synced) ? appended - synced : 0, lagMs,
+		fsyncs, __atomic_load_n(&metrics->fsyncErrors, __ATOMIC_RELAXED),
+		__atomic_load_n(&metrics->fsyncLastUs, __ATOMIC_RELAXED),
+		__atomic_load_n(&metrics->fsyncMaxUs, __ATOMIC_RELAXED),
+		(fsyncs > 0) ? totalUs / fsyncs : 0);
+
+	char temporaryPath[MAX_LINE_LENGTH];
+	snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", pathname);
+	int fd = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+	if(fd == -1)
+		return -1;
+	if(write(fd, text, length) != length){
+		close(fd);
+		return -1;
+	}
+	if(close(fd) == -1)
+		return -1;
+
+	return rename(temporaryPath, pathname);
+}
+
+static void
+flusherTermHandler(int sig)
+{
+	flusherTerminate = 1;
+}
+
+/* main loop of the flusher process, it never returns */
+static void
+runFlusher(int chatlog_fd, const char * metricsPath, pid_t parent)
+{
+	/* SIGTERM (make kill) interrupts the sleep, the chat log is synced a
+	last time before exiting */
+	struct sigaction sa_sigterm;
+	sigemptyset(&sa_sigterm.sa_mask);
+	sa_sigterm.sa_flags = 0;
+	sa_sigterm.sa_handler = flusherTermHandler;
+	if(sigaction(SIGTERM, &sa_sigterm, NULL) == -1){
+		syslog(LOG_ERR, "sigaction(SIGTERM) failed: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+
+	long long now = nowUs();
+	long long nextSync = now + durabilityIntervalMs * 1000LL;
+	long long nextMetrics = now + DURABILITY_METRICS_PERIOD * 1000LL;
+
+	for(;;){
+		long long wakeup = nextMetrics;
+		if(durabilityMode == DURABILITY_INTERVAL && nextSync < wakeup)
+			wakeup = nextSync;
+		struct timespec deadline = { wakeup / 1000000, (wakeup % 1000000) * 1000 };
+		int sleepError = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+		if(sleepError != 0 && sleepError != EINTR){
+			syslog(LOG_ERR, "clock_nanosleep() failed: %s", strerror(sleepError));
+			_exit(EXIT_FAILURE);
+		}
+
+		/* the listening process is gone, nobody appends anymore */
+		int terminate = flusherTerminate || getppid() != parent;
+
+		now = nowUs();
+		if(durabilityMode == DURABILITY_INTERVAL && (now >= nextSync || terminate)){
+			if(__atomic_load_n(&metrics->appended, __ATOMIC_SEQ_CST) != __atomic_load_n(&metrics->synced, __ATOMIC_SEQ_CST)
+				&& syncChatlog(chatlog_fd) == -1)
+				syslog(LOG_ERR, "fdatasync() of the chat log failed: %s", strerror(errno));
+			/* the interval is measured from the end of the last sync, a slow
+			disk is not synced back to back */
+			nextSync = nowUs() + durabilityIntervalMs * 1000LL;
+		}
+		if(now >= nextMetrics || terminate){
+			if(writeMetrics(metricsPath) == -1)
+				syslog(LOG_ERR, "writing durability metrics to %s failed: %s", metricsPath, strerror(errno));
+			nextMetrics = now + DURABILITY_METRICS_PERIOD * 1000LL;
+		}
+
+		if(terminate){
+			syslog(LOG_DEBUG, "Flusher terminated.");
+			_exit(EXIT_SUCCESS);
+		}
+	}
+}
+
+pid_t
+durabilityStartFlusher(int chatlog_fd, const char * metricsPath)
+{
+	if(metrics == NULL)
+		return 0;
+
+	pid_t parent = getpid();
+	pid_t flusher = fork();
+	if(flusher != 0)
+		return flusher;	/* parent or error (-1) */
+
+	configure_syslog("papayaChat(flusher)");
+	/* interval timers are not inherited, sample this process as well */
+	if(profilerArmProcess() == -1)
+		syslog(LOG_ERR, "profilerArmProcess() failed: %s", strerror(errno));
+	runFlusher(chatlog_fd, metricsPath, parent);
+	_exit(EXIT_FAILURE);	/* not reached */
+}
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
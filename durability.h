@@ -0,0 +1,44 @@
+/* durability.h
+
+[back-end] Durability policy of the chat log (DURABILITY in server.config)
+and metrics of the fdatasync() calls
+
+*/
+
+#ifndef DURABILITY_H /* header guard */
+#define DURABILITY_H
+
+#include <sys/types.h>	/* pid_t, size_t */
+
+/* none: the chat log is never synced, the kernel writes it back whenever
+it wants (default).
+interval: a flusher process syncs the chat log every DURABILITY_INTERVAL ms,
+appends never wait for the disk.
+batch: every batch of messages read from a client is synced before the
+next batch is read from that client */
+#define DURABILITY_NONE 0
+#define DURABILITY_INTERVAL 1
+#define DURABILITY_BATCH 2
+
+/* returns the mode with the given name (none, interval or batch) or -1 if
+the name is unknown */
+int durabilityParseMode(const char * name);
+
+/* create the metrics shared by all processes, it should be called once by
+the listening process before any fork(). With DURABILITY_NONE nothing is
+measured. Returns 0 on success and -1 on error */
+int durabilityInit(int mode, long intervalMs);
+
+/* account for bytes appended to the chat log, with DURABILITY_BATCH they are
+synced before returning. Returns 0 on success and -1 if fdatasync() failed */
+int durabilityAppend(int chatlog_fd, size_t bytes);
+
+/* fork the flusher process, which syncs the chat log (DURABILITY_INTERVAL)
+and writes the metrics to metricsPath every DURABILITY_METRICS_PERIOD ms.
+Returns the pid of the flusher, 0 if no flusher is needed (DURABILITY_NONE)
+or -1 on error */
+pid_t durabilityStartFlusher(int chatlog_fd, const char * metricsPath);
+
+#endif
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
@@ -23,7 +23,20 @@ POSIX/fcntl file locking. */
 /* Required for flock(2) (not BSD Linux distros) */
 #include <sys/file.h>
 
+/* the logical end and the hot tail of the chat log are shared by all
+processes */
+#include <sys/mman.h>
+#include <pthread.h>	/* process-shared mutex */
+#include <sched.h>	/* sched_yield() */
+#include <sys/uio.h>	/* pwritev(), records are written with a single syscall */
+#include <sys/eventfd.h>	/* appends seen by the threads of the daemon */
+#include <stdint.h>
+#include <syslog.h>	/* the chat log is recovered by the daemon */
+
 #include "basics.h"
+#include "tracepoints.h"	/* static tracepoints (USDT) */
+#include "file_locking.h"	/* struct chatRecordHeader */
+#include "lineScan.h"		/* scanFindLast(), the history sent to a client */
 
 /* CONFIG.h header file includes the path where the central chat log file
 will be stored; defined under CHAT_LOG_PATH as a string */
@@ -41,10 +54,411 @@ words the last X lines of the file to be sent to the client */
 /* max amount of characters that can be sent back to the client */
 #define MAX_CHARACTERS_BACK_CLIENT (MAX_CHARACTERS_PER_LINE * LINES_SEND_BACK_TO_CLIENT)
 
+/* how many times a reader of the hot tail waits for a writer, before it reads
+the file instead */
+#define HOT_TAIL_MAX_ATTEMPTS 1000
+
+/* The chat log is preallocated in chunks of CHATLOG_PREALLOCATION bytes with
+posix_fallocate(), which also extends the size of the file. Appending a message then
+only writes into blocks that already exist and does not change the size of
+the file, so the filesystem does not update the metadata of the file for
+every message (fdatasync() does not need to commit the journal).
+
+The bytes after the last message are NUL bytes (messages never contain them,
+the daemon removes them from what the clients send with scanRemove()),
+so the logical end of the data is not the size of the file anymore. It is
+kept in memory shared by all processes of the daemon, and readers never read
+past it. When the chat log is opened for the first time, the logical end is
+found again by walking backwards over the NUL bytes at its end, only the
+preallocated tail is read, not the whole chat log. A torn write of a crash
+before the logical end is removed right after (recoverTornTail()).
+
+flock() locks belong to an open file description, and all processes of the
+daemon share the one of the chat log (it is opened before fork()), so the
+exclusive lock does not keep two processes from writing at the same time. The
+offset at which a message is written is therefore taken while holding
+appendLock, a mutex in the shared memory.
+
+The last CHATLOG_HOT_TAIL bytes of the chat log (the hot tail) are kept in the
+shared memory as well, in a ring in which the byte at offset o of the chat log
+is stored at tail[o % CHATLOG_HOT_TAIL]. Everything that readers ask for is
+almost always in it: the history of a joining client, the messages missed by
+a resuming client and the new messages streamed to every client. These reads
+are copied from memory without any syscall, so that a reconnect storm does
+not become a storm of flock() and pread() calls. Only older ranges are read
+from the file.
+The hot tail is protected by a sequence lock: the writer (which holds
+appendLock anyway) makes sequence odd while it changes the ring, and a reader
+copies again if sequence changed while it was copying. */
+struct chatLogState {
+	pthread_mutex_t appendLock;	/* process-shared, robust */
+	off_t end;			/* logical end of the data, changed while holding
+						appendLock */
+	off_t allocated;	/* size of the file */
+	int preallocate;	/* 0 if posix_fallocate() failed */
+	unsigned long sequence;		/* odd while the hot tail is changed */
+	off_t tailStart;	/* offset of the oldest byte in the hot tail */
+	char tail[CHATLOG_HOT_TAIL];
+};
+
+/* NULL until the chat log is opened for the first time, the shared memory is
+inherited by every process created afterwards */
+static struct chatLogState * chatlog = NULL;
+
+/* eventfd written by exclusiveWrite() after every append, -1 if none. It is
+inherited by the processes created after chatLogNotifyAppends() */
+static int appendNotifyFd = -1;
+
+/* find the end of the complete lines among the last CHATLOG_RECOVERY_WINDOW
+bytes before end (the offset after the last byte which is not NUL): the last
+newline. *hole is set to the offset of the first NUL byte before that
+newline, or -1 if there is none. Returns the offset after the newline, end
+if a line longer than the window cannot be checked, or -1 on error */
+static off_t
+completeLinesEnd(int file_fd, off_t end, off_t * hole)
+{
+	*hole = -1;
+	off_t windowStart = (end > CHATLOG_RECOVERY_WINDOW) ? end - CHATLOG_RECOVERY_WINDOW : 0;
+	size_t length = end - windowStart;
+	if(length == 0)
+		return end;
+
+	char * window = (char *) malloc(length);
+	if(window==NULL)
+		return -1;
+	if(pread(file_fd,window,length,windowStart) != (ssize_t) length){
+		free(window);
+		return -1;
+	}
+
+	ssize_t lastNewline = scanFindLast(window, length, '\n', 1, NULL);
+	const char * firstNul = (lastNewline != -1) ? scanFind(window, lastNewline, '\0') : NULL;
+	if(firstNul != NULL)
+		*hole = windowStart + (firstNul - window);
+	free(window);
+
+	if(lastNewline != -1)
+		return windowStart + lastNewline + 1;
+	if(windowStart == 0)
+		return 0;
+	return end;	/* a line longer than the window cannot be checked */
+}
+
+/* check the end of the chat log for the damage of a crash in the middle of a
+write and remove it, returns the end of the valid data (at most end) or -1
+on error.
+Every message ends with a newline and never contains NUL bytes, so only two
+things can go wrong: the daemon (or the machine) died after a part of a
+message was written, then the last line has no newline, and the readers
+would send it to the clients forever, glued to the next message. That line
+is overwritten with NUL bytes (the preallocated tail) and synced; the NUL
+bytes after it were already left out by findEndOfData(). Or the machine died
+before the kernel wrote back every block of the last writes, then some
+blocks before the end read as NUL bytes. The complete lines after such a
+hole are valid messages, they are kept (the hole is only logged).
+Only the last CHATLOG_RECOVERY_WINDOW bytes are read, the data before them
+was synced by the kernel long ago. The search index and the time index check
+themselves against the new end when they are opened */
+static off_t
+recoverTornTail(int file_fd, off_t end)
+{
+	off_t hole;
+	off_t recovered = completeLinesEnd(file_fd, end, &hole);
+	if(recovered == -1)
+		return -1;
+	if(hole != -1)
+		syslog(LOG_WARNING, "Chat log recovery: NUL bytes at offset %lld (blocks never written), the lines after them are kept.",
+			(long long) hole);
+	if(recovered == end)
+		return end;
+
+	syslog(LOG_WARNING, "Chat log recovery: %lld bytes after offset %lld are a torn write, they are removed.",
+		(long long) (end - recovered), (long long) recovered);
+
+	char * zeros = (char *) calloc(1, CHATLOG_RECOVERY_CHUNK);
+	if(zeros==NULL)
+		return -1;
+	for(off_t offset = recovered; offset < end; ){
+		size_t chunk = (end - offset < CHATLOG_RECOVERY_CHUNK) ? (size_t) (end - offset) : CHATLOG_RECOVERY_CHUNK;
+		if(pwrite(file_fd,zeros,chunk,offset) != (ssize_t) chunk){
+			free(zeros);
+			return -1;
+		}
+		offset += chunk;
+	}
+	free(zeros);
+
+	/* the next message is written at recovered, the torn bytes must not
+	come back after another crash */
+	if(fdatasync(file_fd)==-1)
+		return -1;
+	return recovered;
+}
+
+/* find the logical end of the chat log, the offset after its last byte that
+is not NUL, returns -1 on error */
+static off_t
+findEndOfData(int file_fd, off_t fileSize)
+{
+	char * chat_text = (char *) malloc(CHATLOG_RECOVERY_CHUNK);
+	if(chat_text==NULL)
+		return -1;
+
+	off_t end = fileSize;
+	while(end > 0){
+		size_t chunk = (end < CHATLOG_RECOVERY_CHUNK) ? (size_t) end : CHATLOG_RECOVERY_CHUNK;
+		if(pread(file_fd,chat_text,chunk,end-chunk) != (ssize_t) chunk){
+			free(chat_text);
+			return -1;
+		}
+		ssize_t i = chunk - 1;
+		while(i >= 0 && chat_text[i]=='\0')
+			i--;
+		end -= chunk - 1 - i;
+		/* found the last byte of the data */
+		if(i >= 0)
+			break;
+	}
+
+	free(chat_text);
+	return end;
+}
+
+/* copy length bytes of the chat log starting at offset between the ring of
+the hot tail and buffer, in either direction */
+static void
+copyFromHotTail(char * buffer, off_t offset, size_t length)
+{
+	size_t position = offset % CHATLOG_HOT_TAIL;
+	size_t first = CHATLOG_HOT_TAIL - position;
+	if(first > length)
+		first = length;
+	memcpy(buffer, &chatlog->tail[position], first);
+	memcpy(buffer + first, chatlog->tail, length - first);
+}
+
+static void
+copyToHotTail(const char * buffer, off_t offset, size_t length)
+{
+	size_t position = offset % CHATLOG_HOT_TAIL;
+	size_t first = CHATLOG_HOT_TAIL - position;
+	if(first > length)
+		first = length;
+	memcpy(&chatlog->tail[position], buffer, first);
+	memcpy(chatlog->tail, buffer + first, length - first);
+}
+
+/* append a message written at offset to the hot tail, the caller holds
+appendLock. The new logical end is published together with it */
+static void
+appendHotTail(const char * string, size_t sizeString, off_t offset)
+{
+	unsigned long sequence = chatlog->sequence;
+	__atomic_store_n(&chatlog->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	/* a message longer than the ring only leaves its end in it */
+	off_t newEnd = offset + sizeString;
+	if(sizeString > CHATLOG_HOT_TAIL){
+		string += sizeString - CHATLOG_HOT_TAIL;
+		offset = newEnd - CHATLOG_HOT_TAIL;
+		sizeString = CHATLOG_HOT_TAIL;
+	}
+	copyToHotTail(string, offset, sizeString);
+	if(newEnd - chatlog->tailStart > CHATLOG_HOT_TAIL)
+		chatlog->tailStart = newEnd - CHATLOG_HOT_TAIL;
+	__atomic_store_n(&chatlog->end, newEnd, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&chatlog->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/* copy at most sizeString bytes of the chat log starting at offset from the
+hot tail, no lock is needed. Returns the number of bytes copied (0 at the end
+of the chat log) or -1 if offset is older than the hot tail */
+static ssize_t
+readHotTail(char * string, size_t sizeString, off_t offset)
+{
+	for(int attempt = 0; ; attempt++){
+		/* the writer is very slow or died while changing the ring, read
+		the file instead */
+		if(attempt == HOT_TAIL_MAX_ATTEMPTS)
+			return -1;
+
+		unsigned long sequence = __atomic_load_n(&chatlog->sequence, __ATOMIC_ACQUIRE);
+		/* a writer is changing the ring right now, it only copies one
+		message, let it run (the daemon might have a single CPU) */
+		if(sequence & 1){
+			sched_yield();
+			continue;
+		}
+
+		off_t end = chatlog->end;
+		ssize_t bytesRead = -1;
+		if(offset >= chatlog->tailStart && offset <= end){
+			bytesRead = 0;
+			if(sizeString > end - offset)
+				sizeString = end - offset;
+			if(sizeString > 0){
+				copyFromHotTail(string, offset, sizeString);
+				bytesRead = sizeString;
+			}
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&chatlog->sequence, __ATOMIC_RELAXED) == sequence)
+			return bytesRead;
+	}
+}
+
+/* allocate the next chunk of the chat log, if it fails (e.g. the disk is
+full) the chat log simply grows with every message.
+posix_fallocate() uses fallocate() on Linux (or writes the NUL bytes if the
+filesystem does not support it) */
+static void
+preallocateChatLog(int file_fd)
+{
+	if(posix_fallocate(file_fd, chatlog->allocated, CHATLOG_PREALLOCATION) == 0)
+		chatlog->allocated += CHATLOG_PREALLOCATION;
+	else
+		chatlog->preallocate = 0;
+}
+
+/* the mutex is shared by all processes, and if a process dies while holding
+it (e.g. killed in the middle of a write) the next process that locks it
+gets EOWNERDEAD instead of blocking forever */
+int
+initSharedMutex(pthread_mutex_t * mutex)
+{
+	pthread_mutexattr_t attributes;
+	int error = pthread_mutexattr_init(&attributes);
+	if(error == 0)
+		error = pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+	if(error == 0)
+		error = pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+	if(error == 0)
+		error = pthread_mutex_init(mutex, &attributes);
+	pthread_mutexattr_destroy(&attributes);
+
+	if(error != 0){
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+int
+lockSharedMutex(pthread_mutex_t * mutex, void (*repair)(void))
+{
+	int error = pthread_mutex_lock(mutex);
+	if(error == EOWNERDEAD){
+		if(repair != NULL)
+			repair();
+		error = pthread_mutex_consistent(mutex);
+	}
+	if(error != 0){
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+/* the owner of appendLock died. The logical end is only moved after a
+message was written completely, so the message it was writing is simply
+overwritten. If it died while changing the hot tail, the ring is emptied
+(the file still has everything) */
+static void
+repairAppend(void)
+{
+	unsigned long sequence = chatlog->sequence;
+	if(sequence & 1){
+		chatlog->tailStart = chatlog->end;
+		__atomic_store_n(&chatlog->sequence, sequence + 1, __ATOMIC_RELEASE);
+	}
+}
+
+/* lock appendLock, returns 0 on success and -1 on error */
+static int
+lockAppend(void)
+{
+	return lockSharedMutex(&chatlog->appendLock, repairAppend);
+}
+
+/* create the state shared by all processes and find the logical end of the
+chat log, returns 0 on success and -1 on error */
+static int
+initChatLogState(int file_fd)
+{
+	struct chatLogState * state = mmap(NULL, sizeof(struct chatLogState),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(state == MAP_FAILED)
+		return -1;
+	if(initSharedMutex(&state->appendLock) == -1){
+		munmap(state, sizeof(struct chatLogState));
+		return -1;
+	}
+
+	/* no message is written while the end is searched */
+	if(flock(file_fd,LOCK_EX)==-1){
+		munmap(state, sizeof(struct chatLogState));
+		return -1;
+	}
+
+	struct stat fileStat;
+	off_t end = -1;
+	if(fstat(file_fd,&fileStat)==0)
+		end = findEndOfData(file_fd, fileStat.st_size);
+	if(end != -1)
+		end = recoverTornTail(file_fd, end);
+	if(end == -1){
+		flock(file_fd,LOCK_UN);
+		munmap(state, sizeof(struct chatLogState));
+		return -1;
+	}
+
+	state->end = end;
+	state->allocated = fileStat.st_size;
+	state->preallocate = 1;
+	chatlog = state;
+
+	/* fill the hot tail with the end of the chat log */
+	state->sequence = 0;
+	state->tailStart = (end > CHATLOG_HOT_TAIL) ? end - CHATLOG_HOT_TAIL : 0;
+	char * chat_text = (char *) malloc(CHATLOG_RECOVERY_CHUNK);
+	if(chat_text==NULL){
+		flock(file_fd,LOCK_UN);
+		chatlog = NULL;
+		munmap(state, sizeof(struct chatLogState));
+		return -1;
+	}
+	for(off_t offset = state->tailStart; offset < end; ){
+		size_t chunk = (end - offset < CHATLOG_RECOVERY_CHUNK) ? (size_t) (end - offset) : CHATLOG_RECOVERY_CHUNK;
+		if(pread(file_fd,chat_text,chunk,offset) != (ssize_t) chunk){
+			free(chat_text);
+			flock(file_fd,LOCK_UN);
+			chatlog = NULL;
+			munmap(state, sizeof(struct chatLogState));
+			return -1;
+		}
+		copyToHotTail(chat_text, offset, chunk);
+		offset += chunk;
+	}
+	free(chat_text);
+
+	if(chatlog->allocated - chatlog->end < CHATLOG_PREALLOCATION / 2)
+		preallocateChatLog(file_fd);
+
+	if(flock(file_fd,LOCK_UN)==-1)
+		return -1;
+
+	return 0;
+}
+
 /* open the central chat log file
 If file does not exist, it creates the file.
 It returns fd of file if file is created or opened correctly.
-If not, it returns -1 */
+If not, it returns -1.
+The first call also finds the logical end of the chat log, it should happen
+before fork(), so that all processes share it */
 int
 openChatLogFile(void)
 {
@@ -52,17 +466,63 @@ openChatLogFile(void)
 	/* Define flags for open(2)
 	-open for READ/WRITE
 	-if file does not exist, CREATE file
-	-when writting, always APPEND to file (atomic call)
 	-CLOSE file descriptor on EXEC 
+	O_APPEND is not used, messages are written at the logical end of the
+	chat log, in front of the preallocated bytes
 	*/
-	int flags = O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC ;
+	int flags = O_RDWR | O_CREAT | O_CLOEXEC ;
 
 	/* File permissions (when file is created) */
 	mode_t createPermissions = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;
 
-	/* return fd of openned file, or -1 if error */
-	return open(CHAT_LOG_PATH,flags,createPermissions);
+	int file_fd = open(CHAT_LOG_PATH,flags,createPermissions);
+	if(file_fd == -1)
+		return -1;
 
+	if(chatlog == NULL && initChatLogState(file_fd) == -1){
+		close(file_fd);
+		return -1;
+	}
+
+	/* return fd of openned file */
+	return file_fd;
+
+}
+
+/* the threads of the threaded mode cannot wait for SIGUSR1 (the daemon
+ignores it), they wait on this eventfd for the appends of other processes */
+int
+chatLogNotifyAppends(void)
+{
+	appendNotifyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return appendNotifyFd;
+}
+
+/* logical end of the chat log, the readers should hold a lock so that it
+does not change while they use it */
+off_t
+chatLogEnd(void)
+{
+	return __atomic_load_n(&chatlog->end, __ATOMIC_ACQUIRE);
+}
+
+/* the data of the chat log is only appended, the bytes before the end of
+the complete lines never change again, so a reader outside of the daemon
+finds that end from the content of the file and copies up to it without any
+lock: the NUL bytes at the end are skipped (findEndOfData()), then a message
+still being written (a line without newline, the rest of it is not copied
+yet) is left out like a torn write, but nothing is changed */
+off_t
+chatLogSnapshotEnd(int file_fd)
+{
+	struct stat fileStat;
+	if(fstat(file_fd, &fileStat) == -1)
+		return -1;
+	off_t end = findEndOfData(file_fd, fileStat.st_size);
+	if(end == -1)
+		return -1;
+	off_t hole;
+	return completeLinesEnd(file_fd, end, &hole);
 }
 
 /* place an exclusive lock and write to the file 
@@ -81,48 +541,88 @@ exclusiveWrite(int file_fd, char* string, size_t sizeString)
 	and no other file is reading at the same time (shared lock) */	
 	if(flock(file_fd,LOCK_EX)==-1)
 		return -1;
-
-	if (write(file_fd, string, sizeString) != sizeString)
-		return -1;
+	TRACEPOINT2(lock__acquire, traceConnectionID, file_fd);
+
+	/* the processes of the daemon share the open file description of the
+	chat log, the flock() does not exclude them from each other (only other
+	programs which open the chat log), appendLock does. The flock() is
+	released on every error path as well */
+	int result = 0;
+	if(lockAppend() == -1)
+		result = -1;
+	else{
+		/* write at the logical end of the chat log, into the preallocated
+		bytes, a failed write is overwritten by the next message */
+		off_t writeOffset = chatlog->end;
+		if(pwrite(file_fd, string, sizeString, writeOffset) != sizeString)
+			result = -1;
+		else{
+			TRACEPOINT3(write, traceConnectionID, writeOffset, sizeString);
+			appendHotTail(string, sizeString, writeOffset);
+
+			/* allocate the next chunk, before the allocated bytes run out */
+			if(chatlog->preallocate && chatlog->allocated - chatlog->end < CHATLOG_PREALLOCATION / 2)
+				preallocateChatLog(file_fd);
+		}
+		pthread_mutex_unlock(&chatlog->appendLock);
+	}
 
 	/* send SIGUSR1 signal to process group, to signal in a MULTICAST way that 
 	there are new messages in the chat log file
 	the first argument is 0, so that the signal is sent to all members of the 
 	process group */
-    if(kill(0,SIGUSR1)==-1)
-		return -1;
-
-	/* unlock file */
+	if(result == 0 && kill(0,SIGUSR1)==-1)
+		result = -1;
+	/* EAGAIN: the counter is full, the reader was not woken up yet */
+	uint64_t one = 1;
+	if(result == 0 && appendNotifyFd != -1 && write(appendNotifyFd, &one, sizeof(one)) == -1
+		&& errno != EAGAIN)
+		result = -1;
+
+	/* unlock file, errno of a previous error is kept */
+	int savedErrno = errno;
 	if(flock(file_fd,LOCK_UN)==-1)
 		return -1;
+	TRACEPOINT2(lock__release, traceConnectionID, file_fd);
+	errno = savedErrno;
 
-	return 0;
+	return result;
 
 }
 
-/* place a shared lock, read from chat log file, store messages in string, which
-will be sent to client */
+/* read from chat log file, store messages in string, which will be sent to
+client. The bytes are copied from the hot tail if it still has them,
+otherwise they are read from the file under a shared lock.
+pread() is used instead of lseek() and read(), all processes of the daemon
+share the same open file description of the chat log (it is opened before
+fork()), so the file offset is shared as well and another process could move
+it between the lseek() and the read() */
 int 
 sharedRead(int file_fd, char* string, size_t sizeString, off_t offset)
 {
 
+	ssize_t bytesRead = readHotTail(string, sizeString, offset);
+	if(bytesRead >= 0)
+		return bytesRead;
+
 	/* place a shared lock on chat log file, multiple process will be able to read
 	concurrently from the file, but no writes are permitted (LOCK_EX) exclusive locks */
 	if(flock(file_fd,LOCK_SH)==-1)
 		return -1;
 
-	ssize_t bytesRead;	/* bytes read from chat log file */
-
-	int whence = SEEK_SET;	/* SEEK_SET= set the offset in relationship to the beginning 
-							of the file */ 
-
-	/* set file offset in relationship to beginning of file */
-	if(lseek(file_fd,offset,whence)==-1)
-		return -1;
-
-	bytesRead = read(file_fd,string,sizeString);
-	if(bytesRead < 0)
-		return -1;
+	bytesRead = 0;	/* bytes read from chat log file */
+
+	/* read at offset in relationship to beginning of file, without changing
+	the shared file offset, the preallocated bytes after the logical end are
+	never read (EOF) */
+	off_t endOfData = chatLogEnd();
+	if(offset < endOfData){
+		if(sizeString > endOfData - offset)
+			sizeString = endOfData - offset;
+		bytesRead = pread(file_fd,string,sizeString,offset);
+		if(bytesRead < 0)
+			return -1;
+	}
 
 	/* unlock file */	
 	if(flock(file_fd,LOCK_UN)==-1)
@@ -133,143 +633,306 @@ sharedRead(int file_fd, char* string, size_t sizeString, off_t offset)
 
 }
 
-/* lock the chatlog file, find out which bytes to send to the client to 
-send a maximum amount of lines, send the lines to the client and unlock chatlog file 
-returns -1 if there was an error, or the offset of the last byte of the file
-if it was successful */
+/* find the offset of the first of the last lines of the chat log, which are
+sent to a client when it joins the chat (LINES_SEND_BACK_TO_CLIENT lines at
+most, within the last MAX_CHARACTERS_BACK_CLIENT bytes).
+returns -1 if there was an error, or the offset from which the chat log
+should be sent to the client (0 if the whole file fits) */
 off_t
-messagesFromFirstClientConnection(int file_fd, int client_fd)
+historyOffset(int file_fd)
 {
-		/* place a shared lock on chat log file, multiple processes will be able to read
-	concurrently from the file, but no writes are permitted (LOCK_EX) exclusive locks */
-	if(flock(file_fd,LOCK_SH)==-1)
-		return -1;
+	/* the logical end, the chat log is preallocated. Messages appended
+	afterwards are not taken into account */
+	off_t endOfFile = chatLogEnd();
 
-	int whence = SEEK_END;	/* SEEK_END= set the offset at one byte after the last byte of the file */
-
-	/* find the offset for the last byte of the file */
-	off_t lastByteOfFile = lseek(file_fd,0,whence);
-	if(lastByteOfFile==-1){
-		/* unlock file */	
-		if(flock(file_fd,LOCK_UN)==-1)
-			return -1;
-		return -1;	/* there was an error while finding the last byte */
-	}
-	/* if lastByteOfFile == 0, then return, since there is no text in the file */
-	if(lastByteOfFile==0){
-		/* unlock file */
-		if(flock(file_fd,LOCK_UN)==-1)
-			return -1;
-		return 0;	/* return 0, to read from beginning of file */
-	}
-	/* otherwise subtract 1 from lastByteOfFile, since lastByteOfFile points to the
-	next empty byte after the last byte with a character (SEEK_END) */
-	lastByteOfFile--;
-
-	off_t workingOffset;
 	/* this checks if the size of the file is bigger than the possible biggest 
-	message which one would be able to send, if not, check for newlines inside
+	history which one would be able to send, if not, check for newlines inside
 	the whole file, otherwise check only in a reduced area at the end of the file */
-	if(lastByteOfFile < (MAX_CHARACTERS_BACK_CLIENT)){
-		workingOffset = 0; /* beginning of file */
-	}
-	else{
-		workingOffset = lastByteOfFile - (MAX_CHARACTERS_BACK_CLIENT) + 1 ;	/* add one, otherwise we read one extra character */
-	}
-
-	/* set file's offset at workingOffset in relationship to file's beginning */
-	if(lseek(file_fd,workingOffset,SEEK_SET)==-1){
-		/* unlock file */	
-		if(flock(file_fd,LOCK_UN)==-1)
-			return -1;
-		return -1; /* error with lseek */
-	}
+	off_t workingOffset = 0;
+	if(endOfFile > MAX_CHARACTERS_BACK_CLIENT)
+		workingOffset = endOfFile - MAX_CHARACTERS_BACK_CLIENT;
 
 	/* allocate memory to store text from chatlog file */
 	char * chat_text = (char *) malloc(MAX_CHARACTERS_BACK_CLIENT);
-	if(chat_text==NULL){
-		/* unlock file */	
-		if(flock(file_fd,LOCK_UN)==-1)
-			return -1;
+	if(chat_text==NULL)
 		return -1;	/* malloc failed */
-	}
-	ssize_t bytesRead;	/* bytes read from chat log file */
-	bytesRead = read(file_fd,chat_text,MAX_CHARACTERS_BACK_CLIENT);
+
+	/* the end of the chat log is always in the hot tail, the file is only
+	read if CHATLOG_HOT_TAIL is smaller than MAX_CHARACTERS_BACK_CLIENT */
+	ssize_t bytesRead = sharedRead(file_fd,chat_text,endOfFile-workingOffset,workingOffset);
 	if(bytesRead < 0){
 		free(chat_text);
-		/* unlock file */	
-		if(flock(file_fd,LOCK_UN)==-1)
-			return -1;
 		return -1; /* read failed */
 	}
 
-	/* count total amount of newlines in text, after first newline */
-	int count = 0;
-	for(int i=0;i<bytesRead;i++){
-		if(chat_text[i]=='\n')
-			count++;
-	}// end for-loop
-
-	/* send the whole text back, since it is less than the maximum amount
-	of lines permitted to be sent back to the client */
-	if(count <= LINES_SEND_BACK_TO_CLIENT){
-		/* send message to client socket */
-		if(write(client_fd,&chat_text[0],bytesRead)!=bytesRead){
-			free(chat_text);
-			/* unlock file */	
-			if(flock(file_fd,LOCK_UN)==-1)
-				return -1;
-			return -1; /* write to socket failed */
+	/* search backwards from the end of the text for the newline before the
+	first line that should be sent (lineScan.c), the newline at the very end
+	terminates the last line and is not counted */
+	size_t textLength = bytesRead;
+	if(textLength > 0 && chat_text[textLength - 1]=='\n')
+		textLength--;
+	ssize_t i = scanFindLast(chat_text, textLength, '\n', LINES_SEND_BACK_TO_CLIENT, NULL);
+
+	off_t startOffset;
+	/* found enough lines, start one byte after the newline */
+	if(i >= 0)
+		startOffset = workingOffset + i + 1;
+	/* the whole file has less lines than the maximum */
+	else if(workingOffset == 0)
+		startOffset = 0;
+	/* the text starts in the middle of a line, skip that line if possible */
+	else{
+		const char * firstNewline = scanFind(chat_text,bytesRead,'\n');
+		startOffset = workingOffset;
+		if(firstNewline != NULL && firstNewline - chat_text + 1 < bytesRead)
+			startOffset += firstNewline - chat_text + 1;
+	}
+
+	free(chat_text);
+
+	return startOffset;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Binary record format
+
+The chat log itself is text, the clients receive its bytes as they are and
+count them (RESUME). Nothing in it records where a message starts, how long
+it is, who wrote it or when, so a reader has to scan every byte for '\n'.
+The record format stores every message as a fixed header (struct
+chatRecordHeader, 64 bytes) followed by the payload (the message without the
+"username: " and the newline):
+
+	| magic | length | sequence | timestamp | sender | checksum | payload |
+
+A reader can count, skip or slice messages by reading only the headers, the
+next record starts length bytes after the header. The checksum (CRC-32C of
+the header and the payload) shows torn or corrupt records. A NUL magic ends
+the records, so a record log can be preallocated like the chat log. Payloads
+never contain NUL bytes (like the messages of the chat log): in a
+preallocated log the file size covers a payload that was never written, a
+record is only complete if the last byte of its payload is not NUL.
+
+chatlogConvert.bin converts a text chat log to a record log and back. */
+
+#define CHAT_RECORD_READ_AHEAD (64 * 1024)
+
+_Static_assert(sizeof(struct chatRecordHeader) == 64, "the record header has 64 bytes");
+
+/* CRC-32C (Castagnoli), the table is computed on the first call */
+static uint32_t
+crc32c(uint32_t crc, const void * data, size_t length)
+{
+	static uint32_t table[256];
+	static int tableReady = 0;
+	if(!tableReady){
+		for(uint32_t i = 0; i < 256; i++){
+			uint32_t entry = i;
+			for(int bit = 0; bit < 8; bit++)
+				entry = (entry & 1) ? (entry >> 1) ^ 0x82F63B78 : entry >> 1;
+			table[i] = entry;
 		}
-	}// end if count less or equal to LINES_SEND_BACK_TO_CLIENT
-
-	/* send just the last 10 lines */
-	if(count > LINES_SEND_BACK_TO_CLIENT){
-		int newline_index=0;
-		/* find first newline character, everything before the first newline, will not be sent back to the client */
-		for(int i=0;i<bytesRead;i++){
-			/* if true we found index of first newline */
-			if(chat_text[i]=='\n'){
-				/* start at one after newline */	
-				newline_index=i+1;
-				break;
-			}		
-		}// end for-loop
-		
-		/* find the newline at total_new_lines - LINES_SEND_BACK_TO_CLIENT,
-		and send everything from there until last byte of file which would be
-		exactly the max amount of lines of text allowed (LINES_SEND_BACK_TO_CLIENT) */		
-		int startTextIndex=newline_index;
-		int count_newlines = 0;
-		for(int i=newline_index;i<bytesRead;i++){
-			if(chat_text[i]=='\n'){
-				count_newlines++;
-				/* subtract 1 from count, since we eliminated the first newline in the previous step */
-				if(count_newlines==((count-1)-LINES_SEND_BACK_TO_CLIENT)){
-					/* set index at 1 after the newline */
-					startTextIndex=i+1;
-					break;
-				}
-			}
-		}//end for-loop
+		tableReady = 1;
+	}
 
-		/* send text to client */
-		/* TODO: check if the index control is right */
-		if(write(client_fd,&chat_text[startTextIndex],bytesRead-startTextIndex)!=bytesRead-startTextIndex){
-			free(chat_text);
-			/* unlock file */	
-			if(flock(file_fd,LOCK_UN)==-1)
-				return -1;
-			return -1; /* write to socket failed */
+	const unsigned char * bytes = data;
+	crc = ~crc;
+	for(size_t i = 0; i < length; i++)
+		crc = table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+/* checksum of a record, the checksum field of the header counts as 0 */
+static uint32_t
+recordChecksum(const struct chatRecordHeader * header, const char * payload)
+{
+	struct chatRecordHeader copy = *header;
+	copy.checksum = 0;
+	uint32_t crc = crc32c(0, &copy, sizeof(copy));
+	return crc32c(crc, payload, header->length);
+}
+
+int
+openRecordWriter(struct chatRecordWriter * writer, int fd)
+{
+	struct chatRecordReader reader;
+	if(openRecordReader(&reader, fd, 0) == -1)
+		return -1;
+
+	/* the sequence of the next record follows the last one */
+	struct chatRecordHeader header, last;
+	int result;
+	writer->sequence = 0;
+	while((result = nextRecord(&reader, &header)) == 1){
+		writer->sequence = header.sequence + 1;
+		last = header;
+	}
+
+	/* the last record is the one a crash could have torn in the middle of
+	its payload, the new records must not follow it unless its checksum
+	matches */
+	if(result == 0 && writer->sequence > 0){
+		/* reader.current is still the offset of the last record */
+		char * payload = (char *) malloc(last.length + 1);
+		if(payload == NULL)
+			result = -1;
+		else if(readRecordPayload(&reader, &last, payload) == -1){
+			errno = EILSEQ;
+			result = -1;
 		}
-	}// end if count bigger than LINES_SEND_BACK_TO_CLIENT
+		free(payload);
+	}
 
-	free(chat_text);
-	/* unlock file */	
-	if(flock(file_fd,LOCK_UN)==-1)
+	writer->fd = fd;
+	writer->offset = reader.offset;
+	closeRecordReader(&reader);
+	return (result == 0) ? 0 : -1;
+}
+
+int
+writeRecord(struct chatRecordWriter * writer, const char * sender, int64_t timestamp,
+	const char * payload, uint32_t length)
+{
+	/* a NUL byte would look like a payload that was never written */
+	if(memchr(payload, '\0', length) != NULL){
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct chatRecordHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = CHAT_RECORD_MAGIC;
+	header.length = length;
+	header.sequence = writer->sequence;
+	header.timestamp = timestamp;
+	strncpy(header.sender, sender, CHAT_RECORD_SENDER);
+	header.checksum = recordChecksum(&header, payload);
+
+	/* header and payload with a single syscall */
+	struct iovec parts[2] = {
+		{ &header, sizeof(header) },
+		{ (void *) payload, length }
+	};
+	ssize_t size = sizeof(header) + length;
+	if(pwritev(writer->fd, parts, 2, writer->offset) != size)
 		return -1;
 
-	return lastByteOfFile+1;
+	writer->offset += size;
+	writer->sequence++;
+	return 0;
+}
+
+int
+openRecordReader(struct chatRecordReader * reader, int fd, off_t offset)
+{
+	reader->buffer = (char *) malloc(CHAT_RECORD_READ_AHEAD);
+	if(reader->buffer == NULL)
+		return -1;
+	reader->fd = fd;
+	reader->offset = offset;
+	reader->current = -1;
+	reader->bufferOffset = offset;
+	reader->bufferLength = 0;
+	return 0;
+}
+
+void
+closeRecordReader(struct chatRecordReader * reader)
+{
+	free(reader->buffer);
+	reader->buffer = NULL;
+}
+
+/* make the bytes from offset up to offset+length available in the buffer
+(length is at most CHAT_RECORD_READ_AHEAD), returns the number of bytes
+available (less at the end of the file) or -1 on error */
+static ssize_t
+fillRecordBuffer(struct chatRecordReader * reader, off_t offset, size_t length)
+{
+	if(offset >= reader->bufferOffset
+		&& offset + length <= reader->bufferOffset + reader->bufferLength)
+		return length;
+
+	ssize_t bytesRead = pread(reader->fd, reader->buffer, CHAT_RECORD_READ_AHEAD, offset);
+	if(bytesRead == -1)
+		return -1;
+	reader->bufferOffset = offset;
+	reader->bufferLength = bytesRead;
+	return ((size_t) bytesRead < length) ? bytesRead : (ssize_t) length;
+}
+
+int
+nextRecord(struct chatRecordReader * reader, struct chatRecordHeader * header)
+{
+	ssize_t available = fillRecordBuffer(reader, reader->offset, sizeof(*header));
+	if(available == -1)
+		return -1;
+	if(available == 0)
+		return 0;	/* EOF */
+
+	const char * bytes = reader->buffer + (reader->offset - reader->bufferOffset);
+	/* the NUL bytes after the last record */
+	if(available >= (ssize_t) sizeof(header->magic)){
+		uint32_t magic;
+		memcpy(&magic, bytes, sizeof(magic));
+		if(magic == 0)
+			return 0;
+	}
+	if(available < (ssize_t) sizeof(*header)){
+		errno = EILSEQ;	/* torn header */
+		return -1;
+	}
+	memcpy(header, bytes, sizeof(*header));
+	if(header->magic != CHAT_RECORD_MAGIC){
+		errno = EILSEQ;
+		return -1;
+	}
+
+	/* the payload must be complete, without reading it: its last byte was
+	written (not NUL) and is not after the end of the file */
+	off_t end = reader->offset + sizeof(*header) + header->length;
+	if(header->length > 0){
+		off_t lastByte = end - 1;
+		char last = '\0';
+		if(lastByte < reader->bufferOffset + (off_t) reader->bufferLength)
+			last = reader->buffer[lastByte - reader->bufferOffset];
+		else if(pread(reader->fd, &last, 1, lastByte) == -1)
+			return -1;
+		if(last == '\0'){
+			errno = EILSEQ;	/* torn payload */
+			return -1;
+		}
+	}
+
+	reader->current = reader->offset;
+	reader->offset = end;
+	return 1;
+}
+
+int
+readRecordPayload(struct chatRecordReader * reader, const struct chatRecordHeader * header, char * payload)
+{
+	off_t offset = reader->current + sizeof(*header);
+	if(header->length <= CHAT_RECORD_READ_AHEAD){
+		ssize_t available = fillRecordBuffer(reader, offset, header->length);
+		if(available == -1)
+			return -1;
+		if(available < header->length){
+			errno = EILSEQ;
+			return -1;
+		}
+		memcpy(payload, reader->buffer + (offset - reader->bufferOffset), header->length);
+	}
+	else if(pread(reader->fd, payload, header->length, offset) != header->length){
+		errno = EILSEQ;
+		return -1;
+	}
+
+	if(recordChecksum(header, payload) != header->checksum){
+		errno = EBADMSG;
+		return -1;
+	}
+	return 0;
 }
 
 /* Eduardo Rodriguez 2021 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
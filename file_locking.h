@@ -3,10 +3,95 @@
 #ifndef FILE_LOCKING_H 		/* header guard */
 #define FILE_LOCKING_H
 
+#include <pthread.h>	/* process-shared mutexes */
+
 /* open (or if non-existent, create) central chat log file */
 int openChatLogFile(void);
+/* logical end of the chat log, the bytes after it are preallocated */
+off_t chatLogEnd(void);
+/* create an eventfd which exclusiveWrite() increments after every append of
+this process and of the processes forked afterwards (e.g. the replicator of
+a standby), besides the SIGUSR1. Returns the eventfd or -1 on error */
+int chatLogNotifyAppends(void);
+/* end of the complete lines of the chat log open as fd, for a process which
+does not share the logical end of the daemon (a snapshot while the daemon
+runs). It takes no lock, the bytes before it never change. Returns -1 on
+error */
+off_t chatLogSnapshotEnd(int fd);
 int exclusiveWrite(int, char *, size_t);
+
+/* initialize a mutex in memory shared by the processes of the daemon (the
+chat log, the search index and the time index have one). It is robust: a
+process which dies while holding it does not block the others forever.
+Returns 0 on success and -1 on error */
+int initSharedMutex(pthread_mutex_t * mutex);
+/* lock a mutex of initSharedMutex(). If its owner died while holding it,
+repair (unless NULL) is called with the lock held before the mutex is
+usable again, it puts back in order what the owner left half done. Returns
+0 on success and -1 on error */
+int lockSharedMutex(pthread_mutex_t * mutex, void (*repair)(void));
 int sharedRead(int, char*, size_t, off_t);
-off_t messagesFromFirstClientConnection(int, int);
+/* offset of the last lines of the chat log, sent to a client when it joins */
+off_t historyOffset(int);
+
+/* ------------------------------------------------------------------------ */
+/* Binary record format of the chat log (optional, see file_locking.c): every
+message is a fixed header followed by its payload */
+
+#include <stdint.h>
+
+#define CHAT_RECORD_MAGIC 0x31524350	/* "PCR1" */
+#define CHAT_RECORD_SENDER 32
+
+struct chatRecordHeader {
+	uint32_t magic;			/* CHAT_RECORD_MAGIC */
+	uint32_t length;		/* bytes of the payload after the header */
+	uint64_t sequence;		/* number of the record in the log, from 0 */
+	int64_t timestamp;		/* seconds since the epoch, 0 if unknown */
+	char sender[CHAT_RECORD_SENDER];	/* username, padded with NUL bytes */
+	uint32_t checksum;		/* CRC-32C of the header (with checksum 0)
+							and the payload */
+	uint32_t reserved;		/* 0 */
+};
+
+/* appends records at the end of a record log */
+struct chatRecordWriter {
+	int fd;
+	off_t offset;			/* where the next record is written */
+	uint64_t sequence;		/* sequence of the next record */
+};
+
+/* reads the records of a record log one after the other, the headers are
+read ahead in a buffer, the payloads are only read on request */
+struct chatRecordReader {
+	int fd;
+	off_t offset;			/* offset of the next record */
+	off_t current;			/* offset of the record returned last */
+	char * buffer;
+	off_t bufferOffset;		/* offset in the log of buffer[0] */
+	size_t bufferLength;
+};
+
+/* find the end of the records of fd (the last complete record, the bytes
+after it must be NUL) and prepare to append after it, returns 0 on success
+and -1 on error (errno = EILSEQ if the log has a torn or corrupt record) */
+int openRecordWriter(struct chatRecordWriter *, int fd);
+/* append a record, returns 0 on success and -1 on error */
+int writeRecord(struct chatRecordWriter *, const char * sender, int64_t timestamp,
+	const char * payload, uint32_t length);
+
+/* start reading the records of fd at offset (the offset of a record),
+returns 0 on success and -1 on error */
+int openRecordReader(struct chatRecordReader *, int fd, off_t offset);
+void closeRecordReader(struct chatRecordReader *);
+/* read the header of the next record without its payload, returns 1 if a
+record was read, 0 at the end of the records (EOF or NUL bytes) and -1 on
+error (errno = EILSEQ if the record is torn or corrupt) */
+int nextRecord(struct chatRecordReader *, struct chatRecordHeader *);
+/* read the payload of the record returned by nextRecord() into payload (at
+least header->length bytes) and verify its checksum, returns 0 on success
+and -1 on error (errno = EBADMSG if the checksum does not match) */
+int readRecordPayload(struct chatRecordReader *, const struct chatRecordHeader *, char * payload);
+
 #endif
 /* Eduardo Rodriguez 2021 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
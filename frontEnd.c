@@ -5,13 +5,17 @@
 #include <signal.h>				/* check 'man 2 sigaction' signal.h is needed
 								to change the disposition of signals with
 								the sigaction() syscall */	
-#include <sys/wait.h>	/* wait on child processes */
+#include <poll.h>		/* wait for keystrokes and messages at the same time */
+#include <time.h>		/* clock_gettime(), frame rate of the screen updates */
 
 #include "basics.h" /* includes library to handle errors */
 #include "inet_sockets.h" /* include library to handle TCP sockets */
-#include "signalHandling.h" /* functions to handle signals */
-#include "handleMessages.h" /* functions to send/receive messages from pipes and sockets */
+#include "handleMessages.h" /* functions to send/receive messages through the socket */
+#include "scrollback.h"	/* scrollback of the chat */
+#include "historyCache.h"	/* on-disk cache of the chat */
+#include "lineEditor.h"	/* message being written by the user */
 #include "configParser.h"	/* function to parse config files */
+#include "lineScan.h"	/* scanRemove() */
 
 /* Load TCP/IP services from CONFIG.h header */
 #include "CONFIG.h" /* file defines IP and port of chat service server */
@@ -27,6 +31,11 @@ And in other Unix systems, only use KEY_BACKSPACE */
 #define PORTABLE_BACKSPACE KEY_BACKSPACE
 #endif
 
+/* first byte of the escape sequences sent by the terminal for function keys,
+and the max. length of such a sequence */
+#define ESCAPE_KEY 27
+#define ESCAPE_SEQUENCE_MAX 16
+
 /* Define colour pair names for ncurses */
 #define INSTRUCTIONS_COLOUR 1
 
@@ -92,9 +101,9 @@ configureChatWindow(int y_start, int x_start)
 	keypad(chatWindow, TRUE); /* Enable keypad and F-keys */
 
 	/* stdin reading should be non-blocking, if no character is read from
-	stdin, then getch returns ERR 
-	Otherwise, if it weren't non-blocking, we would not be able to 
-	print in the upper half of the chat window concurrently */
+	stdin, then getch returns ERR. The main loop waits with poll() until
+	stdin is readable and then reads every available character, the last
+	wgetch() returns ERR instead of blocking the whole client */
 	if(nodelay(chatWindow,TRUE)==ERR)
 		errExit("nodelay[chatWindow]");		/* nodelay() failed, catastrophic error */
 	
@@ -120,170 +129,381 @@ configureDelimiterWindow(int y_start, int x_start, int height)
 
 }
 
-/* print messages received from server, all syscalls implemented inside this
-function are NON-BLOCKING */
+/* append messages received from server to the scrollback, they are drawn
+with the next frame, all syscalls implemented inside this function are
+NON-BLOCKING. chatlogOffset is advanced by every byte received, it is the
+offset in the chat log of the server after the last received byte. The bytes
+are appended to the history cache as well. Returns -1 if the connection to
+the server is lost, otherwise the amount of bytes received */
+static ssize_t
+printMessagesFromServer(int server_fd, struct scrollback * sb, off_t * chatlogOffset,
+	struct historyCache * cache)
+{
+	/* the buffer is reused on every call, the messages are copied into the
+	scrollback right away */
+	static char string_buf[BUF_SIZE];
+
+	/* fetch messages from server into string buffer */
+	ssize_t bytesReceived = receiveMessages(server_fd, string_buf, BUF_SIZE);
+
+	/* EOF, the server closed the connection */
+	if(bytesReceived == 0)
+		return -1;
+
+	if(bytesReceived == -1){
+		/* poll() woke up the client, but there was nothing to read */
+		if(errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		return -1;	/* e.g. ECONNRESET */
+	}
+
+	/* the server sends the bytes of the chat log unchanged */
+	*chatlogOffset += bytesReceived;
+
+	/* if the cache cannot be written, it is disabled and the chat goes on
+	without it */
+	appendHistoryCache(cache, string_buf, bytesReceived);
+
+	if(appendScrollback(sb, string_buf, bytesReceived)==-1)
+		errExit("appendScrollback() @printMessagesFromServer");
+
+	return bytesReceived;
+}
+
+/* close a connection which could not be established, errno is preserved,
+always returns -1 */
+static int
+abortConnection(int server_fd)
+{
+	int savedErrno = errno;
+	close(server_fd);
+	errno = savedErrno;
+	return -1;
+}
+
+/* connect to the server, authenticate with the key and join the chat (if
+chatlogOffset is negative) or resume it at chatlogOffset, which is updated
+with the offset answered by the server. Returns the non-blocking socket of
+the server, or -1 if the server could not be reached (errno is set) */
+static int
+connectToServer(const char * host, const char * port, const char * key, off_t * chatlogOffset)
+{
+	/* SOCK_STREAM for TCP connection */
+	int server_fd = clientConnect(host, port, SOCK_STREAM);
+	if(server_fd == -1)
+		return -1;
+
+	/* the handshake is blocking, the server should not take longer than
+	HANDSHAKE_TIMEOUT to answer */
+	struct timeval timeout = { HANDSHAKE_TIMEOUT / 1000, (HANDSHAKE_TIMEOUT % 1000) * 1000 };
+	if(setsockopt(server_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))==-1)
+		return abortConnection(server_fd);
+
+	if(sendHello(server_fd, key, *chatlogOffset)==-1)
+		return abortConnection(server_fd);
+	off_t startOffset = receiveStartOffset(server_fd);
+	if(startOffset == -1)
+		return abortConnection(server_fd);
+	*chatlogOffset = startOffset;
+
+	/* the socket is owned by this process, it should never block the user
+	interface, the main loop waits with poll() until it is readable or
+	writable */
+	int flags = fcntl(server_fd, F_GETFL);
+	if(flags==-1)
+		return abortConnection(server_fd);
+	if(fcntl(server_fd, F_SETFL, flags | O_NONBLOCK)==-1)
+		return abortConnection(server_fd);
+
+	return server_fd;
+}
+
+/* the server answered the hello with the offset at which it starts sending
+the chat log, if it is not the end of the history cache (the cache is empty
+or the server could not resume, e.g. its chat log was replaced), the cached
+messages are discarded and the cache starts again at offset */
 static void
-printMessagesFromServer(WINDOW * window, int pipe_fd, int max_y_position)
+synchronizeHistoryCache(struct historyCache * cache, off_t offset)
 {
-	
-	ssize_t bytesReceived;
-
-	char * string_buf = (char *) malloc(BUF_SIZE);
-	/* malloc failed */
-	if(string_buf == NULL)
-		errExit("malloc failed. @printMessagesFromServer");
-
-	/* fetch messages from server into allocated string buffer */
-	bytesReceived = fetchMessage(pipe_fd, string_buf);
-
-	/* print messages, if received */
-	if(bytesReceived > 0){
-		/* check if the cursor is after the last line of the
-		textWindow, in that case clear the window and move cursor
-		to the origin to start printing messages from the top again */
-		int y_cursor = getcury(window);
-		if(y_cursor==ERR)
-			errExit("y_cursor @printMessagesFromServer");
-		if(y_cursor > max_y_position){
-			/* clear screen and move back to origin */
-			if(wclear(window)==ERR)
-				errExit("wclear");
-			if(wmove(window,0,0)==ERR)
-				errExit("wmove");
-		}
-		wprintw(window,"%s\n",string_buf);
-		wrefresh(window);
-	}// end bytesReceived > 0
+	if(cache->end == offset)
+		return;
+	if(resetHistoryCache(cache, offset)==-1)
+		errExit("resetHistoryCache");
+}
 
-	/* if fetchMessage() failes, then bytesReceived < 0, it quietly
-	frees memory, and returns, in order to try to fetch messages again 
-	in the next iteration of the frontEnd main loop */
+/* show the state of the connection in the status line, an empty text clears
+it. The window is drawn with the next frame */
+static void
+setStatus(WINDOW * statusWindow, const char * text)
+{
+	werase(statusWindow);
+	if(text[0] != '\0'){
+		wattron(statusWindow, A_REVERSE);
+		mvwaddstr(statusWindow, 0, 0, text);
+		wattroff(statusWindow, A_REVERSE);
+	}
+	wnoutrefresh(statusWindow);
+}
+
+/* the connection to the server was lost, close its socket and show it in the
+status line, the first attempt to reconnect is made RECONNECT_MIN_DELAY ms
+after lostConnection. Returns -1, the new value of server_fd */
+static int
+closeConnection(int server_fd, WINDOW * statusWindow, struct timespec * lostConnection)
+{
+	close(server_fd);
+	clock_gettime(CLOCK_MONOTONIC, lostConnection);
+
+	char status[128];
+	snprintf(status, sizeof(status), " connection to server lost, reconnecting in %.1fs ",
+		RECONNECT_MIN_DELAY / 1000.0);
+	setStatus(statusWindow, status);
+	return -1;
+}
+
+/* milliseconds elapsed since time */
+static long
+millisecondsSince(const struct timespec * time)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - time->tv_sec) * 1000 + (now.tv_nsec - time->tv_nsec) / 1000000;
+}
+
+/* ms until the next attempt to reconnect, reconnectDelay ms after
+lostConnection (0 if it is already due), used as timeout for poll() */
+static int
+untilReconnect(long reconnectDelay, const struct timespec * lostConnection)
+{
+	long remaining = reconnectDelay - millisecondsSince(lostConnection);
+	return (remaining > 0) ? remaining : 0;
+}
+
+/* try to reconnect to the server and resume the chat at chatlogOffset, after
+a failed attempt the delay until the next attempt doubles (up to
+RECONNECT_MAX_DELAY), after a successful attempt it starts again with
+RECONNECT_MIN_DELAY for the next lost connection. Returns the socket of the
+server or -1 */
+static int
+reconnectToServer(const char * host, const char * port, const char * key, off_t * chatlogOffset,
+	long * reconnectDelay, struct timespec * lostConnection)
+{
+	int server_fd = connectToServer(host, port, key, chatlogOffset);
+	if(server_fd == -1){
+		clock_gettime(CLOCK_MONOTONIC, lostConnection);
+		*reconnectDelay *= 2;
+		if(*reconnectDelay > RECONNECT_MAX_DELAY)
+			*reconnectDelay = RECONNECT_MAX_DELAY;
+		return -1;
+	}
+
+	*reconnectDelay = RECONNECT_MIN_DELAY;
+	return server_fd;
+}
 
-	/* free resources */
-	free(string_buf);
+/* draw all changes of the windows with a single update of the terminal, the
+windows are only copied to the virtual screen (wnoutrefresh) and doupdate()
+sends the differences to the terminal once. If textDirty is not set, the
+textWindow did not change since the last frame */
+static void
+drawFrame(WINDOW * textWindow, WINDOW * chatWindow, const struct scrollback * sb,
+	const struct lineEditor * editor, int textDirty)
+{
+	/* if the user scrolled up, the visible lines do not change, unless the
+	lines were overwritten by new lines */
+	if(textDirty){
+		renderScrollback(sb, textWindow);
+		wnoutrefresh(textWindow);
+	}
+	/* chatWindow is copied last, so that the terminal cursor ends up on the
+	input line */
+	renderLineEditor(editor, chatWindow);
+	wnoutrefresh(chatWindow);
+	doupdate();
 }
 
 static void 
-handleNewline(WINDOW * chatWindow, int pipe_fd, const char * username_input)
+handleNewline(struct lineEditor * editor, struct sendBuffer * sendQueue, const char * username)
 {
-	/* allocate memory locally to store text written in front-end */
-	char * message = (char *) malloc(BUF_SIZE);
+	/* the message is taken from the lineEditor, it is "username: message\n" */
+	size_t usernameLength = strlen(username);
+	size_t messageLength = usernameLength + editor->length + 1;
+	char * message = (char *) malloc(messageLength);
 	/* malloc failed if message == NULL */
 	if(message == NULL)
 		errExit("malloc failed. handleNewline()");
-	/* use memset to guarantee that all values of message
-	are initialized with a 0,
-	the 0 is important, since we are handling strings here, and some functions
-	like strcat, expect a 0 to end a string, otherwise they are going to never 
-	finish */
-    memset(message, 0, BUF_SIZE);
-
-	/* get current x-cursor position, to get number of characters to be
-	sent (the current implementations only reads characters from
-	one single line */
-	int x_cursor = getcurx(chatWindow);
-	if(x_cursor==ERR)
-		errExit("getting x cursor position @handleNewline");
-	/* copy up to max. characters at position, into message char array,
-	the coordinates to start copying strings, should be the relative
-	coordinates inside chatWindow, so 0,0 actually equals 
-	y_start_chatWindow,x_start_chatWindow */
-	int errorString = mvwinnstr(chatWindow,0,0,message,x_cursor);
-	/* if error happens, close ncurses environment, to get a normal
-	terminal and free memory */
-	if(errorString == ERR){
-		free(message);
-		endwin();
-		errExit("mvwinnstr [chatWindow]");
-	}
-
-	/* store the username received as parameter in the heap, in order to append
-	to message sent back to server */
-	char * username = (char *) malloc(BUF_SIZE);
-	if(username == NULL)
-		errExit("malloc failed. handleNewline()");
-	/* guarantee that all values of username are initialized with 0 */
-	memset(username, 0, BUF_SIZE);
-	/* copy value of username in parameter into heap memory allocation */
-	if(strcpy(username,username_input)!=username)
-		errExit("strcpy");
-
-	/* append message to username */
-	if(strcat(username,message)!=username)
-		errExit("strcat");
 
-	/* append newline to username */
-	const char * nl = "\n";
+	memcpy(message, username, usernameLength);
+	memcpy(message + usernameLength, editor->text, editor->length);
 	/* append newline to message, before sending the message to the server */
-	if(strcat(username, nl)!=username)
-		errExit("strcat");
+	message[messageLength - 1] = '\n';
 	
-	/* send concatenation of username, message and newline just written to pipe, 
-	to child process which sends message to server */
-	sendMessageToPipe(pipe_fd, username);
+	/* queue concatenation of username, message and newline just written, the
+	main loop sends it to the server as soon as the socket is writable */
+	int queued = queueMessage(sendQueue, message, messageLength);
 	free(message);
-	free(username);
 
-	/* delete line which was just sent */
-	if(wdeleteln(chatWindow)==ERR){
-		endwin();
-		errExit("delete line failed, after newline.");
+	/* the server did not read the previous messages yet, keep the line, so
+	that the user can try again */
+	if(queued == -1){
+		beep();
+		return;
 	}
-	/* after deleting line, move cursor back to origin */
-	if(wmove(chatWindow,0,0)==ERR){
-		endwin();
-		errExit("move cursor to origin failed, after newline.");
+
+	/* delete line which was just sent, it disappears with the next frame */
+	clearLineEditor(editor);
+}
+
+/* apply a single key to the chat, returns 1 if the user wants to exit the
+chat (ARROW_DOWN) and 0 otherwise. textDirty is set if the user scrolled */
+static int
+handleKey(int a, WINDOW * textWindow, struct scrollback * sb, struct lineEditor * editor,
+	struct sendBuffer * sendQueue, const char * username, int * textDirty)
+{
+	/* Stop ncurses when 'KEY_DOWN' is pressed */
+	if(a == KEY_DOWN)
+		return 1;
+
+	/* scroll through the chat by almost a whole window, so that one line
+	of the previous view is still visible */
+	if(a == KEY_PPAGE || a == KEY_NPAGE){
+		int rows = getmaxy(textWindow) - 1;
+		if(rows < 1)
+			rows = 1;
+		scrollScrollback(sb, (a == KEY_PPAGE) ? -rows : rows,
+			getmaxy(textWindow), getmaxx(textWindow));
+		*textDirty = 1;
+		return 0;
+	}
+
+	/* carriage return was pressed, send line to server and delete
+	line */
+	if(a == '\n' || a == '\r'){
+		handleNewline(editor, sendQueue, username);
+		return 0;
+	}
+
+	/* BACKSPACE was pressed, delete last character */
+	if(a == PORTABLE_BACKSPACE || a == KEY_BACKSPACE || a == 127 || a == '\b'){
+		backspaceLineEditor(editor);
+		return 0;
 	}
+
+	/* other function keys (KEY_LEFT, KEY_F(1), ..., KEY_RESIZE: the size of
+	the windows is not adapted) and control characters are not part of a
+	message */
+	if(a >= KEY_MIN || a < ' ')
+		return 0;
+
+	/* add the character, unless the message has the max. length */
+	insertLineEditor(editor, (char) a);
+	return 0;
 }
 
-static void 
-handleBackspace(WINDOW * chatWindow)
+/* decode the escape sequence of a function key at the beginning of input
+with the key definitions of the terminal (terminfo), returns the key (e.g.
+KEY_DOWN) and stores its length in sequenceLength. Returns 0 if it is not a
+known sequence (a single ESC is skipped) and -1 if input ends in the middle
+of a sequence */
+static int
+decodeEscapeSequence(const unsigned char * input, size_t length, size_t * sequenceLength)
 {
+	char sequence[ESCAPE_SEQUENCE_MAX + 1];
+
+	for(size_t i = 0; i < length && i < ESCAPE_SEQUENCE_MAX; i++){
+		sequence[i] = input[i];
+		sequence[i + 1] = '\0';
+		if(i == 0)
+			continue;
+
+		/* key_defined() returns the key bound to the sequence, 0 if no key
+		starts with the sequence and -1 if it is the prefix of a key */
+		int key = key_defined(sequence);
+		if(key > 0){
+			*sequenceLength = i + 1;
+			return key;
+		}
+		if(key == 0)
+			break;
+	}
 
-	/* get current x position (relative to chatWindow coordinates, so
-	x=0, actually equals to x_start_chatWindow) */
-	int x_position=getcurx(chatWindow);
-	/* if cursor position is x=0, then do not do anything 
-	(edge case). the coordinates are relative to chatWindow */
-	if(x_position==0)
-		return; /* do not continue deleting characters, since the 
-					cursor is at the border of the window */
-	/* move cursor to the left to delete last pressed character */
-	x_position--;
-	int y_position=getcury(chatWindow);
-	wmove(chatWindow,y_position,x_position); /* move cursor to new position */
-	/* delete character under cursor */
-	wdelch(chatWindow);
+	if(length < ESCAPE_SEQUENCE_MAX && key_defined(sequence) == -1)
+		return -1;
 
+	*sequenceLength = 1;
+	return 0;
 }
 
-/* this function checks if the un-sent message has achieved
-the maximum size that can be handled, if not it returns the current
-x position of the cursor (relative to the frame of reference of chatWindow)
-if it has achieved the max size, then it returns -1 */
+/* read every character typed by the user, which is available at the moment,
+returns 1 if the user wants to exit the chat (ARROW_DOWN or the terminal was
+closed) and 0 otherwise. The characters are only applied to the lineEditor, a
+whole paste is drawn with the next frame.
+If stdinReadable is set, all pending bytes are read with a single read()
+(ncurses would call read() once per byte) and decoded here, escape sequences
+of function keys with the key definitions of ncurses. Afterwards wgetch()
+returns the keys that ncurses generates itself (KEY_RESIZE after SIGWINCH) */
 static int
-checkMaxMessageLength(WINDOW * chatWindow, int maxMessageSize)
+handleKeyboardInput(WINDOW * chatWindow, WINDOW * textWindow, struct scrollback * sb,
+	struct lineEditor * editor, struct sendBuffer * sendQueue, const char * username,
+	int * textDirty, int stdinReadable)
 {
-	/* variables to store current cursor position inside chatWindow */
-	int y_cursor;
-	int x_cursor;
-	/* get the current cursor position */
-	getyx(chatWindow,y_cursor,x_cursor);
+	/* the beginning of an escape sequence, whose rest was not read yet */
+	static unsigned char input[BUF_SIZE + ESCAPE_SEQUENCE_MAX];
+	static size_t pending = 0;
+	int a;
+
+	if(stdinReadable){
+		ssize_t bytesRead = read(STDIN_FILENO, input + pending, BUF_SIZE);
+		/* the terminal was closed */
+		if(bytesRead == 0)
+			return 1;
+		if(bytesRead == -1){
+			if(errno != EINTR && errno != EAGAIN){
+				endwin();
+				errExit("read() stdin");
+			}
+			bytesRead = 0;
+		}
+		size_t length = pending + bytesRead;
+		pending = 0;
+
+		for(size_t i = 0; i < length; ){
+			if(input[i] != ESCAPE_KEY){
+				if(handleKey(input[i], textWindow, sb, editor, sendQueue, username, textDirty))
+					return 1;
+				i++;
+				continue;
+			}
 
-	/* subtract 1 from maxMessageSize, since the first character start at x_cursor position 0 */
-	if(x_cursor < (maxMessageSize -1))
-		return x_cursor;
+			size_t sequenceLength;
+			int key = decodeEscapeSequence(input + i, length - i, &sequenceLength);
+			/* wait for the rest of the sequence */
+			if(key == -1){
+				pending = length - i;
+				memmove(input, input + i, pending);
+				break;
+			}
+			if(key > 0 && handleKey(key, textWindow, sb, editor, sendQueue, username, textDirty))
+				return 1;
+			i += sequenceLength;
+		}
+	}
 
-	/* return -1, since max capacity of message was achieved */
-	return -1;
+	/* ncurses generates some keys itself, e.g. KEY_RESIZE */
+	while((a = wgetch(chatWindow)) != ERR){
+		if(handleKey(a, textWindow, sb, editor, sendQueue, username, textDirty))
+			return 1;
+	}
 
+	return 0;
 }
 
 /* parse USERNAME from config file and append semicolon to username,
 store username with suffix in same char * as parameter,
 parse HOST and PORT as well */
 static void
-getConfigValues(char * username_parsed, char * port_parsed, char * host_parsed, char * key)
+getConfigValues(char * username_parsed, char * port_parsed, char * host_parsed, char * key,
+	size_t * scrollbackLines, int * historyCacheEnabled)
 {
 
 	/* allocate memory to store path of config file */
@@ -317,6 +537,26 @@ getConfigValues(char * username_parsed, char * port_parsed, char * host_parsed,
 	if(parseConfigFile(client_config_file, "KEY", key)==-1)
 		errExit("parseConfigFile for key failed");
 
+	/* parse SCROLLBACK in client's config file, it is optional */
+	char scrollback_parsed[MAX_LINE_LENGTH];
+	*scrollbackLines = SCROLLBACK_LINES;
+	if(parseConfigFile(client_config_file, "SCROLLBACK", scrollback_parsed)==0){
+		long lines = strtol(scrollback_parsed, NULL, 10);
+		if(lines <= 0)
+			fatal("SCROLLBACK in %s should be a positive number of lines", client_config_file);
+		*scrollbackLines = lines;
+	}
+
+	/* parse HISTORY_CACHE in client's config file, it is optional */
+	char historyCache_parsed[MAX_LINE_LENGTH];
+	*historyCacheEnabled = 1;
+	if(parseConfigFile(client_config_file, "HISTORY_CACHE", historyCache_parsed)==0){
+		if(strcmp(historyCache_parsed, "off")==0)
+			*historyCacheEnabled = 0;
+		else if(strcmp(historyCache_parsed, "on")!=0)
+			fatal("HISTORY_CACHE in %s should be 'on' or 'off'", client_config_file);
+	}
+
 
 	free(client_config_file);
 
@@ -327,22 +567,312 @@ getConfigValues(char * username_parsed, char * port_parsed, char * host_parsed,
 
 }
 
-/* send authentication key to the server */
+/* queue the complete lines of the headless input buffer as messages
+("username: line"), the bytes of an incomplete line stay in the buffer. A
+full buffer without newline is sent as a line of its own. Returns 1 if a
+line could not be queued (the queue is full), 0 otherwise */
+static int
+queueInputLines(struct sendBuffer * sendQueue, char * input, size_t * inputLength,
+	const char * username, char * message, int inputOpen)
+{
+	size_t usernameLength = strlen(username);
+	size_t consumed = 0;
+	int queueFull = 0;
+
+	while(consumed < *inputLength){
+		char * newline = memchr(input + consumed, '\n', *inputLength - consumed);
+		size_t lineLength;
+		if(newline != NULL)
+			lineLength = newline - (input + consumed);
+		else if((consumed == 0 && *inputLength == BUF_SIZE) || !inputOpen)
+			lineLength = *inputLength - consumed;	/* line without newline */
+		else
+			break;	/* wait for the rest of the line */
+
+		memcpy(message, username, usernameLength);
+		memcpy(message + usernameLength, input + consumed, lineLength);
+		message[usernameLength + lineLength] = '\n';
+		if(queueMessage(sendQueue, message, usernameLength + lineLength + 1) == -1){
+			queueFull = 1;
+			break;
+		}
+
+		consumed += lineLength + ((newline != NULL) ? 1 : 0);
+	}
+
+	memmove(input, input + consumed, *inputLength - consumed);
+	*inputLength -= consumed;
+	return queueFull;
+}
+
+/* headless mode (-H) for bots and scripts: no terminal user interface, every
+line read from stdin is sent as a message and everything received from the
+server is written to stdout. A single process with buffered I/O, stdout is
+flushed once per wakeup of poll(). The connection is resumed after it was
+lost, exactly like in the interactive mode. If exitAfterInput is set, the
+client exits once stdin reached EOF and all messages were sent, otherwise it
+keeps on receiving messages */
 static void
-sendAuthKey(int server_fd, char * key)
+runHeadless(int server_fd, const char * host, const char * port, const char * key,
+	const char * username, off_t chatlogOffset, int exitAfterInput)
 {
-	
-	/* the write() call should write exactly key_size bytes, otherwise
-	it has failed */
-	if(write(server_fd,key,KEY_LENGTH)!=KEY_LENGTH){
-		errExit("key auth write() failed: ");
+	struct sendBuffer sendQueue;
+	if(initSendBuffer(&sendQueue, SEND_BUFFER_SIZE)==-1)
+		errExit("malloc sendQueue failed");
+
+	/* bytes received from the server, written to stdout */
+	char * received = (char *) malloc(BUF_SIZE);
+	/* bytes read from stdin, which do not form a complete line yet */
+	char * input = (char *) malloc(BUF_SIZE);
+	/* a single line together with the username, before being queued */
+	char * message = (char *) malloc(strlen(username) + BUF_SIZE + 1);
+	if(received == NULL || input == NULL || message == NULL)
+		errExit("malloc failed. runHeadless()");
+	size_t inputLength = 0;
+	int inputOpen = 1;
+	int queueFull = 0;
+	int closing = 0;	/* SHUT_WR was sent, wait for the EOF of the server */
+
+	long reconnectDelay = RECONNECT_MIN_DELAY;
+	struct timespec lostConnection = { 0, 0 };
+
+	struct pollfd fds[2];
+	for(;;){
+		/* stop reading stdin while the queue cannot take the lines read so
+		far, the writer of stdin blocks until the server read the messages */
+		fds[0].fd = (inputOpen && !queueFull && inputLength < BUF_SIZE) ? STDIN_FILENO : -1;
+		fds[0].events = POLLIN;
+		fds[1].fd = server_fd;
+		fds[1].events = POLLIN;
+		if(sendQueue.end > sendQueue.start)
+			fds[1].events |= POLLOUT;
+
+		int timeout = (server_fd == -1) ? untilReconnect(reconnectDelay, &lostConnection) : -1;
+		if(poll(fds, 2, timeout) == -1){
+			if(errno != EINTR)
+				errExit("poll() @runHeadless");
+			continue;
+		}
+
+		if(server_fd == -1 && millisecondsSince(&lostConnection) >= reconnectDelay){
+			server_fd = reconnectToServer(host, port, key, &chatlogOffset,
+				&reconnectDelay, &lostConnection);
+			if(server_fd == -1)
+				fprintf(stderr, "connection to server lost, reconnecting in %.1fs\n",
+					reconnectDelay / 1000.0);
+			else{
+				/* a message cut by the lost connection is sent again */
+				rewindSendBuffer(&sendQueue);
+				fprintf(stderr, "reconnected to server\n");
+			}
+			continue;
+		}
+
+		/* the messages are written as they were received, stdio collects
+		them and writes them with a single write() per wakeup */
+		if(server_fd != -1 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))){
+			ssize_t bytesReceived = receiveMessages(server_fd, received, BUF_SIZE);
+			if(bytesReceived > 0){
+				chatlogOffset += bytesReceived;
+				if(fwrite(received, 1, bytesReceived, stdout) != (size_t) bytesReceived)
+					errExit("fwrite stdout");
+			}
+			else if(closing && bytesReceived == 0)
+				break;	/* the server closed the connection after the EOF */
+			else if(bytesReceived == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){
+				close(server_fd);
+				server_fd = -1;
+				clock_gettime(CLOCK_MONOTONIC, &lostConnection);
+				fprintf(stderr, "connection to server lost, reconnecting in %.1fs\n",
+					reconnectDelay / 1000.0);
+			}
+		}
+		if(fflush(stdout) == EOF)
+			errExit("fflush stdout");
+
+		if(fds[0].fd != -1 && (fds[0].revents & (POLLIN | POLLHUP | POLLERR))){
+			ssize_t bytesRead = read(STDIN_FILENO, input + inputLength, BUF_SIZE - inputLength);
+			if(bytesRead == -1 && errno != EINTR)
+				errExit("read stdin");
+			if(bytesRead == 0)
+				inputOpen = 0;
+			/* the server removes NUL bytes from the messages anyway */
+			if(bytesRead > 0)
+				inputLength += scanRemove(input + inputLength, bytesRead, '\0');
+		}
+		queueFull = queueInputLines(&sendQueue, input, &inputLength, username, message, inputOpen);
+
+		if(server_fd != -1 && flushSendBuffer(server_fd, &sendQueue) == -1){
+			close(server_fd);
+			server_fd = -1;
+			clock_gettime(CLOCK_MONOTONIC, &lostConnection);
+			fprintf(stderr, "connection to server lost, reconnecting in %.1fs\n",
+				reconnectDelay / 1000.0);
+		}
+		/* the flush made room for the lines which did not fit before, stdin
+		is only polled again once they are queued */
+		if(queueFull)
+			queueFull = queueInputLines(&sendQueue, input, &inputLength, username, message, inputOpen);
+
+		/* every message was sent, close the connection gracefully: the
+		server reads everything up to the EOF and then closes its side. A
+		close() right away could discard messages which the server did not
+		read yet (RST, since the messages sent back were not read) */
+		if(exitAfterInput && !inputOpen && inputLength == 0 && !closing
+			&& sendQueue.end == sendQueue.start && server_fd != -1){
+			if(shutdown(server_fd, SHUT_WR) == -1)
+				errExit("shutdown @runHeadless");
+			closing = 1;
+		}
+	}
+
+	close(server_fd);
+	free(received);
+	free(input);
+	free(message);
+}
+
+/* connect to the server for a single query (-s, -S, -U), the answer of the
+server is read with a blocking socket. Returns the socket of the server */
+static int
+connectForQuery(const char * host, const char * port)
+{
+	int server_fd = clientConnect(host, port, SOCK_STREAM);
+	if(server_fd == -1)
+		errExit("connection to server failed");
+
+	struct timeval timeout = { HANDSHAKE_TIMEOUT / 1000, (HANDSHAKE_TIMEOUT % 1000) * 1000 };
+	if(setsockopt(server_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))==-1)
+		errExit("setsockopt SO_RCVTIMEO");
+	return server_fd;
+}
+
+/* write everything the server sends to stdout, until it closes the
+connection */
+static void
+copyAnswerToStdout(int server_fd)
+{
+	char * received = (char *) malloc(BUF_SIZE);
+	if(received == NULL)
+		errExit("malloc failed. copyAnswerToStdout()");
+	ssize_t bytesRead;
+	while((bytesRead = read(server_fd, received, BUF_SIZE)) != 0){
+		if(bytesRead == -1){
+			if(errno == EINTR)
+				continue;
+			errExit("read answer of the server");
+		}
+		if(fwrite(received, 1, bytesRead, stdout) != (size_t) bytesRead)
+			errExit("fwrite stdout");
 	}
+	if(fflush(stdout) == EOF)
+		errExit("fflush stdout");
+	free(received);
+}
+
+/* search mode (-s): send a search to the server and write the matching
+lines (the most recent ones) to stdout, the number of matching lines is
+written to stderr. The server closes the connection after the last line */
+static void
+runSearch(const char * host, const char * port, const char * key, const char * query)
+{
+	int server_fd = connectForQuery(host, port);
+
+	if(sendSearch(server_fd, key, query)==-1)
+		errExit("sendSearch");
+	long sent;
+	long matches = receiveMatches(server_fd, &sent);
+	if(matches == -1)
+		fatal("the server did not answer the search (is SEARCH off?)");
+
+	copyAnswerToStdout(server_fd);
+	fprintf(stderr, "%ld lines match, %ld most recent shown\n", matches, sent);
+	close(server_fd);
+}
+
+/* parse a time given with -S or -U: "@<seconds since the epoch>",
+"YYYY-MM-DD HH:MM[:SS]" or "HH:MM[:SS]" (today), in local time. Returns the
+seconds since the epoch, it exits if the time cannot be parsed */
+static time_t
+parseTimeArgument(const char * argument)
+{
+	long long seconds;
+	char end;
+	if(sscanf(argument, "@%lld%c", &seconds, &end) == 1 && seconds >= 0)
+		return seconds;
+
+	time_t now = time(NULL);
+	struct tm tm;
+	if(localtime_r(&now, &tm) == NULL)
+		errExit("localtime_r");
+	int year, month, day, hour, minute, second = 0;
+	int fields = sscanf(argument, "%d-%d-%d %d:%d:%d%c", &year, &month, &day,
+		&hour, &minute, &second, &end);
+	if(fields == 5 || fields == 6){
+		tm.tm_year = year - 1900;
+		tm.tm_mon = month - 1;
+		tm.tm_mday = day;
+	}
+	else{
+		second = 0;
+		fields = sscanf(argument, "%d:%d:%d%c", &hour, &minute, &second, &end);
+		if(fields != 2 && fields != 3)
+			usageErr("time '%s' should be @<seconds>, YYYY-MM-DD HH:MM[:SS] or HH:MM[:SS]\n", argument);
+	}
+	tm.tm_hour = hour;
+	tm.tm_min = minute;
+	tm.tm_sec = second;
+	tm.tm_isdst = -1;	/* mktime() finds out if it is summer time */
+	time_t parsed = mktime(&tm);
+	if(parsed == -1)
+		usageErr("invalid time '%s'\n", argument);
+	return parsed;
+}
 
+/* time range mode (-S, -U): write the messages written between since and
+until (both included, seconds since the epoch) to stdout. The server finds
+them with its time index and closes the connection after the last byte */
+static void
+runTimeRange(const char * host, const char * port, const char * key, time_t since, time_t until)
+{
+	int server_fd = connectForQuery(host, port);
+
+	if(sendTimeRange(server_fd, key, since, until)==-1)
+		errExit("sendTimeRange");
+	off_t start, end;
+	if(receiveRange(server_fd, &start, &end)==-1)
+		fatal("the server did not answer the time range");
+
+	copyAnswerToStdout(server_fd);
+	fprintf(stderr, "%lld bytes of the chat log (offsets %lld-%lld)\n",
+		(long long) (end - start), (long long) start, (long long) end);
+	close(server_fd);
 }
 
 int 
 main(int argc, char *argv[])
 {
+	/* -H headless mode, -e exit after the end of stdin (only with -H),
+	-s search the chat log, -S and -U messages written since/until a time */
+	int headless = 0;
+	int exitAfterInput = 0;
+	const char * searchQuery = NULL;
+	time_t since = -1;
+	time_t until = -1;
+	int opt;
+	while((opt = getopt(argc, argv, "Hes:S:U:")) != -1){
+		switch(opt){
+			case 'H': headless = 1; break;
+			case 'e': exitAfterInput = 1; break;
+			case 's': searchQuery = optarg; break;
+			case 'S': since = parseTimeArgument(optarg); break;
+			case 'U': until = parseTimeArgument(optarg); break;
+			default:
+				usageErr("%s [-H [-e]] [-s \"terms\"] [-S time] [-U time]\n", argv[0]);
+		}
+	}
+	if(exitAfterInput && !headless)
+		usageErr("%s [-H [-e]] [-s \"terms\"] [-S time] [-U time]\n", argv[0]);
 
 /*-------------------Parse config values-------------------------------------------------*/
 	/* allocate memory to store USERNAME, PORT and HOST values after being parsed,
@@ -366,125 +896,73 @@ main(int argc, char *argv[])
 		errExit("malloc key failed");
 
 	/* parse username, port and key from config file */
-	getConfigValues(username_parsed,port_parsed,host_parsed,key);
+	size_t scrollbackLines;
+	int historyCacheEnabled;
+	getConfigValues(username_parsed,port_parsed,host_parsed,key,&scrollbackLines,&historyCacheEnabled);
 
 /*---------------------------------------------------------------------------------------*/
 
-	/* establish connection with server, get fd to be shared with child processes */
-	int server_fd = establishConnection(host_parsed,port_parsed);
-	/* if establishConenction fails, the program exits from within the function call
-	to establishConnection, if the authentication fails, the connection would be closed much later, that
-	is why it actually crashes when ncurses has already taken over control of the terminal */
-
-	/* Send authentication key to server */
-	sendAuthKey(server_fd,key);
-
-	/* SECURITY: if there is core dump here I want the memory block where the key was to be all 0s, so that
-	the key is not leaked, check 'The Linux Programming Interface' for a similar procedure */
-	memset(key,0,KEY_LENGTH);
-	/* free variables not needed any more */
-	free(key);
-	free(host_parsed);
-	free(port_parsed);
-
-	/* configure catching SIGCHLD of child processes */
-	if(configureSignalDisposition()==-1)
-		errExit("sigaction failed, at configureSignalDisposition");
-
-	/* Create child processes which will handle the communication with the server
-	1. Child process will send messages to the server
-	2. Child process will receive messages from the server
-	Both child process will communicate with the parent process handling the front-end through pipes */
-	/* Create pipe for 1. Child process, which will send messages to the server.
-	The pipe is created before fork() so that the fds are shared between both the
-	parent and the child process */
-	int pipe_fds_send_server[2];
-	if(pipe(pipe_fds_send_server)==-1)
-		errExit("pipe send to server");
-
-	int child1_pid = fork();
-	/* 1. Child creation -- handles sending data from server */
-	switch(child1_pid) {
-		/* error on fork() call  */
-		case -1:
-			/* exit with an error message */
-			errExit("fork(), 1. Child [send] could not be created.");
-			break;
-
-		/* 1. Child process (returns 0) */
-		case 0: 
-			/* Close stdin of pipe shared with parent */
-			close(pipe_fds_send_server[1]);
-			handleSendSocket(server_fd, pipe_fds_send_server[0]);
-			_exit(EXIT_SUCCESS);
-			break;
+	if(searchQuery != NULL){
+		runSearch(host_parsed, port_parsed, key, searchQuery);
+		exit(EXIT_SUCCESS);
+	}
+	if(since != -1 || until != -1){
+		runTimeRange(host_parsed, port_parsed, key, (since == -1) ? 0 : since, until);
+		exit(EXIT_SUCCESS);
+	}
 
-		/* Parent: fork() returns PID of newly created child */
-		default:
-			/* Close stdout of pipe shared with 1. Child */
-			close(pipe_fds_send_server[0]);
-			break;
-	}// end switch-case fork 1
-
-	/* 2. Child creation -- handles receiving data from server */
-	int pipe_fds_receive_server[2];
-	if(pipe(pipe_fds_receive_server)==-1)
-		errExit("pipe receive from server");
-	/* transform fd to non-blocking */	
-	int flags;
-	/* get currently used flags on pipe */
-	flags = fcntl(pipe_fds_receive_server[0], F_GETFL); 
-	if(flags==-1)
-		errExit("fcntl F_GETFL");
-	/* activate O_NONBLOCK flag */
-	flags |= O_NONBLOCK;	
-	/* configure pipe fd to be O_NONBLOCK */
-	if(fcntl(pipe_fds_receive_server[0],F_SETFL,flags)==-1)
-		errExit("fcntl O_NONBLOCK");
-
-	int child2_pid = fork();
-	switch(child2_pid) {
-		/* error on fork() call  */
-		case -1:
-			/* exit with an error message */
-			errExit("fork(), 2. Child [receive] could not be created.");
-			break;
+	/* messages received in previous sessions, the chat is resumed at the
+	end of the cache, so that only the newer messages are sent again. The
+	headless mode does not show the history, so it does not use the cache */
+	struct historyCache cache;
+	cache.fd = -1;
+	cache.end = -1;
+	if(historyCacheEnabled && !headless){
+		char historyCache_path[1024];
+		snprintf(historyCache_path, sizeof(historyCache_path), "%s%s%s_%s%s",
+			getenv("HOME"), HISTORY_CACHE_PREFIX, host_parsed, port_parsed, HISTORY_CACHE_SUFFIX);
+		if(openHistoryCache(&cache, historyCache_path)==-1)
+			errExit("openHistoryCache %s", historyCache_path);
+	}
 
-		/* 2. Child process (returns 0) */
-		case 0: 
-			/* Close stdout of pipe shared with parent */
-			close(pipe_fds_receive_server[0]);
-			/* Close pipe from 1. Child inherited through parent */
-			close(pipe_fds_send_server[1]);
-			/* this function call will continously read from server socket
-			if no messages are being received, it will block, if server 
-			disconnects then it will exit with an error */
-			handleReadSocket(server_fd, pipe_fds_receive_server[1]);
-			_exit(EXIT_SUCCESS);
-			break;
+	/* offset in the chat log of the server after the last byte received,
+	negative until the client joined the chat */
+	off_t chatlogOffset = cache.end;
+
+	/* establish connection with server, join the chat and authenticate. If
+	the server cannot be reached at all, exit before ncurses takes over the
+	terminal. The key, host and port are kept in memory to reconnect later */
+	int server_fd = connectToServer(host_parsed,port_parsed,key,&chatlogOffset);
+	if(server_fd == -1)
+		errExit("connection to server failed");
+	synchronizeHistoryCache(&cache, chatlogOffset);
+
+	/* if the server closes the connection, write() should fail with EPIPE
+	instead of killing the client */
+	if(signal(SIGPIPE, SIG_IGN)==SIG_ERR)
+		errExit("signal SIGPIPE");
+
+	if(headless){
+		runHeadless(server_fd, host_parsed, port_parsed, key, username_parsed, chatlogOffset,
+			exitAfterInput);
+		exit(EXIT_SUCCESS);
+	}
 
-		/* Parent: fork() returns PID of newly created child */
-		default:
-			/* Close stdin of pipe shared with 2. Child */
-			close(pipe_fds_receive_server[1]);
-			break;
-	}// end switch-case fork 2
+	/* messages written by the user, which were not sent yet */
+	struct sendBuffer sendQueue;
+	if(initSendBuffer(&sendQueue, SEND_BUFFER_SIZE)==-1)
+		errExit("malloc sendQueue failed");
 
-	
 	/* initialize and configure ncurses */
 	configureNcurses();
 
-	/* configure only the parent process to kill all children when invoking exit(3) */
-	if(atexit(killChildProcesses)== -1)
-		errExit("atexit");
-
 
 	/* Print 'papayaChat' in the first 0, right in the middle of the screen 
 	subtract half of the length of 'papayaChat' from the x position in the
 	middle of the screen */
 	mvprintw(0,COLS/2-strlen("papayaChat")/2,"papayaChat\n");
 	attron(COLOR_PAIR(INSTRUCTIONS_COLOUR));
-	mvprintw(1,0,">>Press ARROW_DOWN to exit chat<<\n");
+	mvprintw(1,0,">>Press ARROW_DOWN to exit chat, PAGE_UP/PAGE_DOWN to scroll<<\n");
 	attroff(COLOR_PAIR(INSTRUCTIONS_COLOUR));
 	/* HLINE not printing */
 	////if(hline('_',COLS)==ERR)
@@ -493,8 +971,6 @@ main(int argc, char *argv[])
 	////printw("\n");
 	refresh();
 
-	int a = 0;			/* TODO: uninitialized ERROR found here fix that*/
-
 	/* starting position for chatWindow */
 	int x_start_chatWindow = 1;
 	int y_start_chatWindow = LINES-4; /* 4 lines below the last line */
@@ -503,7 +979,6 @@ main(int argc, char *argv[])
 	int y_start_textWindow = 3; /* on the 4th vertical line form the top */
 	
 	int y_start_delimiter = y_start_chatWindow - 2;	
-	int max_y_textWindow = LINES/2;
 
 	/* create chatWindow */
 	WINDOW * chatWindow;
@@ -512,47 +987,164 @@ main(int argc, char *argv[])
 	/* create textWindow */
 	WINDOW * textWindow;
 	textWindow=configureTextWindow(y_start_textWindow,x_start_textWindow,y_start_delimiter);
+
+	/* the status line (e.g. while reconnecting) is the empty line above the
+	textWindow */
+	WINDOW * statusWindow = newwin(1,COLS-2,y_start_textWindow-1,x_start_textWindow);
+	if(statusWindow == NULL){
+		endwin();
+		errExit("newwin [statusWindow]");
+	}
 	
-	/* move the cursor on textWindow to the position (0,0) */
-	wmove(textWindow,0,0);
+	/* lines received from the server */
+	struct scrollback sb;
+	if(initScrollback(&sb, scrollbackLines)==-1){
+		endwin();
+		errExit("initScrollback");
+	}
+	/* show the last lines of the previous sessions, the messages sent by
+	the server follow them */
+	if(loadHistoryCache(&cache, &sb)==-1){
+		endwin();
+		errExit("loadHistoryCache");
+	}
 
-	/* Stop ncurses when 'KEY_DOWN' is pressed */
-	while(a!= KEY_DOWN){
-		a = wgetch(chatWindow);
-		/* if getch returns ERR then no character was typed,
-		getch was configured as non-blocking with the nodelay() function */
-		if(a != ERR){
-			/* carriage return was pressed, send line to server, delete
-			line and move cursor to origin */
-			if(a == '\n'){
-				handleNewline(chatWindow,pipe_fds_send_server[1], username_parsed);	
-				/* newline was handled, continue trying to read input from keyboard */
-				continue;
-			} // if-statement \n (newline)
+	/* message being written by the user, the max. length of a message
+	fits into the first line of chatWindow */
+	struct lineEditor editor;
+	if(initLineEditor(&editor, MAX_MESSAGE_SENT - 1)==-1){
+		endwin();
+		errExit("initLineEditor");
+	}
 
-			/* BACKSPACE was pressed, delete last character */
-			if(a == PORTABLE_BACKSPACE){
-				handleBackspace(chatWindow);
-				/* backspace was handled, continue trying to read input from keyboard */
-				continue;
+	/* the client sleeps in poll() until the user types something, a message
+	from the server arrives, a queued message can be sent or a signal is
+	caught (SIGWINCH), so that an idle client does not use any CPU time */
+	struct pollfd fds[2];
+	fds[0].fd = STDIN_FILENO;
+	fds[0].events = POLLIN;
+	fds[1].fd = server_fd;
+
+	/* print the messages received by the server, before the first keystroke */
+	wrefresh(chatWindow);
+
+	/* the screen is updated at most CLIENT_MAX_FPS times per second, a burst
+	of messages (or a paste) only costs one update of the terminal per frame.
+	Changes are marked as dirty and drawn once the frame interval elapsed */
+	const long frameInterval = 1000 / CLIENT_MAX_FPS;
+	struct timespec lastFrame = { 0, 0 };
+	int textDirty = 0;
+	int screenDirty = 0;
+
+	/* while the connection is lost, server_fd is -1 and the client tries to
+	reconnect with an exponential backoff, starting after reconnectDelay ms
+	(counted from lostConnection). The user can keep on writing messages,
+	they are sent after reconnecting */
+	long reconnectDelay = RECONNECT_MIN_DELAY;
+	struct timespec lostConnection = { 0, 0 };
+	char status[128];
+
+	int exitChat = 0;
+	while(!exitChat){
+		/* only wait for the socket to be writable, if a message could not
+		be sent completely, poll() ignores the socket while it is -1 */
+		fds[1].fd = server_fd;
+		fds[1].events = POLLIN;
+		if(sendQueue.end > sendQueue.start)
+			fds[1].events |= POLLOUT;
+
+		/* if there are changes which were not drawn yet, wake up in time for
+		the next frame */
+		int timeout = -1;
+		if(screenDirty){
+			long untilNextFrame = frameInterval - millisecondsSince(&lastFrame);
+			timeout = (untilNextFrame > 0) ? untilNextFrame : 0;
+		}
+		/* wake up in time for the next attempt to reconnect */
+		if(server_fd == -1){
+			int reconnectTimeout = untilReconnect(reconnectDelay, &lostConnection);
+			if(timeout == -1 || reconnectTimeout < timeout)
+				timeout = reconnectTimeout;
+		}
+
+		int interrupted = 0;
+		if(poll(fds, 2, timeout) == -1){
+			/* a caught signal interrupted poll(), if it was SIGWINCH, ncurses
+			returns KEY_RESIZE on the next wgetch() */
+			if(errno != EINTR){
+				endwin();
+				errExit("poll() @main loop");
 			}
-			/* if the current cursor position is smaller than the max. message length,
-			add new read character to chatWindow and refresh view of chatWindow */
-			int messageMaxLength = MAX_MESSAGE_SENT;
-			if(checkMaxMessageLength(chatWindow,messageMaxLength)!=-1){
-				waddch(chatWindow,a);
-				wrefresh(chatWindow);
+			interrupted = 1;
+			fds[0].revents = 0;
+			fds[1].revents = 0;
+		}
+
+		/* try to reconnect, the server sends every message written to the
+		chat log since the last byte received */
+		if(server_fd == -1 && millisecondsSince(&lostConnection) >= reconnectDelay){
+			server_fd = reconnectToServer(host_parsed, port_parsed, key, &chatlogOffset,
+				&reconnectDelay, &lostConnection);
+			if(server_fd == -1){
+				snprintf(status, sizeof(status), " connection to server lost, reconnecting in %.1fs ",
+					reconnectDelay / 1000.0);
+				setStatus(statusWindow, status);
+			}
+			else{
+				/* a message cut by the lost connection is sent again */
+				rewindSendBuffer(&sendQueue);
+				synchronizeHistoryCache(&cache, chatlogOffset);
+				setStatus(statusWindow, "");
 			}
+			screenDirty = 1;
+			fds[1].revents = 0;
+		}
+
+		/* fetch new messages from server */
+		if(server_fd != -1 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))){
+			ssize_t bytesReceived = printMessagesFromServer(server_fd,&sb,&chatlogOffset,&cache);
+			if(bytesReceived == -1)
+				server_fd = closeConnection(server_fd, statusWindow, &lostConnection);
+			if(bytesReceived > 0)
+				textDirty = 1;
+			screenDirty = 1;
+		}
 
-		} // end a!=ERR
-	/* fetch new messages from server (if available, otherwise nothing happens) */
-	printMessagesFromServer(textWindow,pipe_fds_receive_server[0],max_y_textWindow);
+		int stdinReadable = fds[0].revents & (POLLIN | POLLHUP | POLLERR);
+		if(stdinReadable || interrupted){
+			exitChat = handleKeyboardInput(chatWindow, textWindow, &sb, &editor, &sendQueue,
+				username_parsed, &textDirty, stdinReadable);
+			screenDirty = 1;
+		}
+		screenDirty |= textDirty;
+
+		if(screenDirty && millisecondsSince(&lastFrame) >= frameInterval){
+			drawFrame(textWindow, chatWindow, &sb, &editor, textDirty);
+			clock_gettime(CLOCK_MONOTONIC, &lastFrame);
+			textDirty = 0;
+			screenDirty = 0;
+		}
+
+		/* send the messages written by the user (and the rest of messages
+		that could only be sent partially). If the connection was lost, the
+		messages stay queued until the client reconnected */
+		if(server_fd != -1 && flushSendBuffer(server_fd, &sendQueue) == -1){
+			server_fd = closeConnection(server_fd, statusWindow, &lostConnection);
+			screenDirty = 1;
+		}
 
 	} // while-loop
 
 	/* End ncurses, KEY_DOWN was pressed */
 	endwin();			
 
+	/* SECURITY: if there is core dump here I want the memory block where the key was to be all 0s, so that
+	the key is not leaked, check 'The Linux Programming Interface' for a similar procedure */
+	memset(key,0,KEY_LENGTH);
+	/* free variables not needed any more */
+	free(key);
+	free(host_parsed);
+	free(port_parsed);
 	free(username_parsed);
 	exit(EXIT_SUCCESS);
 }
@@ -1,126 +1,239 @@
 /* handleMessages.c
 
+Send and receive messages through the non-blocking socket of the server,
+the front-end owns the socket directly (no child processes and pipes), so
+every function returns instead of blocking, and the front-end waits with
+poll() until the socket is readable or writable again.
+
 */
 
+#define _GNU_SOURCE	/* memrchr() */
 #include "CONFIG.h" /* BUF_SIZE is defined here */
 #include "basics.h" /* to use read() write() */
+#include "handleMessages.h"
 
-/* send a message to a pipe */
-void
-sendMessageToPipe(int pipe_fd, char *message)
+int
+initSendBuffer(struct sendBuffer * buffer, size_t capacity)
 {
-	/* Execute strlen outside of write(), since it demands run time resources
-	and it would be run twice inside write() call*/
-	size_t sizeOfMessage = strlen(message);
-	if(write(pipe_fd,message,sizeOfMessage)!=sizeOfMessage)
-		errExit("write sendMessageToPipe()");
-
+	buffer->data = (char *) malloc(capacity);
+	/* if malloc fails, it returns a NULL pointer */
+	if(buffer->data == NULL)
+		return -1;
+
+	buffer->capacity = capacity;
+	buffer->start = 0;
+	buffer->end = 0;
+	buffer->messageStart = 0;
+	return 0;
 }
 
-/* send a message to the server_fd, the message is received through 
-a pipe from the parent process */
-void
-handleSendSocket(int server_fd, int pipe_fd)
+int
+queueMessage(struct sendBuffer * buffer, const char * message, size_t length)
 {
-	/* size of info read from pipe */
-	ssize_t bytesRead;
+	/* move the bytes that were not sent yet to the beginning of the buffer,
+	this only happens if a message does not fit after the queued bytes. The
+	part of a message which was already sent is kept, in case it has to be
+	sent again after a reconnect */
+	if(buffer->end + length > buffer->capacity && buffer->messageStart > 0){
+		memmove(buffer->data, buffer->data + buffer->messageStart, buffer->end - buffer->messageStart);
+		buffer->end -= buffer->messageStart;
+		buffer->start -= buffer->messageStart;
+		buffer->messageStart = 0;
+	}
 
-	for(;;){
+	/* the server has not read the previous messages yet, and the buffer
+	is full */
+	if(buffer->end + length > buffer->capacity){
+		errno = ENOBUFS;
+		return -1;
+	}
 
-		/* allocate memory on each for-loop to read message
-		from pipe */
-		char * string_buf = (char *) malloc(BUF_SIZE);
-		/* if malloc fails, it returns a NULL pointer */
-		if(string_buf == NULL)
-			errExit("malloc failed. @handleSendSocket()");
-
-		/* read from pipe info to send to server */
-		bytesRead = read(pipe_fd, string_buf, BUF_SIZE);
-/*----------- error handling for read()----------------------------------- */
-		/* read() failed, exit programm with error, always free malloc resources
-		before exit()*/
-		if(bytesRead == -1){
-			free(string_buf);
-			errExit("read - handleSendSocket()");
-		}
-		/* connection to pipe closed */
-		if(bytesRead == 0){
-			free(string_buf);
-			errExit("pipe closed - handleSendSocket()");
-		}
-/*----------- error handling for write()----------------------------------- */
-		/* send data received from pipe to server socket */
-		if(write(server_fd,string_buf,bytesRead)!=bytesRead){
-			free(string_buf);
-			errExit("write handleSendSocket()");
+	memcpy(buffer->data + buffer->end, message, length);
+	buffer->end += length;
+	return 0;
+}
+
+ssize_t
+flushSendBuffer(int server_fd, struct sendBuffer * buffer)
+{
+	while(buffer->start < buffer->end){
+		ssize_t bytesWritten = write(server_fd, buffer->data + buffer->start,
+			buffer->end - buffer->start);
+		if(bytesWritten == -1){
+			if(errno == EINTR)
+				continue;
+			/* the socket's send buffer is full, try again when poll()
+			reports that the socket is writable */
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
 		}
-		/* free resources, char * buffer to read message from pipe */
-		free(string_buf);
-	} // end for-loop
+		/* the next message starts after the last newline sent */
+		const char * newline = memrchr(buffer->data + buffer->start, '\n', bytesWritten);
+		if(newline != NULL)
+			buffer->messageStart = newline - buffer->data + 1;
+		buffer->start += bytesWritten;
+	}
+
+	/* everything was sent, start again at the beginning of the buffer */
+	if(buffer->start == buffer->end){
+		buffer->start = 0;
+		buffer->end = 0;
+		buffer->messageStart = 0;
+	}
 
+	return buffer->end - buffer->start;
+}
+
+void
+rewindSendBuffer(struct sendBuffer * buffer)
+{
+	buffer->start = buffer->messageStart;
 }
 
-/* fetch messages from pipe (fetch, but do not print message yet)
-the pipe should be configured as O_NONBLOCK
-since if the read() on the pipe blocks, all the CLI stalls */
 int
-fetchMessage(int pipe_fd, char *string_buf)
+sendHello(int server_fd, const char * key, off_t offset)
 {
-	ssize_t bytesRead;
+	char hello[KEY_LENGTH + HELLO_MAX_LENGTH];
+
+	/* the key and the hello line are sent with a single write(), the server
+	reads the key with exactly KEY_LENGTH bytes and the hello line byte by
+	byte */
+	memcpy(hello, key, KEY_LENGTH);
+	int helloLength;
+	if(offset < 0)
+		helloLength = snprintf(hello + KEY_LENGTH, HELLO_MAX_LENGTH, "JOIN\n");
+	else
+		helloLength = snprintf(hello + KEY_LENGTH, HELLO_MAX_LENGTH, "RESUME %lld\n",
+			(long long) offset);
+
+	size_t length = KEY_LENGTH + helloLength;
+	if(write(server_fd, hello, length) != (ssize_t) length)
+		return -1;
+	return 0;
+}
 
-	bytesRead = read(pipe_fd, string_buf, BUF_SIZE);
+/* read a line answered by the server (without the newline) into line
+(HELLO_MAX_LENGTH bytes) byte by byte, the messages follow the line right
+away. Returns 0 on success and -1 on error */
+static int
+receiveLine(int server_fd, char * line)
+{
+	size_t length = 0;
 
-	return bytesRead;
+	for(;;){
+		ssize_t bytesRead = read(server_fd, &line[length], 1);
+		if(bytesRead == -1 && errno == EINTR)
+			continue;
+		if(bytesRead <= 0)
+			return -1;	/* EOF, error or SO_RCVTIMEO expired */
+		if(line[length] == '\n')
+			break;
+		if(++length == HELLO_MAX_LENGTH)
+			return -1;
+	}
+	line[length] = '\0';
+	return 0;
+}
 
-/* if the read() syscall fails, the system quietly does nothing
-and tries to read again from the pipe, in the next iteration of 
-the front-end main loop */
+off_t
+receiveStartOffset(int server_fd)
+{
+	char line[HELLO_MAX_LENGTH];
+	if(receiveLine(server_fd, line) == -1)
+		return -1;
+
+	long long offset;
+	if(sscanf(line, "OFFSET %lld", &offset) != 1 || offset < 0)
+		return -1;
+	return offset;
+}
 
+int
+sendSearch(int server_fd, const char * key, const char * query)
+{
+	char hello[KEY_LENGTH + HELLO_MAX_LENGTH];
+
+	memcpy(hello, key, KEY_LENGTH);
+	int helloLength = snprintf(hello + KEY_LENGTH, HELLO_MAX_LENGTH, "SEARCH %s\n", query);
+	/* the query is cut, but the line always ends with a newline */
+	if(helloLength >= HELLO_MAX_LENGTH){
+		helloLength = HELLO_MAX_LENGTH - 1;
+		hello[KEY_LENGTH + helloLength - 1] = '\n';
+	}
+	/* a newline inside of the query would end the hello line */
+	for(int i = strlen("SEARCH "); i < helloLength - 1; i++)
+		if(hello[KEY_LENGTH + i] == '\n' || hello[KEY_LENGTH + i] == '\r')
+			hello[KEY_LENGTH + i] = ' ';
+
+	size_t length = KEY_LENGTH + helloLength;
+	if(write(server_fd, hello, length) != (ssize_t) length)
+		return -1;
+	return 0;
 }
 
-/* read from server socket and pass data through pipe to frontEnd parent process */
-void
-handleReadSocket(int server_fd, int pipe_fd)
+long
+receiveMatches(int server_fd, long * sent)
+{
+	char line[HELLO_MAX_LENGTH];
+	if(receiveLine(server_fd, line) == -1)
+		return -1;
+
+	long matches;
+	if(sscanf(line, "MATCHES %ld %ld", &matches, sent) != 2 || matches < 0 || *sent < 0)
+		return -1;
+	return matches;
+}
+
+int
+sendTimeRange(int server_fd, const char * key, time_t since, time_t until)
+{
+	char hello[KEY_LENGTH + HELLO_MAX_LENGTH];
+
+	memcpy(hello, key, KEY_LENGTH);
+	int helloLength;
+	if(until < 0)
+		helloLength = snprintf(hello + KEY_LENGTH, HELLO_MAX_LENGTH, "SINCE %lld\n",
+			(long long) since);
+	else
+		helloLength = snprintf(hello + KEY_LENGTH, HELLO_MAX_LENGTH, "BETWEEN %lld %lld\n",
+			(long long) since, (long long) until);
+
+	size_t length = KEY_LENGTH + helloLength;
+	if(write(server_fd, hello, length) != (ssize_t) length)
+		return -1;
+	return 0;
+}
+
+int
+receiveRange(int server_fd, off_t * start, off_t * end)
 {
+	char line[HELLO_MAX_LENGTH];
+	if(receiveLine(server_fd, line) == -1)
+		return -1;
+
+	long long rangeStart, rangeEnd;
+	if(sscanf(line, "RANGE %lld %lld", &rangeStart, &rangeEnd) != 2
+		|| rangeStart < 0 || rangeEnd < rangeStart)
+		return -1;
+	*start = rangeStart;
+	*end = rangeEnd;
+	return 0;
+}
 
+ssize_t
+receiveMessages(int server_fd, char * string_buf, size_t size)
+{
 	ssize_t bytesRead;
 
-/* the right way to handle strings is by allocating new memory each time
-a string is received through a read() call from the server, since 
-char * should be immutable objects in C */
-	for(;;){
+	do {
+		bytesRead = read(server_fd, string_buf, size - 1);
+	} while(bytesRead == -1 && errno == EINTR);
 
-		/* TODO: check if the size allocated is correct */
-		/* allocate memory on each for-loop to read from server, into
-		newly allocated char* buffer */
-		char * string_buf = (char *) malloc(BUF_SIZE);
-		/* if malloc fails, it returns a NULL pointer */
-		if(string_buf == NULL)
-			errExit("malloc() failed. @handleReadSocket()");
-		
-		bytesRead = read(server_fd, string_buf, BUF_SIZE);
-/*----------- error handling for read()----------------------------------- */
-		/* read() failed, exit programm with error, always free malloc resources
-		before exit()*/
-		if(bytesRead == -1){
-			free(string_buf);
-			errExit("read from server @handleReadSocket()");
-		}
-		/* connection to server down */
-		if(bytesRead == 0){
-			free(string_buf);
-			errExit("connection to server lost! read() from socket return 0 == EOF :@handleReadSocket()");
-		}
-/*----------- error handling for read()----------------------------------- */
-		/* send data received from server to parent process through pipe */
-		if(write(pipe_fd, string_buf, bytesRead) != bytesRead){
-			/* the amount of bytes written is not equal to the amount of bytes read */
-			errExit("write to pipe @handleReadSocket()");
-		}
-		/* free resources, char * buffer to read message from server */
-		free(string_buf);
-	}
+	/* the received bytes are printed as a string */
+	string_buf[(bytesRead > 0) ? bytesRead : 0] = '\0';
+
+	return bytesRead;
 }
 
 /* Eduardo Rodriguez 2021 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
-
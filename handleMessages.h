@@ -5,21 +5,75 @@
 #ifndef HANDLEMESSAGES_H /* header guard */
 #define HANDLEMESSAGES_H
 
-/* send message to a pipe */
-void sendMessageToPipe(int pipe_fd, char *message);
+#include <sys/types.h>	/* size_t, ssize_t */
+#include <time.h>		/* time_t */
 
-/* send a message to the server_fd, the message is received through 
-a pipe from the parent process */
-void handleSendSocket(int server_fd, int pipe_fd);
+/* messages written by the user, which were not yet sent to the server,
+the socket of the server is non-blocking, so a message might only be sent
+partially and the rest is sent once the socket is writable again. Every
+message ends with a newline */
+struct sendBuffer {
+	char * data;
+	size_t capacity;
+	size_t start;	/* first byte which was not sent yet */
+	size_t end;		/* end of the queued bytes */
+	size_t messageStart;	/* first byte of the message start is in, it
+							differs from start after a partial write */
+};
 
-/* fetch messages from pipe (fetch, but do not print message yet)
-the pipe should be configured as O_NONBLOCK
-since if the read() on the pipe blocks, all the CLI stalls */
-int fetchMessage(int pipe_fd, char *string_buf);
+/* allocate a sendBuffer with capacity bytes, returns 0 on success and -1 on
+error */
+int initSendBuffer(struct sendBuffer * buffer, size_t capacity);
 
-/* read from server socket and pass data through pipe to frontEnd parent process */
-void handleReadSocket(int server_fd, int pipe_fd);
+/* append a message to the sendBuffer, returns 0 on success and -1 if the
+message does not fit into the buffer (errno = ENOBUFS) */
+int queueMessage(struct sendBuffer * buffer, const char * message, size_t length);
 
+/* send as much of the queued bytes as the non-blocking socket accepts,
+returns the number of bytes still queued (0 if everything was sent) or -1 on
+error (e.g. EPIPE, the connection to the server was lost) */
+ssize_t flushSendBuffer(int server_fd, struct sendBuffer * buffer);
+
+/* after a reconnect: send the message which was only sent partially over the
+lost connection again from its beginning, otherwise the new connection would
+only get the rest of it */
+void rewindSendBuffer(struct sendBuffer * buffer);
+
+/* send the key and the hello line to a just connected server, a negative
+offset joins the chat ("JOIN"), otherwise the chat is resumed at offset
+("RESUME <offset>"). Returns 0 on success and -1 on error */
+int sendHello(int server_fd, const char * key, off_t offset);
+
+/* read the answer of the server to the hello line ("OFFSET <offset>"),
+returns the offset in the chat log of the first byte of the messages sent
+afterwards, or -1 on error */
+off_t receiveStartOffset(int server_fd);
+
+/* send the key and a search ("SEARCH <query>") to a just connected server,
+the query is cut if it is too long. Returns 0 on success and -1 on error */
+int sendSearch(int server_fd, const char * key, const char * query);
+
+/* read the answer of the server to a search ("MATCHES <lines> <lines sent>"),
+the matching lines follow it until the server closes the connection. Returns
+the number of matching lines and stores the number of lines sent in sent, or
+returns -1 on error */
+long receiveMatches(int server_fd, long * sent);
+
+/* send the key and a time range to a just connected server, the messages
+written from since up to until (seconds since the epoch, both included) or
+since then if until is negative ("SINCE <since>" or "BETWEEN <since>
+<until>"). Returns 0 on success and -1 on error */
+int sendTimeRange(int server_fd, const char * key, time_t since, time_t until);
+
+/* read the answer of the server to a time range ("RANGE <start> <end>"), the
+bytes of the chat log from offset start up to end follow it until the server
+closes the connection. Returns 0 on success and -1 on error */
+int receiveRange(int server_fd, off_t * start, off_t * end);
+
+/* read from the non-blocking server socket into string_buf (at most size-1
+bytes, string_buf is always null-terminated), returns the bytes read, 0 on EOF
+and -1 on error (errno = EAGAIN, if there was nothing to read) */
+ssize_t receiveMessages(int server_fd, char * string_buf, size_t size);
 
 #endif
 
@@ -0,0 +1,174 @@
+/* historyCache.c
+
+[front-end] On-disk cache of the chat received from a server.
+
+Every byte received from the server is a byte of its chat log (see
+sendNewMessages() in clientRequest.c), so the cache is simply an append-only
+copy of a contiguous range of the chat log. A fixed-size header stores the
+offset in the chat log of the first cached byte, the offset after the last
+cached byte follows from the size of the file.
+
+When the client starts, it resumes the chat at the end of the cache
+("RESUME <offset>"), so the server only sends the messages written since the
+last session, and the scrollback is filled from the cache. Only the end of
+the cache is read (as many lines as fit into the scrollback), so the startup
+does not get slower as the cache grows.
+
+*/
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/file.h>	/* flock() */
+
+#include "basics.h"
+#include "historyCache.h"
+#include "lineScan.h"	/* scanFindLast() */
+#include "CONFIG.h"	/* BUF_SIZE */
+
+/* the header is always rewritten in place, so it has a fixed size:
+"PAPAYACACHE <20 digits offset>\n" */
+#define HEADER_FORMAT "PAPAYACACHE %020lld\n"
+#define HEADER_SIZE 33
+
+int
+openHistoryCache(struct historyCache * cache, const char * path)
+{
+	cache->fd = -1;
+	cache->start = -1;
+	cache->end = -1;
+
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if(fd == -1)
+		return -1;
+
+	/* two clients of the same user appending to the same cache would mix
+	their bytes, the second client simply runs without a cache */
+	if(flock(fd, LOCK_EX | LOCK_NB) == -1){
+		close(fd);
+		if(errno == EWOULDBLOCK)
+			return 0;
+		return -1;
+	}
+	cache->fd = fd;
+
+	struct stat cacheStat;
+	if(fstat(fd, &cacheStat) == -1)
+		return -1;
+
+	/* an empty cache or a cache with a broken header is started again with
+	the first byte received */
+	char header[HEADER_SIZE + 1];
+	long long start;
+	if(cacheStat.st_size < HEADER_SIZE
+		|| pread(fd, header, HEADER_SIZE, 0) != HEADER_SIZE)
+		return resetHistoryCache(cache, -1);
+	header[HEADER_SIZE] = '\0';
+	if(sscanf(header, "PAPAYACACHE %lld", &start) != 1 || start < 0)
+		return resetHistoryCache(cache, -1);
+
+	cache->start = start;
+	cache->end = start + (cacheStat.st_size - HEADER_SIZE);
+	return 0;
+}
+
+int
+loadHistoryCache(const struct historyCache * cache, struct scrollback * sb)
+{
+	if(cache->fd == -1 || cache->start == -1)
+		return 0;
+
+	char * buf = (char *) malloc(BUF_SIZE);
+	if(buf == NULL)
+		return -1;
+
+	/* walk backwards from the end of the cache, until there are more lines
+	than the scrollback can store */
+	off_t endOfFile = HEADER_SIZE + (cache->end - cache->start);
+	off_t position = endOfFile;
+	off_t loadFrom = HEADER_SIZE;
+	size_t newlines = 0;
+	while(position > HEADER_SIZE && loadFrom == HEADER_SIZE){
+		size_t chunk = BUF_SIZE;
+		if(position - HEADER_SIZE < BUF_SIZE)
+			chunk = position - HEADER_SIZE;
+		position -= chunk;
+		if(pread(cache->fd, buf, chunk, position) != (ssize_t) chunk){
+			free(buf);
+			return -1;
+		}
+		/* the newline of the last line does not start another line */
+		size_t length = chunk;
+		if(position + chunk == endOfFile && buf[chunk - 1] == '\n')
+			length--;
+		size_t found;
+		ssize_t i = scanFindLast(buf, length, '\n', sb->capacity - newlines, &found);
+		if(i != -1)
+			loadFrom = position + i + 1;
+		newlines += found;
+	}
+
+	/* append the lines in order, the scrollback splits them again */
+	for(position = loadFrom; position < endOfFile; ){
+		ssize_t bytesRead = pread(cache->fd, buf, BUF_SIZE, position);
+		if(bytesRead <= 0){
+			free(buf);
+			return -1;
+		}
+		if(appendScrollback(sb, buf, bytesRead) == -1){
+			free(buf);
+			return -1;
+		}
+		position += bytesRead;
+	}
+
+	free(buf);
+	return 0;
+}
+
+int
+resetHistoryCache(struct historyCache * cache, off_t start)
+{
+	if(cache->fd == -1)
+		return 0;
+
+	if(ftruncate(cache->fd, 0) == -1)
+		return -1;
+	cache->start = -1;
+	cache->end = -1;
+
+	/* the offset of the first byte is not known yet (nothing was received) */
+	if(start < 0)
+		return 0;
+
+	char header[HEADER_SIZE + 1];
+	snprintf(header, sizeof(header), HEADER_FORMAT, (long long) start);
+	if(write(cache->fd, header, HEADER_SIZE) != HEADER_SIZE)
+		return -1;
+
+	cache->start = start;
+	cache->end = start;
+	return 0;
+}
+
+int
+appendHistoryCache(struct historyCache * cache, const char * data, size_t length)
+{
+	if(cache->fd == -1)
+		return 0;
+
+	/* O_APPEND, the bytes are always written at the end of the cache */
+	if(write(cache->fd, data, length) != (ssize_t) length){
+		/* e.g. the disk is full, the end of the cache would not match the
+		offset of the chat log anymore, discard it and stop caching */
+		int savedErrno = errno;
+		resetHistoryCache(cache, -1);
+		close(cache->fd);
+		cache->fd = -1;
+		errno = savedErrno;
+		return -1;
+	}
+	cache->end += length;
+	return 0;
+}
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
@@ -0,0 +1,45 @@
+/* historyCache.h
+
+[front-end] On-disk cache of the chat received from a server, stored under
+~/.papayachat/, so that only the messages written since the last session are
+downloaded again
+
+*/
+
+#ifndef HISTORYCACHE_H /* header guard */
+#define HISTORYCACHE_H
+
+#include <sys/types.h>	/* off_t, size_t */
+#include "scrollback.h"
+
+/* the cache is an append-only copy of the chat log of the server, starting
+at the offset start of the chat log. Every byte received from the server is
+appended, so the cache always ends at the offset end of the chat log */
+struct historyCache {
+	int fd;		/* -1 if the cache is disabled */
+	off_t start;	/* offset in the chat log of the first cached byte,
+					-1 if the cache is empty */
+	off_t end;		/* offset in the chat log after the last cached byte */
+};
+
+/* open (or create) the cache stored at path, returns 0 on success and -1 on
+error. If the cache is used by another client at the same time, the cache is
+disabled (fd is -1) and 0 is returned */
+int openHistoryCache(struct historyCache * cache, const char * path);
+
+/* append the last lines of the cache (at most the capacity of the
+scrollback) to the scrollback, only the end of the cache is read, returns 0
+on success and -1 on error */
+int loadHistoryCache(const struct historyCache * cache, struct scrollback * sb);
+
+/* discard the cached bytes, the next byte appended is the byte at offset
+start of the chat log, returns 0 on success and -1 on error */
+int resetHistoryCache(struct historyCache * cache, off_t start);
+
+/* append bytes received from the server, returns 0 on success and -1 on
+error, then the cache is discarded and disabled */
+int appendHistoryCache(struct historyCache * cache, const char * data, size_t length);
+
+#endif
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
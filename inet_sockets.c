@@ -7,6 +7,7 @@
                                    definitions from <netdb.h> */
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>        /* TCP_NODELAY */
 #include <arpa/inet.h>
 #include <netdb.h>
 #include "inet_sockets.h"       /* Declares functions defined here */
@@ -190,6 +191,56 @@ serverListen(const char *service, int backlog, socklen_t *addrlen)
     return inetPassiveSocket(service, SOCK_STREAM, addrlen, TRUE, backlog);
 }
 
+/* Options of the low-latency mode for a TCP socket: disable Nagle's
+   algorithm, small writes are sent at once instead of waiting for the
+   ACK of the previous ones. If 'busyPollUs' is greater than 0, a read
+   on the socket polls the device queue for up to 'busyPollUs'
+   microseconds before it sleeps (SO_BUSY_POLL, values above
+   net.core.busy_read need CAP_NET_ADMIN).
+   Return 0 on success, or -1 on error. */
+int
+socketLowLatency(int socket_fd, int busyPollUs)
+{
+    int optval = 1;
+    if (setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval)) == -1)
+        return -1;
+    if (busyPollUs > 0 &&
+            setsockopt(socket_fd, SOL_SOCKET, SO_BUSY_POLL, &busyPollUs, sizeof(busyPollUs)) == -1)
+        return -1;
+    return 0;
+}
+
+/* Like serverListen(), with the options of socketLowLatency() set on the
+   listening socket, so that a wrong 'busyPollUs' is found at startup.
+   The accepted sockets should get them with socketLowLatency() as well.
+   Return socket descriptor on success, or -1 on error. */
+int
+serverListenLowLatency(const char *service, int backlog, socklen_t *addrlen, int busyPollUs)
+{
+    int socket_fd = serverListen(service, backlog, addrlen);
+    if (socket_fd == -1)
+        return -1;
+    if (socketLowLatency(socket_fd, busyPollUs) == -1) {
+        int savedErrno = errno;
+        close(socket_fd);
+        errno = savedErrno;
+        return -1;
+    }
+    return socket_fd;
+}
+
+/* CPU which processed the last packets received on the connection
+   'socket_fd' (SO_INCOMING_CPU), or -1 on error */
+int
+socketIncomingCpu(int socket_fd)
+{
+    int cpu;
+    socklen_t length = sizeof(cpu);
+    if (getsockopt(socket_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) == -1)
+        return -1;
+    return cpu;
+}
+
 /* Create socket bound to wildcard IP address + port given in
    'service'. Return socket descriptor on success, or -1 on error. */
 
@@ -23,6 +23,15 @@ int establishConnection(const char *host, const char *service);
 Server-side function: */
 int serverListen(const char *service, int backlog, socklen_t *addrlen);
 
+/* serverListen() with TCP_NODELAY and, if 'busyPollUs' > 0, SO_BUSY_POLL */
+int serverListenLowLatency(const char *service, int backlog, socklen_t *addrlen, int busyPollUs);
+
+/* set TCP_NODELAY and, if 'busyPollUs' > 0, SO_BUSY_POLL on a connection */
+int socketLowLatency(int socket_fd, int busyPollUs);
+
+/* CPU which received the last packets of a connection, or -1 on error */
+int socketIncomingCpu(int socket_fd);
+
 int inetBind(const char *service, int type, socklen_t *addrlen);
 
 char *inetAddressStr(const struct sockaddr *addr, socklen_t addrlen,
@@ -0,0 +1,59 @@
+/* lineEditor.c
+
+[front-end] In-memory buffer of the message being written by the user.
+
+Every character typed (or pasted) only changes the buffer, the input line is
+drawn from the buffer once per frame (see drawFrame() in frontEnd.c). So a
+long paste does not cost a cursor lookup and a screen update per character,
+and the message is never read back from the screen when it is sent.
+
+*/
+
+#include "basics.h"
+#include "lineEditor.h"
+
+int
+initLineEditor(struct lineEditor * editor, size_t capacity)
+{
+	editor->text = (char *) malloc(capacity);
+	if(editor->text == NULL)
+		return -1;
+
+	editor->length = 0;
+	editor->capacity = capacity;
+	return 0;
+}
+
+int
+insertLineEditor(struct lineEditor * editor, char c)
+{
+	if(editor->length >= editor->capacity)
+		return -1;
+
+	editor->text[editor->length++] = c;
+	return 0;
+}
+
+void
+backspaceLineEditor(struct lineEditor * editor)
+{
+	if(editor->length > 0)
+		editor->length--;
+}
+
+void
+clearLineEditor(struct lineEditor * editor)
+{
+	editor->length = 0;
+}
+
+void
+renderLineEditor(const struct lineEditor * editor, WINDOW * window)
+{
+	werase(window);
+	if(editor->length > 0)
+		mvwaddnstr(window, 0, 0, editor->text, editor->length);
+	wmove(window, 0, editor->length);
+}
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
@@ -0,0 +1,41 @@
+/* lineEditor.h
+
+[front-end] In-memory buffer of the message being written by the user, the
+characters typed are applied to the buffer and the input line is drawn from
+it once per frame
+
+*/
+
+#ifndef LINEEDITOR_H /* header guard */
+#define LINEEDITOR_H
+
+#include <ncurses.h>
+#include <sys/types.h>	/* size_t */
+
+struct lineEditor {
+	char * text;		/* not null-terminated */
+	size_t length;
+	size_t capacity;	/* max. length of a message */
+};
+
+/* allocate a lineEditor for messages with at most capacity characters,
+returns 0 on success and -1 on error */
+int initLineEditor(struct lineEditor * editor, size_t capacity);
+
+/* append a character to the message, returns 0 on success and -1 if the
+message already has the max. length */
+int insertLineEditor(struct lineEditor * editor, char c);
+
+/* delete the last character of the message, if there is one */
+void backspaceLineEditor(struct lineEditor * editor);
+
+/* delete the whole message (after it was sent) */
+void clearLineEditor(struct lineEditor * editor);
+
+/* draw the message in the first row of window and move the cursor after its
+last character. The window is not refreshed */
+void renderLineEditor(const struct lineEditor * editor, WINDOW * window);
+
+#endif
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
@@ -0,0 +1,324 @@
+/* lineScan.c
+
+[back-end and front-end] Counting and locating delimiters (newlines) in a
+buffer.
+
+The daemon walks backwards through the end of the chat log to find the first
+line of the history sent to a joining client (historyOffset()), the client
+does the same with its history cache and splits everything it receives into
+lines. Comparing byte after byte costs about one cycle per byte, so the
+kernels below compare a whole vector register at once:
+
+	scalar	one byte at a time, every CPU
+	sse2	16 bytes at a time, every x86-64 CPU
+	avx2	32 bytes at a time, chosen at runtime if the CPU supports it
+
+Every kernel compares the bytes of a block with the delimiter, which gives a
+register with 0xff in the matching bytes. For counting, the comparisons are
+subtracted from byte counters (0xff is -1) for at most 255 blocks, then the
+counters are summed with _mm_sad_epu8(). For locating, the comparison is
+turned into a bit mask (_mm_movemask_epi8()), the first or last set bit is
+the position of the delimiter. The bytes that do not fill a whole block are
+handled by the scalar kernel.
+
+Only the AVX2 functions are compiled for AVX2 (target attribute), the rest of
+the program runs on any x86-64 CPU. On other architectures only the scalar
+kernel exists. profiling/scanBench/ measures the kernels and
+tests/unit_test_lineScan.sh compares them with the scalar kernel.
+
+*/
+
+#if defined(__x86_64__)
+#include <immintrin.h>	/* SSE2 and AVX2 intrinsics */
+#define SCAN_X86
+#endif
+
+#include "basics.h"
+#include "lineScan.h"
+
+/* the functions of every kernel */
+struct scanKernel {
+	const char * name;
+	int (*supported)(void);
+	size_t (*count)(const char *, size_t, char);
+	const char * (*find)(const char *, size_t, char);
+	/* position of the remaining-th delimiter from the end, -1 if there are
+	less, remaining is decremented for every delimiter passed */
+	ssize_t (*findLast)(const char *, size_t, char, size_t *);
+};
+
+/* ------------------------------------------------------------------------ */
+/* scalar */
+
+static int
+scalarSupported(void)
+{
+	return 1;
+}
+
+static size_t
+scalarCount(const char * buf, size_t length, char delimiter)
+{
+	size_t count = 0;
+	for(size_t i = 0; i < length; i++)
+		count += (buf[i] == delimiter);
+	return count;
+}
+
+static const char *
+scalarFind(const char * buf, size_t length, char delimiter)
+{
+	for(size_t i = 0; i < length; i++)
+		if(buf[i] == delimiter)
+			return buf + i;
+	return NULL;
+}
+
+static ssize_t
+scalarFindLast(const char * buf, size_t length, char delimiter, size_t * remaining)
+{
+	for(ssize_t i = (ssize_t) length - 1; i >= 0; i--)
+		if(buf[i] == delimiter && --(*remaining) == 0)
+			return i;
+	return -1;
+}
+
+#ifdef SCAN_X86
+
+/* walk the set bits of mask (a block starting at position) from the highest
+one, returns the position of the remaining-th one or -1 */
+static inline ssize_t
+lastOfMask(unsigned int mask, size_t position, size_t * remaining)
+{
+	while(mask != 0){
+		int bit = 31 - __builtin_clz(mask);
+		if(--(*remaining) == 0)
+			return position + bit;
+		mask &= ~(1u << bit);
+	}
+	return -1;
+}
+
+/* ------------------------------------------------------------------------ */
+/* sse2 */
+
+static int
+sse2Supported(void)
+{
+	return 1;	/* part of x86-64 */
+}
+
+static size_t
+sse2Count(const char * buf, size_t length, char delimiter)
+{
+	const __m128i needle = _mm_set1_epi8(delimiter);
+	size_t count = 0;
+	size_t i = 0;
+	while(length - i >= 16){
+		/* a byte counter overflows after 255 blocks */
+		size_t blocks = (length - i) / 16;
+		if(blocks > 255)
+			blocks = 255;
+		__m128i counters = _mm_setzero_si128();
+		for(size_t block = 0; block < blocks; block++, i += 16){
+			__m128i bytes = _mm_loadu_si128((const __m128i *) (buf + i));
+			counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(bytes, needle));
+		}
+		__m128i sums = _mm_sad_epu8(counters, _mm_setzero_si128());
+		count += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+	}
+	return count + scalarCount(buf + i, length - i, delimiter);
+}
+
+static const char *
+sse2Find(const char * buf, size_t length, char delimiter)
+{
+	const __m128i needle = _mm_set1_epi8(delimiter);
+	size_t i = 0;
+	for(; length - i >= 16; i += 16){
+		__m128i bytes = _mm_loadu_si128((const __m128i *) (buf + i));
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, needle));
+		if(mask != 0)
+			return buf + i + __builtin_ctz(mask);
+	}
+	return scalarFind(buf + i, length - i, delimiter);
+}
+
+static ssize_t
+sse2FindLast(const char * buf, size_t length, char delimiter, size_t * remaining)
+{
+	const __m128i needle = _mm_set1_epi8(delimiter);
+	size_t i = length;
+	for(; i >= 16; i -= 16){
+		__m128i bytes = _mm_loadu_si128((const __m128i *) (buf + i - 16));
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, needle));
+		ssize_t position = lastOfMask(mask, i - 16, remaining);
+		if(position != -1)
+			return position;
+	}
+	return scalarFindLast(buf, i, delimiter, remaining);
+}
+
+/* ------------------------------------------------------------------------ */
+/* avx2 */
+
+static int
+avx2Supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+}
+
+__attribute__((target("avx2")))
+static size_t
+avx2Count(const char * buf, size_t length, char delimiter)
+{
+	const __m256i needle = _mm256_set1_epi8(delimiter);
+	size_t count = 0;
+	size_t i = 0;
+	while(length - i >= 32){
+		size_t blocks = (length - i) / 32;
+		if(blocks > 255)
+			blocks = 255;
+		__m256i counters = _mm256_setzero_si256();
+		for(size_t block = 0; block < blocks; block++, i += 32){
+			__m256i bytes = _mm256_loadu_si256((const __m256i *) (buf + i));
+			counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(bytes, needle));
+		}
+		__m256i sums = _mm256_sad_epu8(counters, _mm256_setzero_si256());
+		count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1)
+			+ _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+	}
+	return count + sse2Count(buf + i, length - i, delimiter);
+}
+
+__attribute__((target("avx2")))
+static const char *
+avx2Find(const char * buf, size_t length, char delimiter)
+{
+	const __m256i needle = _mm256_set1_epi8(delimiter);
+	size_t i = 0;
+	for(; length - i >= 32; i += 32){
+		__m256i bytes = _mm256_loadu_si256((const __m256i *) (buf + i));
+		unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, needle));
+		if(mask != 0)
+			return buf + i + __builtin_ctz(mask);
+	}
+	return sse2Find(buf + i, length - i, delimiter);
+}
+
+__attribute__((target("avx2,popcnt")))
+static ssize_t
+avx2FindLast(const char * buf, size_t length, char delimiter, size_t * remaining)
+{
+	const __m256i needle = _mm256_set1_epi8(delimiter);
+	size_t i = length;
+	for(; i >= 32; i -= 32){
+		__m256i bytes = _mm256_loadu_si256((const __m256i *) (buf + i - 32));
+		unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, needle));
+		/* the whole block is passed, if the delimiter is not in it */
+		size_t matches = __builtin_popcount(mask);
+		if(matches < *remaining){
+			*remaining -= matches;
+			continue;
+		}
+		return lastOfMask(mask, i - 32, remaining);
+	}
+	return sse2FindLast(buf, i, delimiter, remaining);
+}
+
+#endif /* SCAN_X86 */
+
+/* the fastest kernels first */
+static const struct scanKernel kernels[] = {
+#ifdef SCAN_X86
+	{ "avx2", avx2Supported, avx2Count, avx2Find, avx2FindLast },
+	{ "sse2", sse2Supported, sse2Count, sse2Find, sse2FindLast },
+#endif
+	{ "scalar", scalarSupported, scalarCount, scalarFind, scalarFindLast }
+};
+
+#define SCAN_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+/* chosen on the first call */
+static const struct scanKernel * kernel = NULL;
+
+int
+scanSelectKernel(const char * name)
+{
+	for(size_t i = 0; i < SCAN_KERNELS; i++){
+		if(name != NULL && strcmp(name, kernels[i].name) != 0)
+			continue;
+		if(!kernels[i].supported()){
+			if(name == NULL)
+				continue;
+			break;
+		}
+		kernel = &kernels[i];
+		return 0;
+	}
+	errno = ENOTSUP;
+	return -1;
+}
+
+static inline const struct scanKernel *
+currentKernel(void)
+{
+	/* the scalar kernel is always supported */
+	if(kernel == NULL)
+		scanSelectKernel(NULL);
+	return kernel;
+}
+
+const char *
+scanKernelName(void)
+{
+	return currentKernel()->name;
+}
+
+size_t
+scanCount(const char * buf, size_t length, char delimiter)
+{
+	return currentKernel()->count(buf, length, delimiter);
+}
+
+const char *
+scanFind(const char * buf, size_t length, char delimiter)
+{
+	return currentKernel()->find(buf, length, delimiter);
+}
+
+ssize_t
+scanFindLast(const char * buf, size_t length, char delimiter, size_t n, size_t * found)
+{
+	size_t remaining = n;
+	ssize_t position = -1;
+	if(n > 0)
+		position = currentKernel()->findLast(buf, length, delimiter, &remaining);
+	if(found != NULL)
+		*found = n - remaining;
+	return position;
+}
+
+size_t
+scanRemove(char * buf, size_t length, char delimiter)
+{
+	/* almost always there is none, and nothing is copied */
+	const char * first = scanFind(buf, length, delimiter);
+	if(first == NULL)
+		return length;
+
+	/* the bytes between two delimiters are moved to the front */
+	size_t kept = first - buf;
+	size_t position = kept + 1;
+	while(position < length){
+		const char * next = scanFind(buf + position, length - position, delimiter);
+		size_t run = ((next != NULL) ? (size_t) (next - buf) : length) - position;
+		memmove(buf + kept, buf + position, run);
+		kept += run;
+		position += run + 1;
+	}
+	return kept;
+}
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
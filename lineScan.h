@@ -0,0 +1,40 @@
+/* lineScan.h
+
+[back-end and front-end] Counting and locating delimiters (newlines) in a
+buffer with SIMD instructions (AVX2 or SSE2, chosen at runtime) and a scalar
+fallback
+
+*/
+
+#ifndef LINESCAN_H /* header guard */
+#define LINESCAN_H
+
+#include <sys/types.h>	/* size_t, ssize_t */
+
+/* number of bytes of buf equal to delimiter */
+size_t scanCount(const char * buf, size_t length, char delimiter);
+
+/* first byte of buf equal to delimiter, NULL if there is none (like
+memchr()) */
+const char * scanFind(const char * buf, size_t length, char delimiter);
+
+/* position in buf of the n-th delimiter (n >= 1) counted from the end of
+buf. Returns -1 if buf has less than n delimiters, then *found (if not NULL)
+is the number of delimiters in buf */
+ssize_t scanFindLast(const char * buf, size_t length, char delimiter, size_t n, size_t * found);
+
+/* remove every byte of buf equal to delimiter, the other bytes keep their
+order. Returns the new length of buf */
+size_t scanRemove(char * buf, size_t length, char delimiter);
+
+/* use the kernel called name ("scalar", "sse2" or "avx2"), or the fastest
+one supported by the CPU if name is NULL (the default). Returns 0 on success
+and -1 if the kernel is not supported by the CPU (errno = ENOTSUP) */
+int scanSelectKernel(const char * name);
+
+/* name of the kernel in use */
+const char * scanKernelName(void);
+
+#endif
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
@@ -0,0 +1,75 @@
+/* mpscQueue.c
+
+[back-end] Lock-free queue with many producers and a single consumer.
+
+The elements form a singly linked list from tail (the oldest one) to head
+(the newest one). A producer swaps head with its node in a single atomic
+exchange, and only then links the previous head to it: the producers never
+wait for each other or for the consumer, and a producer preempted between
+the two steps only delays the consumer, which sees the end of the list until
+the link is written.
+
+The consumer owns tail. The list always holds at least one node, the stub:
+when the last real node is popped, the stub is pushed behind it so that head
+never has to be changed by the consumer.
+
+(Dmitry Vyukov's intrusive MPSC queue)
+
+*/
+
+#include "basics.h"
+#include "mpscQueue.h"
+
+void
+mpscInit(struct mpscQueue * queue)
+{
+	queue->stub.next = NULL;
+	queue->head = &queue->stub;
+	queue->tail = &queue->stub;
+}
+
+void
+mpscPush(struct mpscQueue * queue, struct mpscNode * node)
+{
+	__atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+	struct mpscNode * previous = __atomic_exchange_n(&queue->head, node, __ATOMIC_ACQ_REL);
+	/* the node is visible to the consumer from now on */
+	__atomic_store_n(&previous->next, node, __ATOMIC_RELEASE);
+}
+
+struct mpscNode *
+mpscPop(struct mpscQueue * queue)
+{
+	struct mpscNode * tail = queue->tail;
+	struct mpscNode * next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	/* skip the stub */
+	if(tail == &queue->stub){
+		if(next == NULL)
+			return NULL;
+		queue->tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+
+	if(next != NULL){
+		queue->tail = next;
+		return tail;
+	}
+
+	/* tail is the last node linked, a producer is between its exchange and
+	its link */
+	if(tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	/* tail is the last node, put the stub behind it before removing it */
+	mpscPush(queue, &queue->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if(next != NULL){
+		queue->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
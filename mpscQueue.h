@@ -0,0 +1,35 @@
+/* mpscQueue.h
+
+[back-end] Lock-free queue with many producers and a single consumer (MPSC),
+used by the threads of the threaded server mode
+
+*/
+
+#ifndef MPSCQUEUE_H /* header guard */
+#define MPSCQUEUE_H
+
+/* the first member of every element of a queue, the elements are not copied */
+struct mpscNode {
+	struct mpscNode * next;
+};
+
+struct mpscQueue {
+	struct mpscNode * head;		/* last element pushed, changed by the producers */
+	struct mpscNode * tail;		/* next element popped, only used by the consumer */
+	struct mpscNode stub;		/* keeps the queue from ever being empty */
+};
+
+void mpscInit(struct mpscQueue * queue);
+
+/* append node, any thread can push at any time. It never blocks and never
+fails */
+void mpscPush(struct mpscQueue * queue, struct mpscNode * node);
+
+/* remove the oldest node, only one thread (the consumer) may pop. Returns NULL
+if the queue is empty, or if a producer has not finished its push yet (then
+the consumer is woken up again by that producer after its push) */
+struct mpscNode * mpscPop(struct mpscQueue * queue);
+
+#endif
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
@@ -0,0 +1,279 @@
+/* profiler.c
+
+In-process sampling profiler.
+
+Profiling the daemon with external tools is awkward, since every client is
+handled by two short-lived processes with their own PID. With 'PROFILER on' in
+server.config every process of the daemon arms an interval timer (ITIMER_PROF,
+which only runs while the process uses CPU), and on every SIGPROF the stack of
+the process is stored in a buffer shared by all processes (MAP_SHARED memory is
+inherited through fork()). The samples of all processes are therefore
+aggregated in one place and can be dumped as folded stacks at any time by
+sending SIGUSR2 to the listening process:
+
+	$ kill -USR2 <pid of papayachatd>
+	$ flamegraph.pl /var/lib/papayachat/papayachat.folded > papayachat.svg
+
+Frames of functions which are not exported (static functions) are written as
+'binary+0xoffset', profiling/symbolizeFolded.sh resolves them with addr2line.
+
+*/
+
+#include <signal.h>
+#include <sys/time.h>	/* setitimer() */
+#include <sys/mman.h>	/* shared memory */
+#include <execinfo.h>	/* backtrace() */
+#include <stdint.h>
+
+#include "basics.h"
+#include "profiler.h"
+#include "CONFIG.h"	/* PROFILER_FREQUENCY, PROFILER_MAX_STACKS, PROFILER_MAX_DEPTH */
+
+/* frames of the stack that belong to the signal handler itself (the handler
+and the signal trampoline of the kernel), they are not stored */
+#define PROFILER_SKIP_FRAMES 2
+
+/* max. number of slots probed to find the slot of a stack */
+#define PROFILER_MAX_PROBES 64
+
+/* a unique stack and the amount of times it was sampled */
+struct stackSlot {
+	uint64_t hash;		/* 0 means that the slot is empty */
+	unsigned long count;
+	int ready;			/* frames are valid, set after the frames were copied */
+	int depth;
+	void * frames[PROFILER_MAX_DEPTH];
+};
+
+/* buffer shared by all processes of the daemon */
+struct profilerBuffer {
+	unsigned long samples;
+	unsigned long dropped;	/* samples lost, because the buffer was full */
+	struct stackSlot slots[PROFILER_MAX_STACKS];
+};
+
+/* NULL if the profiler is not being used */
+static struct profilerBuffer * buffer = NULL;
+
+/* set by the SIGUSR2 handler */
+static volatile sig_atomic_t dumpRequested = 0;
+
+/* FNV-1a hash of the return addresses of a stack */
+static uint64_t
+hashStack(void ** frames, int depth)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for(int i=0;i<depth;i++){
+		uintptr_t address = (uintptr_t) frames[i];
+		for(size_t byte=0;byte<sizeof(address);byte++){
+			hash ^= (address >> (byte * 8)) & 0xff;
+			hash *= 1099511628211ULL;
+		}
+	}
+
+	/* 0 is reserved for empty slots */
+	return (hash == 0) ? 1 : hash;
+}
+
+/* SIGPROF handler, only atomic operations on the shared buffer are used, so
+that processes never wait for each other (and the handler is async-safe,
+backtrace() was already called once in profilerInit(), so that it does not
+need to load libgcc inside the signal handler) */
+static void
+sampleHandler(int sig)
+{
+	int savedErrno = errno;
+
+	void * frames[PROFILER_MAX_DEPTH + PROFILER_SKIP_FRAMES];
+	int depth = backtrace(frames, PROFILER_MAX_DEPTH + PROFILER_SKIP_FRAMES) - PROFILER_SKIP_FRAMES;
+	if(depth <= 0){
+		errno = savedErrno;
+		return;
+	}
+	void ** stack = &frames[PROFILER_SKIP_FRAMES];
+
+	__atomic_add_fetch(&buffer->samples, 1, __ATOMIC_RELAXED);
+
+	uint64_t hash = hashStack(stack, depth);
+
+	/* open addressing with linear probing */
+	for(int probe=0;probe<PROFILER_MAX_PROBES;probe++){
+		struct stackSlot * slot = &buffer->slots[(hash + probe) % PROFILER_MAX_STACKS];
+
+		uint64_t current = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+		if(current == 0){
+			uint64_t empty = 0;
+			/* try to claim the empty slot, another process might be faster */
+			if(__atomic_compare_exchange_n(&slot->hash, &empty, hash, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+				memcpy(slot->frames, stack, depth * sizeof(void *));
+				slot->depth = depth;
+				__atomic_store_n(&slot->ready, 1, __ATOMIC_RELEASE);
+				__atomic_add_fetch(&slot->count, 1, __ATOMIC_RELAXED);
+				errno = savedErrno;
+				return;
+			}
+			current = empty;	/* hash stored by the other process */
+		}
+
+		/* the same stack was already sampled (64-bit hashes, collisions
+		are ignored) */
+		if(current == hash){
+			__atomic_add_fetch(&slot->count, 1, __ATOMIC_RELAXED);
+			errno = savedErrno;
+			return;
+		}
+	}
+
+	__atomic_add_fetch(&buffer->dropped, 1, __ATOMIC_RELAXED);
+	errno = savedErrno;
+}
+
+static void
+dumpHandler(int sig)
+{
+	dumpRequested = 1;
+}
+
+int
+profilerArmProcess(void)
+{
+	/* profiler not initialized, nothing to do */
+	if(buffer == NULL)
+		return 0;
+
+	struct itimerval timer;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 1000000 / PROFILER_FREQUENCY;
+	timer.it_value = timer.it_interval;
+
+	return setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+int
+profilerInit(void)
+{
+	buffer = mmap(NULL, sizeof(struct profilerBuffer), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(buffer == MAP_FAILED){
+		buffer = NULL;
+		return -1;
+	}
+
+	/* the first call to backtrace() loads libgcc, it must happen outside of
+	the signal handler */
+	void * warmUp[PROFILER_MAX_DEPTH];
+	backtrace(warmUp, PROFILER_MAX_DEPTH);
+
+	struct sigaction sa_sigprof;
+	if(sigemptyset(&sa_sigprof.sa_mask)==-1)
+		return -1;
+	/* SIGPROF should never make a syscall fail with EINTR */
+	sa_sigprof.sa_flags = SA_RESTART;
+	sa_sigprof.sa_handler = sampleHandler;
+	if(sigaction(SIGPROF, &sa_sigprof, NULL)==-1)
+		return -1;
+
+	return profilerArmProcess();
+}
+
+int
+profilerConfigureDumpSignal(void)
+{
+	struct sigaction sa_sigusr2;
+	if(sigemptyset(&sa_sigusr2.sa_mask)==-1)
+		return -1;
+	/* accept() is interrupted (EINTR), so that the listening process can
+	dump the samples right away */
+	sa_sigusr2.sa_flags = 0;
+	sa_sigusr2.sa_handler = dumpHandler;
+	if(sigaction(SIGUSR2, &sa_sigusr2, NULL)==-1)
+		return -1;
+
+	return 0;
+}
+
+int
+profilerDumpRequested(void)
+{
+	if(!dumpRequested)
+		return 0;
+
+	dumpRequested = 0;
+	return 1;
+}
+
+/* write the name of a frame: the function name if it is exported, otherwise
+'binary+0xoffset'. backtrace_symbols() returns strings with the format
+'path(function+0xoffset) [0xaddress]' or 'path(+0xoffset) [0xaddress]' */
+static void
+writeFrame(FILE * fs, const char * symbol)
+{
+	const char * open = strchr(symbol, '(');
+	const char * plus = (open != NULL) ? strchr(open, '+') : NULL;
+	const char * close = (open != NULL) ? strchr(open, ')') : NULL;
+
+	if(open == NULL || plus == NULL || close == NULL){
+		fputs(symbol, fs);
+		return;
+	}
+
+	/* exported function */
+	if(plus > open + 1){
+		fwrite(open + 1, 1, plus - open - 1, fs);
+		return;
+	}
+
+	/* basename of the binary plus offset */
+	const char * name = symbol;
+	for(const char * c = symbol; c < open; c++){
+		if(*c == '/')
+			name = c + 1;
+	}
+	fwrite(name, 1, open - name, fs);
+	fwrite(plus, 1, close - plus, fs);
+}
+
+int
+profilerDump(const char * pathname)
+{
+	if(buffer == NULL){
+		errno = EINVAL;
+		return -1;
+	}
+
+	FILE * fs = fopen(pathname, "w");
+	if(fs == NULL)
+		return -1;
+
+	int stacks = 0;
+	for(int i=0;i<PROFILER_MAX_STACKS;i++){
+		struct stackSlot * slot = &buffer->slots[i];
+		if(!__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE))
+			continue;
+
+		char ** symbols = backtrace_symbols(slot->frames, slot->depth);
+		if(symbols == NULL){
+			fclose(fs);
+			return -1;
+		}
+
+		/* folded stacks start with the outermost frame */
+		for(int frame=slot->depth-1;frame>=0;frame--){
+			writeFrame(fs, symbols[frame]);
+			if(frame > 0)
+				fputc(';', fs);
+		}
+		fprintf(fs, " %lu\n", __atomic_load_n(&slot->count, __ATOMIC_RELAXED));
+
+		free(symbols);
+		stacks++;
+	}
+
+	if(fclose(fs) == EOF)
+		return -1;
+
+	return stacks;
+}
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
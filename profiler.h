@@ -0,0 +1,34 @@
+/* profiler.h
+
+In-process sampling profiler for the daemon and all its child processes
+
+*/
+
+#ifndef PROFILER_H	/* header guard */
+#define PROFILER_H
+
+/* create the shared sample buffer and start sampling the calling process,
+it should be called once by the listening process before any fork(),
+returns 0 on success and -1 on error */
+int profilerInit(void);
+
+/* interval timers are not inherited through fork(), every new child process
+has to call this function to be sampled as well, it does nothing if the
+profiler was not initialized. Returns 0 on success and -1 on error */
+int profilerArmProcess(void);
+
+/* configure SIGUSR2 to request a dump of the samples, returns 0 on success
+and -1 on error */
+int profilerConfigureDumpSignal(void);
+
+/* returns 1 if a dump was requested with SIGUSR2 since the last call */
+int profilerDumpRequested(void);
+
+/* write all samples collected so far by all processes as folded stacks
+(one line per stack 'outer;...;inner count', the input of flamegraph.pl)
+to pathname, returns the number of stacks written or -1 on error */
+int profilerDump(const char * pathname);
+
+#endif
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
@@ -1,29 +1,189 @@
 /* C_Server.c
 
-Back-end server profilling 
+Back-end server profilling
+
+Reference implementation of the multi-process architecture of papayachatd,
+reduced to the semantics that matter for the benchmark (see
+profiling/broadcastBench):
+
+- every client is authenticated with a KEY_LENGTH bytes long key, which is
+read from a key file with the same format as /etc/papayachat/key
+- every message received from a client is appended to the chatlog, holding an
+exclusive flock() on the chatlog
+- every process handling a client is woken up with SIGUSR1 after a message was
+appended, and sends everything new in the chatlog to its client (broadcast)
+
+Every client is handled by two processes, like in papayachatd: one receives
+messages and appends them to the chatlog, the other one sends the new content
+of the chatlog to the client.
+
+Usage: ./server.bin -k <key file> [-p <port>] [-l <chatlog>]
 
 */
 #include <signal.h>				/* check 'man 2 sigaction' signal.h is needed
 								to change the disposition of signals with
-								the sigaction() syscall */	
+								the sigaction() syscall */
 #include <sys/wait.h>
 /* libraries needed to print the pid of a process, */
 #include <sys/types.h>
+#include <sys/file.h>			/* flock() */
+#include <fcntl.h>
 #include <unistd.h>
 #include "inet_sockets.h"       /* Declarations of inet*() socket functions */
 #include "basics.h"
 #include "signalHandling.h"		/* signal handlers library */
 
-#define BACKLOG_QUEUE 200		
+#define BACKLOG_QUEUE 200
 
 /* bytes transmission size, defined in CONFIG.h
 to share the value between multiple files */
-#define BUF_SIZE 4096 
+#define BUF_SIZE 4096
+
+/* length of the auth key, same value as in CONFIG.h */
+#define KEY_LENGTH 128
+
+/* time in seconds that a client has to send the key */
+#define AUTH_TIMEOUT 1
+
+/* default values, if no flag is present */
+#define DEFAULT_PORT "50000"
+#define DEFAULT_CHATLOG "./chat_log.chat"
+
+/* parse the key out of a key file, the key is in the line starting with
+'KEY ' (lines starting with '#' are comments), returns 0 on success and -1
+on error */
+static int
+readKeyFile(const char * pathname, char * key)
+{
+	FILE * fs = fopen(pathname, "r");
+	if(fs == NULL)
+		return -1;
+
+	char line[BUF_SIZE];
+	int found = -1;
+	while(fgets(line, sizeof(line), fs) != NULL){
+		if(strncmp(line, "KEY ", 4) != 0)
+			continue;
+		/* the key might be shorter than KEY_LENGTH, the rest of the key
+		stays 0, exactly like in the client */
+		memset(key, 0, KEY_LENGTH);
+		size_t length = strcspn(line + 4, " \t\n");
+		if(length > KEY_LENGTH)
+			length = KEY_LENGTH;
+		memcpy(key, line + 4, length);
+		found = 0;
+		break;
+	}
+
+	fclose(fs);
+	if(found == -1)
+		errno = EINVAL;
+	return found;
+}
+
+/* SIGALRM handler, its only purpose is to interrupt read() during the auth */
+static void
+authTimeout(int sig)
+{
+}
+
+/* read the key from the client, returns 0 if the client sent the correct key
+and -1 otherwise (wrong key, timeout or error) */
+static int
+authClient(int client_fd, const char * key)
+{
+	struct sigaction sa_alarm;
+	sigemptyset(&sa_alarm.sa_mask);
+	/* no SA_RESTART, read() should be interrupted by the timeout */
+	sa_alarm.sa_flags = 0;
+	sa_alarm.sa_handler = authTimeout;
+	if(sigaction(SIGALRM, &sa_alarm, NULL) == -1)
+		errExit("sigaction(SIGALRM)");
+
+	char buf[KEY_LENGTH];
+	size_t total = 0;
+
+	alarm(AUTH_TIMEOUT);
+	while(total < KEY_LENGTH){
+		ssize_t numRead = read(client_fd, buf + total, KEY_LENGTH - total);
+		if(numRead <= 0)
+			break;	/* EOF, error or timeout (EINTR) */
+		total += numRead;
+	}
+	alarm(0);
+
+	if(total != KEY_LENGTH)
+		return -1;
+
+	return (memcmp(buf, key, KEY_LENGTH) == 0) ? 0 : -1;
+}
+
+/* SIGUSR1 handler of the processes handling a client, it only interrupts
+sigsuspend() */
+static void
+wakeUp(int sig)
+{
+}
+
+/* write all bytes in buf to fd, returns -1 on error */
+static int
+writeAll(int fd, const char * buf, size_t length)
+{
+	while(length > 0){
+		ssize_t numWritten = write(fd, buf, length);
+		if(numWritten == -1){
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += numWritten;
+		length -= numWritten;
+	}
+	return 0;
+}
+
+/* send everything new in the chatlog (starting at offset) to the client,
+after every SIGUSR1. pread() is used, so that the offset of the chatlog fd
+(shared by all processes) is never used */
+static void
+sendMessages(int client_fd, int chatlog_fd)
+{
+	char * buf = (char *) malloc(BUF_SIZE);
+	if(buf == NULL)
+		errExit("malloc failed.");
+
+	/* SIGUSR1 is blocked and only unblocked atomically by sigsuspend(), so
+	that no SIGUSR1 is lost between reading until EOF and going to sleep */
+	sigset_t blocked, waitMask;
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGUSR1);
+	if(sigprocmask(SIG_BLOCK, &blocked, &waitMask) == -1)
+		errExit("sigprocmask()");
+	sigdelset(&waitMask, SIGUSR1);
 
+	/* only messages sent after the connection was established are sent */
+	off_t offset = lseek(chatlog_fd, 0, SEEK_END);
+	if(offset == -1)
+		errExit("lseek()");
+
+	for(;;){
+		ssize_t numRead;
+		while((numRead = pread(chatlog_fd, buf, BUF_SIZE, offset)) > 0){
+			if(writeAll(client_fd, buf, numRead) == -1)
+				_exit(EXIT_SUCCESS);	/* client is gone */
+			offset += numRead;
+		}
+		if(numRead == -1)
+			errExit("pread()");
+
+		sigsuspend(&waitMask);	/* wait for SIGUSR1 */
+	}
+}
 
-/* receive messages from client and write them exclusively to STDOUT */
-static void 
-receiveMessages(int client_fd)
+/* receive messages from client, append them exclusively to the chatlog and
+wake up all processes sending messages to clients */
+static void
+receiveMessages(int client_fd, int chatlog_fd)
 {
 	char * buf = (char *) malloc(BUF_SIZE);
 	/* if malloc fails, it returns a NULL pointer */
@@ -33,54 +193,114 @@ receiveMessages(int client_fd)
 
 	for(;;) {
     	ssize_t numRead;
-		/* allocate memory on each for-loop to read message
-		from pipe */
 
 		/* if the client closes its connection, the previous read() syscall will get an
-		EOF, and it will return 0, in that case, the while-loop ends, and there is no 
-		syslog error appended to the log, since read() did not return an error */  
+		EOF, and it will return 0, in that case, the while-loop ends */
 		if ((numRead = read(client_fd, buf, BUF_SIZE)) > 0) {
-			/* add debug info to see amount of bytes received from client */
-			printf("%ld Bytes received from client.", numRead);
+			if(flock(chatlog_fd, LOCK_EX) == -1)
+				errExit("flock(LOCK_EX)");
+			/* the chatlog is opened with O_APPEND */
+			if(writeAll(chatlog_fd, buf, numRead) == -1)
+				errExit("write() chatlog");
+			if(flock(chatlog_fd, LOCK_UN) == -1)
+				errExit("flock(LOCK_UN)");
 
-			/* print message received to STDOUT */
-			printf("%s", buf);
+			/* wake up every process of the server (process group) */
+			if(kill(0, SIGUSR1) == -1)
+				errExit("kill(SIGUSR1)");
 		} // read()
 
 		if (numRead == -1) {
-			errExit("read() failed.");
+			if(errno == EINTR)
+				continue;
+			break;	/* e.g. connection reset by peer */
 		}
 
 		/* EOF - client closed socket */
 		if (numRead == 0){
-			puts("Received EOF from client!");
 			break; /* break out of for-loop after EOF */
 		}
 	}//infinite for-loop
 
 	/* free resources */
 	free(buf);
+}
 
-	/* kill  receiveMessages() child process, after this command, all child processes created for
-	a particular client should be gone!! this fixes the bug present in pre-release v0.1.0-alpha */
-	_exit(EXIT_SUCCESS);
+/* handle a client in two processes, the child sends the chatlog to the client,
+the parent receives messages from the client */
+static void
+handleClient(int client_fd, int chatlog_fd)
+{
+	pid_t sender = fork();
+	switch (sender) {
+	case -1:
+		errExit("fork() sender");
 
-}
+	case 0:
+		sendMessages(client_fd, chatlog_fd);
+		_exit(EXIT_SUCCESS);
 
+	default:
+		receiveMessages(client_fd, chatlog_fd);
+		/* the client closed the connection, terminate the sender as well */
+		kill(sender, SIGTERM);
+		_exit(EXIT_SUCCESS);
+	}
+}
 
 int
 main(int argc, char *argv[])
 {
     int listen_fd, client_fd;	/* server listening socket and client socket */
-	
+	const char * port = DEFAULT_PORT;
+	const char * chatlogPath = DEFAULT_CHATLOG;
+	const char * keyPath = NULL;
+
+	int opt;
+	while((opt = getopt(argc, argv, "p:l:k:")) != -1){
+		switch(opt){
+		case 'p':
+			port = optarg;
+			break;
+		case 'l':
+			chatlogPath = optarg;
+			break;
+		case 'k':
+			keyPath = optarg;
+			break;
+		default:
+			usageErr("%s -k <key file> [-p <port>] [-l <chatlog>]\n", argv[0]);
+		}
+	}
+	if(keyPath == NULL)
+		usageErr("%s -k <key file> [-p <port>] [-l <chatlog>]\n", argv[0]);
+
+	char key[KEY_LENGTH];
+	if(readKeyFile(keyPath, key) == -1)
+		errExit("readKeyFile(%s)", keyPath);
+
+	/* every process of the server is woken up with kill(0, SIGUSR1), so the
+	server needs its own process group (fails harmlessly, if the server
+	already leads a process group) */
+	setpgid(0, 0);
+
+	/* SIGUSR1 is only relevant for the processes sending messages, which
+	block it before it can arrive. All other processes have to ignore it */
+	if(signal(SIGUSR1, SIG_IGN) == SIG_ERR)
+		errExit("signal(SIGUSR1)");
+
+	int chatlog_fd = open(chatlogPath, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+	if(chatlog_fd == -1)
+		errExit("open(%s)", chatlogPath);
+
 	/* configure signal handling for SIGCHLD */
 	if(configureSignalDisposition()==-1){
         errExit("[ERROR] Error: configureSignalDisposition()");
 	}
 
-	/* server listens on port, with a certain BACKLOG_QUEUE, and does not want to 
+	/* server listens on port, with a certain BACKLOG_QUEUE, and does not want to
 	receive information about the address of the client socket (NULL) */
-    listen_fd = serverListen("50000", BACKLOG_QUEUE, NULL);
+    listen_fd = serverListen(port, BACKLOG_QUEUE, NULL);
     if (listen_fd == -1) {
 		/* The listening socket could not be created. */
         errExit("[ERROR] Could not create server listening socket");
@@ -88,18 +308,21 @@ main(int argc, char *argv[])
 		the program is not run with sudo rights */
     }
 
-	puts("[DEBUG] Server is listening on incomming connections.");
+	printf("[DEBUG] Server is listening on port %s.\n", port);
+	fflush(stdout);
 
     for (;;) {
         client_fd = accept(listen_fd, NULL, NULL);  /* Wait for connection from client */
         if (client_fd == -1) {
+			if (errno == EINTR)
+				continue;
             errExit("[ERROR] Failure in accept()");
        }
-	
+
         /* Multi-process server back-end architecture:
 		Handle each client request in a new child process */
         switch (fork()) {
-		/* an error occured with fork() syscall, no children were created, this error is still handled 
+		/* an error occured with fork() syscall, no children were created, this error is still handled
 		by the parent process */
         case -1:
             errExit("[ERROR] Error fork() call. Can't create child.");
@@ -107,20 +330,25 @@ main(int argc, char *argv[])
             break;                      /* May be temporary; try next client */
 
 		/* Child process (returns 0) */
-        case 0:                       			
-            puts("[DEBUG] Child process initialized (handling client connection)");
+        case 0:
             close(listen_fd);           /* Unneeded copy of listening socket */
-            receiveMessages(client_fd);	/* receiveMessages() needs to have the client_fd as
-										an input parameter, because it would otherwise not know
-										to which and from which file descriptor to perform
-										write and read calls */
-			puts("[DEBUG] Child process terminated.");
+			/* the sender needs a handler, an ignored SIGUSR1 would never
+			interrupt sigsuspend() */
+			struct sigaction sa_sigusr1;
+			sigemptyset(&sa_sigusr1.sa_mask);
+			sa_sigusr1.sa_flags = SA_RESTART;
+			sa_sigusr1.sa_handler = wakeUp;
+			if(sigaction(SIGUSR1, &sa_sigusr1, NULL) == -1)
+				errExit("sigaction(SIGUSR1)");
+			if(authClient(client_fd, key) == -1)
+				_exit(EXIT_FAILURE);	/* wrong key or timeout */
+            handleClient(client_fd, chatlog_fd);
             _exit(EXIT_SUCCESS);		/* child processes should generally only call _exit();
 										for a more general discussion about the topic check
 										25.4 'The Linux Programming Interface' */
 
 	 	/* Parent: fork() actually returns the PID of the newly created child process */
-        default:                       
+        default:
             close(client_fd);           /* Unneeded copy of connected socket */
             break;                      /* Loop to accept next connection */
         } // end switch-case after fork()
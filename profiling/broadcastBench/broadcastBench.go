@@ -0,0 +1,361 @@
+// broadcastBench measures a papayaChat server (papayachatd, or the reference
+// servers in profiling/C_Server and profiling/goServer) with the workload of
+// a chat: N clients authenticate with the key, every client sends messages at
+// a fixed rate and every message is broadcast to all N clients.
+//
+// For every number of clients it writes one line to stdout (tab-separated):
+//
+//	# server clients sent_per_s delivered_per_s p50_us p90_us p99_us p999_us max_us cpu_pct
+//
+// The latency is measured from the moment a message is written by its sender
+// until it is read by each receiver (both run in this process, so they share
+// the same clock). The CPU load is the CPU time used by the whole process tree
+// of the server (-pid) during the measurement, in % of one core.
+//
+// papayachatd expects a hello line after the key (-hello JOIN), it answers
+// with the offset and the last lines of the chat log, which may contain
+// messages of previous runs: only the messages sent during the current run
+// are counted.
+package main
+
+import (
+	"bufio"
+	"errors"
+	"flag"
+	"fmt"
+	"log"
+	"net"
+	"os"
+	"path/filepath"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+)
+
+const (
+	// keyLength, length of the auth key, same value as in CONFIG.h
+	keyLength = 128
+)
+
+// configValues, parsed from the flags
+type configValues struct {
+	addr     string
+	keyFile  string
+	pid      int
+	label    string
+	hello    string
+	clients  []int
+	duration time.Duration
+	settle   time.Duration
+	rate     int
+	size     int
+}
+
+// result of a single run
+type result struct {
+	sent      int
+	delivered int
+	latencies []time.Duration
+	cpu       time.Duration
+}
+
+func main() {
+	cfg := new(configValues)
+	var clients string
+	flag.StringVar(&cfg.addr, "addr", "localhost:50000", "Address of the server")
+	flag.StringVar(&cfg.keyFile, "key", "../../etc/key", "File with the auth key (format of /etc/papayachat/key)")
+	flag.IntVar(&cfg.pid, "pid", 0, "PID of the root of the process tree of the server (CPU load is not measured if 0)")
+	flag.StringVar(&cfg.label, "label", "server", "Name of the server in the output")
+	flag.StringVar(&cfg.hello, "hello", "", "Hello line sent after the key (e.g. JOIN for papayachatd), none if empty")
+	flag.StringVar(&clients, "clients", "1,2,4,8,16,32,64", "Comma-separated numbers of concurrent clients")
+	flag.DurationVar(&cfg.duration, "duration", 10*time.Second, "Duration of every run")
+	flag.DurationVar(&cfg.settle, "settle", time.Second, "Pause after connecting and after every run")
+	flag.IntVar(&cfg.rate, "rate", 50, "Messages per second sent by every client")
+	flag.IntVar(&cfg.size, "size", 64, "Size of every message in bytes (including the newline)")
+	flag.Parse()
+
+	errorLog := log.New(os.Stderr, "ERROR\t", log.Ldate|log.Ltime|log.Lshortfile)
+
+	for _, field := range strings.Split(clients, ",") {
+		n, err := strconv.Atoi(strings.TrimSpace(field))
+		if err != nil || n < 1 {
+			errorLog.Fatalf("invalid number of clients: %q", field)
+		}
+		cfg.clients = append(cfg.clients, n)
+	}
+	if cfg.size < 48 {
+		errorLog.Fatal("-size must be at least 48 bytes")
+	}
+
+	key, err := readKeyFile(cfg.keyFile)
+	if err != nil {
+		errorLog.Fatal(err)
+	}
+
+	fmt.Println("# server\tclients\tsent_per_s\tdelivered_per_s\tp50_us\tp90_us\tp99_us\tp999_us\tmax_us\tcpu_pct")
+	for _, n := range cfg.clients {
+		res, err := run(cfg, key, n)
+		if err != nil {
+			errorLog.Fatal(err)
+		}
+		printResult(cfg, n, res)
+		// let the server clean up the connections of this run
+		time.Sleep(cfg.settle)
+	}
+}
+
+// readKeyFile, parse the key out of the line starting with 'KEY '. A key
+// shorter than keyLength is padded with 0, exactly like in the client
+func readKeyFile(path string) ([]byte, error) {
+	f, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+
+	scanner := bufio.NewScanner(f)
+	for scanner.Scan() {
+		fields := strings.Fields(scanner.Text())
+		if len(fields) < 2 || fields[0] != "KEY" {
+			continue
+		}
+		key := make([]byte, keyLength)
+		copy(key, fields[1])
+		return key, nil
+	}
+	if err := scanner.Err(); err != nil {
+		return nil, err
+	}
+	return nil, errors.New("no KEY found in " + path)
+}
+
+// run, connect n clients, let every client send messages for cfg.duration and
+// collect the latency of every message received by every client
+func run(cfg *configValues, key []byte, n int) (*result, error) {
+	conns := make([]net.Conn, n)
+	for i := range conns {
+		conn, err := net.Dial("tcp", cfg.addr)
+		if err != nil {
+			return nil, err
+		}
+		defer conn.Close()
+		if _, err := conn.Write(key); err != nil {
+			return nil, err
+		}
+		if cfg.hello != "" {
+			if _, err := conn.Write([]byte(cfg.hello + "\n")); err != nil {
+				return nil, err
+			}
+		}
+		conns[i] = conn
+	}
+	// the server does not acknowledge the key, wait until all clients are
+	// ready to receive messages
+	time.Sleep(cfg.settle)
+
+	res := new(result)
+	var mu sync.Mutex
+	var readers sync.WaitGroup
+	var writers sync.WaitGroup
+
+	cpuStart, err := treeCPUTime(cfg.pid)
+	if err != nil {
+		return nil, err
+	}
+	start := time.Now()
+	stop := start.Add(cfg.duration)
+
+	for id, conn := range conns {
+		readers.Add(1)
+		go func(conn net.Conn) {
+			defer readers.Done()
+			latencies, delivered := receive(conn, start)
+			mu.Lock()
+			res.latencies = append(res.latencies, latencies...)
+			res.delivered += delivered
+			mu.Unlock()
+		}(conn)
+
+		writers.Add(1)
+		go func(id int, conn net.Conn) {
+			defer writers.Done()
+			sent := send(cfg, conn, id, stop)
+			mu.Lock()
+			res.sent += sent
+			mu.Unlock()
+		}(id, conn)
+	}
+
+	writers.Wait()
+	cpuEnd, err := treeCPUTime(cfg.pid)
+	if err != nil {
+		return nil, err
+	}
+	res.cpu = cpuEnd - cpuStart
+
+	// messages still in flight are received until the end of the settle
+	// period, afterwards the readers are stopped
+	for _, conn := range conns {
+		conn.SetReadDeadline(time.Now().Add(cfg.settle))
+	}
+	readers.Wait()
+
+	return res, nil
+}
+
+// send, write a message every 1/rate seconds until stop. Every message is
+// 'id seq unix_ns padding\n', the messages of a client are sent at a fixed
+// rate (open loop), so a slow server builds up latency instead of reducing
+// the load
+func send(cfg *configValues, conn net.Conn, id int, stop time.Time) int {
+	interval := time.Second / time.Duration(cfg.rate)
+	ticker := time.NewTicker(interval)
+	defer ticker.Stop()
+
+	msg := make([]byte, 0, cfg.size)
+	sent := 0
+	for now := range ticker.C {
+		if now.After(stop) {
+			break
+		}
+		msg = msg[:0]
+		msg = strconv.AppendInt(msg, int64(id), 10)
+		msg = append(msg, ' ')
+		msg = strconv.AppendInt(msg, int64(sent), 10)
+		msg = append(msg, ' ')
+		msg = strconv.AppendInt(msg, time.Now().UnixNano(), 10)
+		msg = append(msg, ' ')
+		for len(msg) < cfg.size-1 {
+			msg = append(msg, 'x')
+		}
+		msg = append(msg, '\n')
+		if _, err := conn.Write(msg); err != nil {
+			break
+		}
+		sent++
+	}
+	return sent
+}
+
+// receive, read lines until the connection is closed or its read deadline
+// expires, returns the latency of every message sent after start and the
+// number of those messages
+func receive(conn net.Conn, start time.Time) ([]time.Duration, int) {
+	var latencies []time.Duration
+	reader := bufio.NewReader(conn)
+	for {
+		line, err := reader.ReadString('\n')
+		if err != nil {
+			return latencies, len(latencies)
+		}
+		now := time.Now()
+		fields := strings.Fields(line)
+		if len(fields) < 3 {
+			continue // not a message of this benchmark
+		}
+		ns, err := strconv.ParseInt(fields[2], 10, 64)
+		if err != nil || ns < start.UnixNano() {
+			continue // sent before this run (history of papayachatd)
+		}
+		latencies = append(latencies, now.Sub(time.Unix(0, ns)))
+	}
+}
+
+// treeCPUTime, CPU time used by all threads of pid and all its descendants.
+// The time is read from /proc/<pid>/task/<tid>/schedstat (in ns), utime and
+// stime in /proc/<pid>/stat are sampled at every clock tick and miss most of
+// the short bursts of CPU time of the processes of a chat server. Processes
+// that exit during a run are not counted, but no client disconnects during
+// the measurement
+func treeCPUTime(pid int) (time.Duration, error) {
+	if pid == 0 {
+		return 0, nil
+	}
+
+	// parent of every process
+	parents := make(map[int]int)
+	paths, err := filepath.Glob("/proc/[0-9]*/stat")
+	if err != nil {
+		return 0, err
+	}
+	for _, path := range paths {
+		data, err := os.ReadFile(path)
+		if err != nil {
+			continue // process exited in the meantime
+		}
+		// the name of the process (2nd field) may contain spaces, the
+		// other fields start after the last ')'
+		stat := string(data)
+		opening := strings.IndexByte(stat, '(')
+		closing := strings.LastIndexByte(stat, ')')
+		if opening == -1 || closing == -1 {
+			continue
+		}
+		id, err := strconv.Atoi(strings.TrimSpace(stat[:opening]))
+		if err != nil {
+			continue
+		}
+		// fields[0] is the state, fields[1] the ppid
+		fields := strings.Fields(stat[closing+1:])
+		if len(fields) < 2 {
+			continue
+		}
+		parents[id], _ = strconv.Atoi(fields[1])
+	}
+
+	if _, ok := parents[pid]; !ok {
+		return 0, fmt.Errorf("process %d does not exist", pid)
+	}
+
+	var cpu time.Duration
+	for id := range parents {
+		// walk up the tree until pid or the init process is found
+		ancestor := id
+		for ancestor > 1 && ancestor != pid {
+			ancestor = parents[ancestor]
+		}
+		if ancestor != pid {
+			continue
+		}
+		tasks, _ := filepath.Glob(fmt.Sprintf("/proc/%d/task/[0-9]*/schedstat", id))
+		for _, task := range tasks {
+			data, err := os.ReadFile(task)
+			if err != nil {
+				continue
+			}
+			// 1st field: time spent on the CPU in ns
+			fields := strings.Fields(string(data))
+			if len(fields) == 0 {
+				continue
+			}
+			ns, _ := strconv.ParseInt(fields[0], 10, 64)
+			cpu += time.Duration(ns)
+		}
+	}
+	return cpu, nil
+}
+
+// percentile of sorted latencies in microseconds
+func percentile(sorted []time.Duration, p float64) int64 {
+	if len(sorted) == 0 {
+		return 0
+	}
+	i := int(p * float64(len(sorted)-1))
+	return sorted[i].Microseconds()
+}
+
+func printResult(cfg *configValues, n int, res *result) {
+	sort.Slice(res.latencies, func(i, j int) bool { return res.latencies[i] < res.latencies[j] })
+	seconds := cfg.duration.Seconds()
+	cpu := -1.0
+	if cfg.pid != 0 {
+		cpu = 100 * res.cpu.Seconds() / seconds
+	}
+	fmt.Printf("%s\t%d\t%.1f\t%.1f\t%d\t%d\t%d\t%d\t%d\t%.1f\n", cfg.label, n,
+		float64(res.sent)/seconds, float64(res.delivered)/seconds,
+		percentile(res.latencies, 0.50), percentile(res.latencies, 0.90),
+		percentile(res.latencies, 0.99), percentile(res.latencies, 0.999),
+		percentile(res.latencies, 1), cpu)
+}
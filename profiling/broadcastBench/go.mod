@@ -0,0 +1,3 @@
+module github.com/erodrigufer/papayaChat/profiling/broadcastBench
+
+go 1.18
@@ -0,0 +1,76 @@
+#!/bin/bash
+
+# runBroadcastBench.sh builds the reference servers (profiling/C_Server and
+# profiling/goServer) and broadcastBench, and measures both servers with the
+# same workload, one after the other. The results of both servers are written
+# to a single tab-separated file.
+#
+# Usage: ./runBroadcastBench.sh [<flags passed to broadcastBench.bin>]
+# e.g.   ./runBroadcastBench.sh -clients 1,8,64 -duration 5s -rate 20
+#
+# Eduardo Rodriguez (@erodrigufer) (c) 2022.
+# Licensed under AGPLv3.
+
+###########################################################
+#User-defined variables####################################
+# Ports on which the reference servers listen.
+C_SERVER_PORT=50001
+GO_SERVER_PORT=50002
+# Key file used by the servers and the clients.
+KEY_FILE="$(pwd)/../../etc/key"
+# File with the results.
+RESULTS_FILE="./broadcastBench_$(date +%d_%m_%Y_%H%M%S).tsv"
+
+###########################################################
+#Global variables##########################################
+BENCH_EXECUTABLE="./broadcastBench.bin"
+C_SERVER_PATH="../C_Server"
+GO_SERVER_PATH="../goServer/server"
+# Temporary directory for the chatlogs of the servers.
+WORK_DIR=$(mktemp -d)
+###########################################################
+
+# stopServer, terminates the whole process group of a server.
+stopServer(){
+	local PID=$1
+	kill -TERM -- "-${PID}" 2> /dev/null || kill -TERM "${PID}" 2> /dev/null
+	wait "${PID}" 2> /dev/null
+}
+
+# benchServer, runs broadcastBench against a running server.
+benchServer(){
+	local LABEL=$1
+	local PORT=$2
+	local PID=$3
+	shift 3
+
+	# Wait until the server is listening.
+	sleep 1
+	echo "Measuring ${LABEL} (pid ${PID})..." 1>&2
+	${BENCH_EXECUTABLE} -addr "localhost:${PORT}" -key "${KEY_FILE}" \
+		-pid "${PID}" -label "${LABEL}" "$@"
+}
+
+make -s -C "${C_SERVER_PATH}" server || exit 1
+make -s -C "${GO_SERVER_PATH}" server || exit 1
+make -s bench || exit 1
+
+trap 'rm -rf "${WORK_DIR}"' EXIT
+
+# setsid: the C server wakes up its processes with kill(0, SIGUSR1), it must
+# not share the process group of this script.
+setsid "${C_SERVER_PATH}/server.bin" -k "${KEY_FILE}" -p "${C_SERVER_PORT}" \
+	-l "${WORK_DIR}/C_Server.chat" > /dev/null &
+C_SERVER_PID=$!
+benchServer "C_Server" "${C_SERVER_PORT}" "${C_SERVER_PID}" "$@" > "${RESULTS_FILE}"
+stopServer "${C_SERVER_PID}"
+
+"${GO_SERVER_PATH}/server.bin" -key "${KEY_FILE}" -addr ":${GO_SERVER_PORT}" \
+	-log "${WORK_DIR}/goServer.chat" > /dev/null &
+GO_SERVER_PID=$!
+# Skip the header line of the second run.
+benchServer "goServer" "${GO_SERVER_PORT}" "${GO_SERVER_PID}" "$@" | tail -n +2 >> "${RESULTS_FILE}"
+stopServer "${GO_SERVER_PID}"
+
+echo "Results written to ${RESULTS_FILE}" 1>&2
+cat "${RESULTS_FILE}" 1>&2
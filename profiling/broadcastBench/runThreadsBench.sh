@@ -0,0 +1,94 @@
+#!/bin/bash
+
+# runThreadsBench.sh measures papayachatd (test build, tests/concurrent_server_test.bin)
+# with broadcastBench, first in the process mode (THREADS off) and then in the
+# threaded mode with 1, 2, 4, ... event loops up to the number of online CPUs
+# (or the numbers given in THREADS_LIST). The results of all runs are written
+# to a single tab-separated file, the label of every line is the mode.
+#
+# Usage: ./runThreadsBench.sh [<flags passed to broadcastBench.bin>]
+# e.g.   THREADS_LIST="off 1 2 4 8" ./runThreadsBench.sh -clients 16,64,256 -rate 20
+#        LOW_LATENCY=on BUSY_POLL=50 ./runThreadsBench.sh
+#
+# The daemon reads its key from /etc/papayachat/key, like the client.
+#
+# Eduardo Rodriguez (@erodrigufer) (c) 2022.
+# Licensed under AGPLv3.
+
+###########################################################
+#User-defined variables####################################
+# Port on which papayachatd listens.
+SERVER_PORT=50003
+# Key file used by the daemon and the clients.
+KEY_FILE="/etc/papayachat/key"
+# Modes measured (THREADS in server.config).
+if [ -z "${THREADS_LIST}" ]; then
+	THREADS_LIST="off"
+	N=1
+	while [ "${N}" -le "$(nproc)" ]; do
+		THREADS_LIST="${THREADS_LIST} ${N}"
+		N=$((N * 2))
+	done
+fi
+# LOW_LATENCY and BUSY_POLL in server.config (low-latency mode).
+LOW_LATENCY=${LOW_LATENCY:-off}
+BUSY_POLL=${BUSY_POLL:-0}
+# File with the results.
+RESULTS_FILE="./threadsBench_$(date +%d_%m_%Y_%H%M%S).tsv"
+
+###########################################################
+#Global variables##########################################
+BENCH_EXECUTABLE="./broadcastBench.bin"
+REPO_PATH="$(pwd)/../.."
+SERVER_EXECUTABLE="papayachatd_bench.bin"
+# Temporary directory for the chat log, the indexes and the config file.
+WORK_DIR=$(mktemp -d)
+###########################################################
+
+make -s -C "${REPO_PATH}" server-test || exit 1
+make -s bench || exit 1
+
+trap 'rm -rf "${WORK_DIR}"' EXIT
+
+# the test build writes its chat log and indexes to its working directory,
+# SIGTERM executes ./termHandlerAsyncSafe.bin
+cp "${REPO_PATH}/tests/concurrent_server_test.bin" "${WORK_DIR}/${SERVER_EXECUTABLE}"
+cp "${REPO_PATH}/tests/termHandlerAsyncSafe.bin" "${WORK_DIR}/"
+
+HEADER=1
+for THREADS in ${THREADS_LIST}; do
+	rm -f "${WORK_DIR}"/chat_log.chat "${WORK_DIR}"/papayachat.*
+	printf 'PORT %s\nTHREADS %s\nLOW_LATENCY %s\nBUSY_POLL %s\n' "${SERVER_PORT}" \
+		"${THREADS}" "${LOW_LATENCY}" "${BUSY_POLL}" > "${WORK_DIR}/server.config"
+
+	# the daemon detaches itself, its pid is found by the name of the copy
+	(cd "${WORK_DIR}" && "./${SERVER_EXECUTABLE}" -c server.config)
+	sleep 1
+	PID=$(pgrep -o -f "^\./${SERVER_EXECUTABLE}")
+	if [ -z "${PID}" ]; then
+		echo "papayachatd did not start (THREADS ${THREADS}), check the syslog" 1>&2
+		exit 1
+	fi
+
+	LABEL="threads_${THREADS}"
+	if [ "${LOW_LATENCY}" = "on" ]; then
+		LABEL="${LABEL}_lowlatency"
+	fi
+	echo "Measuring THREADS ${THREADS}, LOW_LATENCY ${LOW_LATENCY} (pid ${PID})..." 1>&2
+	${BENCH_EXECUTABLE} -addr "localhost:${SERVER_PORT}" -key "${KEY_FILE}" \
+		-hello JOIN -pid "${PID}" -label "${LABEL}" "$@" \
+		| tail -n +"${HEADER}" >> "${RESULTS_FILE}"
+	# Skip the header line of the next runs.
+	HEADER=2
+
+	# the daemon forked twice to detach itself, its process group (with the
+	# processes of the process mode) is the one of its first child
+	PGID=$(ps -o pgid= -p "${PID}" | tr -d ' ')
+	kill -TERM -- "-${PGID}" 2> /dev/null
+	while pgrep -f "^\./${SERVER_EXECUTABLE}" > /dev/null; do
+		sleep 0.2
+	done
+done
+
+echo "Results written to ${RESULTS_FILE}" 1>&2
+cat "${RESULTS_FILE}" 1>&2
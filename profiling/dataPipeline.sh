@@ -16,6 +16,8 @@ RESULTS_PATH="./measurements/15_05_2022"
 # Store current path, where this script is being executed.
 CURRENT_PATH=$(pwd)
 PLOTTER_EXECUTABLE="plotCurves.bin"
+# Column with the CPU load in the time series written by resourceSampler.
+SAMPLER_CPU_COLUMN=3
 ###########################################################
 
 
@@ -63,8 +65,12 @@ main(){
 	FILES=$(ls)
 
 	for FILE in $FILES; do
+		# Time series written by resourceSampler (*.tsv) do not need to be
+		# cleaned, they can be plotted directly.
+		if [ -f ${FILE} ] && [ "${FILE%.tsv}" != "${FILE}" ]; then
+			../../plotCurves.bin -input ${FILE} -column ${SAMPLER_CPU_COLUMN} -plot ./results/${FILE}.pdf -output ./results/results.txt
 		# If FILE is a regular file (to avoid iterating over directories).
-		if [ -f ${FILE} ]; then
+		elif [ -f ${FILE} ]; then
 			# Where to store clean data.
 			OUTPUT_FILE=./cleanData/${FILE}.clean
 			processFile ${FILE} ${OUTPUT_FILE} && { echo "Cleaned data from file: ${FILE}"; }
@@ -39,6 +39,13 @@ type application struct {
 	outputFile string
 	// results, results struct of values that should be exported to outputFile.
 	results results
+	// column, column of a tab-separated time series (e.g. the output of
+	// resourceSampler) with the values to plot, the first column is then
+	// used as the time in s. If column is 0, every line of the input file
+	// is a single CPU load value, measured every 0.5 s (top measurements).
+	column int
+	// yLabel, label of the Y axis.
+	yLabel string
 }
 
 func main() {
@@ -48,9 +55,11 @@ func main() {
 	flag.StringVar(&app.inputFile, "input", "", "File with input data to plot and analyze.")
 	flag.StringVar(&app.plotFile, "plot", "", "File name to output plot.")
 	flag.StringVar(&app.outputFile, "output", "", "File name to output results.")
+	flag.IntVar(&app.column, "column", 0, "Column (starting at 1) of a tab-separated time series with the values to plot, the 1st column is the time in s.")
+	flag.StringVar(&app.yLabel, "ylabel", "CPU load in %", "Label of the Y axis.")
 	flag.Parse()
 
-	if app.inputFile == "" || app.plotFile == "" || app.outputFile == "" {
+	if app.inputFile == "" || app.plotFile == "" || app.outputFile == "" || app.column < 0 {
 		flag.Usage()
 		os.Exit(-1)
 	}
@@ -72,17 +81,22 @@ func main() {
 	scanner := bufio.NewScanner(dataFile)
 	// Scan one line of the file until EOF.
 	for scanner.Scan() {
+		// Lines starting with '#' are comments, e.g. the header of a time
+		// series.
+		if strings.HasPrefix(scanner.Text(), "#") {
+			continue
+		}
 		// Transform data as string into floats 64. Return one line at the time,
 		// until \n is encountered (scanner.Text()), of the text previously
 		// scanned with scanner.Scan().
-		CPUUsage, err := strconv.ParseFloat(scanner.Text(), 64)
+		t, CPUUsage, err := app.parseLine(scanner.Text(), counter)
 		if err != nil {
 			fmt.Fprintln(os.Stderr, "strconv to float64", err)
 			// Scan next line after error.
 			continue
 		}
 		var dataPoint plotter.XY
-		dataPoint.X = float64(counter+1) * 0.5 // time in s
+		dataPoint.X = t // time in s
 		dataPoint.Y = CPUUsage
 		pts = append(pts, dataPoint)
 		counter++
@@ -108,7 +122,7 @@ func main() {
 
 	p.Title.Text = ""
 	p.X.Label.Text = "t in s"
-	p.Y.Label.Text = "CPU load in %"
+	p.Y.Label.Text = app.yLabel
 	// Draw a grid behind the data.
 	p.Add(plotter.NewGrid())
 
@@ -181,6 +195,27 @@ func main() {
 	}
 }
 
+// parseLine, returns the time in s and the value stored in a line of the input
+// file. counter is the number of data points parsed before this line.
+func (app *application) parseLine(line string, counter int) (float64, float64, error) {
+	// A single value per line, measured every 0.5 s.
+	if app.column == 0 {
+		value, err := strconv.ParseFloat(line, 64)
+		return float64(counter+1) * 0.5, value, err
+	}
+
+	fields := strings.Split(line, "\t")
+	if len(fields) < app.column {
+		return 0, 0, fmt.Errorf("line %q has no column %d", line, app.column)
+	}
+	t, err := strconv.ParseFloat(fields[0], 64)
+	if err != nil {
+		return 0, 0, err
+	}
+	value, err := strconv.ParseFloat(fields[app.column-1], 64)
+	return t, value, err
+}
+
 // exportResults, stores the results of processing each measurement into an
 // output file (app.outputFile).
 func (app *application) exportResults() error {
@@ -1,22 +1,68 @@
+// Reference implementation of papayachatd with goroutines instead of
+// processes, reduced to the semantics that matter for the benchmark (see
+// profiling/broadcastBench):
+//
+//   - every client is authenticated with a keyLength bytes long key, which is
+//     read from a key file with the same format as /etc/papayachat/key
+//   - every message received from a client is appended to the chatlog, holding
+//     an exclusive lock on the chatlog
+//   - every goroutine handling a client is woken up after a message was
+//     appended, and sends everything new in the chatlog to its client
+//     (broadcast)
+//
+// Like in papayachatd, every client is handled by two goroutines: one
+// receives messages and appends them to the chatlog, the other one sends the
+// new content of the chatlog to the client. The mutex replaces flock() and the
+// condition variable replaces SIGUSR1.
 package main
 
 import (
+	"bufio"
+	"bytes"
+	"errors"
 	"flag"
-	"fmt"
+	"io"
 	"log"
 	"net"
 	"os"
+	"strings"
+	"sync"
+	"time"
+)
+
+const (
+	// keyLength, length of the auth key, same value as in CONFIG.h
+	keyLength = 128
+	// authTimeout, time that a client has to send the key
+	authTimeout = time.Second
+	// bufSize, bytes transmission size, same value as in CONFIG.h
+	bufSize = 4096
 )
 
 // configValues, parsed from the flags
 type configValues struct {
 	// addr, defines the port on which the server will be listening
 	addr string
+	// keyFile, path of the file with the auth key
+	keyFile string
+	// chatlog, path of the chatlog
+	chatlog string
 }
 
 type application struct {
 	errorLog *log.Logger // error log handler
 	infoLog  *log.Logger // info log handler
+	key      []byte      // auth key
+	chatlog  *chatlog
+}
+
+// chatlog, file shared by all clients. size is the offset of the end of the
+// chatlog, every goroutine sending messages waits on cond until size changes
+type chatlog struct {
+	mu   sync.Mutex
+	cond *sync.Cond
+	file *os.File
+	size int64
 }
 
 func main() {
@@ -35,43 +81,180 @@ func main() {
 	app.errorLog = log.New(os.Stderr, "ERROR\t", log.Ldate|log.Ltime|log.Lshortfile)
 
 	flag.StringVar(&cfg.addr, "addr", DEFAULT_SERVICE, "Server's listening address")
+	flag.StringVar(&cfg.keyFile, "key", "", "File with the auth key (format of /etc/papayachat/key)")
+	flag.StringVar(&cfg.chatlog, "log", "./chat_log.chat", "Path of the chatlog")
+	flag.Parse()
+
+	var err error
+	app.key, err = readKeyFile(cfg.keyFile)
+	if err != nil {
+		app.errorLog.Fatal(err)
+	}
+
+	app.chatlog, err = openChatlog(cfg.chatlog)
+	if err != nil {
+		app.errorLog.Fatal(err)
+	}
 
-	app.infoLog.Printf("Server listening on %s\n", cfg.addr)
 	ln, err := net.Listen("tcp", cfg.addr)
-	defer ln.Close()
 	if err != nil {
-		app.errorLog.Println(err)
+		app.errorLog.Fatal(err)
 	}
+	defer ln.Close()
+	app.infoLog.Printf("Server listening on %s\n", cfg.addr)
 
 	// infinite for-loop, accept clients and create goroutine to handle client
 	for {
 		conn, err := ln.Accept()
 		if err != nil {
 			app.errorLog.Println(err)
+			continue
 		}
 		go app.handleConnection(conn)
 	}
 }
 
+// readKeyFile, parse the key out of the line starting with 'KEY '. A key
+// shorter than keyLength is padded with 0, exactly like in the client
+func readKeyFile(path string) ([]byte, error) {
+	f, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+
+	scanner := bufio.NewScanner(f)
+	for scanner.Scan() {
+		fields := strings.Fields(scanner.Text())
+		if len(fields) < 2 || fields[0] != "KEY" {
+			continue
+		}
+		key := make([]byte, keyLength)
+		copy(key, fields[1])
+		return key, nil
+	}
+	if err := scanner.Err(); err != nil {
+		return nil, err
+	}
+	return nil, errors.New("no KEY found in " + path)
+}
+
+func openChatlog(path string) (*chatlog, error) {
+	f, err := os.OpenFile(path, os.O_RDWR|os.O_CREATE|os.O_APPEND, 0600)
+	if err != nil {
+		return nil, err
+	}
+	info, err := f.Stat()
+	if err != nil {
+		return nil, err
+	}
+	c := &chatlog{file: f, size: info.Size()}
+	c.cond = sync.NewCond(&c.mu)
+	return c, nil
+}
+
+// append, write p exclusively to the chatlog and wake up all senders
+func (c *chatlog) append(p []byte) error {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	n, err := c.file.Write(p)
+	c.size += int64(n)
+	c.cond.Broadcast()
+	return err
+}
+
+// end, current offset of the end of the chatlog
+func (c *chatlog) end() int64 {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	return c.size
+}
+
+// waitFor, block until the chatlog grows beyond offset or done is set,
+// returns the new end of the chatlog
+func (c *chatlog) waitFor(offset int64, done *bool) int64 {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	for c.size <= offset && !*done {
+		c.cond.Wait()
+	}
+	return c.size
+}
+
+// stop, set done and wake up the sender waiting on it
+func (c *chatlog) stop(done *bool) {
+	c.mu.Lock()
+	*done = true
+	c.cond.Broadcast()
+	c.mu.Unlock()
+}
+
+// authClient, read the key with a timeout and compare it
+func (app *application) authClient(conn net.Conn) bool {
+	buf := make([]byte, keyLength)
+	conn.SetReadDeadline(time.Now().Add(authTimeout))
+	_, err := io.ReadFull(conn, buf)
+	conn.SetReadDeadline(time.Time{})
+	return err == nil && bytes.Equal(buf, app.key)
+}
+
 func (app *application) handleConnection(conn net.Conn) {
 	defer conn.Close()
-	buf := make([]byte, 1024)
-	// read the data up to the newline into netData
+
+	// Go enables TCP_NODELAY by default, papayachatd (and C_Server) use the
+	// default of the OS (Nagle's algorithm enabled)
+	if tcpConn, ok := conn.(*net.TCPConn); ok {
+		tcpConn.SetNoDelay(false)
+	}
+
+	if !app.authClient(conn) {
+		return
+	}
+
+	// done is protected by the mutex of the chatlog
+	done := false
+	// only messages sent after the connection was established are sent
+	offset := app.chatlog.end()
+	go app.sendMessages(conn, offset, &done)
+
+	buf := make([]byte, bufSize)
 	for {
 		n, err := conn.Read(buf)
+		if n > 0 {
+			if err := app.chatlog.append(buf[:n]); err != nil {
+				app.errorLog.Fatal(err)
+			}
+		}
 		if err != nil {
-			//fmt.Printf("Error occured: %q\n", err)
-			// This break is necessary to return from the goroutine after a
-			// client terminates a session with an io.EOF error.
-			// Otherwise, the for-loops runs again, but the conn.Read method
-			// will not read anything and infinite empty strings will be printed
-			// to stdout.
+			// EOF, the client closed the connection
 			break
 		}
-		//fmt.Printf("Bytes received: %d\n", n)
-		fmt.Printf("%q\n", buf[:n])
-		// use q to print also non-readable
-		// characters being sent
+	}
+	app.chatlog.stop(&done)
+}
 
+// sendMessages, send everything new in the chatlog to the client, every time
+// that the chatlog grows
+func (app *application) sendMessages(conn net.Conn, offset int64, done *bool) {
+	buf := make([]byte, bufSize)
+	for {
+		end := app.chatlog.waitFor(offset, done)
+		if offset >= end {
+			return // done
+		}
+		for offset < end {
+			toRead := end - offset
+			if toRead > bufSize {
+				toRead = bufSize
+			}
+			n, err := app.chatlog.file.ReadAt(buf[:toRead], offset)
+			if err != nil && err != io.EOF {
+				app.errorLog.Fatal(err)
+			}
+			if _, err := conn.Write(buf[:n]); err != nil {
+				return // client is gone
+			}
+			offset += int64(n)
+		}
 	}
 }
@@ -0,0 +1,554 @@
+/* lockBench.c
+
+Microbenchmark for the chatlog locking primitives of file_locking.c
+
+K writer processes call exclusiveWrite(), M reader processes follow the chatlog
+with sharedRead() (exactly like the sendNewMessages() processes of the daemon,
+they wait for the SIGUSR1 multicast and read until EOF) and J joiner processes
+call historyOffset() and read the history with sharedRead() in a loop (like a
+client joining the chat), all against a temporary chatlog file.
+
+The binary is linked with '-Wl,--wrap=<syscall>' (check the Makefile), so every
+flock(), read(), pread(), write(), pwrite(), lseek(), fstat() and kill() performed inside
+file_locking.c
+goes through the __wrap_*() functions defined here. This makes it possible to
+count the syscalls per operation and to time exactly how long a process waited
+to acquire a lock, without touching file_locking.c at all.
+
+Usage: lockBench.bin [-w writers] [-r readers] [-j joiners] [-d seconds]
+				[-s message size] [-i] [-f]
+
+-i : every process opens its own fd for the chatlog (independent open file
+	descriptions). By default the fd is opened once before fork(), just like
+	concurrent_server.c does it.
+-f : the writers call fdatasync() after every exclusiveWrite() (like
+	'DURABILITY batch'), the latency of the writers includes it.
+
+*/
+
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>	/* shared memory to collect results from child processes */
+#include <sys/wait.h>
+
+#include "../../basics.h"
+#include "../../file_locking.h"
+#include "../../CONFIG.h"	/* BUF_SIZE */
+
+/* default values of the command-line options */
+#define DEFAULT_WRITERS 4
+#define DEFAULT_READERS 4
+#define DEFAULT_JOINERS 0
+#define DEFAULT_DURATION 5	/* in seconds */
+#define DEFAULT_MESSAGE_SIZE 64
+
+/* max. amount of processes of each type */
+#define MAX_WORKERS 256
+
+/* latencies are stored in a log-linear histogram, every power of two is split
+into HISTOGRAM_SUB_BUCKETS sub-buckets, so that the error of a percentile is
+smaller than ~12% */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB_BUCKETS)
+
+/* type of primitive being measured */
+enum workerType { WRITER, READER, JOINER, WORKER_TYPES };
+
+static const char * workerNames[WORKER_TYPES] = { "exclusiveWrite", "sharedRead", "firstConnection" };
+
+/* syscalls being counted through the linker wrappers */
+enum syscallType { SYS_FLOCK, SYS_READ, SYS_PREAD, SYS_WRITE, SYS_PWRITE, SYS_LSEEK, SYS_FSTAT, SYS_KILL, SYSCALL_TYPES };
+
+static const char * syscallNames[SYSCALL_TYPES] = { "flock", "read", "pread", "write", "pwrite", "lseek", "fstat", "kill" };
+
+struct histogram {
+	unsigned long buckets[HISTOGRAM_BUCKETS];
+	unsigned long count;
+	unsigned long max;	/* in ns */
+};
+
+/* results of a single worker process, stored in shared memory */
+struct workerStats {
+	unsigned long ops;
+	unsigned long bytes;
+	unsigned long syscalls[SYSCALL_TYPES];
+	struct histogram opLatency;	/* whole call to the primitive */
+	struct histogram lockWait;	/* only the time blocked in flock(LOCK_EX/LOCK_SH) */
+};
+
+/* the stats of the worker running in this process, NULL in the parent */
+static struct workerStats * currentStats = NULL;
+
+/* set by SIGALRM in the worker processes when the benchmark is over */
+static volatile sig_atomic_t benchmarkOver = 0;
+
+/* real syscalls, resolved by the linker */
+int __real_flock(int, int);
+ssize_t __real_read(int, void *, size_t);
+ssize_t __real_pread(int, void *, size_t, off_t);
+ssize_t __real_write(int, const void *, size_t);
+ssize_t __real_pwrite(int, const void *, size_t, off_t);
+off_t __real_lseek(int, off_t, int);
+int __real_fstat(int, struct stat *);
+int __real_kill(pid_t, int);
+
+/* monotonic time in ns */
+static unsigned long
+nowNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* find the bucket for a value in ns */
+static int
+histogramBucket(unsigned long value)
+{
+	if(value < HISTOGRAM_SUB_BUCKETS)
+		return (int) value;
+
+	/* position of most significant bit */
+	int msb = 63 - __builtin_clzl(value);
+	/* the HISTOGRAM_SUB_BITS bits after the most significant bit select the
+	sub-bucket */
+	int sub = (int) ((value >> (msb - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+
+	return (msb - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+/* lowest value that would be stored in a given bucket */
+static unsigned long
+histogramBucketValue(int bucket)
+{
+	if(bucket < HISTOGRAM_SUB_BUCKETS)
+		return (unsigned long) bucket;
+
+	int msb = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+	unsigned long sub = bucket % HISTOGRAM_SUB_BUCKETS;
+
+	return (1UL << msb) | (sub << (msb - HISTOGRAM_SUB_BITS));
+}
+
+static void
+histogramRecord(struct histogram * h, unsigned long value)
+{
+	h->buckets[histogramBucket(value)]++;
+	h->count++;
+	if(value > h->max)
+		h->max = value;
+}
+
+static void
+histogramMerge(struct histogram * dst, const struct histogram * src)
+{
+	for(int i=0;i<HISTOGRAM_BUCKETS;i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	if(src->max > dst->max)
+		dst->max = src->max;
+}
+
+/* value at percentile p (0 < p <= 100) */
+static unsigned long
+histogramPercentile(const struct histogram * h, double p)
+{
+	if(h->count == 0)
+		return 0;
+
+	unsigned long rank = (unsigned long) (p / 100.0 * h->count);
+	if(rank == 0)
+		rank = 1;
+
+	unsigned long seen = 0;
+	for(int i=0;i<HISTOGRAM_BUCKETS;i++){
+		seen += h->buckets[i];
+		if(seen >= rank)
+			return histogramBucketValue(i);
+	}
+
+	return h->max;
+}
+
+/* ------------------------ linker wrappers ---------------------------------- */
+
+int
+__wrap_flock(int fd, int operation)
+{
+	if(currentStats == NULL)
+		return __real_flock(fd, operation);
+
+	currentStats->syscalls[SYS_FLOCK]++;
+
+	/* unlocking never blocks, only measure the time to acquire a lock */
+	if(operation == LOCK_UN)
+		return __real_flock(fd, operation);
+
+	unsigned long start = nowNs();
+	int result = __real_flock(fd, operation);
+	histogramRecord(&currentStats->lockWait, nowNs() - start);
+
+	return result;
+}
+
+ssize_t
+__wrap_read(int fd, void * buf, size_t count)
+{
+	if(currentStats != NULL)
+		currentStats->syscalls[SYS_READ]++;
+	return __real_read(fd, buf, count);
+}
+
+ssize_t
+__wrap_pread(int fd, void * buf, size_t count, off_t offset)
+{
+	if(currentStats != NULL)
+		currentStats->syscalls[SYS_PREAD]++;
+	return __real_pread(fd, buf, count, offset);
+}
+
+ssize_t
+__wrap_write(int fd, const void * buf, size_t count)
+{
+	if(currentStats != NULL)
+		currentStats->syscalls[SYS_WRITE]++;
+	return __real_write(fd, buf, count);
+}
+
+ssize_t
+__wrap_pwrite(int fd, const void * buf, size_t count, off_t offset)
+{
+	if(currentStats != NULL)
+		currentStats->syscalls[SYS_PWRITE]++;
+	return __real_pwrite(fd, buf, count, offset);
+}
+
+off_t
+__wrap_lseek(int fd, off_t offset, int whence)
+{
+	if(currentStats != NULL)
+		currentStats->syscalls[SYS_LSEEK]++;
+	return __real_lseek(fd, offset, whence);
+}
+
+int
+__wrap_fstat(int fd, struct stat * statbuf)
+{
+	if(currentStats != NULL)
+		currentStats->syscalls[SYS_FSTAT]++;
+	return __real_fstat(fd, statbuf);
+}
+
+int
+__wrap_kill(pid_t pid, int sig)
+{
+	if(currentStats != NULL)
+		currentStats->syscalls[SYS_KILL]++;
+	return __real_kill(pid, sig);
+}
+
+/* --------------------------------------------------------------------------- */
+
+static void
+alarmHandler(int sig)
+{
+	benchmarkOver = 1;
+}
+
+/* get the chatlog fd for a worker, either inherited or opened again */
+static int
+workerChatlog(int inherited_fd, Boolean independentFds)
+{
+	if(!independentFds)
+		return inherited_fd;
+
+	int chatlog_fd = openChatLogFile();
+	if(chatlog_fd == -1)
+		errExit("openChatLogFile");
+
+	return chatlog_fd;
+}
+
+/* call exclusiveWrite() until the benchmark is over */
+static void
+runWriter(int chatlog_fd, int id, size_t messageSize, Boolean syncWrites)
+{
+	char * message = (char *) malloc(messageSize);
+	if(message == NULL)
+		errExit("malloc");
+
+	/* a message looks like a real chat line, 'writerN: xxxx...\n' */
+	memset(message, 'x', messageSize);
+	int prefix = snprintf(message, messageSize, "writer%d: ", id);
+	if(prefix > 0 && (size_t) prefix < messageSize)
+		message[prefix] = 'x';	/* overwrite '\0' of snprintf */
+	message[messageSize-1] = '\n';
+
+	while(!benchmarkOver){
+		unsigned long start = nowNs();
+		if(exclusiveWrite(chatlog_fd, message, messageSize) == -1)
+			errExit("exclusiveWrite");
+		if(syncWrites && fdatasync(chatlog_fd) == -1)
+			errExit("fdatasync");
+		histogramRecord(&currentStats->opLatency, nowNs() - start);
+		currentStats->ops++;
+		currentStats->bytes += messageSize;
+	}
+
+	free(message);
+}
+
+/* follow the chatlog like sendNewMessages() does: wait for the SIGUSR1
+multicast, then read until EOF */
+static void
+runReader(int chatlog_fd)
+{
+	char * buf = (char *) malloc(BUF_SIZE);
+	if(buf == NULL)
+		errExit("malloc");
+
+	sigset_t usr1;
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+
+	/* wait at most 100 ms for a signal, to notice the end of the benchmark */
+	struct timespec timeout = { 0, 100 * 1000 * 1000 };
+
+	off_t offset = 0;
+	while(!benchmarkOver){
+		for(;;){
+			unsigned long start = nowNs();
+			ssize_t bytesRead = sharedRead(chatlog_fd, buf, BUF_SIZE, offset);
+			if(bytesRead == -1)
+				errExit("sharedRead");
+			histogramRecord(&currentStats->opLatency, nowNs() - start);
+			currentStats->ops++;
+			if(bytesRead == 0)
+				break;	/* EOF, wait for next signal */
+			offset += bytesRead;
+			currentStats->bytes += bytesRead;
+		}
+		/* SIGUSR1 is blocked in this process, so pending signals are
+		collected here instead of interrupting sharedRead() */
+		sigtimedwait(&usr1, NULL, &timeout);
+	}
+
+	free(buf);
+}
+
+/* find the history of a joining client with historyOffset() and read it
+with sharedRead() in a loop */
+static void
+runJoiner(int chatlog_fd)
+{
+	char * buf = (char *) malloc(BUF_SIZE);
+	if(buf == NULL)
+		errExit("malloc");
+
+	while(!benchmarkOver){
+		unsigned long start = nowNs();
+		off_t offset = historyOffset(chatlog_fd);
+		if(offset == -1)
+			errExit("historyOffset");
+		ssize_t bytesRead;
+		while((bytesRead = sharedRead(chatlog_fd, buf, BUF_SIZE, offset)) > 0)
+			offset += bytesRead;
+		if(bytesRead == -1)
+			errExit("sharedRead");
+		histogramRecord(&currentStats->opLatency, nowNs() - start);
+		currentStats->ops++;
+	}
+
+	free(buf);
+}
+
+static void
+printHistogram(const char * name, const struct histogram * h)
+{
+	printf("  %-10s p50 %9.1f us  p90 %9.1f us  p99 %9.1f us  p99.9 %9.1f us  max %9.1f us\n",
+		name,
+		histogramPercentile(h, 50) / 1000.0,
+		histogramPercentile(h, 90) / 1000.0,
+		histogramPercentile(h, 99) / 1000.0,
+		histogramPercentile(h, 99.9) / 1000.0,
+		h->max / 1000.0);
+}
+
+/* aggregate the stats of all workers of the same type and print them */
+static void
+printResults(struct workerStats * stats, int workers[WORKER_TYPES], double seconds)
+{
+	int index = 0;
+
+	for(int type=0;type<WORKER_TYPES;type++){
+		struct workerStats total;
+		memset(&total, 0, sizeof(total));
+
+		for(int i=0;i<workers[type];i++, index++){
+			total.ops += stats[index].ops;
+			total.bytes += stats[index].bytes;
+			for(int s=0;s<SYSCALL_TYPES;s++)
+				total.syscalls[s] += stats[index].syscalls[s];
+			histogramMerge(&total.opLatency, &stats[index].opLatency);
+			histogramMerge(&total.lockWait, &stats[index].lockWait);
+		}
+
+		if(workers[type] == 0)
+			continue;
+
+		printf("%s (%d processes)\n", workerNames[type], workers[type]);
+		printf("  ops        %lu (%.0f ops/sec, %.2f MB/sec)\n", total.ops,
+			total.ops / seconds, total.bytes / seconds / (1024.0 * 1024.0));
+		printHistogram("latency", &total.opLatency);
+		printHistogram("lock wait", &total.lockWait);
+		printf("  syscalls/op");
+		for(int s=0;s<SYSCALL_TYPES;s++)
+			printf(" %s %.2f", syscallNames[s], total.ops ? (double) total.syscalls[s] / total.ops : 0.0);
+		printf("\n");
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	int workers[WORKER_TYPES] = { DEFAULT_WRITERS, DEFAULT_READERS, DEFAULT_JOINERS };
+	int duration = DEFAULT_DURATION;
+	size_t messageSize = DEFAULT_MESSAGE_SIZE;
+	Boolean independentFds = FALSE;
+	Boolean syncWrites = FALSE;
+
+	int opt;
+	while((opt = getopt(argc, argv, "w:r:j:d:s:if")) != -1){
+		switch(opt){
+			case 'w': workers[WRITER] = atoi(optarg); break;
+			case 'r': workers[READER] = atoi(optarg); break;
+			case 'j': workers[JOINER] = atoi(optarg); break;
+			case 'd': duration = atoi(optarg); break;
+			case 's': messageSize = (size_t) atol(optarg); break;
+			case 'i': independentFds = TRUE; break;
+			case 'f': syncWrites = TRUE; break;
+			default:
+				usageErr("%s [-w writers] [-r readers] [-j joiners] [-d seconds] [-s message size] [-i] [-f]\n", argv[0]);
+		}
+	}
+
+	for(int type=0;type<WORKER_TYPES;type++){
+		if(workers[type] < 0 || workers[type] > MAX_WORKERS)
+			cmdLineErr("number of processes must be between 0 and %d\n", MAX_WORKERS);
+	}
+	if(duration <= 0 || messageSize < 2 || messageSize > BUF_SIZE)
+		cmdLineErr("invalid duration or message size\n");
+
+	int totalWorkers = workers[WRITER] + workers[READER] + workers[JOINER];
+
+	/* results of every worker, MAP_SHARED so that they survive fork() */
+	struct workerStats * stats = mmap(NULL, totalWorkers * sizeof(struct workerStats),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(stats == MAP_FAILED)
+		errExit("mmap");
+
+	/* the chatlog file is created in an empty temporary directory, the TEST
+	version of file_locking.c opens './chat_log.chat' */
+	char tempDir[] = "/tmp/lockBench.XXXXXX";
+	if(mkdtemp(tempDir) == NULL)
+		errExit("mkdtemp");
+	if(chdir(tempDir) == -1)
+		errExit("chdir");
+
+	int chatlog_fd = openChatLogFile();
+	if(chatlog_fd == -1)
+		errExit("openChatLogFile");
+
+	/* the parent and the writers ignore SIGUSR1, the readers block it and
+	collect it with sigtimedwait() */
+	signal(SIGUSR1, SIG_IGN);
+
+	struct sigaction sa;
+	sigemptyset(&sa.sa_mask);
+	/* let the operation in progress finish when the alarm goes off */
+	sa.sa_flags = SA_RESTART;
+	sa.sa_handler = alarmHandler;
+	if(sigaction(SIGALRM, &sa, NULL) == -1)
+		errExit("sigaction");
+
+	printf("lockBench: %d writers, %d readers, %d joiners, %d s, %zu bytes/message, %s fds%s\n",
+		workers[WRITER], workers[READER], workers[JOINER], duration, messageSize,
+		independentFds ? "independent" : "inherited", syncWrites ? ", fdatasync" : "");
+	fflush(stdout);
+
+	/* exclusiveWrite() multicasts SIGUSR1 to the whole process group, all
+	workers are moved to a new process group (led by the first worker) so that
+	neither this process nor the shell running the benchmark are hit */
+	pid_t workerGroup = 0;
+
+	int index = 0;
+	for(int type=0;type<WORKER_TYPES;type++){
+		for(int i=0;i<workers[type];i++, index++){
+			pid_t pid = fork();
+			switch(pid){
+				case -1:
+					errExit("fork");
+
+				case 0:
+					/* setpgid() is called by both parent and child, to
+					avoid a race condition */
+					if(setpgid(0, workerGroup) == -1)
+						errExit("setpgid");
+					currentStats = &stats[index];
+					int fd = workerChatlog(chatlog_fd, independentFds);
+					if(type == READER){
+						sigset_t usr1;
+						sigemptyset(&usr1);
+						sigaddset(&usr1, SIGUSR1);
+						signal(SIGUSR1, SIG_DFL);
+						sigprocmask(SIG_BLOCK, &usr1, NULL);
+					}
+					alarm(duration);
+					if(type == WRITER)
+						runWriter(fd, i, messageSize, syncWrites);
+					else if(type == READER)
+						runReader(fd);
+					else
+						runJoiner(fd);
+					_exit(EXIT_SUCCESS);
+
+				default:
+					if(setpgid(pid, workerGroup) == -1 && errno != EACCES)
+						errExit("setpgid");
+					if(workerGroup == 0)
+						workerGroup = pid;
+					break;
+			}
+		}
+	}
+
+	/* wait for all workers */
+	int status;
+	Boolean failed = FALSE;
+	while(wait(&status) > 0){
+		if(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+			failed = TRUE;
+	}
+
+	/* the file itself is longer, it is preallocated */
+	printf("chatlog size: %lld bytes\n", (long long) chatLogEnd());
+
+	printResults(stats, workers, (double) duration);
+
+	/* remove temporary chatlog */
+	close(chatlog_fd);
+	unlink("chat_log.chat");
+	if(chdir("/") == 0)
+		rmdir(tempDir);
+
+	if(failed)
+		fatal("at least one worker failed");
+
+	exit(EXIT_SUCCESS);
+}
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
@@ -0,0 +1,446 @@
+/* resourceSampler.c
+
+Sample the resource usage of the whole papayachatd process tree from /proc
+(Linux only) at a fixed interval, and write it as a compact time series.
+
+The multi-process server creates two processes per client, so the resources of
+the daemon are spread over a tree of short-lived processes. Every sample adds up
+the values of all the processes in the tree:
+
+	t_s			seconds since the start of the sampling
+	procs		number of processes in the tree
+	cpu_pct		CPU load (user + system) in % of one core during the last interval
+	rss_kb		resident set size
+	pss_kb		proportional set size (pages shared between the forked processes are
+				only counted once in total), 0 if smaps_rollup is not available
+	vcs_s		voluntary context switches per second
+	ivcs_s		involuntary context switches per second
+	fds			open file descriptors
+
+The CPU time of a process that exited is not lost, since it is added to the
+cutime/cstime of the process that reaped it (every process in the daemon reaps
+its children with waitpid(), check signalHandling.c).
+
+Usage: resourceSampler.bin [-p pid | -n process name] [-i interval in ms]
+						[-d duration in s] [-o output file]
+
+By default the process tree of the oldest process called 'papayachatd' is
+sampled every 500 ms until the tree disappears.
+
+*/
+
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>		/* iterate over /proc */
+#include <limits.h>
+
+#include "../../basics.h"
+
+/* default values of the command-line options */
+#define DEFAULT_PROCESS_NAME "papayachatd"
+#define DEFAULT_INTERVAL_MS 500
+
+/* max. amount of processes in the tree (the daemon creates 2 per client) */
+#define MAX_PROCESSES 8192
+
+/* values read for a single process */
+struct processSample {
+	pid_t pid;
+	pid_t ppid;
+	char comm[64];
+	unsigned long long cpuTicks;	/* utime + stime + cutime + cstime */
+	unsigned long rssKb;
+	unsigned long pssKb;
+	unsigned long voluntarySwitches;
+	unsigned long involuntarySwitches;
+	unsigned long fds;
+	char state;		/* R, S, D, Z, ... */
+	Boolean inTree;
+};
+
+/* values of the whole tree */
+struct treeSample {
+	int processes;
+	unsigned long long cpuTicks;
+	unsigned long rssKb;
+	unsigned long pssKb;
+	unsigned long voluntarySwitches;
+	unsigned long involuntarySwitches;
+	unsigned long fds;
+};
+
+static volatile sig_atomic_t stopSampling = 0;
+
+static void
+stopHandler(int sig)
+{
+	stopSampling = 1;
+}
+
+/* read /proc/<pid>/stat, returns -1 if the process does not exist (anymore) */
+static int
+readStat(pid_t pid, struct processSample * ps)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+
+	FILE * fs = fopen(path, "r");
+	if(fs == NULL)
+		return -1;
+
+	char line[1024];
+	if(fgets(line, sizeof(line), fs) == NULL){
+		fclose(fs);
+		return -1;
+	}
+	fclose(fs);
+
+	/* the comm field is inside parentheses and can contain white-spaces,
+	everything after the last ')' has a fixed format, check 'man 5 proc' */
+	char * open = strchr(line, '(');
+	char * close = strrchr(line, ')');
+	if(open == NULL || close == NULL || close < open)
+		return -1;
+
+	size_t commLength = close - open - 1;
+	if(commLength >= sizeof(ps->comm))
+		commLength = sizeof(ps->comm) - 1;
+	memcpy(ps->comm, open + 1, commLength);
+	ps->comm[commLength] = '\0';
+
+	char state;
+	int ppid;
+	unsigned long utime, stime;
+	long cutime, cstime;
+	/* fields 3 to 17 of /proc/<pid>/stat */
+	if(sscanf(close + 2, "%c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld %ld",
+			&state, &ppid, &utime, &stime, &cutime, &cstime) != 6)
+		return -1;
+
+	ps->pid = pid;
+	ps->ppid = (pid_t) ppid;
+	ps->state = state;
+	ps->cpuTicks = (unsigned long long) utime + stime + cutime + cstime;
+
+	return 0;
+}
+
+/* parse the value of a 'Key:   value kB' line in a /proc file */
+static unsigned long
+parseProcValue(const char * line, const char * key)
+{
+	size_t keyLength = strlen(key);
+	if(strncmp(line, key, keyLength) != 0 || line[keyLength] != ':')
+		return ULONG_MAX;
+
+	return strtoul(line + keyLength + 1, NULL, 10);
+}
+
+/* read memory and context switches from /proc/<pid>/status and PSS from
+/proc/<pid>/smaps_rollup */
+static void
+readStatus(struct processSample * ps)
+{
+	char path[64];
+	char line[256];
+	unsigned long value;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int) ps->pid);
+	FILE * fs = fopen(path, "r");
+	if(fs != NULL){
+		while(fgets(line, sizeof(line), fs) != NULL){
+			if((value = parseProcValue(line, "VmRSS")) != ULONG_MAX)
+				ps->rssKb = value;
+			else if((value = parseProcValue(line, "voluntary_ctxt_switches")) != ULONG_MAX)
+				ps->voluntarySwitches = value;
+			else if((value = parseProcValue(line, "nonvoluntary_ctxt_switches")) != ULONG_MAX)
+				ps->involuntarySwitches = value;
+		}
+		fclose(fs);
+	}
+
+	/* smaps_rollup exists since Linux 4.14 */
+	snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int) ps->pid);
+	fs = fopen(path, "r");
+	if(fs != NULL){
+		while(fgets(line, sizeof(line), fs) != NULL){
+			if((value = parseProcValue(line, "Pss")) != ULONG_MAX){
+				ps->pssKb = value;
+				break;
+			}
+		}
+		fclose(fs);
+	}
+}
+
+/* count the entries in /proc/<pid>/fd */
+static unsigned long
+countFds(pid_t pid)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/fd", (int) pid);
+
+	DIR * dir = opendir(path);
+	if(dir == NULL)
+		return 0;
+
+	unsigned long fds = 0;
+	struct dirent * entry;
+	while((entry = readdir(dir)) != NULL){
+		if(entry->d_name[0] != '.')
+			fds++;
+	}
+	closedir(dir);
+
+	return fds;
+}
+
+/* read /proc/<pid>/stat of every process in the system, returns the number of
+processes found */
+static int
+scanProcesses(struct processSample * processes, int maxProcesses)
+{
+	DIR * dir = opendir("/proc");
+	if(dir == NULL)
+		errExit("opendir /proc");
+
+	int count = 0;
+	struct dirent * entry;
+	while((entry = readdir(dir)) != NULL && count < maxProcesses){
+		char * end;
+		long pid = strtol(entry->d_name, &end, 10);
+		if(*end != '\0' || pid <= 0)
+			continue;	/* not a process directory */
+
+		memset(&processes[count], 0, sizeof(struct processSample));
+		if(readStat((pid_t) pid, &processes[count]) == 0)
+			count++;
+	}
+	closedir(dir);
+
+	return count;
+}
+
+/* find the root of the daemon's tree: the oldest process with the given name
+whose parent has a different name (every forked child of the daemon has the
+same name as the daemon itself) */
+static pid_t
+findRoot(struct processSample * processes, int count, const char * name)
+{
+	pid_t root = -1;
+
+	for(int i=0;i<count;i++){
+		if(strcmp(processes[i].comm, name) != 0)
+			continue;
+
+		Boolean parentHasSameName = FALSE;
+		for(int j=0;j<count;j++){
+			if(processes[j].pid == processes[i].ppid && strcmp(processes[j].comm, name) == 0)
+				parentHasSameName = TRUE;
+		}
+
+		/* PIDs grow over time, keep the smallest one */
+		if(!parentHasSameName && (root == -1 || processes[i].pid < root))
+			root = processes[i].pid;
+	}
+
+	return root;
+}
+
+/* order processes by pid, to look up parents with a binary search */
+static int
+comparePid(const void * a, const void * b)
+{
+	pid_t pidA = ((const struct processSample *) a)->pid;
+	pid_t pidB = ((const struct processSample *) b)->pid;
+	return (pidA > pidB) - (pidA < pidB);
+}
+
+/* mark the processes that belong to the tree under root, returns the number
+of processes in the tree, or 0 if root does not exist or is a zombie */
+static int
+markTree(struct processSample * processes, int count, pid_t root)
+{
+	qsort(processes, count, sizeof(struct processSample), comparePid);
+
+	struct processSample key;
+	key.pid = root;
+	struct processSample * rootProcess = bsearch(&key, processes, count, sizeof(struct processSample), comparePid);
+	if(rootProcess == NULL || rootProcess->state == 'Z')
+		return 0;
+	rootProcess->inTree = TRUE;
+	int members = 1;
+
+	/* every pass adds the next generation of children, the depth of the
+	daemon's tree is small (daemon -> client handler -> sending process) */
+	Boolean changed = TRUE;
+	while(changed){
+		changed = FALSE;
+		for(int i=0;i<count;i++){
+			if(processes[i].inTree)
+				continue;
+			key.pid = processes[i].ppid;
+			struct processSample * parent = bsearch(&key, processes, count, sizeof(struct processSample), comparePid);
+			if(parent != NULL && parent->inTree){
+				processes[i].inTree = TRUE;
+				members++;
+				changed = TRUE;
+			}
+		}
+	}
+
+	return members;
+}
+
+/* sample the whole tree under root, returns -1 if root does not exist anymore */
+static int
+sampleTree(struct processSample * processes, pid_t root, struct treeSample * ts)
+{
+	memset(ts, 0, sizeof(struct treeSample));
+
+	int count = scanProcesses(processes, MAX_PROCESSES);
+	if(markTree(processes, count, root) == 0)
+		return -1;
+
+	for(int i=0;i<count;i++){
+		if(!processes[i].inTree)
+			continue;
+
+		readStatus(&processes[i]);
+		processes[i].fds = countFds(processes[i].pid);
+
+		ts->processes++;
+		ts->cpuTicks += processes[i].cpuTicks;
+		ts->rssKb += processes[i].rssKb;
+		ts->pssKb += processes[i].pssKb;
+		ts->voluntarySwitches += processes[i].voluntarySwitches;
+		ts->involuntarySwitches += processes[i].involuntarySwitches;
+		ts->fds += processes[i].fds;
+	}
+
+	return (ts->processes == 0) ? -1 : 0;
+}
+
+/* difference between two counters, the sum of a counter over the tree can go
+down when a process exits */
+static unsigned long long
+counterDelta(unsigned long long current, unsigned long long previous)
+{
+	return (current > previous) ? current - previous : 0;
+}
+
+static double
+secondsSince(const struct timespec * start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+	pid_t root = -1;
+	const char * name = DEFAULT_PROCESS_NAME;
+	long intervalMs = DEFAULT_INTERVAL_MS;
+	long duration = 0;	/* 0 = until the tree disappears */
+	const char * outputPath = NULL;
+
+	int opt;
+	while((opt = getopt(argc, argv, "p:n:i:d:o:")) != -1){
+		switch(opt){
+			case 'p': root = (pid_t) atol(optarg); break;
+			case 'n': name = optarg; break;
+			case 'i': intervalMs = atol(optarg); break;
+			case 'd': duration = atol(optarg); break;
+			case 'o': outputPath = optarg; break;
+			default:
+				usageErr("%s [-p pid | -n process name] [-i interval in ms] [-d duration in s] [-o output file]\n", argv[0]);
+		}
+	}
+	if(intervalMs <= 0 || duration < 0)
+		cmdLineErr("invalid interval or duration\n");
+
+	FILE * out = stdout;
+	if(outputPath != NULL){
+		out = fopen(outputPath, "w");
+		if(out == NULL)
+			errExit("fopen %s", outputPath);
+	}
+
+	struct processSample * processes = (struct processSample *) malloc(MAX_PROCESSES * sizeof(struct processSample));
+	if(processes == NULL)
+		errExit("malloc");
+
+	if(root == -1){
+		int count = scanProcesses(processes, MAX_PROCESSES);
+		root = findRoot(processes, count, name);
+		if(root == -1)
+			fatal("no process called '%s' found", name);
+	}
+
+	/* stop cleanly (flushing the output) with CTRL-C or kill */
+	struct sigaction sa;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	sa.sa_handler = stopHandler;
+	if(sigaction(SIGINT, &sa, NULL) == -1 || sigaction(SIGTERM, &sa, NULL) == -1)
+		errExit("sigaction");
+
+	long ticksPerSecond = sysconf(_SC_CLK_TCK);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	struct treeSample previous;
+	if(sampleTree(processes, root, &previous) == -1)
+		fatal("process %d does not exist", (int) root);
+	double previousTime = 0.0;
+
+	fprintf(out, "# papayachatd resources, root pid %d, interval %ld ms\n", (int) root, intervalMs);
+	fprintf(out, "# t_s\tprocs\tcpu_pct\trss_kb\tpss_kb\tvcs_s\tivcs_s\tfds\n");
+
+	/* absolute deadlines avoid drifting away from the interval */
+	struct timespec deadline = start;
+
+	while(!stopSampling){
+		deadline.tv_nsec += (intervalMs % 1000) * 1000000;
+		deadline.tv_sec += intervalMs / 1000 + deadline.tv_nsec / 1000000000;
+		deadline.tv_nsec %= 1000000000;
+		/* a signal interrupts the sleep, keep sleeping unless it was a signal
+		to stop */
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR && !stopSampling)
+			continue;
+		if(stopSampling)
+			break;
+
+		struct treeSample current;
+		if(sampleTree(processes, root, &current) == -1)
+			break;	/* the daemon is gone */
+
+		double now = secondsSince(&start);
+		double elapsed = now - previousTime;
+
+		double cpuPercent = 100.0 * counterDelta(current.cpuTicks, previous.cpuTicks) / ticksPerSecond / elapsed;
+		double voluntary = counterDelta(current.voluntarySwitches, previous.voluntarySwitches) / elapsed;
+		double involuntary = counterDelta(current.involuntarySwitches, previous.involuntarySwitches) / elapsed;
+
+		fprintf(out, "%.3f\t%d\t%.2f\t%lu\t%lu\t%.1f\t%.1f\t%lu\n", now, current.processes,
+			cpuPercent, current.rssKb, current.pssKb, voluntary, involuntary, current.fds);
+		fflush(out);
+
+		previous = current;
+		previousTime = now;
+
+		if(duration > 0 && now >= duration)
+			break;
+	}
+
+	free(processes);
+	if(out != stdout)
+		fclose(out);
+
+	exit(EXIT_SUCCESS);
+}
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
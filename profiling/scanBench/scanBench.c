@@ -0,0 +1,182 @@
+/* scanBench.c
+
+Microbenchmark for the newline scanning kernels of lineScan.c
+
+A buffer of chat lines ("userN: words\n", like the chat log) is scanned with
+every kernel supported by the CPU (scalar, sse2, avx2):
+
+count		scanCount() of the whole buffer
+split		scanFind() from line to line through the whole buffer, like the
+			client splitting the chat into lines (appendScrollback())
+findLast	scanFindLast() of the n-th newline from the end of the buffer,
+			like the history sent to a joining client (historyOffset()) and
+			the history cache loaded by the client (loadHistoryCache())
+
+split is measured with memchr() of the C library as well, as a reference.
+Every operation is repeated for about the given time, the throughput is the
+amount of bytes scanned per second.
+
+Usage: scanBench.bin [-s buffer size (KB)] [-l average line length]
+				[-n lines from the end] [-d seconds per measurement]
+
+*/
+
+#include <time.h>
+
+#include "../../basics.h"
+#include "../../lineScan.h"
+
+/* default values of the command-line options */
+#define DEFAULT_BUFFER_KB 4096
+#define DEFAULT_LINE_LENGTH 60
+#define DEFAULT_LINES_FROM_END 1000
+#define DEFAULT_DURATION 1.0	/* in seconds */
+
+static const char * kernelNames[] = { "scalar", "sse2", "avx2" };
+
+/* keeps the compiler from dropping the results */
+static volatile size_t sink;
+
+/* monotonic time in s */
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* fill buf with lines of random words, the lengths of the lines vary
+between half and one and a half times lineLength */
+static void
+fillChat(char * buf, size_t size, size_t lineLength)
+{
+	size_t i = 0;
+	unsigned int seed = 1;
+	while(i < size){
+		int prefix = snprintf(buf + i, size - i, "user%d: ", rand_r(&seed) % 100);
+		if(prefix < 0 || (size_t) prefix >= size - i)
+			break;
+		i += prefix;
+		size_t length = lineLength / 2 + rand_r(&seed) % (lineLength + 1);
+		for(size_t j = 0; j < length && i < size - 1; j++)
+			buf[i++] = (rand_r(&seed) % 6 == 0) ? ' ' : 'a' + rand_r(&seed) % 26;
+		buf[i++] = '\n';
+	}
+	buf[size - 1] = '\n';
+}
+
+/* split the buffer into lines, returns the number of lines */
+static size_t
+splitScan(const char * buf, size_t size)
+{
+	size_t lines = 0;
+	const char * end = buf + size;
+	const char * newline;
+	while((newline = scanFind(buf, end - buf, '\n')) != NULL){
+		lines++;
+		buf = newline + 1;
+	}
+	return lines;
+}
+
+static size_t
+splitMemchr(const char * buf, size_t size)
+{
+	size_t lines = 0;
+	const char * end = buf + size;
+	const char * newline;
+	while((newline = memchr(buf, '\n', end - buf)) != NULL){
+		lines++;
+		buf = newline + 1;
+	}
+	return lines;
+}
+
+enum operation { COUNT, SPLIT, SPLIT_MEMCHR, FIND_LAST };
+
+/* run the operation repeatedly for duration seconds, returns the seconds
+per operation */
+static double
+measure(enum operation op, const char * buf, size_t size, size_t linesFromEnd, double duration)
+{
+	unsigned long iterations = 0;
+	double start = now();
+	double elapsed;
+	do{
+		switch(op){
+			case COUNT: sink = scanCount(buf, size, '\n'); break;
+			case SPLIT: sink = splitScan(buf, size); break;
+			case SPLIT_MEMCHR: sink = splitMemchr(buf, size); break;
+			case FIND_LAST: sink = scanFindLast(buf, size, '\n', linesFromEnd, NULL); break;
+		}
+		iterations++;
+		elapsed = now() - start;
+	}while(elapsed < duration);
+	return elapsed / iterations;
+}
+
+static void
+printResult(const char * kernel, const char * operation, size_t bytes, double seconds)
+{
+	printf("  %-8s %-10s %10.1f us %9.2f GB/s\n", kernel, operation, seconds * 1e6, bytes / seconds / 1e9);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t bufferKB = DEFAULT_BUFFER_KB;
+	size_t lineLength = DEFAULT_LINE_LENGTH;
+	size_t linesFromEnd = DEFAULT_LINES_FROM_END;
+	double duration = DEFAULT_DURATION;
+
+	int opt;
+	while((opt = getopt(argc, argv, "s:l:n:d:")) != -1){
+		switch(opt){
+			case 's': bufferKB = (size_t) atol(optarg); break;
+			case 'l': lineLength = (size_t) atol(optarg); break;
+			case 'n': linesFromEnd = (size_t) atol(optarg); break;
+			case 'd': duration = atof(optarg); break;
+			default:
+				usageErr("%s [-s buffer size (KB)] [-l average line length] [-n lines from the end] [-d seconds]\n", argv[0]);
+		}
+	}
+	if(bufferKB == 0 || lineLength == 0 || linesFromEnd == 0 || duration <= 0)
+		cmdLineErr("invalid buffer size, line length, lines or duration\n");
+
+	size_t size = bufferKB * 1024;
+	char * buf = (char *) malloc(size);
+	if(buf == NULL)
+		errExit("malloc");
+	fillChat(buf, size, lineLength);
+
+	/* the kernels must agree, otherwise the numbers are meaningless */
+	scanSelectKernel("scalar");
+	size_t lines = scanCount(buf, size, '\n');
+	ssize_t lastOffset = scanFindLast(buf, size, '\n', linesFromEnd, NULL);
+	/* the bytes scanned by findLast */
+	size_t lastBytes = (lastOffset == -1) ? size : size - lastOffset;
+
+	printf("scanBench: %zu KB, %zu lines (%.1f bytes/line), newline %zu from the end at offset %zd\n",
+		bufferKB, lines, (double) size / lines, linesFromEnd, lastOffset);
+
+	for(size_t k = 0; k < sizeof(kernelNames) / sizeof(kernelNames[0]); k++){
+		if(scanSelectKernel(kernelNames[k]) == -1){
+			printf("  %-8s not supported by this CPU\n", kernelNames[k]);
+			continue;
+		}
+		if(scanCount(buf, size, '\n') != lines || splitScan(buf, size) != lines
+			|| scanFindLast(buf, size, '\n', linesFromEnd, NULL) != lastOffset)
+			fatal("%s kernel does not match the scalar kernel", kernelNames[k]);
+
+		printResult(kernelNames[k], "count", size, measure(COUNT, buf, size, linesFromEnd, duration));
+		printResult(kernelNames[k], "split", size, measure(SPLIT, buf, size, linesFromEnd, duration));
+		printResult(kernelNames[k], "findLast", lastBytes, measure(FIND_LAST, buf, size, linesFromEnd, duration));
+	}
+	printResult("libc", "split", size, measure(SPLIT_MEMCHR, buf, size, linesFromEnd, duration));
+
+	free(buf);
+	exit(EXIT_SUCCESS);
+}
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
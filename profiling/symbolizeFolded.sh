@@ -0,0 +1,66 @@
+#!/bin/bash
+
+# symbolizeFolded.sh resolves the frames of the folded stacks written by the
+# in-process profiler of the daemon (profiler.c), which could not be named at
+# run-time (frames with the format 'binary+0xoffset'), with addr2line.
+#
+# Usage: ./symbolizeFolded.sh <FOLDED FILE> <BINARY> [<BINARY> ...]
+#
+# Only frames of the given binaries are resolved, the other frames are kept.
+# The result is written to stdout.
+#
+# Eduardo Rodriguez (@erodrigufer) (c) 2022.
+# Licensed under AGPLv3.
+
+if [ "$#" -lt 2 ]; then
+	echo "Usage: $0 <FOLDED FILE> <BINARY> [<BINARY> ...]" 1>&2
+	exit 1
+fi
+
+FOLDED_FILE=$1
+shift
+
+if ! command -v addr2line > /dev/null; then
+	echo "Error: addr2line (binutils) is not installed." 1>&2
+	exit 1
+fi
+
+# Map with the resolved frames, 'binary+0xoffset' -> function name.
+declare -A RESOLVED
+
+for BINARY in "$@"; do
+	NAME=$(basename "${BINARY}")
+	# All different offsets of this binary found in the folded stacks.
+	OFFSETS=$(grep -o "${NAME}+0x[0-9a-f]*" "${FOLDED_FILE}" | sort -u | cut -d'+' -f2)
+	if [ -z "${OFFSETS}" ]; then
+		continue
+	fi
+
+	# addr2line -f prints two lines per address (function and file:line).
+	# The return addresses point to the instruction after the call, so
+	# resolve the address of the call itself (offset - 1).
+	ADDRESSES=$(for OFFSET in ${OFFSETS}; do printf "0x%x\n" $((OFFSET - 1)); done)
+	FUNCTIONS=$(addr2line -f -e "${BINARY}" ${ADDRESSES} | awk 'NR % 2 == 1')
+
+	while read -r OFFSET FUNCTION; do
+		if [ "${FUNCTION}" != "??" ]; then
+			RESOLVED["${NAME}+${OFFSET}"]=${FUNCTION}
+		fi
+	done < <(paste <(echo "${OFFSETS}") <(echo "${FUNCTIONS}"))
+done
+
+# Replace every resolved frame, the count at the end of each line is kept.
+awk -v FS=' ' '
+	NR == FNR { map[$1] = $2; next }
+	{
+		count = $NF
+		stack = substr($0, 1, length($0) - length(count) - 1)
+		n = split(stack, frames, ";")
+		line = ""
+		for (i = 1; i <= n; i++) {
+			frame = (frames[i] in map) ? map[frames[i]] : frames[i]
+			line = (i == 1) ? frame : line ";" frame
+		}
+		print line " " count
+	}
+' <(for KEY in "${!RESOLVED[@]}"; do echo "${KEY} ${RESOLVED[${KEY}]}"; done) "${FOLDED_FILE}"
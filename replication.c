@@ -0,0 +1,603 @@
+/* replication.c
+
+[back-end] Streaming replication of the chat log to a hot standby.
+
+A standby is a second daemon with REPLICATION_PRIMARY and REPLICATION_PORT in
+its server.config. Its clients can connect and read the chat, but only the
+replicator process appends to its chat log: it connects to the primary like
+a client, authenticates with the key and sends the hello
+
+	REPLICATE <offset> <fingerprint>
+
+offset is the end of the chat log of the standby, fingerprint the FNV-1a hash
+(hex) of the REPLICATION_FINGERPRINT bytes before it. The primary only
+streams to a standby whose chat log is a prefix of its own, otherwise it
+answers "ERROR <reason>" and closes the connection (e.g. the standby was
+promoted and written to in the meantime). If the logs match, it answers
+"STREAM <offset>" and sends every byte of its chat log from offset on, as
+soon as it was appended.
+
+The standby appends what it receives exactly like a client message
+(exclusiveWrite(), durability policy, indexes), so its own clients are woken
+up with SIGUSR1 as usual, and then acknowledges it with "ACK <offset>" (the
+end of its chat log). The primary does not wait for every acknowledgement,
+up to REPLICATION_WINDOW bytes are sent ahead (pipelining), which keeps the
+connection busy when the round trip to the standby is long. The time every
+chunk was sent is remembered until it is acknowledged, the age of the oldest
+chunk not acknowledged is the replication lag.
+
+Both sides write their state to REPLICATION_STATUS_PATH every
+REPLICATION_STATUS_PERIOD ms:
+
+	$ cat /var/lib/papayachat/papayachat.replication
+
+A lost connection is retried by the standby with the same backoff as the
+client (RECONNECT_MIN_DELAY up to RECONNECT_MAX_DELAY), it resumes at the end
+of its chat log, nothing is sent twice.
+
+*/
+
+#define _GNU_SOURCE				/* To get ppoll() from <poll.h> */
+#include <signal.h>
+#include <time.h>		/* clock_gettime(), nanosleep() */
+#include <fcntl.h>
+#include <poll.h>		/* ppoll() */
+#include <sys/stat.h>
+#include <syslog.h>		/* the replication runs as part of the daemon */
+
+#include "basics.h"
+#include "replication.h"
+#include "inet_sockets.h"	/* clientConnect() */
+#include "file_locking.h"	/* exclusiveWrite(), sharedRead(), chatLogEnd() */
+#include "signalHandling.h"	/* activateSIGUSR1() */
+#include "configure_syslog.h"
+#include "durability.h"		/* fdatasync() policy of the chat log */
+#include "searchIndex.h"	/* inverted index of the chat log */
+#include "timeIndex.h"		/* time of the messages */
+#include "profiler.h"		/* in-process sampling profiler */
+#include "lineScan.h"		/* scanFind() */
+#include "CONFIG.h"			/* REPLICATION_*, KEY_LENGTH, HELLO_MAX_LENGTH */
+
+/* bytes of the chat log hashed to check that the chat log of the standby is
+a prefix of the one of the primary */
+#define REPLICATION_FINGERPRINT 64
+/* max. bytes of the chat log sent or appended at once */
+#define REPLICATION_CHUNK (64 * 1024)
+/* max. chunks sent and not acknowledged yet */
+#define REPLICATION_INFLIGHT 1024
+
+/* 1 in the listening process of a standby and every process forked by it */
+static int standby = 0;
+
+/* set by replicationInit() */
+static const char * statusPath = REPLICATION_STATUS_PATH;
+
+/* a chunk sent to the standby, which was not acknowledged yet */
+struct inflightChunk {
+	off_t end;				/* offset after the last byte of the chunk */
+	long long sentUs;		/* time when it was sent */
+};
+
+/* monotonic time in microseconds */
+static long long
+nowUs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void
+replicationInit(const char * path)
+{
+	statusPath = path;
+}
+
+int
+replicationIsStandby(void)
+{
+	return standby;
+}
+
+/* FNV-1a hash of the (at most) REPLICATION_FINGERPRINT bytes of the chat log
+before offset, stored in hash. Returns 0 on success and -1 on error */
+static int
+fingerprint(int chatlog_fd, off_t offset, unsigned long long * hash)
+{
+	char buf[REPLICATION_FINGERPRINT];
+	off_t start = (offset > REPLICATION_FINGERPRINT) ? offset - REPLICATION_FINGERPRINT : 0;
+	ssize_t length = sharedRead(chatlog_fd, buf, offset - start, start);
+	if(length == -1)
+		return -1;
+	if(length != offset - start){
+		errno = ERANGE;
+		return -1;
+	}
+
+	*hash = 14695981039346656037ULL;
+	for(ssize_t i = 0; i < length; i++){
+		*hash ^= (unsigned char) buf[i];
+		*hash *= 1099511628211ULL;
+	}
+	return 0;
+}
+
+/* write the state of the replication (text of length bytes) to a temporary
+file and rename it to statusPath, so that a reader never sees half of it.
+Returns 0 on success and -1 on error */
+static int
+writeStatus(const char * text, int length)
+{
+	char temporaryPath[MAX_LINE_LENGTH];
+	snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", statusPath);
+	int fd = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+	if(fd == -1)
+		return -1;
+	if(write(fd, text, length) != length){
+		close(fd);
+		return -1;
+	}
+	if(close(fd) == -1)
+		return -1;
+
+	return rename(temporaryPath, statusPath);
+}
+
+/* write all length bytes of buf to fd, returns 0 on success and -1 on
+error */
+static int
+writeAll(int fd, const char * buf, size_t length)
+{
+	while(length > 0){
+		ssize_t written = write(fd, buf, length);
+		if(written == -1 && errno == EINTR)
+			continue;
+		if(written == -1)
+			return -1;
+		buf += written;
+		length -= written;
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+/* primary */
+
+/* answer "ERROR <reason>" to the standby and terminate the process */
+static void
+refuseStandby(int standby_fd, const char * reason)
+{
+	char line[HELLO_MAX_LENGTH];
+	int length = snprintf(line, sizeof(line), "ERROR %s\n", reason);
+	writeAll(standby_fd, line, length);
+	syslog(LOG_WARNING, "Standby refused: %s.", reason);
+	_exit(EXIT_FAILURE);
+}
+
+static void
+writePrimaryStatus(int connected, off_t sent, off_t acked, long long oldestUs, unsigned long long acks)
+{
+	off_t end = chatLogEnd();
+	long long lagMs = (oldestUs != 0) ? (nowUs() - oldestUs) / 1000 : 0;
+
+	char text[BUF_SIZE];
+	int length = snprintf(text, sizeof(text),
+		"role primary\n"
+		"standby_connected %d\n"
+		"primary_end %lld\n"
+		"sent_offset %lld\n"
+		"acked_offset %lld\n"
+		"lag_bytes %lld\n"
+		"lag_ms %lld\n"
+		"acks %llu\n",
+		connected, (long long) end, (long long) sent, (long long) acked,
+		(long long) (end - acked), lagMs, acks);
+	if(writeStatus(text, length) == -1)
+		syslog(LOG_ERR, "writing replication status to %s failed: %s", statusPath, strerror(errno));
+}
+
+void
+replicationServe(int standby_fd, int chatlog_fd, const char * request)
+{
+	configure_syslog("papayaChat(replication)");
+
+	/* the standby can disconnect at any time, write() returns EPIPE */
+	if(signal(SIGPIPE, SIG_IGN) == SIG_ERR){
+		syslog(LOG_ERR, "signal(SIGPIPE) failed: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+
+	long long requested;
+	unsigned long long standbyHash, primaryHash;
+	if(sscanf(request, "%lld %llx", &requested, &standbyHash) != 2 || requested < 0)
+		refuseStandby(standby_fd, "invalid REPLICATE hello");
+	if(requested > chatLogEnd())
+		refuseStandby(standby_fd, "offset after the end of the chat log of the primary");
+	if(fingerprint(chatlog_fd, requested, &primaryHash) == -1){
+		syslog(LOG_ERR, "fingerprint() failed: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	if(primaryHash != standbyHash)
+		refuseStandby(standby_fd, "the chat logs differ");
+
+	/* SIGUSR1 is only received inside ppoll(), like in sendNewMessages() a
+	message appended while sending stays pending */
+	sigset_t blockedUSR1, waitMask;
+	sigemptyset(&blockedUSR1);
+	sigaddset(&blockedUSR1, SIGUSR1);
+	if(sigprocmask(SIG_BLOCK, &blockedUSR1, &waitMask) == -1){
+		syslog(LOG_ERR, "sigprocmask() failed: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	sigdelset(&waitMask, SIGUSR1);
+	if(activateSIGUSR1() == -1){
+		syslog(LOG_ERR, "activateSIGUSR1() failed: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+
+	char line[HELLO_MAX_LENGTH];
+	int lineLength = snprintf(line, sizeof(line), "STREAM %lld\n", requested);
+	if(writeAll(standby_fd, line, lineLength) == -1){
+		syslog(LOG_ERR, "write() to standby failed: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	syslog(LOG_INFO, "Standby connected, streaming from offset %lld.", requested);
+
+	char * chunk = (char *) malloc(REPLICATION_CHUNK);
+	struct inflightChunk * inflight = (struct inflightChunk *) malloc(REPLICATION_INFLIGHT * sizeof(struct inflightChunk));
+	if(chunk == NULL || inflight == NULL){
+		syslog(LOG_ERR, "malloc failed: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	/* ring of the chunks not acknowledged, from the oldest one */
+	size_t inflightFirst = 0, inflightCount = 0;
+
+	off_t sent = requested, acked = requested;
+	unsigned long long acks = 0;
+	/* the acknowledgements read so far, up to the last complete line */
+	char ackBuf[HELLO_MAX_LENGTH];
+	size_t ackLength = 0;
+	long long nextStatus = nowUs();
+
+	for(;;){
+		/* send everything appended, as long as the window allows it */
+		off_t end = chatLogEnd();
+		while(sent < end && sent - acked < REPLICATION_WINDOW && inflightCount < REPLICATION_INFLIGHT){
+			size_t length = REPLICATION_CHUNK;
+			if(length > end - sent)
+				length = end - sent;
+			if(length > REPLICATION_WINDOW - (sent - acked))
+				length = REPLICATION_WINDOW - (sent - acked);
+			ssize_t bytesRead = sharedRead(chatlog_fd, chunk, length, sent);
+			if(bytesRead <= 0){
+				syslog(LOG_ERR, "sharedRead() failed: %s", strerror(errno));
+				_exit(EXIT_FAILURE);
+			}
+			if(writeAll(standby_fd, chunk, bytesRead) == -1){
+				syslog(LOG_INFO, "Standby disconnected: %s", strerror(errno));
+				writePrimaryStatus(0, sent, acked, 0, acks);
+				_exit(EXIT_SUCCESS);
+			}
+			sent += bytesRead;
+			struct inflightChunk * last = &inflight[(inflightFirst + inflightCount++) % REPLICATION_INFLIGHT];
+			last->end = sent;
+			last->sentUs = nowUs();
+		}
+
+		long long now = nowUs();
+		if(now >= nextStatus){
+			writePrimaryStatus(1, sent, acked, inflightCount > 0 ? inflight[inflightFirst].sentUs : 0, acks);
+			nextStatus = now + REPLICATION_STATUS_PERIOD * 1000LL;
+		}
+
+		/* wait for an acknowledgement, a new message (SIGUSR1) or the next
+		status */
+		long long waitUs = nextStatus - nowUs();
+		if(waitUs < 0)
+			waitUs = 0;
+		struct timespec timeout = { waitUs / 1000000, (waitUs % 1000000) * 1000 };
+		struct pollfd pfd = { standby_fd, POLLIN, 0 };
+		int ready = ppoll(&pfd, 1, &timeout, &waitMask);
+		if(ready == -1 && errno == EINTR)
+			continue;
+		if(ready == -1){
+			syslog(LOG_ERR, "ppoll() failed: %s", strerror(errno));
+			_exit(EXIT_FAILURE);
+		}
+		if(ready == 0)
+			continue;
+
+		ssize_t numRead = read(standby_fd, ackBuf + ackLength, sizeof(ackBuf) - ackLength);
+		if(numRead == -1 && errno == EINTR)
+			continue;
+		if(numRead <= 0){
+			syslog(LOG_INFO, "Standby disconnected at offset %lld.", (long long) acked);
+			writePrimaryStatus(0, sent, acked, 0, acks);
+			_exit(EXIT_SUCCESS);
+		}
+		ackLength += numRead;
+
+		/* every complete line is an acknowledgement */
+		char * lineStart = ackBuf;
+		char * newline;
+		while((newline = memchr(lineStart, '\n', ackBuf + ackLength - lineStart)) != NULL){
+			*newline = '\0';
+			long long ack;
+			if(sscanf(lineStart, "ACK %lld", &ack) != 1 || ack < acked || ack > sent)
+				refuseStandby(standby_fd, "invalid acknowledgement");
+			acked = ack;
+			acks++;
+			while(inflightCount > 0 && inflight[inflightFirst].end <= acked){
+				inflightFirst = (inflightFirst + 1) % REPLICATION_INFLIGHT;
+				inflightCount--;
+			}
+			lineStart = newline + 1;
+		}
+		ackLength -= lineStart - ackBuf;
+		memmove(ackBuf, lineStart, ackLength);
+		if(ackLength == sizeof(ackBuf))
+			refuseStandby(standby_fd, "acknowledgement too long");
+	}
+}
+
+/* ------------------------------------------------------------------------ */
+/* standby */
+
+/* state of the replicator, written to the status file */
+struct standbyState {
+	const char * host;
+	const char * port;
+	int connected;
+	unsigned long long receivedBytes;
+	unsigned long long connects;
+	long long lastReceiveUs;	/* 0 if nothing was received yet */
+	char lastError[HELLO_MAX_LENGTH];
+};
+
+static void
+writeStandbyStatus(const struct standbyState * state)
+{
+	long long lastReceiveMs = (state->lastReceiveUs != 0) ? (nowUs() - state->lastReceiveUs) / 1000 : -1;
+
+	char text[BUF_SIZE];
+	int length = snprintf(text, sizeof(text),
+		"role standby\n"
+		"primary %s:%s\n"
+		"connected %d\n"
+		"applied_offset %lld\n"
+		"received_bytes %llu\n"
+		"connects %llu\n"
+		"last_receive_ms %lld\n"
+		"last_error %s\n",
+		state->host, state->port, state->connected, (long long) chatLogEnd(),
+		state->receivedBytes, state->connects, lastReceiveMs,
+		(state->lastError[0] != '\0') ? state->lastError : "none");
+	if(writeStatus(text, length) == -1)
+		syslog(LOG_ERR, "writing replication status to %s failed: %s", statusPath, strerror(errno));
+}
+
+/* connect to the primary and send the hello, the answer of the primary is
+read until the end of its line (the chat log follows it). Returns the socket
+or -1 on error, the reason is stored in state->lastError */
+static int
+connectPrimary(int chatlog_fd, const char * key, struct standbyState * state)
+{
+	off_t end = chatLogEnd();
+	unsigned long long hash;
+	if(fingerprint(chatlog_fd, end, &hash) == -1){
+		snprintf(state->lastError, sizeof(state->lastError), "fingerprint: %s", strerror(errno));
+		return -1;
+	}
+
+	int primary_fd = clientConnect(state->host, state->port, SOCK_STREAM);
+	if(primary_fd == -1){
+		snprintf(state->lastError, sizeof(state->lastError), "connect: %s", strerror(errno));
+		return -1;
+	}
+
+	/* the primary has HANDSHAKE_TIMEOUT ms to answer */
+	struct timeval timeout = { HANDSHAKE_TIMEOUT / 1000, (HANDSHAKE_TIMEOUT % 1000) * 1000 };
+	int keepalive = 1;
+	if(setsockopt(primary_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1
+		|| setsockopt(primary_fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive)) == -1){
+		snprintf(state->lastError, sizeof(state->lastError), "setsockopt: %s", strerror(errno));
+		close(primary_fd);
+		return -1;
+	}
+
+	/* the key and the hello in one write(), like a client */
+	char hello[KEY_LENGTH + HELLO_MAX_LENGTH];
+	memcpy(hello, key, KEY_LENGTH);
+	int helloLength = snprintf(hello + KEY_LENGTH, HELLO_MAX_LENGTH, "REPLICATE %lld %llx\n", (long long) end, hash);
+	if(writeAll(primary_fd, hello, KEY_LENGTH + helloLength) == -1){
+		snprintf(state->lastError, sizeof(state->lastError), "write: %s", strerror(errno));
+		close(primary_fd);
+		return -1;
+	}
+
+	char answer[HELLO_MAX_LENGTH];
+	size_t length = 0;
+	for(;;){
+		ssize_t numRead = read(primary_fd, &answer[length], 1);
+		if(numRead <= 0){
+			snprintf(state->lastError, sizeof(state->lastError), "no answer from the primary (%s)",
+				(numRead == 0) ? "EOF" : strerror(errno));
+			close(primary_fd);
+			return -1;
+		}
+		if(answer[length] == '\n')
+			break;
+		if(++length == HELLO_MAX_LENGTH){
+			snprintf(state->lastError, sizeof(state->lastError), "answer of the primary too long");
+			close(primary_fd);
+			return -1;
+		}
+	}
+	answer[length] = '\0';
+
+	long long offset;
+	if(sscanf(answer, "STREAM %lld", &offset) != 1 || offset != end){
+		snprintf(state->lastError, sizeof(state->lastError), "%s", answer);
+		close(primary_fd);
+		return -1;
+	}
+
+	/* the chat log can be idle for a long time */
+	timeout.tv_sec = 0;
+	timeout.tv_usec = 0;
+	if(setsockopt(primary_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1){
+		snprintf(state->lastError, sizeof(state->lastError), "setsockopt: %s", strerror(errno));
+		close(primary_fd);
+		return -1;
+	}
+	return primary_fd;
+}
+
+/* append everything the primary sends to the chat log until the connection
+is lost or the listening process is gone */
+static void
+receiveStream(int primary_fd, int chatlog_fd, pid_t parent, struct standbyState * state)
+{
+	char * buf = (char *) malloc(REPLICATION_CHUNK);
+	if(buf == NULL){
+		syslog(LOG_ERR, "malloc failed: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	long long nextStatus = nowUs();
+
+	for(;;){
+		long long now = nowUs();
+		if(now >= nextStatus){
+			writeStandbyStatus(state);
+			nextStatus = now + REPLICATION_STATUS_PERIOD * 1000LL;
+		}
+		if(getppid() != parent){
+			syslog(LOG_DEBUG, "Replicator terminated.");
+			_exit(EXIT_SUCCESS);
+		}
+
+		struct pollfd pfd = { primary_fd, POLLIN, 0 };
+		int ready = poll(&pfd, 1, REPLICATION_STATUS_PERIOD);
+		if(ready == -1 && errno == EINTR)
+			continue;
+		if(ready == -1){
+			syslog(LOG_ERR, "poll() failed: %s", strerror(errno));
+			_exit(EXIT_FAILURE);
+		}
+		if(ready == 0)
+			continue;
+
+		ssize_t numRead = read(primary_fd, buf, REPLICATION_CHUNK);
+		if(numRead == -1 && errno == EINTR)
+			continue;
+		if(numRead <= 0){
+			snprintf(state->lastError, sizeof(state->lastError), "connection lost (%s)",
+				(numRead == 0) ? "EOF" : strerror(errno));
+			break;
+		}
+
+		/* the chat log of the primary never contains NUL bytes (they are
+		removed from the messages of the clients), they are not removed here
+		because both chat logs must have the same offsets */
+		if(scanFind(buf, numRead, '\0') != NULL){
+			snprintf(state->lastError, sizeof(state->lastError), "NUL byte received at offset %lld",
+				(long long) chatLogEnd());
+			break;
+		}
+
+		/* the same path as the messages of a client */
+		if(exclusiveWrite(chatlog_fd, buf, numRead) == -1){
+			syslog(LOG_ERR, "exclusiveWrite() failed: %s", strerror(errno));
+			_exit(EXIT_FAILURE);
+		}
+		if(durabilityAppend(chatlog_fd, numRead) == -1){
+			syslog(LOG_ERR, "fdatasync() of the chat log failed: %s", strerror(errno));
+			_exit(EXIT_FAILURE);
+		}
+		if(searchIndexUpdate(chatlog_fd) == -1)
+			syslog(LOG_ERR, "searchIndexUpdate() failed: %s", strerror(errno));
+		if(timeIndexUpdate() == -1)
+			syslog(LOG_ERR, "timeIndexUpdate() failed: %s", strerror(errno));
+		state->receivedBytes += numRead;
+		state->lastReceiveUs = nowUs();
+
+		/* with 'DURABILITY batch' the bytes acknowledged are on disk */
+		char ack[HELLO_MAX_LENGTH];
+		int ackLength = snprintf(ack, sizeof(ack), "ACK %lld\n", (long long) chatLogEnd());
+		if(writeAll(primary_fd, ack, ackLength) == -1){
+			snprintf(state->lastError, sizeof(state->lastError), "write: %s", strerror(errno));
+			break;
+		}
+	}
+	free(buf);
+}
+
+/* main loop of the replicator process, it never returns */
+static void
+runReplicator(int chatlog_fd, const char * key, pid_t parent, struct standbyState * state)
+{
+	long reconnectDelay = RECONNECT_MIN_DELAY;
+	for(;;){
+		if(getppid() != parent){
+			syslog(LOG_DEBUG, "Replicator terminated.");
+			_exit(EXIT_SUCCESS);
+		}
+
+		int primary_fd = connectPrimary(chatlog_fd, key, state);
+		if(primary_fd == -1){
+			syslog(LOG_WARNING, "Replication from %s:%s failed: %s (retry in %ld ms)",
+				state->host, state->port, state->lastError, reconnectDelay);
+			writeStandbyStatus(state);
+			struct timespec delay = { reconnectDelay / 1000, (reconnectDelay % 1000) * 1000000 };
+			nanosleep(&delay, NULL);
+			reconnectDelay *= 2;
+			if(reconnectDelay > RECONNECT_MAX_DELAY)
+				reconnectDelay = RECONNECT_MAX_DELAY;
+			continue;
+		}
+
+		reconnectDelay = RECONNECT_MIN_DELAY;
+		state->connected = 1;
+		state->connects++;
+		state->lastError[0] = '\0';
+		syslog(LOG_INFO, "Replicating from %s:%s at offset %lld.", state->host, state->port, (long long) chatLogEnd());
+
+		receiveStream(primary_fd, chatlog_fd, parent, state);
+
+		close(primary_fd);
+		state->connected = 0;
+		syslog(LOG_WARNING, "Replication from %s:%s stopped: %s", state->host, state->port, state->lastError);
+		writeStandbyStatus(state);
+	}
+}
+
+pid_t
+replicationStartStandby(int chatlog_fd, const char * host, const char * port, const char * key)
+{
+	/* the client processes forked from now on drop what their clients send */
+	standby = 1;
+
+	pid_t parent = getpid();
+	pid_t replicator = fork();
+	if(replicator != 0)
+		return replicator;	/* parent or error (-1) */
+
+	configure_syslog("papayaChat(replicator)");
+	/* interval timers are not inherited, sample this process as well */
+	if(profilerArmProcess() == -1)
+		syslog(LOG_ERR, "profilerArmProcess() failed: %s", strerror(errno));
+	/* the primary can disconnect at any time, write() returns EPIPE */
+	if(signal(SIGPIPE, SIG_IGN) == SIG_ERR){
+		syslog(LOG_ERR, "signal(SIGPIPE) failed: %s", strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+
+	struct standbyState state;
+	memset(&state, 0, sizeof(state));
+	state.host = host;
+	state.port = port;
+	runReplicator(chatlog_fd, key, parent, &state);
+	_exit(EXIT_FAILURE);	/* not reached */
+}
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
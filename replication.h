@@ -0,0 +1,35 @@
+/* replication.h
+
+[back-end] Streaming replication of the chat log from a primary daemon to a
+hot standby daemon
+
+*/
+
+#ifndef REPLICATION_H /* header guard */
+#define REPLICATION_H
+
+#include <sys/types.h>	/* pid_t */
+
+/* the state of the replication is written to statusPath (primary and
+standby), it should be called by the listening process before any fork() */
+void replicationInit(const char * statusPath);
+
+/* start the replicator process of a standby, it connects to the primary at
+host:port, authenticates with key (KEY_LENGTH bytes) and appends everything
+the primary appends to its chat log. It should be called by the listening
+process after the chat log and the indexes were opened. From now on the
+clients of this daemon can only read the chat. Returns the pid of the
+replicator or -1 on error */
+pid_t replicationStartStandby(int chatlog_fd, const char * host, const char * port, const char * key);
+
+/* 1 if this daemon is a standby, its clients cannot write to the chat log */
+int replicationIsStandby(void);
+
+/* serve a standby which sent the hello "REPLICATE <offset> <fingerprint>",
+stream the chat log from offset while receiving its acknowledgements. It
+never returns */
+void replicationServe(int standby_fd, int chatlog_fd, const char * request);
+
+#endif
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
@@ -0,0 +1,252 @@
+/* scrollback.c
+
+[front-end] In-memory scrollback of the chat.
+
+Every line received from the server is stored in a ring buffer with a fixed
+capacity (SCROLLBACK in client.config), once the ring is full the oldest
+line is overwritten. The length of every line is stored with it, so the
+number of screen rows that a wrapped line needs is known without scanning
+its text again (also after the terminal was resized).
+
+Rendering starts at the line at the bottom of the window and walks up only
+until the window is full, so drawing and scrolling take time proportional to
+the size of the window, not to the number of lines stored.
+
+*/
+
+#include "basics.h"
+#include "scrollback.h"
+#include "lineScan.h"	/* scanFind() */
+#include "CONFIG.h"	/* BUF_SIZE */
+
+/* number of screen rows that a line with length characters needs in a
+window with the given width */
+static int
+rowsOfLine(size_t length, int width)
+{
+	if(length == 0)
+		return 1;
+	return (length + width - 1) / width;
+}
+
+/* absolute number of the oldest line stored */
+static unsigned long
+oldestLine(const struct scrollback * sb)
+{
+	return sb->total - sb->count;
+}
+
+/* absolute number of the newest line, the line still being received counts
+as a line, so that it is shown before its newline arrives. Returns -1 if the
+scrollback is empty */
+static long
+newestLine(const struct scrollback * sb)
+{
+	if(sb->partialLength > 0)
+		return sb->total;
+	return (long) sb->total - 1;
+}
+
+/* text and length of the line with the absolute number line */
+static const char *
+textOfLine(const struct scrollback * sb, unsigned long line, size_t * length)
+{
+	if(line == sb->total){
+		*length = sb->partialLength;
+		return sb->partial;
+	}
+
+	const struct scrollbackLine * l = &sb->lines[(sb->first + (line - oldestLine(sb))) % sb->capacity];
+	*length = l->length;
+	return l->text;
+}
+
+int
+initScrollback(struct scrollback * sb, size_t capacity)
+{
+	memset(sb, 0, sizeof(struct scrollback));
+
+	sb->lines = (struct scrollbackLine *) calloc(capacity, sizeof(struct scrollbackLine));
+	if(sb->lines == NULL)
+		return -1;
+	sb->capacity = capacity;
+
+	sb->partialCapacity = BUF_SIZE;
+	sb->partial = (char *) malloc(sb->partialCapacity);
+	if(sb->partial == NULL)
+		return -1;
+
+	sb->following = 1;
+	return 0;
+}
+
+/* append bytes to the line still being received */
+static int
+appendPartial(struct scrollback * sb, const char * data, size_t length)
+{
+	if(sb->partialLength + length > sb->partialCapacity){
+		size_t newCapacity = sb->partialCapacity * 2;
+		while(sb->partialLength + length > newCapacity)
+			newCapacity *= 2;
+		char * newPartial = (char *) realloc(sb->partial, newCapacity);
+		if(newPartial == NULL)
+			return -1;
+		sb->partial = newPartial;
+		sb->partialCapacity = newCapacity;
+	}
+
+	memcpy(sb->partial + sb->partialLength, data, length);
+	sb->partialLength += length;
+	return 0;
+}
+
+/* store the line still being received in the ring, overwrite the oldest line
+if the ring is full */
+static int
+completeLine(struct scrollback * sb)
+{
+	char * text = (char *) malloc(sb->partialLength + 1);
+	if(text == NULL)
+		return -1;
+	memcpy(text, sb->partial, sb->partialLength);
+	text[sb->partialLength] = '\0';
+
+	struct scrollbackLine * line;
+	if(sb->count < sb->capacity){
+		line = &sb->lines[(sb->first + sb->count) % sb->capacity];
+		sb->count++;
+	} else {
+		/* the ring is full, the newest line takes the place of the oldest */
+		line = &sb->lines[sb->first];
+		free(line->text);
+		sb->first = (sb->first + 1) % sb->capacity;
+	}
+
+	line->text = text;
+	line->length = sb->partialLength;
+	sb->total++;
+	sb->partialLength = 0;
+	return 0;
+}
+
+int
+appendScrollback(struct scrollback * sb, const char * data, size_t length)
+{
+	while(length > 0){
+		const char * newline = scanFind(data, length, '\n');
+		size_t chunk = (newline != NULL) ? (size_t) (newline - data) : length;
+
+		if(appendPartial(sb, data, chunk) == -1)
+			return -1;
+
+		/* the line is only complete, once its newline was received */
+		if(newline == NULL)
+			break;
+		if(completeLine(sb) == -1)
+			return -1;
+
+		data += chunk + 1;
+		length -= chunk + 1;
+	}
+
+	return 0;
+}
+
+void
+scrollScrollback(struct scrollback * sb, int rows, int height, int width)
+{
+	long newest = newestLine(sb);
+	if(newest < 0 || height <= 0 || width <= 0)
+		return;
+
+	if(sb->following)
+		sb->bottom = newest;
+	/* the line at the bottom might have been overwritten in the meantime */
+	if(sb->bottom < oldestLine(sb))
+		sb->bottom = oldestLine(sb);
+
+	size_t length;
+	/* scroll up, towards older lines */
+	while(rows < 0 && sb->bottom > oldestLine(sb)){
+		textOfLine(sb, sb->bottom, &length);
+		rows += rowsOfLine(length, width);
+		sb->bottom--;
+	}
+	/* scroll down, towards newer lines */
+	while(rows > 0 && (long) sb->bottom < newest){
+		sb->bottom++;
+		textOfLine(sb, sb->bottom, &length);
+		rows -= rowsOfLine(length, width);
+	}
+
+	/* the oldest lines should fill the whole window, instead of being shown
+	at the bottom of an otherwise empty window */
+	unsigned long minBottom = oldestLine(sb);
+	textOfLine(sb, minBottom, &length);
+	int rowsUsed = rowsOfLine(length, width);
+	while(rowsUsed < height && (long) minBottom < newest){
+		minBottom++;
+		textOfLine(sb, minBottom, &length);
+		rowsUsed += rowsOfLine(length, width);
+	}
+	if(sb->bottom < minBottom)
+		sb->bottom = minBottom;
+
+	/* the newest line is at the bottom again, show new lines as they arrive */
+	sb->following = ((long) sb->bottom >= newest);
+}
+
+void
+renderScrollback(const struct scrollback * sb, WINDOW * window)
+{
+	int height = getmaxy(window);
+	int width = getmaxx(window);
+
+	werase(window);
+
+	long newest = newestLine(sb);
+	if(newest < 0 || height <= 0 || width <= 0)
+		return;
+
+	unsigned long bottom = sb->following ? (unsigned long) newest : sb->bottom;
+	if(bottom < oldestLine(sb))
+		bottom = oldestLine(sb);
+
+	/* walk up from the bottom line, until the lines fill the window */
+	unsigned long top = bottom;
+	size_t length;
+	textOfLine(sb, top, &length);
+	int rowsUsed = rowsOfLine(length, width);
+	while(rowsUsed < height && top > oldestLine(sb)){
+		top--;
+		textOfLine(sb, top, &length);
+		rowsUsed += rowsOfLine(length, width);
+	}
+	/* the oldest lines were overwritten while the user was scrolled up to
+	them, fill the rest of the window with newer lines */
+	while(rowsUsed < height && (long) bottom < newest){
+		bottom++;
+		textOfLine(sb, bottom, &length);
+		rowsUsed += rowsOfLine(length, width);
+	}
+
+	/* the top line might not fit completely, then only its last rows are
+	shown (y starts negative) */
+	int y = height - rowsUsed;
+	for(unsigned long line = top; line <= bottom; line++){
+		const char * text = textOfLine(sb, line, &length);
+		int rows = rowsOfLine(length, width);
+		for(int row = 0; row < rows; row++, y++){
+			if(y < 0)
+				continue;
+			size_t offset = (size_t) row * width;
+			size_t segment = length - offset;
+			if(segment > (size_t) width)
+				segment = width;
+			if(segment > 0)
+				mvwaddnstr(window, y, 0, text + offset, segment);
+		}
+	}
+}
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
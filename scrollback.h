@@ -0,0 +1,63 @@
+/* scrollback.h
+
+[front-end] In-memory scrollback of the chat, a ring buffer with a fixed
+capacity of lines, of which only the visible slice is rendered
+
+*/
+
+#ifndef SCROLLBACK_H /* header guard */
+#define SCROLLBACK_H
+
+#include <ncurses.h>
+#include <sys/types.h>	/* size_t */
+
+/* a single line of the chat (without newline) */
+struct scrollbackLine {
+	char * text;
+	size_t length;
+};
+
+struct scrollback {
+	struct scrollbackLine * lines;	/* ring buffer of lines */
+	size_t capacity;	/* max. number of lines stored, the oldest line is
+						overwritten by a new line if the ring is full */
+	size_t first;		/* index in lines of the oldest line */
+	size_t count;		/* number of lines stored */
+	unsigned long total;	/* number of lines ever appended, the absolute
+							number of a line does not change when older lines
+							are overwritten */
+
+	/* received bytes after the last newline, a line is only appended once
+	its newline was received */
+	char * partial;
+	size_t partialLength;
+	size_t partialCapacity;
+
+	/* absolute number of the line shown at the bottom of the window, if
+	the user scrolled up. If following is set, the bottom of the window
+	always shows the newest line */
+	unsigned long bottom;
+	int following;
+};
+
+/* allocate a scrollback with capacity lines, returns 0 on success and -1 on
+error */
+int initScrollback(struct scrollback * sb, size_t capacity);
+
+/* append the bytes received from the server, every newline completes a line,
+returns 0 on success and -1 on error */
+int appendScrollback(struct scrollback * sb, const char * data, size_t length);
+
+/* scroll by the given amount of screen rows (negative values scroll up,
+towards older lines) for a window with the given height and width, scrolling
+down past the newest line follows new lines again */
+void scrollScrollback(struct scrollback * sb, int rows, int height, int width);
+
+/* draw the visible slice of the scrollback into window, only the lines that
+fit into the window are visited, so it takes constant time independently of
+the number of lines stored. The window is not refreshed */
+void renderScrollback(const struct scrollback * sb, WINDOW * window);
+
+#endif
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
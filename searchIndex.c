@@ -0,0 +1,590 @@
+/* searchIndex.c
+
+[back-end] Inverted index of the chat log for the full-text search.
+
+Every line of the chat log is split into terms: runs of ASCII letters and
+digits (lowercased) and of non-ASCII bytes (UTF-8), with at least
+TERM_MIN_LENGTH and at most TERM_MAX_LENGTH bytes, longer runs are not
+indexed. For every term the index keeps its posting list, the offsets in the
+chat log of the lines containing it in ascending order. A query ("SEARCH
+<terms>", see client.bin -s) intersects the posting lists of its terms,
+starting with the shortest one, and only the matching lines are read from
+the chat log, which is never scanned.
+
+The index is a file next to the chat log (SEARCH_INDEX_PATH), mapped with
+MAP_SHARED by the listening process, so that all processes of the daemon
+share it (the mapping is inherited through fork()) and it survives a restart:
+
+	header | hash table of the terms | arena (terms and posting blocks)
+
+The file is created sparse with its max. size (SEARCH_INDEX_MAX_SIZE), its
+pages are only allocated when the arena grows into them. A posting list is a
+chain of blocks of POSTING_BLOCK_SIZE bytes, which store the difference to
+the previous offset as a varint (7 bits per byte): consecutive lines
+containing a term are usually close to each other, so a posting takes 1 or 2
+bytes instead of 8. When the arena is full, no more lines are indexed.
+
+After every append searchIndexUpdate() indexes the complete lines between
+the end of the indexed lines (indexedEnd) and the logical end of the chat
+log, a line written with several appends is indexed once its newline
+arrived. The lines are read with sharedRead(), so they come from the hot tail
+of the chat log. A process-shared robust mutex serializes updates and
+queries.
+
+On startup the index is reused if it belongs to the chat log (indexedEnd is
+not after the end of the chat log and the bytes before indexedEnd did not
+change), then only the lines appended since it was written the last time are
+indexed. Otherwise, or if a process died while changing the index, the index
+is built again from the start of the chat log.
+
+*/
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stddef.h>		/* offsetof() */
+#include <pthread.h>	/* process-shared mutex */
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <syslog.h>		/* the index is used by the daemon */
+
+#include "basics.h"
+#include "searchIndex.h"
+#include "file_locking.h"	/* sharedRead(), chatLogEnd(), initSharedMutex() */
+#include "CONFIG.h"			/* SEARCH_INDEX_MAX_SIZE, SEARCH_INDEX_BUCKETS */
+
+#define SEARCH_INDEX_MAGIC "PAPAYAIX"
+#define SEARCH_INDEX_VERSION 1
+
+/* min. and max. length of an indexed term in bytes */
+#define TERM_MIN_LENGTH 2
+#define TERM_MAX_LENGTH 32
+
+/* max. number of terms of a query, the others are ignored */
+#define QUERY_MAX_TERMS 8
+
+#define POSTING_BLOCK_SIZE 64
+
+/* bytes of the chat log read at once while indexing */
+#define INDEX_READ_CHUNK (64 * 1024)
+
+/* bytes before indexedEnd used to recognize the chat log of the index */
+#define FINGERPRINT_LENGTH 64
+
+struct indexHeader {
+	char magic[8];			/* SEARCH_INDEX_MAGIC */
+	uint32_t version;		/* SEARCH_INDEX_VERSION */
+	uint32_t buckets;		/* SEARCH_INDEX_BUCKETS */
+	uint64_t size;			/* size of the file */
+	uint64_t indexedEnd;	/* offset in the chat log after the last indexed line */
+	uint64_t fingerprint;	/* hash of the bytes of the chat log before indexedEnd */
+	uint64_t used;			/* bytes of the file in use, the arena grows at its end */
+	uint64_t terms;
+	uint64_t postings;
+	uint32_t updating;		/* 1 while the index is changed */
+	uint32_t full;			/* 1 if a term or block did not fit anymore */
+	pthread_mutex_t lock;	/* process-shared, robust */
+};
+
+/* a term of the hash table, followed by its text */
+struct indexTerm {
+	uint32_t next;			/* next term of the bucket, 0 at the end */
+	uint32_t firstBlock;	/* posting blocks of the term */
+	uint32_t lastBlock;
+	uint32_t count;			/* lines containing the term */
+	uint64_t lastOffset;	/* the next posting is stored as the difference
+							to this one */
+	uint8_t length;
+	char text[];
+};
+
+struct postingBlock {
+	uint32_t next;			/* 0 for the last block of a term */
+	uint16_t used;			/* bytes of data in use */
+	uint8_t data[POSTING_BLOCK_SIZE - 6];
+};
+
+/* NULL if the index is not open. The terms and blocks are referenced by
+their offset in the file (0 is never a valid offset) */
+static struct indexHeader * header = NULL;
+static char * indexBase = NULL;
+static uint32_t * hashTable = NULL;
+
+#define AT(offset) ((void *) (indexBase + (offset)))
+
+/* FNV-1a */
+static uint64_t
+hashBytes(const char * bytes, size_t length)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for(size_t i = 0; i < length; i++){
+		hash ^= (unsigned char) bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static int
+isTermByte(unsigned char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+		|| c >= 0x80;
+}
+
+/* find the next term of text starting at *position, it is stored lowercased
+in term (TERM_MAX_LENGTH bytes). Returns the length of the term, or 0 if
+text has no more terms */
+static size_t
+nextTerm(const char * text, size_t length, size_t * position, char * term)
+{
+	size_t i = *position;
+	for(;;){
+		while(i < length && !isTermByte(text[i]))
+			i++;
+		size_t start = i;
+		while(i < length && isTermByte(text[i]))
+			i++;
+		size_t termLength = i - start;
+		if(termLength == 0){
+			*position = i;
+			return 0;
+		}
+		/* too short or too long to be indexed, try the next one */
+		if(termLength < TERM_MIN_LENGTH || termLength > TERM_MAX_LENGTH)
+			continue;
+
+		for(size_t j = 0; j < termLength; j++){
+			char c = text[start + j];
+			term[j] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+		}
+		*position = i;
+		return termLength;
+	}
+}
+
+/* allocate size bytes of the arena, returns their offset or 0 if the index
+is full */
+static uint32_t
+allocateIndex(size_t size)
+{
+	size = (size + 7) & ~(size_t) 7;
+	if(header->used + size > header->size){
+		if(!header->full)
+			syslog(LOG_ERR, "Search index is full, the lines after offset %llu of the chat log are not indexed.",
+				(unsigned long long) header->indexedEnd);
+		header->full = 1;
+		return 0;
+	}
+	uint32_t offset = header->used;
+	header->used += size;
+	return offset;
+}
+
+/* find a term, if it is not in the index yet and create is set, it is added.
+Returns NULL if it was not found (or the index is full) */
+static struct indexTerm *
+findTerm(const char * text, size_t length, int create)
+{
+	uint32_t * bucket = &hashTable[hashBytes(text, length) % header->buckets];
+	for(uint32_t offset = *bucket; offset != 0; ){
+		struct indexTerm * term = AT(offset);
+		if(term->length == length && memcmp(term->text, text, length) == 0)
+			return term;
+		offset = term->next;
+	}
+	if(!create)
+		return NULL;
+
+	uint32_t termOffset = allocateIndex(offsetof(struct indexTerm, text) + length);
+	uint32_t blockOffset = allocateIndex(sizeof(struct postingBlock));
+	if(termOffset == 0 || blockOffset == 0)
+		return NULL;
+
+	struct postingBlock * block = AT(blockOffset);
+	block->next = 0;
+	block->used = 0;
+
+	struct indexTerm * term = AT(termOffset);
+	term->firstBlock = blockOffset;
+	term->lastBlock = blockOffset;
+	term->count = 0;
+	term->lastOffset = 0;
+	term->length = length;
+	memcpy(term->text, text, length);
+	term->next = *bucket;
+	*bucket = termOffset;
+	header->terms++;
+	return term;
+}
+
+/* append the line at lineOffset to the posting list of term, returns 0 on
+success and -1 if the index is full */
+static int
+addPosting(struct indexTerm * term, uint64_t lineOffset)
+{
+	/* the term appears more than once in the line */
+	if(term->count > 0 && term->lastOffset == lineOffset)
+		return 0;
+
+	uint8_t varint[10];
+	size_t length = 0;
+	uint64_t delta = lineOffset - term->lastOffset;
+	do {
+		varint[length] = delta & 0x7f;
+		delta >>= 7;
+		if(delta != 0)
+			varint[length] |= 0x80;
+		length++;
+	} while(delta != 0);
+
+	struct postingBlock * block = AT(term->lastBlock);
+	if(block->used + length > sizeof(block->data)){
+		uint32_t blockOffset = allocateIndex(sizeof(struct postingBlock));
+		if(blockOffset == 0)
+			return -1;
+		block->next = blockOffset;
+		term->lastBlock = blockOffset;
+		block = AT(blockOffset);
+		block->next = 0;
+		block->used = 0;
+	}
+
+	memcpy(&block->data[block->used], varint, length);
+	block->used += length;
+	term->lastOffset = lineOffset;
+	term->count++;
+	header->postings++;
+	return 0;
+}
+
+/* add every term of a line to the index, returns 0 on success and -1 if the
+index is full */
+static int
+indexLine(const char * line, size_t length, uint64_t lineOffset)
+{
+	char text[TERM_MAX_LENGTH];
+	size_t position = 0;
+	size_t termLength;
+	while((termLength = nextTerm(line, length, &position, text)) > 0){
+		struct indexTerm * term = findTerm(text, termLength, 1);
+		if(term == NULL || addPosting(term, lineOffset) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/* decode the posting list of term into postings (term->count entries),
+returns the number of postings */
+static size_t
+decodePostings(const struct indexTerm * term, uint64_t * postings)
+{
+	size_t count = 0;
+	uint64_t offset = 0;
+	for(uint32_t blockOffset = term->firstBlock; blockOffset != 0; ){
+		const struct postingBlock * block = AT(blockOffset);
+		for(size_t i = 0; i < block->used; ){
+			uint64_t delta = 0;
+			int shift = 0;
+			uint8_t byte;
+			do {
+				byte = block->data[i++];
+				delta |= (uint64_t) (byte & 0x7f) << shift;
+				shift += 7;
+			} while(byte & 0x80);
+			offset += delta;
+			postings[count++] = offset;
+		}
+		blockOffset = block->next;
+	}
+	return count;
+}
+
+/* keep only the matches (ascending) which are in the posting list of term as
+well, returns the number of matches left */
+static size_t
+intersectPostings(const struct indexTerm * term, uint64_t * matches, size_t matchCount)
+{
+	size_t kept = 0;
+	size_t m = 0;
+	uint64_t offset = 0;
+	for(uint32_t blockOffset = term->firstBlock; blockOffset != 0 && m < matchCount; ){
+		const struct postingBlock * block = AT(blockOffset);
+		for(size_t i = 0; i < block->used && m < matchCount; ){
+			uint64_t delta = 0;
+			int shift = 0;
+			uint8_t byte;
+			do {
+				byte = block->data[i++];
+				delta |= (uint64_t) (byte & 0x7f) << shift;
+				shift += 7;
+			} while(byte & 0x80);
+			offset += delta;
+
+			while(m < matchCount && matches[m] < offset)
+				m++;
+			if(m < matchCount && matches[m] == offset)
+				matches[kept++] = matches[m++];
+		}
+		blockOffset = block->next;
+	}
+	return kept;
+}
+
+/* empty the index, the chat log is indexed again from its start */
+static void
+resetIndex(void)
+{
+	header->indexedEnd = 0;
+	header->fingerprint = 0;
+	header->terms = 0;
+	header->postings = 0;
+	header->full = 0;
+	memset(hashTable, 0, header->buckets * sizeof(uint32_t));
+	header->used = ((char *) (hashTable + header->buckets) - indexBase + 7) & ~(uint64_t) 7;
+	header->updating = 0;
+}
+
+/* hash of the FINGERPRINT_LENGTH bytes of the chat log before end (or
+less, at its start), returns -1 on error */
+static int
+chatLogFingerprint(int chatlog_fd, uint64_t end, uint64_t * fingerprint)
+{
+	char bytes[FINGERPRINT_LENGTH];
+	uint64_t start = (end > FINGERPRINT_LENGTH) ? end - FINGERPRINT_LENGTH : 0;
+	size_t length = 0;
+	while(start + length < end){
+		ssize_t bytesRead = sharedRead(chatlog_fd, bytes + length, end - start - length, start + length);
+		if(bytesRead <= 0)
+			return -1;
+		length += bytesRead;
+	}
+	*fingerprint = hashBytes(bytes, length);
+	return 0;
+}
+
+/* the owner of the lock died, if it was changing the index, the index is
+built again */
+static void
+repairIndex(void)
+{
+	if(header->updating){
+		syslog(LOG_ERR, "A process died while updating the search index, it is built again.");
+		resetIndex();
+	}
+}
+
+/* lock the index, returns 0 on success and -1 on error */
+static int
+lockIndex(void)
+{
+	return lockSharedMutex(&header->lock, repairIndex);
+}
+
+/* index the complete lines between indexedEnd and the end of the chat log,
+the caller holds the lock. Returns 0 on success and -1 on error */
+static int
+indexChatLog(int chatlog_fd)
+{
+	uint64_t end = chatLogEnd();
+	if(header->full || header->indexedEnd >= end)
+		return 0;
+
+	char * buffer = (char *) malloc(INDEX_READ_CHUNK);
+	if(buffer == NULL)
+		return -1;
+
+	header->updating = 1;
+	while(!header->full && header->indexedEnd < end){
+		size_t wanted = end - header->indexedEnd;
+		if(wanted > INDEX_READ_CHUNK)
+			wanted = INDEX_READ_CHUNK;
+		ssize_t bytesRead = sharedRead(chatlog_fd, buffer, wanted, header->indexedEnd);
+		if(bytesRead <= 0){
+			free(buffer);
+			header->updating = 0;
+			return -1;
+		}
+
+		size_t position = 0;
+		while(position < (size_t) bytesRead){
+			char * newline = memchr(buffer + position, '\n', bytesRead - position);
+			size_t lineLength;
+			if(newline != NULL)
+				lineLength = newline - (buffer + position) + 1;
+			/* a line longer than the buffer is indexed in pieces */
+			else if(position == 0 && bytesRead == INDEX_READ_CHUNK)
+				lineLength = bytesRead;
+			else
+				break;	/* the rest of the line was not written yet */
+
+			if(indexLine(buffer + position, lineLength, header->indexedEnd) == -1)
+				break;	/* full */
+			header->indexedEnd += lineLength;
+			position += lineLength;
+		}
+		if(position == 0)
+			break;
+	}
+	free(buffer);
+
+	int result = chatLogFingerprint(chatlog_fd, header->indexedEnd, &header->fingerprint);
+	header->updating = 0;
+	return result;
+}
+
+/* does the index in the file belong to the chat log */
+static int
+validIndex(int chatlog_fd)
+{
+	uint64_t fingerprint;
+	return memcmp(header->magic, SEARCH_INDEX_MAGIC, sizeof(header->magic)) == 0
+		&& header->version == SEARCH_INDEX_VERSION
+		&& header->buckets == SEARCH_INDEX_BUCKETS
+		&& header->size == SEARCH_INDEX_MAX_SIZE
+		&& header->used <= header->size
+		&& !header->updating
+		&& header->indexedEnd <= (uint64_t) chatLogEnd()
+		&& chatLogFingerprint(chatlog_fd, header->indexedEnd, &fingerprint) == 0
+		&& fingerprint == header->fingerprint;
+}
+
+int
+searchIndexOpen(const char * path, int chatlog_fd)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+	if(fd == -1)
+		return -1;
+
+	/* a new (or foreign) file gets the max. size, without allocating it */
+	struct stat fileStat;
+	if(fstat(fd, &fileStat) == -1){
+		close(fd);
+		return -1;
+	}
+	if(fileStat.st_size != SEARCH_INDEX_MAX_SIZE
+		&& (ftruncate(fd, 0) == -1 || ftruncate(fd, SEARCH_INDEX_MAX_SIZE) == -1)){
+		close(fd);
+		return -1;
+	}
+
+	/* the mapping stays after the file is closed */
+	void * mapping = mmap(NULL, SEARCH_INDEX_MAX_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(mapping == MAP_FAILED)
+		return -1;
+
+	indexBase = mapping;
+	header = mapping;
+	hashTable = (uint32_t *) (indexBase + ((sizeof(struct indexHeader) + 7) & ~(size_t) 7));
+
+	/* the lock stored in the file belonged to the processes of the last
+	daemon */
+	memset(&header->lock, 0, sizeof(header->lock));
+	if(initSharedMutex(&header->lock) == -1){
+		munmap(mapping, SEARCH_INDEX_MAX_SIZE);
+		header = NULL;
+		return -1;
+	}
+
+	if(!validIndex(chatlog_fd)){
+		syslog(LOG_INFO, "Search index %s does not belong to the chat log, it is built again.", path);
+		memcpy(header->magic, SEARCH_INDEX_MAGIC, sizeof(header->magic));
+		header->version = SEARCH_INDEX_VERSION;
+		header->buckets = SEARCH_INDEX_BUCKETS;
+		header->size = SEARCH_INDEX_MAX_SIZE;
+		resetIndex();
+	}
+
+	if(indexChatLog(chatlog_fd) == -1){
+		munmap(mapping, SEARCH_INDEX_MAX_SIZE);
+		header = NULL;
+		return -1;
+	}
+	syslog(LOG_INFO, "Search index: %llu terms, %llu postings, %llu bytes.",
+		(unsigned long long) header->terms, (unsigned long long) header->postings,
+		(unsigned long long) header->used);
+	return 0;
+}
+
+int
+searchIndexUpdate(int chatlog_fd)
+{
+	if(header == NULL)
+		return 0;
+
+	if(lockIndex() == -1)
+		return -1;
+	int result = indexChatLog(chatlog_fd);
+	pthread_mutex_unlock(&header->lock);
+	return result;
+}
+
+long
+searchIndexQuery(const char * query, off_t * results, size_t maxResults)
+{
+	if(header == NULL){
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	/* the distinct terms of the query */
+	char terms[QUERY_MAX_TERMS][TERM_MAX_LENGTH];
+	size_t termLengths[QUERY_MAX_TERMS];
+	int termCount = 0;
+	size_t position = 0;
+	while(termCount < QUERY_MAX_TERMS
+		&& (termLengths[termCount] = nextTerm(query, strlen(query), &position, terms[termCount])) > 0){
+		int duplicate = 0;
+		for(int i = 0; i < termCount; i++)
+			if(termLengths[i] == termLengths[termCount]
+				&& memcmp(terms[i], terms[termCount], termLengths[i]) == 0)
+				duplicate = 1;
+		if(!duplicate)
+			termCount++;
+	}
+	if(termCount == 0)
+		return 0;
+
+	if(lockIndex() == -1)
+		return -1;
+
+	/* every term must be in the index, the shortest posting list is
+	intersected first */
+	struct indexTerm * found[QUERY_MAX_TERMS];
+	for(int i = 0; i < termCount; i++){
+		found[i] = findTerm(terms[i], termLengths[i], 0);
+		if(found[i] == NULL){
+			pthread_mutex_unlock(&header->lock);
+			return 0;
+		}
+		for(int j = i; j > 0 && found[j]->count < found[j-1]->count; j--){
+			struct indexTerm * swap = found[j];
+			found[j] = found[j-1];
+			found[j-1] = swap;
+		}
+	}
+
+	/* a term added while the index became full has no postings */
+	if(found[0]->count == 0){
+		pthread_mutex_unlock(&header->lock);
+		return 0;
+	}
+	uint64_t * matches = (uint64_t *) malloc(found[0]->count * sizeof(uint64_t));
+	if(matches == NULL){
+		pthread_mutex_unlock(&header->lock);
+		return -1;
+	}
+	size_t matchCount = decodePostings(found[0], matches);
+	for(int i = 1; i < termCount && matchCount > 0; i++)
+		matchCount = intersectPostings(found[i], matches, matchCount);
+	pthread_mutex_unlock(&header->lock);
+
+	/* the most recent matches */
+	size_t first = (matchCount > maxResults) ? matchCount - maxResults : 0;
+	for(size_t i = first; i < matchCount; i++)
+		results[i - first] = matches[i];
+
+	free(matches);
+	return matchCount;
+}
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
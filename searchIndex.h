@@ -0,0 +1,33 @@
+/* searchIndex.h
+
+[back-end] Inverted index of the chat log (term -> offsets of the lines
+containing it), used to answer search queries without scanning the chat log
+
+*/
+
+#ifndef SEARCHINDEX_H /* header guard */
+#define SEARCHINDEX_H
+
+#include <sys/types.h>	/* off_t, size_t */
+
+/* open (or create) the index stored at path and index the lines appended to
+the chat log since the index was written the last time (or the whole chat
+log, if the index does not belong to it). It should be called once by the
+listening process after openChatLogFile() and before any fork(). Returns 0
+on success and -1 on error */
+int searchIndexOpen(const char * path, int chatlog_fd);
+
+/* index the complete lines appended to the chat log since the last update,
+it is called after every exclusiveWrite(). Does nothing if the index is not
+open. Returns 0 on success and -1 on error */
+int searchIndexUpdate(int chatlog_fd);
+
+/* find the lines containing every term of query, the offsets of at most
+maxResults of them (the most recent ones) are stored in ascending order in
+results. Returns the number of lines matching (which can be more than
+maxResults) or -1 on error (errno = ENOTSUP if the index is not open) */
+long searchIndexQuery(const char * query, off_t * results, size_t maxResults);
+
+#endif
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
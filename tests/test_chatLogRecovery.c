@@ -0,0 +1,129 @@
+#include <sys/wait.h>
+#include <fcntl.h>
+
+#include "../basics.h"
+#include "../file_locking.h"
+
+/* test of the startup recovery of the chat log (recoverTornTail() in
+file_locking.c): every case writes a chat log followed by NUL bytes (the
+preallocated tail) to CHAT_LOG_PATH of the TEST build (./chat_log.chat),
+opens it in a child process (the logical end is only searched once per
+process) and checks the logical end and the bytes of the file. Returns != 0
+if a case failed */
+
+#define CHAT_LOG "./chat_log.chat"
+/* NUL bytes written after the data of every case */
+#define PREALLOCATED 4096
+
+/* data is written, the logical end must be recovered, the bytes after it
+must be NUL and the bytes before it unchanged */
+struct recoveryCase {
+	const char * name;
+	const char * data;
+	size_t length;
+	off_t recovered;
+};
+
+#define DATA(text) text, sizeof(text) - 1
+
+static const struct recoveryCase cases[] = {
+	{ "empty chat log", DATA(""), 0 },
+	{ "complete lines", DATA("alice: hi\nbob: hello\n"), 21 },
+	{ "torn last line", DATA("alice: hi\nbob: hel"), 10 },
+	{ "torn line without any newline", DATA("alice: h"), 0 },
+	/* blocks of alice's message were never written back, bob's were */
+	{ "NUL hole", DATA("alice: \0\0\0\0\0\0\0\0\nbob: hello\n"), 27 },
+	{ "NUL hole and torn last line", DATA("alice: hi\n\0\0\0\0bob: hello\ncarol: he"), 25 },
+	/* written by a daemon which did not remove NUL bytes from the messages */
+	{ "NUL inside a message", DATA("alice: before\nmallory: a\0b\n"
+		"bob: valid message 1\nbob: valid message 2\nbob: valid message 3\n"
+		"bob: valid message 4\nbob: valid message 5\n"), 132 },
+};
+
+/* write the chat log of a case, returns 0 on success and -1 on error */
+static int
+writeChatLog(const struct recoveryCase * recovery)
+{
+	int fd = open(CHAT_LOG, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if(fd == -1)
+		return -1;
+	char zeros[PREALLOCATED] = { 0 };
+	if(write(fd, recovery->data, recovery->length) != (ssize_t) recovery->length
+		|| write(fd, zeros, PREALLOCATED) != PREALLOCATED){
+		close(fd);
+		return -1;
+	}
+	return close(fd);
+}
+
+/* run in a child process, returns 0 if the chat log was recovered as
+expected */
+static int
+checkRecovery(const struct recoveryCase * recovery)
+{
+	int fd = openChatLogFile();
+	if(fd == -1){
+		printf("[FAILED] %s: openChatLogFile(): %s\n", recovery->name, strerror(errno));
+		return -1;
+	}
+	if(chatLogEnd() != recovery->recovered){
+		printf("[FAILED] %s: logical end %lld, expected %lld\n", recovery->name,
+			(long long) chatLogEnd(), (long long) recovery->recovered);
+		return -1;
+	}
+
+	char * content = (char *) malloc(recovery->length + 1);
+	if(content == NULL || pread(fd, content, recovery->length, 0) != (ssize_t) recovery->length){
+		printf("[FAILED] %s: pread(): %s\n", recovery->name, strerror(errno));
+		return -1;
+	}
+	int failed = 0;
+	if(memcmp(content, recovery->data, recovery->recovered) != 0){
+		printf("[FAILED] %s: the data before the logical end was changed\n", recovery->name);
+		failed = -1;
+	}
+	for(size_t i = recovery->recovered; i < recovery->length; i++){
+		if(content[i] != '\0'){
+			printf("[FAILED] %s: byte %zu after the logical end is not NUL\n", recovery->name, i);
+			failed = -1;
+			break;
+		}
+	}
+	free(content);
+	return failed;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int failures = 0;
+	for(size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++){
+		const struct recoveryCase * recovery = &cases[c];
+		if(writeChatLog(recovery) == -1){
+			printf("[FAILED] %s: cannot write %s: %s\n", recovery->name, CHAT_LOG, strerror(errno));
+			failures++;
+			continue;
+		}
+
+		/* the child must not print the lines buffered until now again */
+		fflush(stdout);
+		pid_t child = fork();
+		if(child == -1)
+			return -1;
+		if(child == 0){
+			int result = checkRecovery(recovery);
+			fflush(stdout);
+			_exit((result == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+
+		int status;
+		if(waitpid(child, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+			failures++;
+			continue;
+		}
+		printf("[passed] %s\n", recovery->name);
+	}
+
+	unlink(CHAT_LOG);
+	return (failures == 0) ? 0 : -1;
+}
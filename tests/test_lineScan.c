@@ -0,0 +1,177 @@
+#include "../basics.h"
+#include "../lineScan.h"
+
+/* differential test of the kernels of lineScan.c: every kernel supported by
+the CPU must give the same results as the scalar kernel for random buffers
+of every length up to MAX_LENGTH, at every alignment and with few, many or
+only delimiters. The results of the scalar kernel are compared with a naive
+loop as well. Prints the kernels tested and returns != 0 on a mismatch */
+
+#define MAX_LENGTH 600
+#define ROUNDS 40
+
+/* the SSE2 and AVX2 counters are flushed after 255 blocks of 16 or 32 bytes,
+these lengths end right before, at and after one or more flushes. With a
+delimiter in every byte the byte counters overflow without the flush */
+static const size_t flushLengths[] = {
+	255 * 16 - 1, 255 * 16, 255 * 16 + 1, 255 * 16 + 15,
+	255 * 32 - 1, 255 * 32, 255 * 32 + 1, 255 * 32 + 31,
+	2 * 255 * 32 + 7, 3 * 255 * 32 + 17, 65536 + 5
+};
+#define FLUSH_MAX_LENGTH (65536 + 5)
+
+static const char * kernelNames[] = { "scalar", "sse2", "avx2" };
+
+/* one delimiter in every 1, 2, 8, 64 or 1024 bytes */
+static const unsigned long densities[] = { 1, 2, 8, 64, 1024 };
+
+/* deterministic pseudo-random numbers (xorshift), the same buffers on every
+run */
+static unsigned long state = 88172645463325252UL;
+
+static unsigned long
+nextRandom(void)
+{
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+/* fill length bytes of buf with one delimiter in every density bytes (on
+average) */
+static void
+fillBuffer(char * buf, size_t length, unsigned long density)
+{
+	for(size_t i = 0; i < length; i++){
+		/* the bytes next to the delimiter as well, 0x8a differs from '\n'
+		only in the sign bit */
+		unsigned long r = nextRandom();
+		if(r % density == 0)
+			buf[i] = '\n';
+		else
+			buf[i] = "a\x0b\x09\x8a\xff "[(r >> 32) % 6];
+	}
+}
+
+/* naive reference of scanFindLast() */
+static ssize_t
+referenceFindLast(const char * buf, size_t length, char delimiter, size_t n, size_t * found)
+{
+	*found = 0;
+	for(ssize_t i = (ssize_t) length - 1; i >= 0; i--)
+		if(buf[i] == delimiter && ++(*found) == n)
+			return i;
+	return -1;
+}
+
+/* compare the results of the kernel in use with the naive loop, returns the
+number of mismatches */
+static int
+checkBuffer(const char * buf, size_t length, char delimiter)
+{
+	int failures = 0;
+
+	size_t expectedCount = 0;
+	const char * expectedFirst = NULL;
+	for(size_t i = 0; i < length; i++){
+		if(buf[i] != delimiter)
+			continue;
+		if(expectedFirst == NULL)
+			expectedFirst = buf + i;
+		expectedCount++;
+	}
+
+	if(scanCount(buf, length, delimiter) != expectedCount){
+		printf("[FAILED] %s: scanCount() of %zu bytes\n", scanKernelName(), length);
+		failures++;
+	}
+	if(scanFind(buf, length, delimiter) != expectedFirst){
+		printf("[FAILED] %s: scanFind() of %zu bytes\n", scanKernelName(), length);
+		failures++;
+	}
+
+	/* scanRemove() on a copy, compared with the bytes which are not the
+	delimiter */
+	char * removed = (char *) malloc(length + 1);
+	char * expectedRemoved = (char *) malloc(length + 1);
+	if(removed == NULL || expectedRemoved == NULL)
+		exit(EXIT_FAILURE);
+	memcpy(removed, buf, length);
+	size_t expectedLength = 0;
+	for(size_t i = 0; i < length; i++)
+		if(buf[i] != delimiter)
+			expectedRemoved[expectedLength++] = buf[i];
+	size_t removedLength = scanRemove(removed, length, delimiter);
+	if(removedLength != expectedLength || memcmp(removed, expectedRemoved, expectedLength) != 0){
+		printf("[FAILED] %s: scanRemove() of %zu bytes\n", scanKernelName(), length);
+		failures++;
+	}
+	free(removed);
+	free(expectedRemoved);
+
+	/* the first n and the last ones, up to one more than the delimiters in
+	buf */
+	for(size_t n = 0; n <= expectedCount + 1; n++){
+		if(n == 40 && expectedCount > 80)
+			n = expectedCount - 40;
+		size_t expectedFound;
+		ssize_t expected = referenceFindLast(buf, length, delimiter, n, &expectedFound);
+		if(n == 0){
+			expected = -1;
+			expectedFound = 0;
+		}
+		size_t found;
+		ssize_t position = scanFindLast(buf, length, delimiter, n, &found);
+		if(position != expected || found != expectedFound){
+			printf("[FAILED] %s: scanFindLast(n = %zu) of %zu bytes returned %zd (%zu found), expected %zd (%zu found)\n",
+				scanKernelName(), n, length, position, found, expected, expectedFound);
+			failures++;
+		}
+	}
+	return failures;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char * storage = (char *) malloc(FLUSH_MAX_LENGTH + 64);
+	if(storage == NULL)
+		return -1;
+
+	int failures = 0;
+	for(size_t k = 0; k < sizeof(kernelNames) / sizeof(kernelNames[0]); k++){
+		if(scanSelectKernel(kernelNames[k]) == -1){
+			printf("[skipped] %s kernel not supported by this CPU\n", kernelNames[k]);
+			continue;
+		}
+
+		/* the same buffers for every kernel */
+		state = 88172645463325252UL;
+		int kernelFailures = 0;
+		for(int round = 0; round < ROUNDS; round++){
+			unsigned long density = densities[round % 5];
+			for(size_t length = 0; length <= MAX_LENGTH; length += 1 + round % 3){
+				char * buf = storage + nextRandom() % 64;
+				fillBuffer(buf, length, density);
+				kernelFailures += checkBuffer(buf, length, '\n');
+				kernelFailures += checkBuffer(buf, length, (char) 0xff);
+			}
+		}
+		/* long buffers through the counter flushes, only delimiters and
+		dense ones */
+		for(size_t l = 0; l < sizeof(flushLengths) / sizeof(flushLengths[0]); l++){
+			for(int d = 0; d < 3; d++){
+				char * buf = storage + nextRandom() % 64;
+				fillBuffer(buf, flushLengths[l], densities[d]);
+				kernelFailures += checkBuffer(buf, flushLengths[l], '\n');
+			}
+		}
+		if(kernelFailures == 0)
+			printf("[passed] %s kernel matches the reference loop\n", kernelNames[k]);
+		failures += kernelFailures;
+	}
+
+	free(storage);
+	return (failures == 0) ? 0 : -1;
+}
@@ -0,0 +1,27 @@
+#!/bin/sh
+
+TEST_EXECUTABLE=chatLogRecovery.bin
+
+# run from the tests directory, also with 'make unit-test'
+cd "$(dirname "$0")"
+
+# file_locking.c is compiled with TEST, the chat log is ./chat_log.chat
+compile_test(){
+	gcc -Wall -O2 -D TEST -c ../file_locking.c ../lineScan.c ../tracepoints.c
+	gcc -o ${TEST_EXECUTABLE} ./test_chatLogRecovery.c ./file_locking.o ./lineScan.o ./tracepoints.o -pthread
+}
+
+clean(){
+	rm ./${TEST_EXECUTABLE}
+	rm ./*.o
+}
+
+compile_test
+
+./${TEST_EXECUTABLE}
+RESULT=$?
+
+# remove executable compiled before
+clean
+
+[ ${RESULT} -eq 0 ] && { printf "[SUCCESS] All tests passed! \n" ; exit 0 ; } || { printf "[FAILURE] Some test(s) failed! \n" ; exit 1 ; }
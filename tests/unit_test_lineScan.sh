@@ -0,0 +1,26 @@
+#!/bin/sh
+
+TEST_EXECUTABLE=lineScan.bin
+
+# run from the tests directory, also with 'make unit-test'
+cd "$(dirname "$0")"
+
+compile_test(){
+	gcc -Wall -O2 -c ../lineScan.c ../error_handling.c
+	gcc -o ${TEST_EXECUTABLE} ./test_lineScan.c ./lineScan.o ./error_handling.o
+}
+
+clean(){
+	rm ./${TEST_EXECUTABLE}
+	rm ./*.o
+}
+
+compile_test
+
+./${TEST_EXECUTABLE}
+RESULT=$?
+
+# remove executable compiled before
+clean
+
+[ ${RESULT} -eq 0 ] && { printf "[SUCCESS] All tests passed! \n" ; exit 0 ; } || { printf "[FAILURE] Some test(s) failed! \n" ; exit 1 ; }
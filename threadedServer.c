@@ -0,0 +1,1044 @@
+/* threadedServer.c
+
+[back-end] Threaded server mode (THREADS in server.config).
+
+By default every client gets two processes (clientRequest.c): one reads its
+messages and appends them to the chat log, the other one sleeps until
+SIGUSR1 and sends the new part of the chat log. Every message wakes up one
+process per client, and the scheduler switches between all of them. In the
+threaded mode the daemon is a single process:
+
+	listening thread	accept() as before, the connections are handed to
+						the event loops round robin
+	event loops			one thread per core, every loop waits with
+						epoll_wait() on the sockets of its clients. It
+						checks the key and the hello, reads the messages
+						and sends the chat log to its clients with
+						non-blocking sockets (EPOLLOUT while a client cannot
+						take more)
+	appender			a single thread which appends the messages to the
+						chat log (exclusiveWrite(), durability policy,
+						indexes), so the loops never wait for the chat log
+
+The threads talk through lock-free queues with many producers and a single
+consumer (mpscQueue.c), every consumer sleeps on an eventfd which the
+producers write after a push:
+
+	listening thread -> loop		new connection
+	loop -> appender				messages read from a client
+	appender -> every loop			"the chat log grew" (broadcast)
+
+The broadcast is one notice per loop, not per client, and it is only queued
+if the previous one of that loop was already handled: a loop that is busy
+gets a single notice for many appends and sends everything appended until
+then to each of its clients. The appender handles every message queued when
+it wakes up as a batch, so 'DURABILITY batch' syncs once per batch of all
+clients (group commit), and the indexes are updated once per batch. The
+messages of a batch are visible to the readers as soon as they are written,
+not only after the sync.
+
+The one-shot requests (SEARCH, SINCE, BETWEEN and REPLICATE) are answered by
+a child process with the code of the process mode (handleOneShotRequest()).
+They are rare and can take long (REPLICATE never ends), the loops must not
+block on them. A process with threads must not fork() children which call
+syslog() or malloc() (another thread may hold their locks), so the children
+are forked by a helper process, which threadedServerStart() forks before any
+thread is created. After the hello, a loop sends the socket of the client
+(SCM_RIGHTS) and the hello to the helper through a UNIX socket and closes
+its own copy.
+
+On a standby the chat log is appended by the replicator process, whose
+SIGUSR1 is ignored by the daemon: its appends are counted in an eventfd
+(chatLogNotifyAppends(), threadedServerWatchAppends()), on which the
+appender waits as well and broadcasts them to the loops.
+
+Clients, the hello and the chat log bytes sent are the same in both modes.
+
+Low-latency mode (LOW_LATENCY on, threadedServerPinLoops()): every loop is
+pinned to one of the CPUs the daemon may run on (loop i to the i-th CPU,
+several loops share a CPU if there are more loops than CPUs). A new
+connection is handed to a loop on the CPU which processed its packets
+(SO_INCOMING_CPU), so that the kernel and the loop use the socket on the
+same CPU and its cache lines do not move between CPUs; round robin is only
+used if no loop runs on that CPU. A reporter thread writes the load of every
+CPU with a loop to CPU_LOAD_PATH: the CPU time of the loops and of the whole
+CPU (from /proc/stat, softirq is the time spent receiving packets).
+
+*/
+
+#define _GNU_SOURCE			/* pthread_attr_setaffinity_np(), CPU_SET() */
+#include <signal.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>			/* the appender waits for two eventfds */
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <syslog.h>			/* the threads run as part of the daemon */
+
+#include "basics.h"
+#include "threadedServer.h"
+#include "mpscQueue.h"		/* lock-free queues between the threads */
+#include "clientRequest.h"	/* chatOffset(), handleOneShotRequest() */
+#include "file_locking.h"	/* exclusiveWrite(), sharedRead(), chatLogEnd() */
+#include "configure_syslog.h"
+#include "durability.h"		/* fdatasync() policy of the chat log */
+#include "searchIndex.h"	/* inverted index of the chat log */
+#include "timeIndex.h"		/* time of the messages */
+#include "replication.h"	/* the clients of a standby cannot write */
+#include "profiler.h"		/* in-process sampling profiler */
+#include "inet_sockets.h"	/* socketIncomingCpu() */
+#include "lineScan.h"		/* scanRemove() */
+#include "CONFIG.h"			/* KEY_LENGTH, HELLO_MAX_LENGTH, BUF_SIZE */
+
+/* max. events handled per epoll_wait() */
+#define LOOP_EVENTS 64
+/* max. bytes of the chat log sent to a client at once */
+#define LOOP_SEND_CHUNK (64 * 1024)
+/* time in ms that a client has for the key and the hello, the process mode
+gives it one second for each */
+#define LOOP_HANDSHAKE_TIMEOUT 2000
+/* the clients which did not finish the handshake are checked this often
+(ms) */
+#define LOOP_SWEEP_PERIOD 250
+
+/* a client waits for its key and hello, then it chats */
+enum connectionState { CONNECTION_HANDSHAKE, CONNECTION_CHAT };
+
+/* a client of an event loop, only used by its loop */
+struct connection {
+	int fd;
+	enum connectionState state;
+	int wantWrite;			/* 1 while the loop waits for EPOLLOUT */
+	off_t offset;			/* next byte of the chat log sent to the client */
+	long long acceptedUs;
+	/* the key and the hello line, read before the client chats */
+	char hello[KEY_LENGTH + HELLO_MAX_LENGTH];
+	size_t helloLength;
+	/* 1 after closeConnection(), freed after the events of the epoll_wait() */
+	int closed;
+	struct connection * previous;
+	struct connection * next;
+};
+
+/* a connection handed to a loop by the listening thread */
+struct newConnection {
+	struct mpscNode node;	/* first member, the node is the element */
+	int fd;
+	long long acceptedUs;
+};
+
+/* bytes read from a client, appended by the appender */
+struct appendRequest {
+	struct mpscNode node;
+	size_t length;
+	char data[];
+};
+
+struct eventLoop {
+	int index;
+	pthread_t thread;
+	int epoll_fd;
+	int event_fd;			/* written after every push to inbox */
+	struct mpscQueue inbox;
+	/* "the chat log grew", it is in inbox while appendedPending is 1 */
+	struct mpscNode appendedNotice;
+	int appendedPending;
+	struct connection * connections;
+	/* closed during the current events, the other events of the same
+	epoll_wait() may still point to them */
+	struct connection * closedConnections;
+	char * sendBuffer;
+	/* low-latency mode, the counters are read by the reporter */
+	int cpu;				/* the loop is pinned to it, -1 if not pinned */
+	long connectionCount;
+	unsigned long long steered;		/* connections received on cpu */
+	unsigned long long sentBytes;
+};
+
+struct appender {
+	pthread_t thread;
+	int event_fd;
+	struct mpscQueue queue;
+	/* appends of other processes (chatLogNotifyAppends()), -1 if none */
+	int appended_fd;
+};
+
+static int chatlogFd = -1;
+static char serverKey[KEY_LENGTH];
+/* the loops send the one-shot requests to the helper process through it */
+static int oneShotFd = -1;
+
+static struct eventLoop * loops = NULL;
+static int loopCount = 0;
+/* only used by the listening thread */
+static unsigned int nextLoop = 0;
+
+static struct appender appender = { .appended_fd = -1 };
+
+/* low-latency mode: the loops are pinned to the CPUs of the daemon */
+static int pinLoops = 0;
+static const char * cpuLoadPath = NULL;
+static int cpus[CPU_SETSIZE];		/* the CPUs the daemon may run on */
+static int cpuCount = 0;
+static int cpuIndex[CPU_SETSIZE];	/* index in cpus of every CPU, or -1 */
+/* connections not received on a CPU with a loop, only used by the
+listening thread */
+static unsigned long long unsteered = 0;
+
+/* monotonic time in microseconds */
+static long long
+nowUs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* wake up the consumer sleeping on event_fd */
+static void
+wake(int event_fd)
+{
+	uint64_t one = 1;
+	/* the counter cannot overflow, EAGAIN is not possible */
+	if(write(event_fd, &one, sizeof(one)) != sizeof(one))
+		syslog(LOG_ERR, "write(eventfd) failed: %s", strerror(errno));
+}
+
+/* the signals of the daemon (SIGCHLD, SIGTERM, SIGUSR2, ...) are handled by
+the listening thread, epoll_wait() of a loop is only interrupted by SIGPROF
+of the profiler */
+static void
+blockSignals(void)
+{
+	sigset_t blocked;
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGCHLD);
+	sigaddset(&blocked, SIGTERM);
+	sigaddset(&blocked, SIGUSR1);
+	sigaddset(&blocked, SIGUSR2);
+	sigaddset(&blocked, SIGALRM);
+	sigaddset(&blocked, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &blocked, NULL);
+}
+
+/* ------------------------------------------------------------------------ */
+/* appender */
+
+/* tell every loop that the chat log grew, a loop which was not told yet
+gets a notice */
+static void
+broadcastAppended(void)
+{
+	for(int i = 0; i < loopCount; i++){
+		struct eventLoop * loop = &loops[i];
+		if(__atomic_exchange_n(&loop->appendedPending, 1, __ATOMIC_SEQ_CST) == 0){
+			mpscPush(&loop->inbox, &loop->appendedNotice);
+			wake(loop->event_fd);
+		}
+	}
+}
+
+static void *
+runAppender(void * arg)
+{
+	blockSignals();
+	/* poll() ignores appended_fd if it is -1 */
+	struct pollfd waitFor[2] = {
+		{ .fd = appender.event_fd, .events = POLLIN },
+		{ .fd = appender.appended_fd, .events = POLLIN }
+	};
+	for(;;){
+		if(poll(waitFor, 2, -1) == -1){
+			if(errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "poll() failed: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		uint64_t wakeups;
+		/* another process (the replicator) appended, it updated the indexes
+		itself */
+		if(waitFor[1].revents & POLLIN){
+			if(read(appender.appended_fd, &wakeups, sizeof(wakeups)) == -1 && errno != EAGAIN)
+				syslog(LOG_ERR, "read(eventfd) failed: %s", strerror(errno));
+			broadcastAppended();
+		}
+		if(!(waitFor[0].revents & POLLIN))
+			continue;
+		if(read(appender.event_fd, &wakeups, sizeof(wakeups)) == -1){
+			if(errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "read(eventfd) failed: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		/* every message queued until now is one batch */
+		size_t appended = 0;
+		struct mpscNode * node;
+		while((node = mpscPop(&appender.queue)) != NULL){
+			struct appendRequest * request = (struct appendRequest *) node;
+			if(exclusiveWrite(chatlogFd, request->data, request->length) == -1){
+				syslog(LOG_ERR, "exclusiveWrite() failed: %s", strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			appended += request->length;
+			free(request);
+		}
+		if(appended == 0)
+			continue;
+
+		/* 'DURABILITY batch' syncs the whole batch at once. exclusiveWrite()
+		already made every message visible (end of the chat log, hot tail,
+		SIGUSR1), so the clients may get them before they are on disk, as in
+		the process mode; the next batch is only written after the sync */
+		if(durabilityAppend(chatlogFd, appended) == -1){
+			syslog(LOG_ERR, "fdatasync() of the chat log failed: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if(searchIndexUpdate(chatlogFd) == -1)
+			syslog(LOG_ERR, "searchIndexUpdate() failed: %s", strerror(errno));
+		if(timeIndexUpdate() == -1)
+			syslog(LOG_ERR, "timeIndexUpdate() failed: %s", strerror(errno));
+		broadcastAppended();
+	}
+	return NULL;
+}
+
+/* hand length bytes read from a client to the appender */
+static int
+queueAppend(const char * data, size_t length)
+{
+	if(length == 0)
+		return 0;
+	/* only the replicator appends to the chat log of a standby */
+	if(replicationIsStandby()){
+		syslog(LOG_DEBUG, "%zu Bytes received from client dropped (standby).", length);
+		return 0;
+	}
+	struct appendRequest * request = (struct appendRequest *) malloc(sizeof(struct appendRequest) + length);
+	if(request == NULL)
+		return -1;
+	memcpy(request->data, data, length);
+	/* NUL bytes mark the preallocated end of the chat log, they are removed
+	from the messages (file_locking.c) */
+	request->length = scanRemove(request->data, length, '\0');
+	if(request->length == 0){
+		free(request);
+		return 0;
+	}
+	mpscPush(&appender.queue, &request->node);
+	wake(appender.event_fd);
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+/* event loops */
+
+/* close the socket of a client, the connection is freed by
+freeClosedConnections() */
+static void
+closeConnection(struct eventLoop * loop, struct connection * connection)
+{
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+	close(connection->fd);
+	__atomic_store_n(&loop->connectionCount, loop->connectionCount - 1, __ATOMIC_RELAXED);
+	if(connection->previous != NULL)
+		connection->previous->next = connection->next;
+	else
+		loop->connections = connection->next;
+	if(connection->next != NULL)
+		connection->next->previous = connection->previous;
+	connection->closed = 1;
+	connection->next = loop->closedConnections;
+	loop->closedConnections = connection;
+}
+
+/* free the connections closed since the last call, no event of the last
+epoll_wait() is handled after it */
+static void
+freeClosedConnections(struct eventLoop * loop)
+{
+	while(loop->closedConnections != NULL){
+		struct connection * next = loop->closedConnections->next;
+		free(loop->closedConnections);
+		loop->closedConnections = next;
+	}
+}
+
+static void
+addConnection(struct eventLoop * loop, int fd, long long acceptedUs)
+{
+	struct connection * connection = (struct connection *) calloc(1, sizeof(struct connection));
+	int flags = fcntl(fd, F_GETFL);
+	if(connection == NULL || flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1){
+		syslog(LOG_ERR, "Connection dropped: %s", strerror(errno));
+		free(connection);
+		close(fd);
+		return;
+	}
+	connection->fd = fd;
+	connection->state = CONNECTION_HANDSHAKE;
+	connection->acceptedUs = acceptedUs;
+
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = connection };
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1){
+		syslog(LOG_ERR, "epoll_ctl() failed: %s", strerror(errno));
+		free(connection);
+		close(fd);
+		return;
+	}
+	__atomic_store_n(&loop->connectionCount, loop->connectionCount + 1, __ATOMIC_RELAXED);
+	connection->next = loop->connections;
+	if(loop->connections != NULL)
+		loop->connections->previous = connection;
+	loop->connections = connection;
+}
+
+/* wait for EPOLLOUT (want 1) or not */
+static int
+setWantWrite(struct eventLoop * loop, struct connection * connection, int want)
+{
+	if(connection->wantWrite == want)
+		return 0;
+	struct epoll_event event = { .events = EPOLLIN | (want ? EPOLLOUT : 0), .data.ptr = connection };
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) == -1)
+		return -1;
+	connection->wantWrite = want;
+	return 0;
+}
+
+/* send the chat log from the offset of the client to its end, until the
+socket cannot take more. Returns 0, or -1 if the connection was closed */
+static int
+sendPending(struct eventLoop * loop, struct connection * connection)
+{
+	off_t end = chatLogEnd();
+	while(connection->offset < end){
+		ssize_t bytesRead = sharedRead(chatlogFd, loop->sendBuffer, LOOP_SEND_CHUNK, connection->offset);
+		if(bytesRead <= 0){
+			syslog(LOG_ERR, "sharedRead() failed: %s", strerror(errno));
+			closeConnection(loop, connection);
+			return -1;
+		}
+		ssize_t sent = send(connection->fd, loop->sendBuffer, bytesRead, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			sent = 0;
+		else if(sent == -1){
+			syslog(LOG_DEBUG, "send() failed, client dropped: %s", strerror(errno));
+			closeConnection(loop, connection);
+			return -1;
+		}
+		connection->offset += sent;
+		__atomic_store_n(&loop->sentBytes, loop->sentBytes + sent, __ATOMIC_RELAXED);
+		/* the socket buffer is full, continue on EPOLLOUT */
+		if(sent < bytesRead){
+			if(setWantWrite(loop, connection, 1) == -1){
+				closeConnection(loop, connection);
+				return -1;
+			}
+			return 0;
+		}
+	}
+	if(setWantWrite(loop, connection, 0) == -1){
+		closeConnection(loop, connection);
+		return -1;
+	}
+	return 0;
+}
+
+/* hand a one-shot request (hello without newline) to the helper process,
+which answers it in a child process */
+static void
+sendOneShot(struct eventLoop * loop, struct connection * connection, const char * hello)
+{
+	union {
+		struct cmsghdr header;	/* aligns the buffer */
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct iovec payload = { .iov_base = (void *) hello, .iov_len = strlen(hello) + 1 };
+	struct msghdr message = {
+		.msg_iov = &payload, .msg_iovlen = 1,
+		.msg_control = control.buf, .msg_controllen = sizeof(control.buf)
+	};
+	struct cmsghdr * header = CMSG_FIRSTHDR(&message);
+	header->cmsg_level = SOL_SOCKET;
+	header->cmsg_type = SCM_RIGHTS;
+	header->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(header), &connection->fd, sizeof(int));
+
+	if(sendmsg(oneShotFd, &message, MSG_NOSIGNAL) == -1)
+		syslog(LOG_ERR, "sendmsg() to the one-shot helper failed, client dropped: %s", strerror(errno));
+	/* the helper has its own copy of the socket */
+	closeConnection(loop, connection);
+}
+
+/* receive a one-shot request sent by sendOneShot(), the hello is written to
+hello (HELLO_MAX_LENGTH bytes) and the socket of the client to client_fd.
+Returns 1 on success, 0 if the daemon closed the socket and -1 on error */
+static int
+receiveOneShot(char * hello, int * client_fd)
+{
+	union {
+		struct cmsghdr header;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec payload = { .iov_base = hello, .iov_len = HELLO_MAX_LENGTH };
+	struct msghdr message = {
+		.msg_iov = &payload, .msg_iovlen = 1,
+		.msg_control = control.buf, .msg_controllen = sizeof(control.buf)
+	};
+	ssize_t numRead = recvmsg(oneShotFd, &message, MSG_CMSG_CLOEXEC);
+	if(numRead <= 0)
+		return (int) numRead;
+
+	struct cmsghdr * header = CMSG_FIRSTHDR(&message);
+	if(header == NULL || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS
+		|| header->cmsg_len != CMSG_LEN(sizeof(int))){
+		errno = EPROTO;
+		return -1;
+	}
+	memcpy(client_fd, CMSG_DATA(header), sizeof(int));
+	hello[HELLO_MAX_LENGTH - 1] = '\0';
+	return 1;
+}
+
+/* the helper process: fork a child for every one-shot request, until the
+daemon terminates. The helper has no threads, its children may use the
+code of the process mode */
+static void
+runOneShotHelper(void)
+{
+	for(;;){
+		char hello[HELLO_MAX_LENGTH];
+		int client_fd;
+		int received = receiveOneShot(hello, &client_fd);
+		if(received == -1 && errno == EINTR)
+			continue;
+		if(received == 0)
+			_exit(EXIT_SUCCESS);
+		if(received == -1){
+			syslog(LOG_ERR, "recvmsg() of the one-shot helper failed: %s", strerror(errno));
+			_exit(EXIT_FAILURE);
+		}
+
+		switch(fork()){
+			case -1:
+				syslog(LOG_ERR, "Error fork() call. Can't create child (%s)", strerror(errno));
+				break;
+
+			case 0:
+				configure_syslog("papayaChat(child)");
+				close(oneShotFd);
+				if(profilerArmProcess() == -1)
+					syslog(LOG_ERR, "profilerArmProcess() failed: %s", strerror(errno));
+				/* the loop made the socket non-blocking */
+				int flags = fcntl(client_fd, F_GETFL);
+				if(flags == -1 || fcntl(client_fd, F_SETFL, flags & ~O_NONBLOCK) == -1){
+					syslog(LOG_ERR, "fcntl() failed: %s", strerror(errno));
+					_exit(EXIT_FAILURE);
+				}
+				handleOneShotRequest(client_fd, chatlogFd, hello);
+				_exit(EXIT_FAILURE);	/* not reached */
+
+			default:
+				break;
+		}
+		/* the child has its own copy of the socket */
+		close(client_fd);
+	}
+}
+
+/* fork the helper process of the one-shot requests, before any thread is
+created. Returns 0 in the daemon and -1 on error */
+static int
+startOneShotHelper(void)
+{
+	int sockets[2];
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) == -1)
+		return -1;
+	switch(fork()){
+		case -1:
+			close(sockets[0]);
+			close(sockets[1]);
+			return -1;
+
+		case 0:
+			configure_syslog("papayaChat(one-shot)");
+			close(sockets[0]);
+			oneShotFd = sockets[1];
+			if(profilerArmProcess() == -1)
+				syslog(LOG_ERR, "profilerArmProcess() failed: %s", strerror(errno));
+			runOneShotHelper();
+			_exit(EXIT_FAILURE);	/* not reached */
+
+		default:
+			break;
+	}
+	close(sockets[1]);
+	oneShotFd = sockets[0];
+	return 0;
+}
+
+/* the client sent a part of the key and hello, returns -1 if the
+connection was closed */
+static int
+readHandshake(struct eventLoop * loop, struct connection * connection)
+{
+	ssize_t numRead = read(connection->fd, connection->hello + connection->helloLength,
+		sizeof(connection->hello) - connection->helloLength);
+	if(numRead == -1 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if(numRead <= 0){
+		syslog(LOG_DEBUG, "Received EOF from client before hello!");
+		closeConnection(loop, connection);
+		return -1;
+	}
+	connection->helloLength += numRead;
+	if(connection->helloLength < KEY_LENGTH)
+		return 0;
+
+	if(strncmp(connection->hello, serverKey, KEY_LENGTH) != 0){
+		syslog(LOG_INFO, "Auth failed. Client dropped!");
+		closeConnection(loop, connection);
+		return -1;
+	}
+
+	char * hello = connection->hello + KEY_LENGTH;
+	char * newline = memchr(hello, '\n', connection->helloLength - KEY_LENGTH);
+	if(newline == NULL){
+		if(connection->helloLength == sizeof(connection->hello)){
+			syslog(LOG_INFO, "Hello line too long. Client dropped!");
+			closeConnection(loop, connection);
+			return -1;
+		}
+		return 0;
+	}
+	*newline = '\0';
+
+	if(isOneShotRequest(hello)){
+		sendOneShot(loop, connection, hello);
+		return -1;
+	}
+
+	off_t offset = chatOffset(chatlogFd, hello);
+	if(offset == -1){
+		if(errno == EINVAL)
+			syslog(LOG_INFO, "Unknown hello (%s). Client dropped!", hello);
+		else
+			syslog(LOG_ERR, "historyOffset() failed: %s", strerror(errno));
+		closeConnection(loop, connection);
+		return -1;
+	}
+
+	/* the same answer as sendNewMessages(), the socket is empty */
+	char offsetLine[HELLO_MAX_LENGTH];
+	int offsetLength = snprintf(offsetLine, HELLO_MAX_LENGTH, "OFFSET %lld\n", (long long) offset);
+	if(send(connection->fd, offsetLine, offsetLength, MSG_NOSIGNAL | MSG_DONTWAIT) != offsetLength){
+		syslog(LOG_DEBUG, "send() failed, client dropped: %s", strerror(errno));
+		closeConnection(loop, connection);
+		return -1;
+	}
+	connection->offset = offset;
+	connection->state = CONNECTION_CHAT;
+
+	/* messages sent right after the hello */
+	char * messages = newline + 1;
+	if(queueAppend(messages, connection->hello + connection->helloLength - messages) == -1){
+		syslog(LOG_ERR, "malloc failed: %s", strerror(errno));
+		closeConnection(loop, connection);
+		return -1;
+	}
+	return sendPending(loop, connection);
+}
+
+/* the client sent messages, returns -1 if the connection was closed */
+static int
+readMessages(struct eventLoop * loop, struct connection * connection)
+{
+	char buf[BUF_SIZE];
+	ssize_t numRead = read(connection->fd, buf, BUF_SIZE);
+	if(numRead == -1 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if(numRead == -1)
+		syslog(LOG_ERR, "read() failed: %s", strerror(errno));
+	if(numRead <= 0){
+		syslog(LOG_DEBUG, "Received EOF from client!");
+		closeConnection(loop, connection);
+		return -1;
+	}
+	if(queueAppend(buf, numRead) == -1){
+		syslog(LOG_ERR, "malloc failed: %s", strerror(errno));
+		closeConnection(loop, connection);
+		return -1;
+	}
+	return 0;
+}
+
+/* handle the new connections and the notices of the appender */
+static void
+processInbox(struct eventLoop * loop)
+{
+	/* read the counter before popping, a push that is not visible yet is
+	followed by another wake() */
+	uint64_t wakeups;
+	if(read(loop->event_fd, &wakeups, sizeof(wakeups)) == -1 && errno != EAGAIN)
+		syslog(LOG_ERR, "read(eventfd) failed: %s", strerror(errno));
+
+	int appended = 0;
+	struct mpscNode * node;
+	while((node = mpscPop(&loop->inbox)) != NULL){
+		if(node == &loop->appendedNotice){
+			/* cleared before the end of the chat log is read, an append
+			after it queues the notice again */
+			__atomic_store_n(&loop->appendedPending, 0, __ATOMIC_SEQ_CST);
+			appended = 1;
+			continue;
+		}
+		struct newConnection * accepted = (struct newConnection *) node;
+		addConnection(loop, accepted->fd, accepted->acceptedUs);
+		free(accepted);
+	}
+	if(!appended)
+		return;
+
+	struct connection * connection = loop->connections;
+	while(connection != NULL){
+		struct connection * next = connection->next;
+		/* a client waiting for EPOLLOUT gets the rest then */
+		if(connection->state == CONNECTION_CHAT && !connection->wantWrite)
+			sendPending(loop, connection);
+		connection = next;
+	}
+}
+
+/* drop the clients which did not send their key and hello in time */
+static void
+sweepHandshakes(struct eventLoop * loop)
+{
+	long long deadline = nowUs() - LOOP_HANDSHAKE_TIMEOUT * 1000LL;
+	struct connection * connection = loop->connections;
+	while(connection != NULL){
+		struct connection * next = connection->next;
+		if(connection->state == CONNECTION_HANDSHAKE && connection->acceptedUs < deadline){
+			syslog(LOG_INFO, "Handshake timed out. Client dropped!");
+			closeConnection(loop, connection);
+		}
+		connection = next;
+	}
+}
+
+static void *
+runLoop(void * arg)
+{
+	struct eventLoop * loop = (struct eventLoop *) arg;
+	blockSignals();
+
+	struct epoll_event events[LOOP_EVENTS];
+	long long nextSweep = nowUs() + LOOP_SWEEP_PERIOD * 1000LL;
+	for(;;){
+		int ready = epoll_wait(loop->epoll_fd, events, LOOP_EVENTS, LOOP_SWEEP_PERIOD);
+		if(ready == -1 && errno != EINTR){
+			syslog(LOG_ERR, "epoll_wait() failed: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		for(int i = 0; i < ready; i++){
+			struct connection * connection = events[i].data.ptr;
+			if(connection == NULL){
+				processInbox(loop);
+				continue;
+			}
+			/* closed by an earlier event of this epoll_wait() (e.g. a failed
+			send() to every client after a notice of the appender) */
+			if(connection->closed)
+				continue;
+			if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)){
+				int closed = (connection->state == CONNECTION_HANDSHAKE)
+					? readHandshake(loop, connection)
+					: readMessages(loop, connection);
+				if(closed == -1)
+					continue;
+			}
+			if(events[i].events & EPOLLOUT)
+				sendPending(loop, connection);
+		}
+
+		long long now = nowUs();
+		if(now >= nextSweep){
+			sweepHandshakes(loop);
+			nextSweep = now + LOOP_SWEEP_PERIOD * 1000LL;
+		}
+		freeClosedConnections(loop);
+	}
+	return NULL;
+}
+
+/* ------------------------------------------------------------------------ */
+/* low-latency mode */
+
+/* time of every CPU from /proc/stat, in clock ticks */
+struct cpuTimes {
+	unsigned long long total;
+	unsigned long long idle;		/* idle and iowait */
+	unsigned long long softirq;
+};
+
+/* read the times of every CPU from /proc/stat into times (indexed by the
+number of the CPU), returns 0 on success and -1 on error */
+static int
+readCpuTimes(struct cpuTimes * times)
+{
+	FILE * stat = fopen("/proc/stat", "r");
+	if(stat == NULL)
+		return -1;
+	char line[MAX_LINE_LENGTH];
+	while(fgets(line, sizeof(line), stat) != NULL){
+		int cpu;
+		unsigned long long user, nice, system, idle, iowait, irq, softirq, steal;
+		/* the line 'cpu ' of all CPUs does not match */
+		if(sscanf(line, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu", &cpu, &user, &nice,
+			&system, &idle, &iowait, &irq, &softirq, &steal) != 9)
+			continue;
+		if(cpu < 0 || cpu >= CPU_SETSIZE)
+			continue;
+		times[cpu].total = user + nice + system + idle + iowait + irq + softirq + steal;
+		times[cpu].idle = idle + iowait;
+		times[cpu].softirq = softirq;
+	}
+	fclose(stat);
+	return 0;
+}
+
+/* CPU time used by a thread in ns, 0 if it cannot be read */
+static long long
+threadCpuNs(pthread_t thread)
+{
+	clockid_t clock;
+	struct timespec used;
+	if(pthread_getcpuclockid(thread, &clock) != 0 || clock_gettime(clock, &used) == -1)
+		return 0;
+	return (long long) used.tv_sec * 1000000000 + used.tv_nsec;
+}
+
+/* same as in replication.c: the report is written to a temporary file which
+is renamed to cpuLoadPath, so that a reader never sees half of it */
+static int
+writeCpuLoad(const char * text, int length)
+{
+	char temporaryPath[MAX_LINE_LENGTH];
+	snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", cpuLoadPath);
+	int fd = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+	if(fd == -1)
+		return -1;
+	if(write(fd, text, length) != length){
+		close(fd);
+		return -1;
+	}
+	if(close(fd) == -1)
+		return -1;
+	return rename(temporaryPath, cpuLoadPath);
+}
+
+/* write the load of every CPU with a loop every CPU_LOAD_PERIOD ms, one line
+per CPU:
+	cpu <n> loops <loops> connections <clients> steered <connections>
+	sent_bytes <bytes> loop_pct <CPU time of its loops in %> busy_pct
+	<CPU time of the whole CPU in %> softirq_pct <time receiving packets> */
+static void *
+runReporter(void * arg)
+{
+	blockSignals();
+
+	static struct cpuTimes before[CPU_SETSIZE], after[CPU_SETSIZE];
+	long long * loopNsBefore = (long long *) calloc(loopCount, sizeof(long long));
+	/* one line per CPU, besides the header */
+	size_t reportSize = (size_t) (cpuCount + 2) * MAX_LINE_LENGTH;
+	char * report = (char *) malloc(reportSize);
+	if(loopNsBefore == NULL || report == NULL){
+		syslog(LOG_ERR, "CPU load report disabled, malloc failed: %s", strerror(errno));
+		return NULL;
+	}
+	readCpuTimes(before);
+	for(int i = 0; i < loopCount; i++)
+		loopNsBefore[i] = threadCpuNs(loops[i].thread);
+	long long lastUs = nowUs();
+
+	for(;;){
+		struct timespec period = { CPU_LOAD_PERIOD / 1000, (CPU_LOAD_PERIOD % 1000) * 1000000L };
+		while(nanosleep(&period, &period) == -1 && errno == EINTR)
+			;
+		long long now = nowUs();
+		double elapsedNs = (now - lastUs) * 1000.0;
+		lastUs = now;
+		readCpuTimes(after);
+
+		int length = snprintf(report, reportSize, "period_ms %d\nunsteered %llu\n",
+			CPU_LOAD_PERIOD, __atomic_load_n(&unsteered, __ATOMIC_RELAXED));
+		for(int k = 0; k < cpuCount && k < loopCount; k++){
+			int cpu = cpus[k];
+			long connections = 0;
+			unsigned long long steered = 0, sentBytes = 0;
+			long long loopNs = 0;
+			int loopsOnCpu = 0;
+			/* the loops k, k + cpuCount, ... run on cpus[k] */
+			for(int i = k; i < loopCount; i += cpuCount){
+				struct eventLoop * loop = &loops[i];
+				long long ns = threadCpuNs(loop->thread);
+				loopNs += ns - loopNsBefore[i];
+				loopNsBefore[i] = ns;
+				connections += __atomic_load_n(&loop->connectionCount, __ATOMIC_RELAXED);
+				steered += __atomic_load_n(&loop->steered, __ATOMIC_RELAXED);
+				sentBytes += __atomic_load_n(&loop->sentBytes, __ATOMIC_RELAXED);
+				loopsOnCpu++;
+			}
+			unsigned long long ticks = after[cpu].total - before[cpu].total;
+			double busy = 0, softirq = 0;
+			if(ticks > 0){
+				busy = 100.0 * (ticks - (after[cpu].idle - before[cpu].idle)) / ticks;
+				softirq = 100.0 * (after[cpu].softirq - before[cpu].softirq) / ticks;
+			}
+			length += snprintf(report + length, reportSize - length,
+				"cpu %d loops %d connections %ld steered %llu sent_bytes %llu loop_pct %.1f busy_pct %.1f softirq_pct %.1f\n",
+				cpu, loopsOnCpu, connections, steered, sentBytes,
+				(elapsedNs > 0) ? 100.0 * loopNs / elapsedNs : 0.0, busy, softirq);
+		}
+		memcpy(before, after, sizeof(before));
+
+		if(writeCpuLoad(report, length) == -1)
+			syslog(LOG_ERR, "CPU load report %s: %s", cpuLoadPath, strerror(errno));
+	}
+	return NULL;
+}
+
+/* the loop for a new connection: in the low-latency mode one of the loops on
+the CPU which received its packets, otherwise the next one */
+static struct eventLoop *
+chooseLoop(int client_fd)
+{
+	if(pinLoops){
+		int cpu = socketIncomingCpu(client_fd);
+		int k = (cpu >= 0 && cpu < CPU_SETSIZE) ? cpuIndex[cpu] : -1;
+		/* the loops k, k + cpuCount, ... run on cpus[k], if k < loopCount */
+		if(k != -1 && k < loopCount){
+			int loopsOnCpu = (loopCount - 1 - k) / cpuCount + 1;
+			struct eventLoop * loop = &loops[k + (nextLoop++ % loopsOnCpu) * cpuCount];
+			__atomic_store_n(&loop->steered, loop->steered + 1, __ATOMIC_RELAXED);
+			return loop;
+		}
+		__atomic_store_n(&unsteered, unsteered + 1, __ATOMIC_RELAXED);
+	}
+	return &loops[nextLoop++ % loopCount];
+}
+
+void
+threadedServerPinLoops(const char * loadPath)
+{
+	pinLoops = 1;
+	cpuLoadPath = loadPath;
+}
+
+void
+threadedServerWatchAppends(int appended_fd)
+{
+	appender.appended_fd = appended_fd;
+}
+
+void
+threadedServerDispatch(int client_fd)
+{
+	struct newConnection * accepted = (struct newConnection *) malloc(sizeof(struct newConnection));
+	if(accepted == NULL){
+		syslog(LOG_ERR, "malloc failed, client dropped: %s", strerror(errno));
+		close(client_fd);
+		return;
+	}
+	accepted->fd = client_fd;
+	accepted->acceptedUs = nowUs();
+
+	struct eventLoop * loop = chooseLoop(client_fd);
+	mpscPush(&loop->inbox, &accepted->node);
+	wake(loop->event_fd);
+}
+
+int
+threadedServerStart(int chatlog_fd, const char * key, int loopsWanted)
+{
+	chatlogFd = chatlog_fd;
+	memcpy(serverKey, key, KEY_LENGTH);
+
+	/* forked while the daemon has a single thread */
+	if(startOneShotHelper() == -1)
+		return -1;
+
+	loops = (struct eventLoop *) calloc(loopsWanted, sizeof(struct eventLoop));
+	if(loops == NULL)
+		return -1;
+
+	/* the CPUs the daemon may run on (e.g. restricted with taskset), the
+	loops are spread over them */
+	if(pinLoops){
+		cpu_set_t allowed;
+		if(sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+			return -1;
+		for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+			cpuIndex[cpu] = -1;
+			if(CPU_ISSET(cpu, &allowed)){
+				cpuIndex[cpu] = cpuCount;
+				cpus[cpuCount++] = cpu;
+			}
+		}
+	}
+
+	appender.event_fd = eventfd(0, EFD_CLOEXEC);
+	if(appender.event_fd == -1)
+		return -1;
+	mpscInit(&appender.queue);
+
+	for(int i = 0; i < loopsWanted; i++){
+		struct eventLoop * loop = &loops[i];
+		loop->index = i;
+		loop->cpu = pinLoops ? cpus[i % cpuCount] : -1;
+		mpscInit(&loop->inbox);
+		loop->sendBuffer = (char *) malloc(LOOP_SEND_CHUNK);
+		loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		loop->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(loop->sendBuffer == NULL || loop->epoll_fd == -1 || loop->event_fd == -1)
+			return -1;
+		struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+		if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->event_fd, &event) == -1)
+			return -1;
+	}
+	loopCount = loopsWanted;
+
+	/* pthread_create() returns the error instead of setting errno */
+	int error = pthread_create(&appender.thread, NULL, runAppender, NULL);
+	for(int i = 0; error == 0 && i < loopCount; i++){
+		pthread_attr_t attributes;
+		pthread_attr_init(&attributes);
+		if(loops[i].cpu != -1){
+			cpu_set_t pinned;
+			CPU_ZERO(&pinned);
+			CPU_SET(loops[i].cpu, &pinned);
+			error = pthread_attr_setaffinity_np(&attributes, sizeof(pinned), &pinned);
+		}
+		if(error == 0)
+			error = pthread_create(&loops[i].thread, &attributes, runLoop, &loops[i]);
+		pthread_attr_destroy(&attributes);
+	}
+	if(error == 0 && pinLoops){
+		pthread_t reporter;
+		error = pthread_create(&reporter, NULL, runReporter, NULL);
+	}
+	if(error != 0){
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
@@ -0,0 +1,36 @@
+/* threadedServer.h
+
+[back-end] Threaded server mode: one event loop (epoll) per core instead of
+two processes per client
+
+*/
+
+#ifndef THREADEDSERVER_H /* header guard */
+#define THREADEDSERVER_H
+
+/* start loops event loop threads and the appender thread, key is the
+authentication key (KEY_LENGTH bytes). The helper process of the one-shot
+requests is forked first, so it must be called while the daemon has no other
+threads, after the chat log, the indexes and the replication were set up.
+Returns 0 on success and -1 on error */
+int threadedServerStart(int chatlog_fd, const char * key, int loops);
+
+/* low-latency mode: pin every event loop to a CPU, hand every connection to
+a loop on the CPU which receives its packets and write the load of these
+CPUs to loadPath every CPU_LOAD_PERIOD ms. It should be called before
+threadedServerStart() */
+void threadedServerPinLoops(const char * loadPath);
+
+/* the chat log is also appended by another process (the replicator of a
+standby), appended_fd is the eventfd of chatLogNotifyAppends(). The loops
+send these appends to their clients as well. It should be called before
+threadedServerStart() */
+void threadedServerWatchAppends(int appended_fd);
+
+/* hand a connection accepted by the listening thread to one of the event
+loops (round robin), which authenticates the client and serves it */
+void threadedServerDispatch(int client_fd);
+
+#endif
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
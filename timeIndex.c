@@ -0,0 +1,222 @@
+/* timeIndex.c
+
+[back-end] Sparse index from the server time to the offsets of the chat log.
+
+The messages are stamped with the time of the server when they are appended,
+without changing the bytes of the chat log (the offsets used by the clients,
+the history cache and the search index stay the same). The stamps are stored
+in a file next to the chat log (TIME_INDEX_PATH) as entries of 16 bytes:
+
+	time (s)	offset of the first byte appended in that second
+
+An entry is only added for the first append in a new second, so every byte
+from the offset of an entry up to the offset of the next one was appended in
+the second of the entry. A chat log written once per second over a whole
+year needs about 500 MB, a usual chat a tiny fraction of it.
+
+After every append timeIndexUpdate() stamps the bytes appended since the last
+update with the current time. The entries are ordered by time and offset:
+the stamps are taken while holding a process-shared mutex, and a clock going
+backwards never produces an older time than the last entry.
+
+"Messages since T" or "between T1 and T2" is a binary search over the
+entries (pread(), no scan) for the first entry not older than T1 and the
+first entry newer than T2, the bytes between the two offsets are then read
+sequentially from the chat log.
+
+The bytes written before the time index existed have no stamp, the first
+entry (0, 0) makes them older than any time asked for.
+
+*/
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>	/* process-shared mutex */
+#include <sys/stat.h>
+#include <sys/mman.h>	/* the state is shared by all processes */
+#include <syslog.h>		/* the index is used by the daemon */
+
+#include "basics.h"
+#include "timeIndex.h"
+#include "file_locking.h"	/* chatLogEnd(), initSharedMutex() */
+
+/* state shared by all processes, changed while holding lock */
+struct timeIndexState {
+	pthread_mutex_t lock;	/* process-shared, robust */
+	int64_t entries;		/* complete entries in the file */
+	int64_t lastTime;		/* time of the last entry */
+	off_t stampedEnd;		/* offset in the chat log after the last
+							stamped byte */
+};
+
+/* NULL if the index is not open */
+static struct timeIndexState * state = NULL;
+static int index_fd = -1;
+
+/* an entry is written completely before entries is incremented, a process
+which died while holding the lock left nothing half done */
+static int
+lockTimeIndex(void)
+{
+	return lockSharedMutex(&state->lock, NULL);
+}
+
+/* append an entry to the file, the caller holds the lock (or no other
+process exists yet). Returns 0 on success and -1 on error */
+static int
+appendEntry(int64_t time, int64_t offset)
+{
+	struct timeEntry entry = { time, offset };
+	if(pwrite(index_fd, &entry, sizeof(entry), state->entries * sizeof(entry)) != sizeof(entry))
+		return -1;
+	state->lastTime = time;
+	__atomic_store_n(&state->entries, state->entries + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* read entry i of the time index open as fd */
+static int
+readEntry(int fd, int64_t i, struct timeEntry * entry)
+{
+	ssize_t bytesRead = pread(fd, entry, sizeof(*entry), i * sizeof(*entry));
+	if(bytesRead != sizeof(*entry)){
+		if(bytesRead >= 0)
+			errno = EIO;	/* the file is shorter than the entries */
+		return -1;
+	}
+	return 0;
+}
+
+int
+timeIndexOpen(const char * path)
+{
+	index_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+	if(index_fd == -1)
+		return -1;
+
+	state = mmap(NULL, sizeof(struct timeIndexState), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(state == MAP_FAILED || initSharedMutex(&state->lock) == -1){
+		close(index_fd);
+		state = NULL;
+		return -1;
+	}
+
+	/* a daemon that died in the middle of a write leaves a partial entry */
+	state->entries = timeIndexEntries(index_fd);
+	if(state->entries == -1)
+		return -1;
+	if(ftruncate(index_fd, state->entries * sizeof(struct timeEntry)) == -1)
+		return -1;
+
+	/* the entries of the bytes after the end were removed with a torn write
+	(recoverTornTail()) or belong to another chat log, only the last entries
+	are read */
+	off_t end = chatLogEnd();
+	int64_t entries = state->entries;
+	struct timeEntry last = { 0, 0 };
+	while(entries > 0){
+		if(readEntry(index_fd, entries - 1, &last) == -1)
+			return -1;
+		if(last.offset < end)
+			break;
+		entries--;
+	}
+	if(entries < state->entries){
+		syslog(LOG_INFO, "Time index %s: %lld entries after the end of the chat log are removed.",
+			path, (long long) (state->entries - entries));
+		if(ftruncate(index_fd, entries * sizeof(struct timeEntry)) == -1)
+			return -1;
+		state->entries = entries;
+	}
+	state->lastTime = (entries > 0) ? last.time : 0;
+	/* the messages written before the index existed have no time */
+	if(state->entries == 0 && end > 0 && appendEntry(0, 0) == -1)
+		return -1;
+
+	state->stampedEnd = end;
+	return 0;
+}
+
+int
+timeIndexUpdate(void)
+{
+	if(state == NULL)
+		return 0;
+
+	if(lockTimeIndex() == -1)
+		return -1;
+	int result = 0;
+	off_t end = chatLogEnd();
+	if(end > state->stampedEnd){
+		/* only the first append of a second gets an entry */
+		int64_t now = time(NULL);
+		if(now > state->lastTime)
+			result = appendEntry(now, state->stampedEnd);
+		if(result == 0)
+			state->stampedEnd = end;
+	}
+	pthread_mutex_unlock(&state->lock);
+	return result;
+}
+
+int64_t
+timeIndexEntries(int fd)
+{
+	struct stat fileStat;
+	if(fstat(fd, &fileStat) == -1)
+		return -1;
+	return fileStat.st_size / sizeof(struct timeEntry);
+}
+
+off_t
+timeIndexOffsetAfter(int fd, int64_t entries, int64_t time, off_t end)
+{
+	/* binary search for the first entry newer than time */
+	int64_t low = 0;
+	int64_t high = entries;
+	while(low < high){
+		int64_t middle = low + (high - low) / 2;
+		struct timeEntry entry;
+		if(readEntry(fd, middle, &entry) == -1)
+			return -1;
+		if(entry.time > time)
+			high = middle;
+		else
+			low = middle + 1;
+	}
+	if(low == entries)
+		return end;
+
+	struct timeEntry entry;
+	if(readEntry(fd, low, &entry) == -1)
+		return -1;
+	/* an entry added after end was read */
+	return (entry.offset < end) ? entry.offset : end;
+}
+
+int
+timeIndexRange(time_t since, time_t until, off_t * start, off_t * end)
+{
+	if(state == NULL){
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	/* the entries only grow, the ones counted here are complete. The bytes
+	after the last entry belong to it, so the end of the chat log is read
+	before the entries */
+	off_t endOfData = chatLogEnd();
+	int64_t entries = __atomic_load_n(&state->entries, __ATOMIC_ACQUIRE);
+
+	/* every entry is newer than second -1 */
+	*start = timeIndexOffsetAfter(index_fd, entries, (int64_t) since - 1, endOfData);
+	*end = timeIndexOffsetAfter(index_fd, entries, until, endOfData);
+	if(*start == -1 || *end == -1)
+		return -1;
+	if(*end < *start)
+		*end = *start;
+	return 0;
+}
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
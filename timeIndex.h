@@ -0,0 +1,53 @@
+/* timeIndex.h
+
+[back-end] Sparse index from the server time to the offsets of the chat log,
+used to send the messages written since a time or between two times
+
+*/
+
+#ifndef TIMEINDEX_H /* header guard */
+#define TIMEINDEX_H
+
+#include <sys/types.h>	/* off_t */
+#include <time.h>		/* time_t */
+#include <stdint.h>
+
+/* entry of the time index file (TIME_INDEX_PATH), the entries are ordered
+by time and by offset */
+struct timeEntry {
+	int64_t time;		/* seconds since the epoch */
+	int64_t offset;		/* first byte of the chat log appended in time */
+};
+
+/* open (or create) the time index stored at path. It should be called once
+by the listening process after openChatLogFile() and before any fork().
+Returns 0 on success and -1 on error */
+int timeIndexOpen(const char * path);
+
+/* stamp the bytes appended to the chat log since the last update with the
+current time, it is called after every exclusiveWrite(). Does nothing if the
+index is not open. Returns 0 on success and -1 on error */
+int timeIndexUpdate(void);
+
+/* find the bytes of the chat log written from second since up to second
+until (both included), they start at *start and end before *end. Returns 0
+on success and -1 on error (errno = ENOTSUP if the index is not open) */
+int timeIndexRange(time_t since, time_t until, off_t * start, off_t * end);
+
+/* the lookups of timeIndexRange() on a time index open as fd, also used by
+the tools which read the index of the daemon (chatlogSnapshot.c,
+chatlogConvert.c) */
+
+/* number of complete entries in the time index open as fd, returns -1 on
+error */
+int64_t timeIndexEntries(int fd);
+
+/* offset of the first byte of the chat log written after second time, found
+among the first entries of the time index open as fd (binary search).
+Returns end if every byte before end was written up to time, and -1 on
+error */
+off_t timeIndexOffsetAfter(int fd, int64_t entries, int64_t time, off_t end);
+
+#endif
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
@@ -0,0 +1,32 @@
+/* tracepoints.c
+
+Connection id and semaphores of the static tracepoints declared in
+tracepoints.h
+
+*/
+
+#include "tracepoints.h"
+
+unsigned long traceConnectionID = 0;
+
+#ifdef HAVE_TRACEPOINTS
+
+/* the tracer finds the semaphores through the ELF note of every probe and
+increments them while it is attached, they must live in the .probes section */
+#define TRACEPOINT_SEMAPHORE_DEFINE(name) \
+	unsigned short TRACEPOINT_SEMAPHORE(name) __attribute__ ((section (".probes"))) = 0
+
+TRACEPOINT_SEMAPHORE_DEFINE(accept);
+TRACEPOINT_SEMAPHORE_DEFINE(auth__start);
+TRACEPOINT_SEMAPHORE_DEFINE(auth__end);
+TRACEPOINT_SEMAPHORE_DEFINE(receive);
+TRACEPOINT_SEMAPHORE_DEFINE(lock__acquire);
+TRACEPOINT_SEMAPHORE_DEFINE(write);
+TRACEPOINT_SEMAPHORE_DEFINE(lock__release);
+TRACEPOINT_SEMAPHORE_DEFINE(wakeup);
+TRACEPOINT_SEMAPHORE_DEFINE(socket__write);
+TRACEPOINT_SEMAPHORE_DEFINE(fsync);
+
+#endif
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */
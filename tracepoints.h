@@ -0,0 +1,88 @@
+/* tracepoints.h
+
+Static tracepoints (USDT probes) on the message path of the server.
+
+If <sys/sdt.h> is available (Debian/Ubuntu: 'apt-get install systemtap-sdt-dev')
+every probe is compiled into a single nop instruction plus an ELF note, so that
+perf, bpftrace or systemtap can attach to it in production without rebuilding:
+
+	$ sudo bpftrace -l 'usdt:/usr/local/bin/papayachat/papayachatd:*'
+	$ sudo bpftrace -e 'usdt:/usr/local/bin/papayachat/papayachatd:papayachat:write
+		{ @bytes[arg0] = sum(arg2); }'
+
+Probes (provider 'papayachat'), the first argument is always the connection id:
+
+	accept			(conn_id, client_fd)
+	auth-start		(conn_id, client_fd)
+	auth-end		(conn_id, result 0/-1, bytes read)
+	receive			(conn_id, bytes)
+	lock-acquire	(conn_id, chatlog_fd)
+	write			(conn_id, chatlog offset, bytes)
+	lock-release	(conn_id, chatlog_fd)
+	wakeup			(conn_id, chatlog offset)
+	socket-write	(conn_id, chatlog offset, bytes)
+	fsync			(conn_id, latency us, bytes appended up to the sync)
+
+Every probe has a semaphore, which the tracer increments while it is attached,
+so that arguments that cost a syscall are only computed while someone is
+tracing (TRACEPOINT_ENABLED()).
+
+Without <sys/sdt.h>, or if compiled with -D NO_TRACEPOINTS, all macros expand to
+nothing.
+
+*/
+
+#ifndef TRACEPOINTS_H	/* header guard */
+#define TRACEPOINTS_H
+
+#if !defined(NO_TRACEPOINTS) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_TRACEPOINTS
+#endif
+#endif
+
+/* id of the connection handled by this process, it is incremented by the
+listening process for every accepted client and inherited through fork(),
+0 in the listening process itself */
+extern unsigned long traceConnectionID;
+
+#ifdef HAVE_TRACEPOINTS
+
+/* all probes are declared with a semaphore (defined in tracepoints.c) */
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define TRACEPOINT_SEMAPHORE(name) papayachat_##name##_semaphore
+
+extern unsigned short TRACEPOINT_SEMAPHORE(accept);
+extern unsigned short TRACEPOINT_SEMAPHORE(auth__start);
+extern unsigned short TRACEPOINT_SEMAPHORE(auth__end);
+extern unsigned short TRACEPOINT_SEMAPHORE(receive);
+extern unsigned short TRACEPOINT_SEMAPHORE(lock__acquire);
+extern unsigned short TRACEPOINT_SEMAPHORE(write);
+extern unsigned short TRACEPOINT_SEMAPHORE(lock__release);
+extern unsigned short TRACEPOINT_SEMAPHORE(wakeup);
+extern unsigned short TRACEPOINT_SEMAPHORE(socket__write);
+extern unsigned short TRACEPOINT_SEMAPHORE(fsync);
+
+/* true only while a tracer is attached to the probe */
+#define TRACEPOINT_ENABLED(name) __builtin_expect(TRACEPOINT_SEMAPHORE(name) != 0, 0)
+
+/* double underscores in the name become a dash for the tracer,
+e.g. auth__start -> papayachat:auth-start */
+#define TRACEPOINT2(name, a1, a2) STAP_PROBE2(papayachat, name, a1, a2)
+#define TRACEPOINT3(name, a1, a2, a3) STAP_PROBE3(papayachat, name, a1, a2, a3)
+
+#else
+
+/* the arguments are still referenced, so that variables only used by a probe
+do not trigger -Wunused warnings, the compiler removes them anyway */
+#define TRACEPOINT_ENABLED(name) 0
+#define TRACEPOINT2(name, a1, a2) do { (void) (a1); (void) (a2); } while(0)
+#define TRACEPOINT3(name, a1, a2, a3) do { (void) (a1); (void) (a2); (void) (a3); } while(0)
+
+#endif /* HAVE_TRACEPOINTS */
+
+#endif /* endif for header guard */
+
+/* Eduardo Rodriguez 2022 (c) (@erodrigufer). Licensed under GNU AGPLv3 */